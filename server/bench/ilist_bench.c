@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "ft_list.h"
+#include "ft_ilist.h"
+#include "../third_party/uthash-master/src/utlist.h"
+
+/*
+ * make bench: ft_ilist against ft_list and utlist's DL_ macros (what the
+ * mail retry queue used before) on the operations the server does with
+ * a list. Prints ns per operation, lower is better.
+ */
+
+#define BENCH_NODES 20000
+#define BENCH_ROUNDS 20
+
+typedef struct
+{
+    list_item_t item;       /* ft_list: must come first */
+    int value;
+} flist_node_t;
+
+typedef struct
+{
+    int value;
+    ft_ilist_node_t link;
+} ilist_node_t;
+
+typedef struct dl_node_s
+{
+    int value;
+    struct dl_node_s* prev;
+    struct dl_node_s* next;
+} dl_node_t;
+
+static flist_node_t m_fnodes[BENCH_NODES];
+static ilist_node_t m_inodes[BENCH_NODES];
+static dl_node_t m_dnodes[BENCH_NODES];
+static int m_order[BENCH_NODES];
+static volatile long m_sink;
+
+static uint64_t m_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void m_report(const char* name, const char* impl, uint64_t ns, long ops)
+{
+    printf("%-22s %-8s %8.1f ns/op\n", name, impl, (double)ns / ops);
+}
+
+/* push_back every node, then pop them from the front */
+static void m_queue(void)
+{
+    flist_node_t* fhead;
+    ft_ilist_t il;
+    dl_node_t* dhead;
+    uint64_t t;
+    int r;
+    int i;
+
+    t = m_now_ns();
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        ft_ilist_init(&il);
+        for (i = 0; i < BENCH_NODES; i++)
+            ft_ilist_push_back(&il, &m_inodes[i].link);
+        while (ft_ilist_pop_front(&il))
+            ;
+    }
+    m_report("queue push/pop", "ft_ilist", m_now_ns() - t, 2L * BENCH_ROUNDS * BENCH_NODES);
+
+    t = m_now_ns();
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        dhead = NULL;
+        for (i = 0; i < BENCH_NODES; i++)
+            DL_APPEND(dhead, &m_dnodes[i]);
+        while (dhead)
+            DL_DELETE(dhead, dhead);
+    }
+    m_report("queue push/pop", "utlist", m_now_ns() - t, 2L * BENCH_ROUNDS * BENCH_NODES);
+
+    /* ft_list_get_first() walks the ring, one round is plenty */
+    t = m_now_ns();
+    fhead = NULL;
+    for (i = 0; i < BENCH_NODES; i++)
+        FT_LIST_ADD_LAST(&fhead, &m_fnodes[i]);
+    while (fhead)
+        FT_LIST_POP_FIRST(&fhead);
+    m_report("queue push/pop", "ft_list", m_now_ns() - t, 2L * BENCH_NODES);
+}
+
+/* sum over the whole list */
+static void m_iterate(void)
+{
+    flist_node_t* fhead;
+    flist_node_t* f;
+    ft_ilist_t il;
+    ilist_node_t* it;
+    dl_node_t* dhead;
+    dl_node_t* d;
+    uint64_t t;
+    long sum;
+    int r;
+    int i;
+
+    ft_ilist_init(&il);
+    fhead = NULL;
+    dhead = NULL;
+    for (i = 0; i < BENCH_NODES; i++)
+    {
+        m_inodes[i].value = m_fnodes[i].value = m_dnodes[i].value = i;
+        ft_ilist_push_back(&il, &m_inodes[i].link);
+        FT_LIST_ADD_LAST(&fhead, &m_fnodes[i]);
+        DL_APPEND(dhead, &m_dnodes[i]);
+    }
+
+    t = m_now_ns();
+    sum = 0;
+    for (r = 0; r < BENCH_ROUNDS; r++)
+        FT_ILIST_FOREACH(&il, it, link)
+            sum += it->value;
+    m_sink = sum;
+    m_report("iterate", "ft_ilist", m_now_ns() - t, (long)BENCH_ROUNDS * BENCH_NODES);
+
+    t = m_now_ns();
+    sum = 0;
+    for (r = 0; r < BENCH_ROUNDS; r++)
+        DL_FOREACH(dhead, d)
+            sum += d->value;
+    m_sink = sum;
+    m_report("iterate", "utlist", m_now_ns() - t, (long)BENCH_ROUNDS * BENCH_NODES);
+
+    t = m_now_ns();
+    sum = 0;
+    for (r = 0; r < BENCH_ROUNDS; r++)
+        for (f = fhead; f; f = FT_LIST_GET_NEXT(&fhead, f))
+            sum += f->value;
+    m_sink = sum;
+    m_report("iterate", "ft_list", m_now_ns() - t, (long)BENCH_ROUNDS * BENCH_NODES);
+
+    /* size of a full list */
+    t = m_now_ns();
+    sum = 0;
+    for (r = 0; r < BENCH_ROUNDS * 100; r++)
+        sum += ft_ilist_size(&il);
+    m_sink = sum;
+    m_report("size", "ft_ilist", m_now_ns() - t, BENCH_ROUNDS * 100L);
+
+    t = m_now_ns();
+    sum = 0;
+    for (r = 0; r < BENCH_ROUNDS * 100; r++)
+    {
+        DL_COUNT(dhead, d, i);
+        sum += i;
+    }
+    m_sink = sum;
+    m_report("size", "utlist", m_now_ns() - t, BENCH_ROUNDS * 100L);
+
+    t = m_now_ns();
+    sum = 0;
+    for (r = 0; r < BENCH_ROUNDS * 100; r++)
+        sum += FT_LIST_GET_SIZE(&fhead);
+    m_sink = sum;
+    m_report("size", "ft_list", m_now_ns() - t, BENCH_ROUNDS * 100L);
+
+    /* unlink in random order, what closing connections looks like */
+    t = m_now_ns();
+    for (i = 0; i < BENCH_NODES; i++)
+        ft_ilist_remove(&il, &m_inodes[m_order[i]].link);
+    m_report("unlink random", "ft_ilist", m_now_ns() - t, BENCH_NODES);
+
+    t = m_now_ns();
+    for (i = 0; i < BENCH_NODES; i++)
+        DL_DELETE(dhead, &m_dnodes[m_order[i]]);
+    m_report("unlink random", "utlist", m_now_ns() - t, BENCH_NODES);
+
+    t = m_now_ns();
+    for (i = 0; i < BENCH_NODES; i++)
+        FT_LIST_POP(&fhead, &m_fnodes[m_order[i]]);
+    m_report("unlink random", "ft_list", m_now_ns() - t, BENCH_NODES);
+}
+
+int main(void)
+{
+    int tmp;
+    int i;
+    int j;
+
+    srand(42);
+    for (i = 0; i < BENCH_NODES; i++)
+        m_order[i] = i;
+    for (i = BENCH_NODES - 1; i > 0; i--)
+    {
+        j = rand() % (i + 1);
+        tmp = m_order[i];
+        m_order[i] = m_order[j];
+        m_order[j] = tmp;
+    }
+
+    printf("%d nodes\n", BENCH_NODES);
+    m_queue();
+    m_iterate();
+    return 0;
+}
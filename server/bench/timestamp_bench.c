@@ -0,0 +1,90 @@
+#define _XOPEN_SOURCE 700   /* strptime, for the reference */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "../srcs/db/db_gen.h"
+
+/*
+ * make bench: db_gen_parse_timestamp_us() and db_gen_format_timestamp_us()
+ * on 1M values as Postgres prints TIMESTAMPTZ columns, against the
+ * strptime() + mktime() pair they replaced. The parse must stay well
+ * under a second for the 1M.
+ */
+
+#define BENCH_VALUES 1000000
+#define BENCH_DISTINCT 4096     /* formatted inputs, cycled */
+
+static char m_text[BENCH_DISTINCT][DB_TIMESTAMP_LEN];
+static volatile int64_t m_sink;
+
+static uint64_t m_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void m_report(const char* name, uint64_t ns)
+{
+    printf("%-28s %8.1f ms  %6.1f ns/op\n", name, ns / 1e6, (double)ns / BENCH_VALUES);
+}
+
+/* what db_gen_parse_timestamp() did before */
+static time_t m_strptime_parse(const char* s)
+{
+    struct tm tm;
+
+    if (strptime(s, "%Y-%m-%d %H:%M:%S", &tm) == NULL)
+        return 0;
+    return mktime(&tm);
+}
+
+int main(void)
+{
+    char buf[DB_TIMESTAMP_LEN];
+    uint64_t t;
+    uint64_t parse_ns;
+    int64_t us;
+    int64_t sum;
+    int i;
+
+    /* 2000-01-01 onwards, one value about every 4 hours, with microseconds */
+    srand(42);
+    for (i = 0; i < BENCH_DISTINCT; i++)
+    {
+        us = (946684800LL + i * 14407LL) * 1000000LL + rand() % 1000000;
+        db_gen_format_timestamp_us(us, m_text[i], sizeof(m_text[i]));
+    }
+    printf("%d values, e.g. \"%s\"\n", BENCH_VALUES, m_text[0]);
+
+    t = m_now_ns();
+    sum = 0;
+    for (i = 0; i < BENCH_VALUES; i++)
+        sum += db_gen_parse_timestamp_us(m_text[i % BENCH_DISTINCT]);
+    parse_ns = m_now_ns() - t;
+    m_sink = sum;
+    m_report("db_gen_parse_timestamp_us", parse_ns);
+
+    t = m_now_ns();
+    sum = 0;
+    for (i = 0; i < BENCH_VALUES; i++)
+        sum += db_gen_format_timestamp_us((int64_t)i * 997003LL, buf, sizeof(buf))[20];
+    m_sink = sum;
+    m_report("db_gen_format_timestamp_us", m_now_ns() - t);
+
+    t = m_now_ns();
+    sum = 0;
+    for (i = 0; i < BENCH_VALUES; i++)
+        sum += m_strptime_parse(m_text[i % BENCH_DISTINCT]);
+    m_sink = sum;
+    m_report("strptime + mktime", m_now_ns() - t);
+
+    if (parse_ns >= 1000000000ull)
+    {
+        printf("parse budget exceeded: 1M decodes must take well under 1 s\n");
+        return 1;
+    }
+    return 0;
+}
@@ -20,11 +20,13 @@ if __name__ == "__main__":
     # Disable certificate validation for testing self-signed certs
 
     port = sys.argv[1] if len(sys.argv) > 1 else "8080"
+    session_id = sys.argv[2] if len(sys.argv) > 2 else ""
     ssl_opts = {
         "cert_reqs": ssl.CERT_NONE
     }
 
-    ws = websocket.WebSocketApp("wss://localhost:" + port + "/",
+    ws = websocket.WebSocketApp("ws://localhost:" + port + "/ws",
+                                cookie="session_id=" + session_id,
                                 on_open=on_open,
                                 on_message=on_message,
                                 on_error=on_error,
@@ -14,3 +14,8 @@ CFLAGS += -g
 else
 CFLAGS += -O3
 endif
+
+# make MALLOC_TRACK=1: per call site allocation accounting in ft_malloc
+ifdef MALLOC_TRACK
+CFLAGS += -DFT_MALLOC_TRACK
+endif
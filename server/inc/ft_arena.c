@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "ft_arena.h"
+#include "ft_malloc.h"
+
+struct ft_arena_block_s
+{
+    ft_arena_block_t* next;
+    size_t cap;
+    size_t used;
+    _Alignas(FT_ARENA_ALIGN) unsigned char data[];
+};
+
+static pthread_key_t m_thread_key;
+static pthread_once_t m_thread_once = PTHREAD_ONCE_INIT;
+static __thread ft_arena_t* m_thread_arena = NULL;
+static atomic_size_t m_thread_block_size = FT_ARENA_BLOCK_SIZE;
+
+void ft_arena_init(ft_arena_t* arena, size_t block_size)
+{
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->block_size = block_size ? block_size : FT_ARENA_BLOCK_SIZE;
+}
+
+void ft_arena_destroy(ft_arena_t* arena)
+{
+    ft_arena_block_t* b;
+    ft_arena_block_t* next;
+
+    for (b = arena->first; b; b = next)
+    {
+        next = b->next;
+        free(b);
+    }
+    arena->first = NULL;
+    arena->current = NULL;
+}
+
+/* slow path: the next kept block that fits, or a new one at the tail */
+static ft_arena_block_t* m_next_block(ft_arena_t* arena, size_t size)
+{
+    ft_arena_block_t* prev;
+    ft_arena_block_t* b;
+    size_t cap;
+
+    prev = arena->current;
+    b = prev ? prev->next : arena->first;
+    while (b && b->cap < size)
+    {
+        prev = b;
+        b = b->next;
+    }
+    if (!b)
+    {
+        cap = size > arena->block_size ? size : arena->block_size;
+        b = malloc(sizeof(*b) + cap);
+        b->next = NULL;
+        b->cap = cap;
+        if (prev)
+            prev->next = b;
+        else
+            arena->first = b;
+    }
+    b->used = 0;
+    arena->current = b;
+    return b;
+}
+
+void* ft_arena_alloc(ft_arena_t* arena, size_t size)
+{
+    ft_arena_block_t* b;
+    void* p;
+
+    size = (size + FT_ARENA_ALIGN - 1) & ~((size_t)FT_ARENA_ALIGN - 1);
+    if (size == 0)
+        size = FT_ARENA_ALIGN;
+
+    b = arena->current;
+    if (!b || b->cap - b->used < size)
+        b = m_next_block(arena, size);
+    p = b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+void* ft_arena_calloc(ft_arena_t* arena, size_t count, size_t size)
+{
+    void* p;
+
+    ft_assert(size == 0 || count <= SIZE_MAX / size, "arena calloc overflow");
+    p = ft_arena_alloc(arena, count * size);
+    memset(p, 0, count * size);
+    return p;
+}
+
+static char* m_copy(ft_arena_t* arena, const char* s, size_t n)
+{
+    char* out;
+
+    out = ft_arena_alloc(arena, n + 1);
+    memcpy(out, s, n);
+    out[n] = '\0';
+    return out;
+}
+
+char* ft_arena_strndup(ft_arena_t* arena, const char* s, size_t n)
+{
+    return m_copy(arena, s, strnlen(s, n));
+}
+
+char* ft_arena_strdup(ft_arena_t* arena, const char* s)
+{
+    return m_copy(arena, s, strlen(s));
+}
+
+char* ft_arena_sprintf(ft_arena_t* arena, const char* fmt, ...)
+{
+    va_list ap;
+    va_list ap2;
+    char* out;
+    int len;
+
+    va_start(ap, fmt);
+    va_copy(ap2, ap);
+    len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    ft_assert(len >= 0, "arena sprintf failed");
+
+    out = ft_arena_alloc(arena, (size_t)len + 1);
+    vsnprintf(out, (size_t)len + 1, fmt, ap2);
+    va_end(ap2);
+    return out;
+}
+
+ft_arena_mark_t ft_arena_mark(const ft_arena_t* arena)
+{
+    ft_arena_mark_t mark;
+
+    mark.block = arena->current;
+    mark.used = arena->current ? arena->current->used : 0;
+    return mark;
+}
+
+void ft_arena_release(ft_arena_t* arena, ft_arena_mark_t mark)
+{
+    if (!mark.block)
+    {
+        ft_arena_reset(arena);
+        return;
+    }
+    arena->current = mark.block;
+    mark.block->used = mark.used;
+}
+
+void ft_arena_reset(ft_arena_t* arena)
+{
+    arena->current = arena->first;
+    if (arena->first)
+        arena->first->used = 0;
+}
+
+static void m_thread_destroy(void* p)
+{
+    ft_arena_destroy(p);
+    free(p);
+}
+
+static void m_thread_key_init(void)
+{
+    pthread_key_create(&m_thread_key, m_thread_destroy);
+}
+
+void ft_arena_set_thread_block_size(size_t block_size)
+{
+    atomic_store_explicit(&m_thread_block_size, block_size ? block_size : FT_ARENA_BLOCK_SIZE,
+                          memory_order_relaxed);
+}
+
+ft_arena_t* ft_arena_thread(void)
+{
+    if (m_thread_arena)
+        return m_thread_arena;
+
+    pthread_once(&m_thread_once, m_thread_key_init);
+    m_thread_arena = malloc(sizeof(*m_thread_arena));
+    ft_arena_init(m_thread_arena, atomic_load_explicit(&m_thread_block_size, memory_order_relaxed));
+    pthread_setspecific(m_thread_key, m_thread_arena);
+    return m_thread_arena;
+}
@@ -0,0 +1,59 @@
+#ifndef FT_ARENA_H
+# define FT_ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump-pointer arena for memory that lives as long as one request or one
+ * DB call.
+ *
+ * Allocations are carved from a chain of blocks and never freed one by
+ * one; ft_arena_release() rewinds to a mark taken at the start of the
+ * scope. Blocks are kept across releases, so once the chain has grown to
+ * the size a scope needs, later scopes run without touching the heap.
+ */
+# define FT_ARENA_ALIGN 16
+# define FT_ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct ft_arena_block_s ft_arena_block_t;
+
+typedef struct
+{
+    ft_arena_block_t* first;
+    ft_arena_block_t* current;
+    size_t block_size;
+} ft_arena_t;
+
+typedef struct
+{
+    ft_arena_block_t* block;
+    size_t used;
+} ft_arena_mark_t;
+
+void ft_arena_init(ft_arena_t* arena, size_t block_size);
+void ft_arena_destroy(ft_arena_t* arena);
+
+/* FT_ARENA_ALIGN aligned, never NULL */
+void* ft_arena_alloc(ft_arena_t* arena, size_t size);
+void* ft_arena_calloc(ft_arena_t* arena, size_t count, size_t size);
+char* ft_arena_strdup(ft_arena_t* arena, const char* s);
+char* ft_arena_strndup(ft_arena_t* arena, const char* s, size_t n);
+char* ft_arena_sprintf(ft_arena_t* arena, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+ft_arena_mark_t ft_arena_mark(const ft_arena_t* arena);
+void ft_arena_release(ft_arena_t* arena, ft_arena_mark_t mark);
+
+/* drops everything, keeps the blocks */
+void ft_arena_reset(ft_arena_t* arena);
+
+/*
+ * Scratch arena of the calling thread, created on first use. The router
+ * scopes one request on it and db_gen one call, nested inside the request.
+ */
+ft_arena_t* ft_arena_thread(void);
+
+/* block size of the thread arenas created afterwards, 0 = FT_ARENA_BLOCK_SIZE */
+void ft_arena_set_thread_block_size(size_t block_size);
+
+#endif /* FT_ARENA_H */
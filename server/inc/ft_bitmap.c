@@ -0,0 +1,611 @@
+#include <stdio.h>
+#include <string.h>
+#include "ft_bitmap.h"
+#include "ft_malloc.h"
+#include "error_codes.h"
+
+static void m_container_free(ft_bitmap_container_t* c)
+{
+    if (c->is_bitset)
+        free(c->data.words);
+    else
+        free(c->data.array);
+}
+
+/* binary search on container keys. returns true if found, *idx is the position or insertion point */
+static bool m_find_container(const ft_bitmap_t* bm, uint16_t key, uint32_t* idx)
+{
+    uint32_t lo;
+    uint32_t hi;
+    uint32_t mid;
+
+    lo = 0;
+    hi = bm->count;
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if (bm->containers[mid].key < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *idx = lo;
+    return (lo < bm->count && bm->containers[lo].key == key);
+}
+
+static ft_bitmap_container_t* m_insert_container(ft_bitmap_t* bm, uint32_t idx, uint16_t key)
+{
+    ft_bitmap_container_t* c;
+
+    if (bm->count == bm->cap)
+    {
+        bm->cap = bm->cap ? bm->cap * 2 : 4;
+        bm->containers = realloc(bm->containers, bm->cap * sizeof(*bm->containers));
+    }
+
+    memmove(&bm->containers[idx + 1], &bm->containers[idx],
+            (bm->count - idx) * sizeof(*bm->containers));
+    bm->count++;
+
+    c = &bm->containers[idx];
+    memset(c, 0, sizeof(*c));
+    c->key = key;
+    return c;
+}
+
+static void m_remove_container(ft_bitmap_t* bm, uint32_t idx)
+{
+    m_container_free(&bm->containers[idx]);
+    memmove(&bm->containers[idx], &bm->containers[idx + 1],
+            (bm->count - idx - 1) * sizeof(*bm->containers));
+    bm->count--;
+}
+
+/* binary search inside an array container */
+static bool m_array_find(const uint16_t* arr, uint32_t card, uint16_t low, uint32_t* idx)
+{
+    uint32_t lo;
+    uint32_t hi;
+    uint32_t mid;
+
+    lo = 0;
+    hi = card;
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if (arr[mid] < low)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *idx = lo;
+    return (lo < card && arr[lo] == low);
+}
+
+static inline bool m_bit_test(const uint64_t* words, uint16_t low)
+{
+    return (words[low >> 6] >> (low & 63)) & 1;
+}
+
+static void m_to_bitset(ft_bitmap_container_t* c)
+{
+    uint64_t* words;
+    uint32_t i;
+
+    words = calloc(FT_BITMAP_WORDS, sizeof(uint64_t));
+    ft_assert(words != NULL, "calloc failed");
+    for (i = 0; i < c->card; i++)
+        words[c->data.array[i] >> 6] |= 1ULL << (c->data.array[i] & 63);
+
+    free(c->data.array);
+    c->data.words = words;
+    c->is_bitset = true;
+    c->cap = 0;
+}
+
+static void m_to_array(ft_bitmap_container_t* c)
+{
+    uint16_t* arr;
+    uint64_t w;
+    uint32_t n;
+    uint32_t i;
+
+    arr = malloc((c->card ? c->card : 1) * sizeof(uint16_t));
+    n = 0;
+    for (i = 0; i < FT_BITMAP_WORDS; i++)
+    {
+        w = c->data.words[i];
+        while (w)
+        {
+            arr[n++] = (uint16_t)((i << 6) + __builtin_ctzll(w));
+            w &= w - 1;
+        }
+    }
+
+    free(c->data.words);
+    c->data.array = arr;
+    c->is_bitset = false;
+    c->cap = c->card ? c->card : 1;
+}
+
+static uint32_t m_bitset_count(const uint64_t* words)
+{
+    uint32_t card;
+    uint32_t i;
+
+    card = 0;
+    for (i = 0; i < FT_BITMAP_WORDS; i++)
+        card += __builtin_popcountll(words[i]);
+    return card;
+}
+
+/* keeps containers small: dense ones as bitsets, sparse ones as arrays */
+static void m_normalize(ft_bitmap_container_t* c)
+{
+    if (c->is_bitset && c->card <= FT_BITMAP_ARRAY_MAX)
+        m_to_array(c);
+}
+
+void ft_bitmap_init(ft_bitmap_t* bm)
+{
+    bm->containers = NULL;
+    bm->count = 0;
+    bm->cap = 0;
+}
+
+void ft_bitmap_clear(ft_bitmap_t* bm)
+{
+    uint32_t i;
+
+    if (!bm) return;
+    for (i = 0; i < bm->count; i++)
+        m_container_free(&bm->containers[i]);
+    free(bm->containers);
+    ft_bitmap_init(bm);
+}
+
+ft_bitmap_t* ft_bitmap_new(void)
+{
+    ft_bitmap_t* bm;
+
+    bm = malloc(sizeof(*bm));
+    ft_bitmap_init(bm);
+    return bm;
+}
+
+void ft_bitmap_free(ft_bitmap_t* bm)
+{
+    if (!bm) return;
+    ft_bitmap_clear(bm);
+    free(bm);
+}
+
+ft_bitmap_t* ft_bitmap_copy(const ft_bitmap_t* bm)
+{
+    ft_bitmap_t* out;
+    const ft_bitmap_container_t* src;
+    ft_bitmap_container_t* dst;
+    uint32_t i;
+
+    out = ft_bitmap_new();
+    if (!bm || bm->count == 0)
+        return out;
+
+    out->containers = malloc(bm->count * sizeof(*out->containers));
+    out->count = bm->count;
+    out->cap = bm->count;
+    for (i = 0; i < bm->count; i++)
+    {
+        src = &bm->containers[i];
+        dst = &out->containers[i];
+        *dst = *src;
+        if (src->is_bitset)
+        {
+            dst->data.words = malloc(FT_BITMAP_WORDS * sizeof(uint64_t));
+            memcpy(dst->data.words, src->data.words, FT_BITMAP_WORDS * sizeof(uint64_t));
+        }
+        else
+        {
+            dst->cap = src->card ? src->card : 1;
+            dst->data.array = malloc(dst->cap * sizeof(uint16_t));
+            memcpy(dst->data.array, src->data.array, src->card * sizeof(uint16_t));
+        }
+    }
+    return out;
+}
+
+int ft_bitmap_add(ft_bitmap_t* bm, uint32_t value)
+{
+    ft_bitmap_container_t* c;
+    uint16_t key;
+    uint16_t low;
+    uint32_t idx;
+    uint32_t pos;
+    uint64_t mask;
+
+    if (!bm) return INVALID_ARGS;
+
+    key = (uint16_t)(value >> 16);
+    low = (uint16_t)(value & 0xFFFF);
+
+    if (m_find_container(bm, key, &idx))
+        c = &bm->containers[idx];
+    else
+        c = m_insert_container(bm, idx, key);
+
+    if (c->is_bitset)
+    {
+        mask = 1ULL << (low & 63);
+        if (!(c->data.words[low >> 6] & mask))
+        {
+            c->data.words[low >> 6] |= mask;
+            c->card++;
+        }
+        return OK;
+    }
+
+    if (m_array_find(c->data.array, c->card, low, &pos))
+        return OK;
+
+    if (c->card == c->cap)
+    {
+        c->cap = c->cap ? c->cap * 2 : 4;
+        c->data.array = realloc(c->data.array, c->cap * sizeof(uint16_t));
+    }
+    memmove(&c->data.array[pos + 1], &c->data.array[pos], (c->card - pos) * sizeof(uint16_t));
+    c->data.array[pos] = low;
+    c->card++;
+
+    if (c->card > FT_BITMAP_ARRAY_MAX)
+        m_to_bitset(c);
+
+    return OK;
+}
+
+int ft_bitmap_remove(ft_bitmap_t* bm, uint32_t value)
+{
+    ft_bitmap_container_t* c;
+    uint16_t low;
+    uint32_t idx;
+    uint32_t pos;
+    uint64_t mask;
+
+    if (!bm) return INVALID_ARGS;
+
+    low = (uint16_t)(value & 0xFFFF);
+    if (!m_find_container(bm, (uint16_t)(value >> 16), &idx))
+        return OK;
+
+    c = &bm->containers[idx];
+    if (c->is_bitset)
+    {
+        mask = 1ULL << (low & 63);
+        if (c->data.words[low >> 6] & mask)
+        {
+            c->data.words[low >> 6] &= ~mask;
+            c->card--;
+        }
+        m_normalize(c);
+    }
+    else if (m_array_find(c->data.array, c->card, low, &pos))
+    {
+        memmove(&c->data.array[pos], &c->data.array[pos + 1], (c->card - pos - 1) * sizeof(uint16_t));
+        c->card--;
+    }
+
+    if (c->card == 0)
+        m_remove_container(bm, idx);
+
+    return OK;
+}
+
+bool ft_bitmap_contains(const ft_bitmap_t* bm, uint32_t value)
+{
+    const ft_bitmap_container_t* c;
+    uint16_t low;
+    uint32_t idx;
+
+    if (!bm) return false;
+
+    low = (uint16_t)(value & 0xFFFF);
+    if (!m_find_container(bm, (uint16_t)(value >> 16), &idx))
+        return false;
+
+    c = &bm->containers[idx];
+    if (c->is_bitset)
+        return m_bit_test(c->data.words, low);
+    return m_array_find(c->data.array, c->card, low, &idx);
+}
+
+uint64_t ft_bitmap_cardinality(const ft_bitmap_t* bm)
+{
+    uint64_t card;
+    uint32_t i;
+
+    if (!bm) return 0;
+
+    card = 0;
+    for (i = 0; i < bm->count; i++)
+        card += bm->containers[i].card;
+    return card;
+}
+
+/* intersects container a with container b, result stored in a */
+static void m_container_and(ft_bitmap_container_t* a, const ft_bitmap_container_t* b)
+{
+    uint16_t* arr;
+    uint32_t i;
+    uint32_t j;
+    uint32_t n;
+
+    if (!a->is_bitset && !b->is_bitset)
+    {
+        i = 0;
+        j = 0;
+        n = 0;
+        while (i < a->card && j < b->card)
+        {
+            if (a->data.array[i] < b->data.array[j])
+                i++;
+            else if (a->data.array[i] > b->data.array[j])
+                j++;
+            else
+            {
+                a->data.array[n++] = a->data.array[i];
+                i++;
+                j++;
+            }
+        }
+        a->card = n;
+    }
+    else if (!a->is_bitset)
+    {
+        n = 0;
+        for (i = 0; i < a->card; i++)
+        {
+            if (m_bit_test(b->data.words, a->data.array[i]))
+                a->data.array[n++] = a->data.array[i];
+        }
+        a->card = n;
+    }
+    else if (!b->is_bitset)
+    {
+        arr = malloc((b->card ? b->card : 1) * sizeof(uint16_t));
+        n = 0;
+        for (j = 0; j < b->card; j++)
+        {
+            if (m_bit_test(a->data.words, b->data.array[j]))
+                arr[n++] = b->data.array[j];
+        }
+        free(a->data.words);
+        a->data.array = arr;
+        a->is_bitset = false;
+        a->card = n;
+        a->cap = b->card ? b->card : 1;
+    }
+    else
+    {
+        for (i = 0; i < FT_BITMAP_WORDS; i++)
+            a->data.words[i] &= b->data.words[i];
+        a->card = m_bitset_count(a->data.words);
+        m_normalize(a);
+    }
+}
+
+/* removes container b's values from container a */
+static void m_container_andnot(ft_bitmap_container_t* a, const ft_bitmap_container_t* b)
+{
+    uint32_t i;
+    uint32_t j;
+    uint32_t n;
+
+    if (!a->is_bitset && !b->is_bitset)
+    {
+        i = 0;
+        j = 0;
+        n = 0;
+        while (i < a->card)
+        {
+            while (j < b->card && b->data.array[j] < a->data.array[i])
+                j++;
+            if (j >= b->card || b->data.array[j] != a->data.array[i])
+                a->data.array[n++] = a->data.array[i];
+            i++;
+        }
+        a->card = n;
+    }
+    else if (!a->is_bitset)
+    {
+        n = 0;
+        for (i = 0; i < a->card; i++)
+        {
+            if (!m_bit_test(b->data.words, a->data.array[i]))
+                a->data.array[n++] = a->data.array[i];
+        }
+        a->card = n;
+    }
+    else if (!b->is_bitset)
+    {
+        for (j = 0; j < b->card; j++)
+            a->data.words[b->data.array[j] >> 6] &= ~(1ULL << (b->data.array[j] & 63));
+        a->card = m_bitset_count(a->data.words);
+        m_normalize(a);
+    }
+    else
+    {
+        for (i = 0; i < FT_BITMAP_WORDS; i++)
+            a->data.words[i] &= ~b->data.words[i];
+        a->card = m_bitset_count(a->data.words);
+        m_normalize(a);
+    }
+}
+
+int ft_bitmap_and_inplace(ft_bitmap_t* a, const ft_bitmap_t* b)
+{
+    uint32_t i;
+    uint32_t j;
+    uint32_t n;
+
+    if (!a || !b) return INVALID_ARGS;
+
+    i = 0;
+    j = 0;
+    n = 0;
+    while (i < a->count)
+    {
+        while (j < b->count && b->containers[j].key < a->containers[i].key)
+            j++;
+
+        if (j < b->count && b->containers[j].key == a->containers[i].key)
+            m_container_and(&a->containers[i], &b->containers[j]);
+        else
+            a->containers[i].card = 0;
+
+        if (a->containers[i].card == 0)
+            m_container_free(&a->containers[i]);
+        else
+            a->containers[n++] = a->containers[i];
+        i++;
+    }
+    a->count = n;
+    return OK;
+}
+
+int ft_bitmap_andnot_inplace(ft_bitmap_t* a, const ft_bitmap_t* b)
+{
+    uint32_t i;
+    uint32_t j;
+    uint32_t n;
+
+    if (!a || !b) return INVALID_ARGS;
+
+    i = 0;
+    j = 0;
+    n = 0;
+    while (i < a->count)
+    {
+        while (j < b->count && b->containers[j].key < a->containers[i].key)
+            j++;
+
+        if (j < b->count && b->containers[j].key == a->containers[i].key)
+            m_container_andnot(&a->containers[i], &b->containers[j]);
+
+        if (a->containers[i].card == 0)
+            m_container_free(&a->containers[i]);
+        else
+            a->containers[n++] = a->containers[i];
+        i++;
+    }
+    a->count = n;
+    return OK;
+}
+
+static uint32_t m_container_and_card(const ft_bitmap_container_t* a, const ft_bitmap_container_t* b)
+{
+    uint32_t i;
+    uint32_t j;
+    uint32_t n;
+
+    if (a->is_bitset && b->is_bitset)
+    {
+        n = 0;
+        for (i = 0; i < FT_BITMAP_WORDS; i++)
+            n += __builtin_popcountll(a->data.words[i] & b->data.words[i]);
+        return n;
+    }
+
+    if (a->is_bitset)
+    {
+        const ft_bitmap_container_t* tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    n = 0;
+    if (b->is_bitset)
+    {
+        for (i = 0; i < a->card; i++)
+            n += m_bit_test(b->data.words, a->data.array[i]);
+        return n;
+    }
+
+    i = 0;
+    j = 0;
+    while (i < a->card && j < b->card)
+    {
+        if (a->data.array[i] < b->data.array[j])
+            i++;
+        else if (a->data.array[i] > b->data.array[j])
+            j++;
+        else
+        {
+            n++;
+            i++;
+            j++;
+        }
+    }
+    return n;
+}
+
+uint64_t ft_bitmap_and_cardinality(const ft_bitmap_t* a, const ft_bitmap_t* b)
+{
+    uint64_t card;
+    uint32_t i;
+    uint32_t j;
+
+    if (!a || !b) return 0;
+
+    card = 0;
+    i = 0;
+    j = 0;
+    while (i < a->count && j < b->count)
+    {
+        if (a->containers[i].key < b->containers[j].key)
+            i++;
+        else if (a->containers[i].key > b->containers[j].key)
+            j++;
+        else
+        {
+            card += m_container_and_card(&a->containers[i], &b->containers[j]);
+            i++;
+            j++;
+        }
+    }
+    return card;
+}
+
+size_t ft_bitmap_to_array(const ft_bitmap_t* bm, uint32_t* out, size_t max)
+{
+    const ft_bitmap_container_t* c;
+    uint32_t high;
+    uint64_t w;
+    size_t n;
+    uint32_t i;
+    uint32_t j;
+
+    if (!bm || !out) return 0;
+
+    n = 0;
+    for (i = 0; i < bm->count && n < max; i++)
+    {
+        c = &bm->containers[i];
+        high = (uint32_t)c->key << 16;
+        if (!c->is_bitset)
+        {
+            for (j = 0; j < c->card && n < max; j++)
+                out[n++] = high | c->data.array[j];
+            continue;
+        }
+
+        for (j = 0; j < FT_BITMAP_WORDS && n < max; j++)
+        {
+            w = c->data.words[j];
+            while (w && n < max)
+            {
+                out[n++] = high | ((j << 6) + __builtin_ctzll(w));
+                w &= w - 1;
+            }
+        }
+    }
+    return n;
+}
@@ -0,0 +1,61 @@
+#ifndef FT_BITMAP_H
+# define FT_BITMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Compressed bitmap of uint32 values (roaring-style).
+ *
+ * Values are split by their high 16 bits into containers. A container
+ * holds the low 16 bits either as a sorted uint16 array (sparse, up to
+ * FT_BITMAP_ARRAY_MAX values) or as a 65536-bit bitset (dense).
+ */
+# define FT_BITMAP_ARRAY_MAX 4096
+# define FT_BITMAP_WORDS 1024
+
+typedef struct
+{
+    uint16_t key;
+    bool is_bitset;
+    uint32_t card;
+    uint32_t cap;
+    union
+    {
+        uint16_t* array;
+        uint64_t* words;
+    } data;
+} ft_bitmap_container_t;
+
+typedef struct
+{
+    ft_bitmap_container_t* containers;
+    uint32_t count;
+    uint32_t cap;
+} ft_bitmap_t;
+
+void ft_bitmap_init(ft_bitmap_t* bm);
+void ft_bitmap_clear(ft_bitmap_t* bm);
+ft_bitmap_t* ft_bitmap_new(void);
+void ft_bitmap_free(ft_bitmap_t* bm);
+ft_bitmap_t* ft_bitmap_copy(const ft_bitmap_t* bm);
+
+int ft_bitmap_add(ft_bitmap_t* bm, uint32_t value);
+int ft_bitmap_remove(ft_bitmap_t* bm, uint32_t value);
+bool ft_bitmap_contains(const ft_bitmap_t* bm, uint32_t value);
+uint64_t ft_bitmap_cardinality(const ft_bitmap_t* bm);
+
+/* a = a AND b */
+int ft_bitmap_and_inplace(ft_bitmap_t* a, const ft_bitmap_t* b);
+
+/* a = a AND NOT b */
+int ft_bitmap_andnot_inplace(ft_bitmap_t* a, const ft_bitmap_t* b);
+
+/* |a AND b| without materializing the intersection */
+uint64_t ft_bitmap_and_cardinality(const ft_bitmap_t* a, const ft_bitmap_t* b);
+
+/* writes up to max values in ascending order, returns how many were written */
+size_t ft_bitmap_to_array(const ft_bitmap_t* bm, uint32_t* out, size_t max);
+
+#endif /* FT_BITMAP_H */
@@ -0,0 +1,136 @@
+#ifndef FT_DEQUE_H
+# define FT_DEQUE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include "ft_malloc.h"
+
+/*
+ * Array-backed double ended queue, header only.
+ *
+ * FT_DEQUE_DEFINE(name, type) declares name##_t and its functions. The
+ * elements live in one power of two ring that doubles when full, so
+ * queue traffic does not allocate once the ring has grown and iteration
+ * walks at most two contiguous runs.
+ *
+ *     FT_DEQUE_DEFINE(fd_queue, int)
+ *     fd_queue_t q = FT_DEQUE_INIT;
+ *     fd_queue_push_back(&q, fd);
+ *     while (fd_queue_pop_front(&q, &fd)) ...
+ */
+# define FT_DEQUE_MIN_CAP 16
+# define FT_DEQUE_INIT { NULL, 0, 0, 0 }
+
+# define FT_DEQUE_DEFINE(name, type)                                             \
+typedef struct                                                                  \
+{                                                                               \
+    type* items;                                                                \
+    size_t head;                                                                \
+    size_t count;                                                               \
+    size_t cap;             /* 0 or a power of two */                           \
+} name##_t;                                                                     \
+                                                                                \
+static inline void name##_init(name##_t* d)                                     \
+{                                                                               \
+    memset(d, 0, sizeof(*d));                                                   \
+}                                                                               \
+                                                                                \
+static inline void name##_free(name##_t* d)                                     \
+{                                                                               \
+    free(d->items);                                                             \
+    memset(d, 0, sizeof(*d));                                                   \
+}                                                                               \
+                                                                                \
+static inline size_t name##_size(const name##_t* d)                             \
+{                                                                               \
+    return d->count;                                                            \
+}                                                                               \
+                                                                                \
+static inline bool name##_empty(const name##_t* d)                              \
+{                                                                               \
+    return d->count == 0;                                                       \
+}                                                                               \
+                                                                                \
+/* grows to hold at least n elements, the ring is unwrapped while copying */    \
+static inline void name##_reserve(name##_t* d, size_t n)                        \
+{                                                                               \
+    type* items;                                                                \
+    size_t cap;                                                                 \
+    size_t first;                                                               \
+                                                                                \
+    if (n <= d->cap)                                                            \
+        return;                                                                 \
+    cap = d->cap ? d->cap : FT_DEQUE_MIN_CAP;                                   \
+    while (cap < n)                                                             \
+        cap *= 2;                                                               \
+    items = malloc(cap * sizeof(type));                                         \
+    first = d->cap - d->head < d->count ? d->cap - d->head : d->count;          \
+    if (d->count)                                                               \
+    {                                                                           \
+        memcpy(items, d->items + d->head, first * sizeof(type));                \
+        memcpy(items + first, d->items, (d->count - first) * sizeof(type));     \
+    }                                                                           \
+    free(d->items);                                                             \
+    d->items = items;                                                           \
+    d->head = 0;                                                                \
+    d->cap = cap;                                                               \
+}                                                                               \
+                                                                                \
+/* i-th element from the front, i < count */                                    \
+static inline type* name##_at(const name##_t* d, size_t i)                      \
+{                                                                               \
+    return &d->items[(d->head + i) & (d->cap - 1)];                             \
+}                                                                               \
+                                                                                \
+static inline void name##_push_back(name##_t* d, type v)                        \
+{                                                                               \
+    if (d->count == d->cap)                                                     \
+        name##_reserve(d, d->count + 1);                                        \
+    d->items[(d->head + d->count) & (d->cap - 1)] = v;                          \
+    d->count++;                                                                 \
+}                                                                               \
+                                                                                \
+static inline void name##_push_front(name##_t* d, type v)                       \
+{                                                                               \
+    if (d->count == d->cap)                                                     \
+        name##_reserve(d, d->count + 1);                                        \
+    d->head = (d->head - 1) & (d->cap - 1);                                     \
+    d->items[d->head] = v;                                                      \
+    d->count++;                                                                 \
+}                                                                               \
+                                                                                \
+static inline bool name##_pop_front(name##_t* d, type* out)                     \
+{                                                                               \
+    if (!d->count)                                                              \
+        return false;                                                           \
+    if (out)                                                                    \
+        *out = d->items[d->head];                                               \
+    d->head = (d->head + 1) & (d->cap - 1);                                     \
+    d->count--;                                                                 \
+    return true;                                                                \
+}                                                                               \
+                                                                                \
+static inline bool name##_pop_back(name##_t* d, type* out)                      \
+{                                                                               \
+    if (!d->count)                                                              \
+        return false;                                                           \
+    d->count--;                                                                 \
+    if (out)                                                                    \
+        *out = d->items[(d->head + d->count) & (d->cap - 1)];                   \
+    return true;                                                                \
+}                                                                               \
+                                                                                \
+/* keeps the storage */                                                         \
+static inline void name##_clear(name##_t* d)                                    \
+{                                                                               \
+    d->head = 0;                                                                \
+    d->count = 0;                                                               \
+}
+
+/* it is a pointer to the element type, declared by the caller */
+# define FT_DEQUE_FOREACH(d, i, it)                                              \
+    for ((i) = 0; (i) < (d)->count                                              \
+         && ((it) = &(d)->items[((d)->head + (i)) & ((d)->cap - 1)], 1); (i)++)
+
+#endif /* FT_DEQUE_H */
@@ -0,0 +1,166 @@
+#ifndef FT_ILIST_H
+# define FT_ILIST_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Intrusive doubly linked list, header only.
+ *
+ * The node is embedded in the element and the list keeps a sentinel and
+ * its size, so push, pop, unlink and size are O(1) and nothing is
+ * allocated. Unlinked nodes have next == NULL, which makes double
+ * removal harmless.
+ *
+ *     typedef struct { int fd; ft_ilist_node_t link; } conn_t;
+ *     FT_ILIST_FOREACH(&list, c, link)
+ *         ...c->fd...
+ */
+
+typedef struct ft_ilist_node_s
+{
+    struct ft_ilist_node_s* next;
+    struct ft_ilist_node_s* prev;
+} ft_ilist_node_t;
+
+typedef struct
+{
+    ft_ilist_node_t head;
+    size_t size;
+} ft_ilist_t;
+
+/* element holding node, member is the name of its ft_ilist_node_t field */
+# define FT_ILIST_ENTRY(node, type, member) \
+    ((type*)((char*)(node) - offsetof(type, member)))
+
+static inline void ft_ilist_init(ft_ilist_t* l)
+{
+    l->head.next = &l->head;
+    l->head.prev = &l->head;
+    l->size = 0;
+}
+
+static inline size_t ft_ilist_size(const ft_ilist_t* l)
+{
+    return l->size;
+}
+
+static inline bool ft_ilist_empty(const ft_ilist_t* l)
+{
+    return l->size == 0;
+}
+
+static inline bool ft_ilist_linked(const ft_ilist_node_t* n)
+{
+    return n->next != NULL;
+}
+
+static inline void ft_ilist_insert_after(ft_ilist_t* l, ft_ilist_node_t* pos, ft_ilist_node_t* n)
+{
+    n->prev = pos;
+    n->next = pos->next;
+    pos->next->prev = n;
+    pos->next = n;
+    l->size++;
+}
+
+static inline void ft_ilist_insert_before(ft_ilist_t* l, ft_ilist_node_t* pos, ft_ilist_node_t* n)
+{
+    ft_ilist_insert_after(l, pos->prev, n);
+}
+
+static inline void ft_ilist_push_front(ft_ilist_t* l, ft_ilist_node_t* n)
+{
+    ft_ilist_insert_after(l, &l->head, n);
+}
+
+static inline void ft_ilist_push_back(ft_ilist_t* l, ft_ilist_node_t* n)
+{
+    ft_ilist_insert_after(l, l->head.prev, n);
+}
+
+static inline void ft_ilist_remove(ft_ilist_t* l, ft_ilist_node_t* n)
+{
+    if (!n->next)
+        return;
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+    n->next = NULL;
+    n->prev = NULL;
+    l->size--;
+}
+
+static inline ft_ilist_node_t* ft_ilist_first(const ft_ilist_t* l)
+{
+    return l->size ? l->head.next : NULL;
+}
+
+static inline ft_ilist_node_t* ft_ilist_last(const ft_ilist_t* l)
+{
+    return l->size ? l->head.prev : NULL;
+}
+
+/* NULL past the end */
+static inline ft_ilist_node_t* ft_ilist_next(const ft_ilist_t* l, const ft_ilist_node_t* n)
+{
+    return n->next == &l->head ? NULL : n->next;
+}
+
+static inline ft_ilist_node_t* ft_ilist_prev(const ft_ilist_t* l, const ft_ilist_node_t* n)
+{
+    return n->prev == &l->head ? NULL : n->prev;
+}
+
+static inline ft_ilist_node_t* ft_ilist_pop_front(ft_ilist_t* l)
+{
+    ft_ilist_node_t* n;
+
+    n = ft_ilist_first(l);
+    if (n)
+        ft_ilist_remove(l, n);
+    return n;
+}
+
+static inline ft_ilist_node_t* ft_ilist_pop_back(ft_ilist_t* l)
+{
+    ft_ilist_node_t* n;
+
+    n = ft_ilist_last(l);
+    if (n)
+        ft_ilist_remove(l, n);
+    return n;
+}
+
+/* moves every element of src to the end of dst */
+static inline void ft_ilist_splice_back(ft_ilist_t* dst, ft_ilist_t* src)
+{
+    if (!src->size)
+        return;
+    src->head.next->prev = dst->head.prev;
+    dst->head.prev->next = src->head.next;
+    src->head.prev->next = &dst->head;
+    dst->head.prev = src->head.prev;
+    dst->size += src->size;
+    ft_ilist_init(src);
+}
+
+/* it is a pointer to the element type, declared by the caller */
+# define FT_ILIST_FOREACH(l, it, member)                                         \
+    for ((it) = FT_ILIST_ENTRY((l)->head.next, __typeof__(*(it)), member);      \
+         &(it)->member != &(l)->head;                                           \
+         (it) = FT_ILIST_ENTRY((it)->member.next, __typeof__(*(it)), member))
+
+# define FT_ILIST_FOREACH_REVERSE(l, it, member)                                 \
+    for ((it) = FT_ILIST_ENTRY((l)->head.prev, __typeof__(*(it)), member);      \
+         &(it)->member != &(l)->head;                                           \
+         (it) = FT_ILIST_ENTRY((it)->member.prev, __typeof__(*(it)), member))
+
+/* it may be removed (and freed) inside the loop */
+# define FT_ILIST_FOREACH_SAFE(l, it, tmp, member)                               \
+    for ((it) = FT_ILIST_ENTRY((l)->head.next, __typeof__(*(it)), member),      \
+         (tmp) = FT_ILIST_ENTRY((it)->member.next, __typeof__(*(it)), member);  \
+         &(it)->member != &(l)->head;                                           \
+         (it) = (tmp),                                                          \
+         (tmp) = FT_ILIST_ENTRY((tmp)->member.next, __typeof__(*(it)), member))
+
+#endif /* FT_ILIST_H */
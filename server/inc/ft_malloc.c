@@ -1,27 +1,229 @@
 #include <ft_malloc.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include <pthread.h>
 
 #undef malloc
 #undef realloc
+#undef strdup
+#undef calloc
+#undef free
+
+#ifdef FT_MALLOC_TRACK
+/* the tables are allocated with the libc allocator, never through the macros */
+#include "../third_party/uthash-master/src/uthash.h"
+
+typedef struct
+{
+    const char* file;
+    int line;
+} m_site_key_t;
+
+typedef struct
+{
+    m_site_key_t key;
+    ft_malloc_site_t stats;
+    UT_hash_handle hh;
+} m_site_t;
+
+typedef struct
+{
+    void* ptr;
+    size_t size;
+    m_site_t* site;
+    UT_hash_handle hh;
+} m_block_t;
+
+static pthread_mutex_t m_lock = PTHREAD_MUTEX_INITIALIZER;
+static m_site_t* m_sites = NULL;
+static m_block_t* m_blocks = NULL;
+static ft_malloc_totals_t m_totals;
+
+static m_site_t* m_site(const char* file, int line)
+{
+    m_site_key_t key;
+    m_site_t* site;
+
+    memset(&key, 0, sizeof(key));
+    key.file = file ? file : "?";
+    key.line = line;
+    HASH_FIND(hh, m_sites, &key, sizeof(key), site);
+    if (!site)
+    {
+        site = calloc(1, sizeof(*site));
+        ft_assert(site != NULL, "calloc failed");
+        site->key = key;
+        site->stats.file = key.file;
+        site->stats.line = line;
+        HASH_ADD(hh, m_sites, key, sizeof(key), site);
+    }
+    return site;
+}
+
+/* caller holds m_lock */
+static void m_forget(void* ptr)
+{
+    m_block_t* b;
+
+    HASH_FIND_PTR(m_blocks, &ptr, b);
+    if (!b)
+        return;
+    HASH_DEL(m_blocks, b);
+    b->site->stats.live_count--;
+    b->site->stats.live_bytes -= b->size;
+    m_totals.live_bytes -= b->size;
+    m_totals.frees++;
+    free(b);
+}
+
+static void m_track(void* ptr, size_t size, const char* file, int line)
+{
+    m_block_t* b;
+
+    b = malloc(sizeof(*b));
+    ft_assert(b != NULL, "malloc failed");
+    b->ptr = ptr;
+    b->size = size;
+
+    pthread_mutex_lock(&m_lock);
+    /* a pointer still recorded was freed behind our back and handed out again */
+    m_forget(ptr);
+    b->site = m_site(file, line);
+    b->site->stats.allocs++;
+    b->site->stats.bytes += size;
+    b->site->stats.live_count++;
+    b->site->stats.live_bytes += size;
+    m_totals.allocs++;
+    m_totals.live_bytes += size;
+    if (m_totals.live_bytes > m_totals.peak_bytes)
+        m_totals.peak_bytes = m_totals.live_bytes;
+    HASH_ADD_PTR(m_blocks, ptr, b);
+    pthread_mutex_unlock(&m_lock);
+}
+
+void* ft_malloc_at(size_t size, const char* file, int line)
+{
+    void* ptr;
+
+    ptr = malloc(size);
+    ft_assert(ptr != NULL, "malloc failed");
+    m_track(ptr, size, file, line);
+    return ptr;
+}
+
+void* ft_calloc_at(size_t count, size_t size, const char* file, int line)
+{
+    void* ptr;
+
+    ptr = calloc(count, size);
+    if (ptr)
+        m_track(ptr, count * size, file, line);
+    return ptr;
+}
+
+void* ft_realloc_at(void* ptr, size_t size, const char* file, int line)
+{
+    void* new_ptr;
+
+    if (ptr)
+    {
+        pthread_mutex_lock(&m_lock);
+        m_forget(ptr);
+        pthread_mutex_unlock(&m_lock);
+    }
+    new_ptr = realloc(ptr, size);
+    ft_assert(new_ptr != NULL, "realloc failed");
+    m_track(new_ptr, size, file, line);
+    return new_ptr;
+}
+
+char* ft_strdup_at(const char* s, const char* file, int line)
+{
+    size_t len;
+    char* new_s;
+
+    len = strlen(s);
+    new_s = ft_malloc_at(len + 1, file, line);
+    memcpy(new_s, s, len + 1);
+    return new_s;
+}
+
+void ft_free(void* ptr)
+{
+    if (!ptr)
+        return;
+    pthread_mutex_lock(&m_lock);
+    m_forget(ptr);
+    pthread_mutex_unlock(&m_lock);
+    free(ptr);
+}
+
+void* ft_malloc(size_t size)
+{
+    return ft_malloc_at(size, NULL, 0);
+}
+
+void* ft_realloc(void* ptr, size_t size)
+{
+    return ft_realloc_at(ptr, size, NULL, 0);
+}
+
+char* ft_strdup(const char* s)
+{
+    return ft_strdup_at(s, NULL, 0);
+}
+
+int ft_malloc_tracking(void)
+{
+    return 1;
+}
+
+void ft_malloc_totals(ft_malloc_totals_t* out)
+{
+    pthread_mutex_lock(&m_lock);
+    *out = m_totals;
+    pthread_mutex_unlock(&m_lock);
+}
+
+static int m_site_cmp(m_site_t* a, m_site_t* b)
+{
+    if (a->stats.live_bytes != b->stats.live_bytes)
+        return a->stats.live_bytes < b->stats.live_bytes ? 1 : -1;
+    if (a->stats.bytes != b->stats.bytes)
+        return a->stats.bytes < b->stats.bytes ? 1 : -1;
+    return 0;
+}
+
+size_t ft_malloc_top_sites(ft_malloc_site_t* out, size_t max)
+{
+    m_site_t* site;
+    size_t n;
+
+    n = 0;
+    pthread_mutex_lock(&m_lock);
+    HASH_SORT(m_sites, m_site_cmp);
+    for (site = m_sites; site && n < max; site = site->hh.next)
+        out[n++] = site->stats;
+    pthread_mutex_unlock(&m_lock);
+    return n;
+}
+
+#else
 
 void* ft_malloc(size_t size)
 {
-#undef malloc
     void *ptr = malloc(size);
     ft_assert(ptr != NULL, "malloc failed");
-#define malloc(x) ft_malloc(x)
     return ptr;
 }
 
 void* ft_realloc(void *ptr, size_t size)
 {
-#undef realloc
     void* new_ptr = realloc(ptr, size);
     ft_assert(new_ptr != NULL, "realloc failed");
-#define realloc(x, y) ft_realloc(x, y)
     return new_ptr;
 }
 
@@ -33,3 +235,56 @@ char *ft_strdup(const char *s)
     new_s[len] = '\0';
     return new_s;
 }
+
+/* the instrumented entry points still link, they just skip the accounting */
+void* ft_malloc_at(size_t size, const char* file, int line)
+{
+    (void)file;
+    (void)line;
+    return ft_malloc(size);
+}
+
+void* ft_realloc_at(void *ptr, size_t size, const char* file, int line)
+{
+    (void)file;
+    (void)line;
+    return ft_realloc(ptr, size);
+}
+
+char* ft_strdup_at(const char *s, const char* file, int line)
+{
+    (void)file;
+    (void)line;
+    return ft_strdup(s);
+}
+
+void* ft_calloc_at(size_t count, size_t size, const char* file, int line)
+{
+    (void)file;
+    (void)line;
+    return calloc(count, size);
+}
+
+void ft_free(void *ptr)
+{
+    free(ptr);
+}
+
+int ft_malloc_tracking(void)
+{
+    return 0;
+}
+
+void ft_malloc_totals(ft_malloc_totals_t* out)
+{
+    memset(out, 0, sizeof(*out));
+}
+
+size_t ft_malloc_top_sites(ft_malloc_site_t* out, size_t max)
+{
+    (void)out;
+    (void)max;
+    return 0;
+}
+
+#endif /* FT_MALLOC_TRACK */
@@ -23,11 +23,58 @@
     ptr_new; \
 })
 
+#ifdef FT_MALLOC_TRACK
+/*
+ * Instrumented build (make MALLOC_TRACK=1): every allocation made through
+ * these macros is charged to its call site. calloc and free are routed
+ * too so that live bytes stay exact; memory from anywhere else is freed
+ * untouched.
+ */
+#include <string.h>
+
+#define malloc(x) ft_malloc_at(x, __FILE__, __LINE__)
+#define realloc(x, y) ft_realloc_at(x, y, __FILE__, __LINE__)
+#define strdup(x) ft_strdup_at(x, __FILE__, __LINE__)
+#define calloc(x, y) ft_calloc_at(x, y, __FILE__, __LINE__)
+#define free(x) ft_free(x)
+#else
 #define malloc(x) ft_malloc(x)
 #define realloc(x, y) ft_realloc(x, y)
 #define strdup(x) ft_strdup(x)
+#endif
 
 void* ft_malloc(size_t size);
 void* ft_realloc(void *ptr, size_t size);
 char* ft_strdup(const char *s);
+
+void* ft_malloc_at(size_t size, const char* file, int line);
+void* ft_realloc_at(void *ptr, size_t size, const char* file, int line);
+char* ft_strdup_at(const char *s, const char* file, int line);
+void* ft_calloc_at(size_t count, size_t size, const char* file, int line);
+void ft_free(void *ptr);
+
+typedef struct
+{
+    const char* file;
+    int line;
+    size_t allocs;
+    size_t bytes;           /* allocated since start */
+    size_t live_count;
+    size_t live_bytes;
+} ft_malloc_site_t;
+
+typedef struct
+{
+    size_t allocs;
+    size_t frees;
+    size_t live_bytes;
+    size_t peak_bytes;
+} ft_malloc_totals_t;
+
+/* false unless built with FT_MALLOC_TRACK, the queries below then report nothing */
+int ft_malloc_tracking(void);
+void ft_malloc_totals(ft_malloc_totals_t* out);
+
+/* up to max call sites, by live bytes then bytes allocated, returns how many were written */
+size_t ft_malloc_top_sites(ft_malloc_site_t* out, size_t max);
 #endif /* FT_MALLOC_H */
@@ -0,0 +1,131 @@
+#include <string.h>
+#include "ft_sha1.h"
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void m_sha1_block(uint32_t h[5], const uint8_t* block)
+{
+    uint32_t w[80];
+    uint32_t a, b, c, d, e;
+    uint32_t f, k, tmp;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16)
+             | ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+    for (i = 16; i < 80; i++)
+        w[i] = ROL32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    a = h[0];
+    b = h[1];
+    c = h[2];
+    d = h[3];
+    e = h[4];
+    for (i = 0; i < 80; i++)
+    {
+        if (i < 20)
+        {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        }
+        else if (i < 40)
+        {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        }
+        else if (i < 60)
+        {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        }
+        else
+        {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        tmp = ROL32(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = ROL32(b, 30);
+        b = a;
+        a = tmp;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+void ft_sha1(const void* data, size_t len, uint8_t out[FT_SHA1_DIGEST_LEN])
+{
+    const uint8_t* p = data;
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    uint8_t tail[128];
+    uint64_t bits;
+    size_t rest;
+    size_t tail_len;
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64)
+        m_sha1_block(h, p + i);
+
+    /* padding: 0x80, zeroes, 64-bit big-endian length */
+    rest = len - i;
+    memcpy(tail, p + i, rest);
+    tail[rest] = 0x80;
+    tail_len = rest + 1 + 8 <= 64 ? 64 : 128;
+    memset(tail + rest + 1, 0, tail_len - rest - 1);
+    bits = (uint64_t)len * 8;
+    for (i = 0; i < 8; i++)
+        tail[tail_len - 1 - i] = (uint8_t)(bits >> (i * 8));
+
+    m_sha1_block(h, tail);
+    if (tail_len == 128)
+        m_sha1_block(h, tail + 64);
+
+    for (i = 0; i < 5; i++)
+    {
+        out[i * 4]     = (uint8_t)(h[i] >> 24);
+        out[i * 4 + 1] = (uint8_t)(h[i] >> 16);
+        out[i * 4 + 2] = (uint8_t)(h[i] >> 8);
+        out[i * 4 + 3] = (uint8_t)h[i];
+    }
+}
+
+size_t ft_base64_encode(const uint8_t* in, size_t len, char* out)
+{
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    uint32_t v;
+    size_t o;
+    size_t i;
+
+    o = 0;
+    for (i = 0; i + 3 <= len; i += 3)
+    {
+        v = ((uint32_t)in[i] << 16) | ((uint32_t)in[i + 1] << 8) | in[i + 2];
+        out[o++] = alphabet[(v >> 18) & 63];
+        out[o++] = alphabet[(v >> 12) & 63];
+        out[o++] = alphabet[(v >> 6) & 63];
+        out[o++] = alphabet[v & 63];
+    }
+    if (len - i == 1)
+    {
+        v = (uint32_t)in[i] << 16;
+        out[o++] = alphabet[(v >> 18) & 63];
+        out[o++] = alphabet[(v >> 12) & 63];
+        out[o++] = '=';
+        out[o++] = '=';
+    }
+    else if (len - i == 2)
+    {
+        v = ((uint32_t)in[i] << 16) | ((uint32_t)in[i + 1] << 8);
+        out[o++] = alphabet[(v >> 18) & 63];
+        out[o++] = alphabet[(v >> 12) & 63];
+        out[o++] = alphabet[(v >> 6) & 63];
+        out[o++] = '=';
+    }
+    out[o] = '\0';
+    return o;
+}
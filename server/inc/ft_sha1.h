@@ -0,0 +1,19 @@
+#ifndef FT_SHA1_H
+# define FT_SHA1_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * SHA-1 and base64, just what the WebSocket handshake needs
+ * (Sec-WebSocket-Accept) without linking a crypto library.
+ */
+# define FT_SHA1_DIGEST_LEN 20
+
+void ft_sha1(const void* data, size_t len, uint8_t out[FT_SHA1_DIGEST_LEN]);
+
+/* out must hold ft_base64_len(len) bytes, NUL included. Returns strlen(out). */
+# define ft_base64_len(len) ((((len) + 2) / 3) * 4 + 1)
+size_t ft_base64_encode(const uint8_t* in, size_t len, char* out);
+
+#endif /* FT_SHA1_H */
@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "ft_slab.h"
+#include "ft_malloc.h"
+
+#define SLAB_ALIGN 16
+#define SLAB_HEADER 64          /* objects start on the next cache line */
+#define CACHE_LINE 64
+
+typedef struct ft_slab_local_s ft_slab_local_t;
+
+typedef struct ft_slab_page_s
+{
+    ft_slab_local_t* owner;
+    struct ft_slab_page_s* next;
+    uint32_t carved;            /* objects handed out at least once */
+} ft_slab_page_t;
+
+/* one per cache and thread; the remote list sits on its own cache line */
+struct ft_slab_local_s
+{
+    ft_slab_cache_t* cache;
+    ft_slab_local_t* next;
+    const char* thread;         /* &m_thread_tag of the owner */
+    void* free;
+    ft_slab_page_t* pages;
+    atomic_size_t allocs;
+    atomic_size_t frees;
+    atomic_size_t slabs;
+    _Alignas(CACHE_LINE) _Atomic(void*) remote;
+    atomic_size_t remote_frees;
+};
+
+struct ft_slab_cache_s
+{
+    char name[32];
+    size_t size;
+    uint32_t per_slab;
+    int id;
+    uint64_t gen;
+    pthread_mutex_t lock;
+    ft_slab_local_t* locals;
+};
+
+typedef struct
+{
+    ft_slab_local_t* local;
+    uint64_t gen;
+} slab_tls_t;
+
+_Static_assert(sizeof(ft_slab_page_t) <= SLAB_HEADER, "slab header too large");
+
+static ft_slab_cache_t* m_caches[FT_SLAB_MAX_CACHES];
+static pthread_mutex_t m_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t m_gen = 0;
+static __thread slab_tls_t m_tls[FT_SLAB_MAX_CACHES];
+static __thread char m_thread_tag;
+
+ft_slab_cache_t* ft_slab_create(const char* name, size_t object_size)
+{
+    ft_slab_cache_t* c;
+    int id;
+
+    c = calloc(1, sizeof(*c));
+    ft_assert(c != NULL, "calloc failed");
+    snprintf(c->name, sizeof(c->name), "%s", name);
+    c->size = (object_size + SLAB_ALIGN - 1) & ~((size_t)SLAB_ALIGN - 1);
+    if (c->size == 0)
+        c->size = SLAB_ALIGN;
+    ft_assert(c->size <= (FT_SLAB_SIZE - SLAB_HEADER) / 8, "slab object too large");
+    c->per_slab = (FT_SLAB_SIZE - SLAB_HEADER) / c->size;
+    pthread_mutex_init(&c->lock, NULL);
+
+    pthread_mutex_lock(&m_lock);
+    for (id = 0; id < FT_SLAB_MAX_CACHES && m_caches[id]; id++)
+        ;
+    ft_assert(id < FT_SLAB_MAX_CACHES, "too many slab caches");
+    c->id = id;
+    c->gen = ++m_gen;
+    m_caches[id] = c;
+    pthread_mutex_unlock(&m_lock);
+    return c;
+}
+
+void ft_slab_destroy(ft_slab_cache_t* cache)
+{
+    ft_slab_local_t* l;
+    ft_slab_local_t* next_local;
+    ft_slab_page_t* p;
+    ft_slab_page_t* next_page;
+
+    if (!cache)
+        return;
+
+    pthread_mutex_lock(&m_lock);
+    m_caches[cache->id] = NULL;
+    pthread_mutex_unlock(&m_lock);
+
+    for (l = cache->locals; l; l = next_local)
+    {
+        next_local = l->next;
+        for (p = l->pages; p; p = next_page)
+        {
+            next_page = p->next;
+            free(p);
+        }
+        free(l);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+/* the calling thread's state for cache, created on its first allocation */
+static ft_slab_local_t* m_local(ft_slab_cache_t* c)
+{
+    slab_tls_t* tls;
+    ft_slab_local_t* l;
+
+    tls = &m_tls[c->id];
+    if (tls->gen == c->gen)
+        return tls->local;
+
+    l = aligned_alloc(CACHE_LINE, (sizeof(*l) + CACHE_LINE - 1) & ~((size_t)CACHE_LINE - 1));
+    ft_assert(l != NULL, "aligned_alloc failed");
+    memset(l, 0, sizeof(*l));
+    l->cache = c;
+    l->thread = &m_thread_tag;
+
+    pthread_mutex_lock(&c->lock);
+    l->next = c->locals;
+    c->locals = l;
+    pthread_mutex_unlock(&c->lock);
+
+    tls->local = l;
+    tls->gen = c->gen;
+    return l;
+}
+
+static void* m_carve(ft_slab_local_t* l)
+{
+    ft_slab_page_t* p;
+
+    p = l->pages;
+    if (!p || p->carved == l->cache->per_slab)
+    {
+        p = aligned_alloc(FT_SLAB_SIZE, FT_SLAB_SIZE);
+        ft_assert(p != NULL, "aligned_alloc failed");
+        p->owner = l;
+        p->carved = 0;
+        p->next = l->pages;
+        l->pages = p;
+        atomic_fetch_add_explicit(&l->slabs, 1, memory_order_relaxed);
+    }
+    return (char*)p + SLAB_HEADER + (size_t)p->carved++ * l->cache->size;
+}
+
+void* ft_slab_alloc(ft_slab_cache_t* cache)
+{
+    ft_slab_local_t* l;
+    void* obj;
+
+    l = m_local(cache);
+    obj = l->free;
+    if (!obj)
+        obj = atomic_exchange_explicit(&l->remote, NULL, memory_order_acquire);
+    if (obj)
+        l->free = *(void**)obj;
+    else
+        obj = m_carve(l);
+
+    atomic_store_explicit(&l->allocs, atomic_load_explicit(&l->allocs, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    memset(obj, 0, cache->size);
+    return obj;
+}
+
+void ft_slab_free(void* object)
+{
+    ft_slab_page_t* p;
+    ft_slab_local_t* l;
+    void* head;
+
+    if (!object)
+        return;
+
+    p = (ft_slab_page_t*)((uintptr_t)object & ~((uintptr_t)FT_SLAB_SIZE - 1));
+    l = p->owner;
+    if (l->thread == &m_thread_tag)
+    {
+        *(void**)object = l->free;
+        l->free = object;
+        atomic_store_explicit(&l->frees, atomic_load_explicit(&l->frees, memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+        return;
+    }
+
+    head = atomic_load_explicit(&l->remote, memory_order_relaxed);
+    do
+        *(void**)object = head;
+    while (!atomic_compare_exchange_weak_explicit(&l->remote, &head, object,
+                                                  memory_order_release, memory_order_relaxed));
+    atomic_fetch_add_explicit(&l->remote_frees, 1, memory_order_relaxed);
+}
+
+void ft_slab_stats(ft_slab_cache_t* cache, ft_slab_stats_t* out)
+{
+    ft_slab_local_t* l;
+    size_t freed;
+    size_t allocs;
+
+    memset(out, 0, sizeof(*out));
+    out->name = cache->name;
+    out->object_size = cache->size;
+
+    allocs = 0;
+    freed = 0;
+    pthread_mutex_lock(&cache->lock);
+    for (l = cache->locals; l; l = l->next)
+    {
+        allocs += atomic_load_explicit(&l->allocs, memory_order_relaxed);
+        freed += atomic_load_explicit(&l->frees, memory_order_relaxed);
+        out->remote_frees += atomic_load_explicit(&l->remote_frees, memory_order_relaxed);
+        out->slabs += atomic_load_explicit(&l->slabs, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    freed += out->remote_frees;
+    out->live = allocs > freed ? allocs - freed : 0;
+    out->capacity = out->slabs * cache->per_slab;
+    if (out->capacity)
+        out->fragmentation = 1.0 - (double)out->live / (double)out->capacity;
+}
+
+void ft_slab_foreach(ft_slab_stats_cb_t cb, void* user_data)
+{
+    ft_slab_stats_t stats;
+    int i;
+
+    pthread_mutex_lock(&m_lock);
+    for (i = 0; i < FT_SLAB_MAX_CACHES; i++)
+    {
+        if (!m_caches[i])
+            continue;
+        ft_slab_stats(m_caches[i], &stats);
+        cb(&stats, user_data);
+    }
+    pthread_mutex_unlock(&m_lock);
+}
@@ -0,0 +1,51 @@
+#ifndef FT_SLAB_H
+# define FT_SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Pool of fixed-size objects carved from FT_SLAB_SIZE aligned slabs.
+ *
+ * Every thread allocates from its own freelist and slabs, so the fast
+ * paths take no lock. An object freed by another thread is pushed on the
+ * owner's lock-free remote list and reused by the owner once its local
+ * freelist runs dry. Slabs stay with the cache until ft_slab_destroy().
+ */
+# define FT_SLAB_SIZE (64 * 1024)
+# define FT_SLAB_MAX_CACHES 64
+
+typedef struct ft_slab_cache_s ft_slab_cache_t;
+
+typedef struct
+{
+    const char* name;
+    size_t object_size;
+    size_t live;                /* allocated and not yet freed */
+    size_t slabs;
+    size_t capacity;            /* objects the slabs can hold */
+    uint64_t remote_frees;      /* frees from a thread other than the owner */
+    double fragmentation;       /* share of the slab space not holding a live object */
+} ft_slab_stats_t;
+
+typedef void (*ft_slab_stats_cb_t)(const ft_slab_stats_t* stats, void* user_data);
+
+ft_slab_cache_t* ft_slab_create(const char* name, size_t object_size);
+
+/* objects still allocated from the cache become invalid */
+void ft_slab_destroy(ft_slab_cache_t* cache);
+
+/* zeroed, never NULL */
+void* ft_slab_alloc(ft_slab_cache_t* cache);
+
+/* from any thread, the cache is found from the slab */
+void ft_slab_free(void* object);
+
+void ft_slab_stats(ft_slab_cache_t* cache, ft_slab_stats_t* out);
+void ft_slab_foreach(ft_slab_stats_cb_t cb, void* user_data);
+
+/* typed front end: FT_SLAB_CACHE(session_t), FT_SLAB_NEW(cache, session_t) */
+# define FT_SLAB_CACHE(type) ft_slab_create(#type, sizeof(type))
+# define FT_SLAB_NEW(cache, type) ((type*)ft_slab_alloc(cache))
+
+#endif /* FT_SLAB_H */
@@ -0,0 +1,574 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "../log/log_api.h"
+#include "../server/server_api.h"
+#include "../metrics/metrics_api.h"
+#include "../../inc/ft_malloc.h"
+#include "../../inc/ft_slab.h"
+#include "../../inc/error_codes.h"
+#include "../../third_party/uthash-master/src/uthash.h"
+#include "bus_api.h"
+
+#define BUS_MAX_REACTORS 16
+#define BUS_BATCH 1024          /* deliveries per wakeup before yielding to the loop */
+#define BUS_NOTIFY_BATCH 256    /* payloads per pg_notify statement */
+#define BUS_NOTIFY_MAX 7900     /* NOTIFY payloads are limited to 8000 bytes */
+#define BUS_CHANNEL "matcha_bus"
+
+/* shared by every reactor it was queued to */
+typedef struct
+{
+    atomic_int refs;
+    int user_id;
+    size_t len;
+    char data[];
+} bus_msg_t;
+
+typedef struct bus_node_s
+{
+    _Atomic(struct bus_node_s*) next;
+    bus_msg_t* msg;
+} bus_node_t;
+
+/* Vyukov intrusive MPSC queue: wait-free push, single consumer pop */
+typedef struct
+{
+    _Atomic(bus_node_t*) head;
+    bus_node_t* tail;
+    bus_node_t stub;
+} bus_queue_t;
+
+typedef struct
+{
+    bus_cb_t cb;
+    void* user_data;
+} bus_sub_t;
+
+typedef struct
+{
+    int user_id;
+    bus_sub_t* subs;
+    size_t count;
+    size_t cap;
+    UT_hash_handle hh;
+} bus_user_t;
+
+struct bus_reactor_s
+{
+    int efd;
+    atomic_int signaled;
+    bus_queue_t inbox;
+    bus_user_t* users;
+    bool dispatching;
+    bus_batch_cb_t begin;
+    bus_batch_cb_t end;
+};
+
+static bus_reactor_t* m_reactors[BUS_MAX_REACTORS];
+static atomic_int m_n_reactors = 0;
+static pthread_mutex_t m_reactors_lock = PTHREAD_MUTEX_INITIALIZER;
+static bus_reactor_t* m_main = NULL;
+static metric_t* m_batch_sizes = NULL;  /* inbox depth drained per dispatch */
+static ft_slab_cache_t* m_nodes = NULL; /* allocated by publishers, freed by reactors */
+
+/* cluster relay, owned by the main reactor */
+static DB_ID m_listen_db = INVALID_DB_ID;
+static bus_queue_t m_outbox;
+static char m_node_id[17];
+
+/* queue */
+static void m_queue_init(bus_queue_t* q)
+{
+    atomic_store_explicit(&q->stub.next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&q->head, &q->stub, memory_order_relaxed);
+    q->tail = &q->stub;
+}
+
+static void m_queue_push(bus_queue_t* q, bus_node_t* n)
+{
+    bus_node_t* prev;
+
+    atomic_store_explicit(&n->next, NULL, memory_order_relaxed);
+    prev = atomic_exchange_explicit(&q->head, n, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, n, memory_order_release);
+}
+
+/* NULL when empty, or while a producer is between its two stores */
+static bus_node_t* m_queue_pop(bus_queue_t* q)
+{
+    bus_node_t* tail;
+    bus_node_t* next;
+
+    tail = q->tail;
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &q->stub)
+    {
+        if (!next)
+            return NULL;
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next)
+    {
+        q->tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire))
+        return NULL;
+
+    m_queue_push(q, &q->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next)
+    {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/* messages */
+static bus_msg_t* m_msg_new(int user_id, const char* payload, size_t len, int refs)
+{
+    bus_msg_t* msg;
+
+    msg = malloc(sizeof(*msg) + len + 1);
+    atomic_init(&msg->refs, refs);
+    msg->user_id = user_id;
+    msg->len = len;
+    memcpy(msg->data, payload, len);
+    msg->data[len] = '\0';
+    return msg;
+}
+
+static void m_msg_release(bus_msg_t* msg)
+{
+    if (atomic_fetch_sub_explicit(&msg->refs, 1, memory_order_acq_rel) == 1)
+        free(msg);
+}
+
+static void m_enqueue(bus_queue_t* q, bus_msg_t* msg)
+{
+    bus_node_t* n;
+
+    n = FT_SLAB_NEW(m_nodes, bus_node_t);
+    n->msg = msg;
+    m_queue_push(q, n);
+}
+
+/* one eventfd write per wakeup, however many producers */
+static void m_signal(bus_reactor_t* r)
+{
+    uint64_t one = 1;
+
+    if (atomic_exchange_explicit(&r->signaled, 1, memory_order_acq_rel) == 0)
+    {
+        if (write(r->efd, &one, sizeof(one)) < 0)
+            atomic_store_explicit(&r->signaled, 0, memory_order_release);
+    }
+}
+
+static void m_publish(int user_id, const char* payload, size_t len, bool relay)
+{
+    bus_msg_t* msg;
+    int n;
+    int i;
+
+    n = atomic_load_explicit(&m_n_reactors, memory_order_acquire);
+    relay = relay && m_listen_db != INVALID_DB_ID;
+    if (n == 0)
+        return;
+
+    msg = m_msg_new(user_id, payload, len, n + (relay ? 1 : 0));
+    /* queued before the main reactor is signaled, which drains the outbox */
+    if (relay)
+        m_enqueue(&m_outbox, msg);
+    for (i = 0; i < n; i++)
+    {
+        m_enqueue(&m_reactors[i]->inbox, msg);
+        m_signal(m_reactors[i]);
+    }
+}
+
+int bus_publish(int user_id, const char* payload, size_t len)
+{
+    if (!payload)
+        return INVALID_ARGS;
+    m_publish(user_id, payload, len, true);
+    return SUCCESS;
+}
+
+/* registry */
+int bus_subscribe(bus_reactor_t* r, int user_id, bus_cb_t cb, void* user_data)
+{
+    bus_user_t* u;
+
+    if (!r || !cb)
+        return INVALID_ARGS;
+
+    HASH_FIND_INT(r->users, &user_id, u);
+    if (!u)
+    {
+        u = calloc(1, sizeof(*u));
+        ft_assert(u != NULL, "calloc failed");
+        u->user_id = user_id;
+        HASH_ADD_INT(r->users, user_id, u);
+    }
+    if (u->count == u->cap)
+    {
+        u->cap = u->cap ? u->cap * 2 : 2;
+        u->subs = realloc(u->subs, u->cap * sizeof(bus_sub_t));
+    }
+    u->subs[u->count].cb = cb;
+    u->subs[u->count].user_data = user_data;
+    u->count++;
+    return SUCCESS;
+}
+
+static void m_user_free(bus_reactor_t* r, bus_user_t* u)
+{
+    HASH_DEL(r->users, u);
+    free(u->subs);
+    free(u);
+}
+
+void bus_unsubscribe(bus_reactor_t* r, int user_id, bus_cb_t cb, void* user_data)
+{
+    bus_user_t* u;
+    size_t i;
+
+    if (!r)
+        return;
+    HASH_FIND_INT(r->users, &user_id, u);
+    if (!u)
+        return;
+
+    for (i = 0; i < u->count; i++)
+    {
+        if (u->subs[i].cb == cb && u->subs[i].user_data == user_data)
+        {
+            u->subs[i] = u->subs[--u->count];
+            break;
+        }
+    }
+    /* an empty entry met during a dispatch is freed by m_deliver() */
+    if (u->count == 0 && !r->dispatching)
+        m_user_free(r, u);
+}
+
+static void m_deliver(bus_reactor_t* r, const bus_msg_t* msg)
+{
+    bus_user_t* u;
+    size_t i;
+
+    HASH_FIND_INT(r->users, &msg->user_id, u);
+    if (!u)
+        return;
+
+    /* backwards, so a callback may unsubscribe itself */
+    for (i = u->count; i-- > 0;)
+    {
+        if (i < u->count)
+            u->subs[i].cb(msg->user_id, msg->data, msg->len, u->subs[i].user_data);
+    }
+    if (u->count == 0)
+        m_user_free(r, u);
+}
+
+/* cluster relay */
+static void m_array_append(char** buf, size_t* len, size_t* cap, const char* s, size_t n)
+{
+    if (*len + n + 1 > *cap)
+    {
+        while (*len + n + 1 > *cap)
+            *cap = *cap ? *cap * 2 : 4096;
+        *buf = realloc(*buf, *cap);
+    }
+    memcpy(*buf + *len, s, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+}
+
+/* one element of a text[] literal: "node user payload", quoted and escaped */
+static void m_array_element(char** buf, size_t* len, size_t* cap, const bus_msg_t* msg)
+{
+    char head[48];
+    const char* p;
+    int n;
+
+    n = snprintf(head, sizeof(head), "%s\"%s %d ", *len > 1 ? "," : "", m_node_id, msg->user_id);
+    m_array_append(buf, len, cap, head, n);
+    for (p = msg->data; *p; p++)
+    {
+        if (*p == '"' || *p == '\\')
+            m_array_append(buf, len, cap, "\\", 1);
+        m_array_append(buf, len, cap, p, 1);
+    }
+    m_array_append(buf, len, cap, "\"", 1);
+}
+
+static void m_flush_outbox(void)
+{
+    PGresult* res;
+    bus_node_t* node;
+    char* array;
+    size_t len;
+    size_t cap;
+    int n;
+
+    const char *sql =
+      "SELECT pg_notify('" BUS_CHANNEL "', p) FROM unnest($1::text[]) AS p;";
+
+    array = NULL;
+    len = 0;
+    cap = 0;
+    while (1)
+    {
+        m_array_append(&array, &len, &cap, "{", 1);
+        n = 0;
+        while (n < BUS_NOTIFY_BATCH && (node = m_queue_pop(&m_outbox)) != NULL)
+        {
+            if (node->msg->len <= BUS_NOTIFY_MAX)
+            {
+                m_array_element(&array, &len, &cap, node->msg);
+                n++;
+            }
+            else
+                log_msg(LOG_LEVEL_WARN, "bus: %zu byte payload not relayed\n", node->msg->len);
+            m_msg_release(node->msg);
+            ft_slab_free(node);
+        }
+        m_array_append(&array, &len, &cap, "}", 1);
+        if (n == 0)
+            break;
+
+        res = db_query(m_listen_db, sql, 1, (const char*[]){ array });
+        if (!res)
+            log_msg(LOG_LEVEL_WARN, "bus: NOTIFY of %d events failed\n", n);
+        PQclear(res);
+        len = 0;
+        if (n < BUS_NOTIFY_BATCH)
+            break;
+    }
+    free(array);
+}
+
+static void m_on_notify(const char* channel, const char* payload, void* user_data)
+{
+    const char* p;
+    char* end;
+    long user_id;
+
+    (void)user_data;
+    if (strcmp(channel, BUS_CHANNEL) != 0)
+        return;
+
+    /* our own publishes were already delivered locally */
+    if (strncmp(payload, m_node_id, sizeof(m_node_id) - 1) == 0)
+        return;
+
+    p = strchr(payload, ' ');
+    if (!p)
+        return;
+    user_id = strtol(p + 1, &end, 10);
+    if (end == p + 1 || *end != ' ')
+        return;
+
+    m_publish((int)user_id, end + 1, strlen(end + 1), false);
+}
+
+static void m_on_listen_ready(int fd, void* user_data)
+{
+    (void)fd;
+    (void)user_data;
+
+    if (db_poll_notifies(m_listen_db, m_on_notify, NULL) == ERROR)
+    {
+        log_msg(LOG_LEVEL_ERROR, "bus: LISTEN connection lost, running single node\n");
+        server_unwatch_fd(fd);
+        db_close(m_listen_db);
+        m_listen_db = INVALID_DB_ID;
+    }
+}
+
+/* reactors */
+bus_reactor_t* bus_reactor_new(void)
+{
+    bus_reactor_t* r;
+    int n;
+
+    r = calloc(1, sizeof(*r));
+    ft_assert(r != NULL, "calloc failed");
+    r->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->efd < 0)
+    {
+        free(r);
+        return NULL;
+    }
+    atomic_init(&r->signaled, 0);
+    m_queue_init(&r->inbox);
+
+    pthread_mutex_lock(&m_reactors_lock);
+    n = atomic_load_explicit(&m_n_reactors, memory_order_relaxed);
+    if (n == BUS_MAX_REACTORS)
+    {
+        pthread_mutex_unlock(&m_reactors_lock);
+        close(r->efd);
+        free(r);
+        return NULL;
+    }
+    m_reactors[n] = r;
+    atomic_store_explicit(&m_n_reactors, n + 1, memory_order_release);
+    pthread_mutex_unlock(&m_reactors_lock);
+    return r;
+}
+
+int bus_reactor_fd(const bus_reactor_t* r)
+{
+    return r ? r->efd : ERROR;
+}
+
+void bus_reactor_on_batch(bus_reactor_t* r, bus_batch_cb_t begin, bus_batch_cb_t end)
+{
+    if (!r)
+        return;
+    r->begin = begin;
+    r->end = end;
+}
+
+void bus_reactor_dispatch(bus_reactor_t* r)
+{
+    bus_node_t* node;
+    uint64_t value;
+    int i;
+
+    if (read(r->efd, &value, sizeof(value)) < 0)
+        value = 0;
+    /* cleared before draining: a publish racing with us signals again */
+    atomic_store_explicit(&r->signaled, 0, memory_order_release);
+
+    if (r == m_main && m_listen_db != INVALID_DB_ID)
+        m_flush_outbox();
+
+    r->dispatching = true;
+    if (r->begin)
+        r->begin();
+    for (i = 0; i < BUS_BATCH && (node = m_queue_pop(&r->inbox)) != NULL; i++)
+    {
+        m_deliver(r, node->msg);
+        m_msg_release(node->msg);
+        ft_slab_free(node);
+    }
+    if (r->end)
+        r->end();
+    r->dispatching = false;
+    metrics_observe(m_batch_sizes, i);
+
+    if (i == BUS_BATCH)
+        m_signal(r);
+}
+
+static void m_on_reactor_ready(int fd, void* user_data)
+{
+    (void)fd;
+    bus_reactor_dispatch(user_data);
+}
+
+bus_reactor_t* bus_main_reactor(void)
+{
+    return m_main;
+}
+
+bool bus_is_clustered(void)
+{
+    return m_listen_db != INVALID_DB_ID;
+}
+
+int bus_init(DB_ID listen_db)
+{
+    m_queue_init(&m_outbox);
+    snprintf(m_node_id, sizeof(m_node_id), "%016llx",
+             (unsigned long long)(((uint64_t)getpid() << 32) ^ (uint64_t)time(NULL)
+                                  ^ (uint64_t)(uintptr_t)&m_node_id));
+
+    m_batch_sizes = metrics_histogram("bus_dispatch_batch", "Messages delivered per reactor wakeup", NULL);
+    m_nodes = FT_SLAB_CACHE(bus_node_t);
+    m_main = bus_reactor_new();
+    if (!m_main || server_watch_fd(m_main->efd, m_on_reactor_ready, m_main) != SUCCESS)
+    {
+        log_msg(LOG_LEVEL_ERROR, "bus: unable to create the main reactor\n");
+        return ERROR;
+    }
+
+    if (listen_db != INVALID_DB_ID)
+    {
+        if (db_listen(listen_db, BUS_CHANNEL) == SUCCESS
+            && server_watch_fd(db_socket(listen_db), m_on_listen_ready, NULL) == SUCCESS)
+            m_listen_db = listen_db;
+        else
+        {
+            log_msg(LOG_LEVEL_WARN, "bus: LISTEN failed, running single node\n");
+            db_close(listen_db);
+        }
+    }
+
+    log_msg(LOG_LEVEL_BOOT, "Bus initialized: node %s, %s\n", m_node_id,
+            m_listen_db != INVALID_DB_ID ? "clustered" : "single node");
+    return SUCCESS;
+}
+
+static void m_queue_drain(bus_queue_t* q)
+{
+    bus_node_t* node;
+
+    while ((node = m_queue_pop(q)) != NULL)
+    {
+        m_msg_release(node->msg);
+        ft_slab_free(node);
+    }
+}
+
+void bus_cleanup(void)
+{
+    bus_reactor_t* r;
+    bus_user_t* u;
+    bus_user_t* tmp;
+    int n;
+    int i;
+
+    if (m_listen_db != INVALID_DB_ID)
+    {
+        m_flush_outbox();
+        server_unwatch_fd(db_socket(m_listen_db));
+        db_close(m_listen_db);
+        m_listen_db = INVALID_DB_ID;
+    }
+    m_queue_drain(&m_outbox);
+
+    n = atomic_load_explicit(&m_n_reactors, memory_order_acquire);
+    for (i = 0; i < n; i++)
+    {
+        r = m_reactors[i];
+        if (r == m_main)
+            server_unwatch_fd(r->efd);
+        m_queue_drain(&r->inbox);
+        HASH_ITER(hh, r->users, u, tmp)
+        {
+            m_user_free(r, u);
+        }
+        close(r->efd);
+        free(r);
+        m_reactors[i] = NULL;
+    }
+    atomic_store_explicit(&m_n_reactors, 0, memory_order_release);
+    m_main = NULL;
+    ft_slab_destroy(m_nodes);
+    m_nodes = NULL;
+}
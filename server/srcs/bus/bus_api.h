@@ -0,0 +1,55 @@
+#ifndef BUS_API_H
+#define BUS_API_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "../db/db_api.h"
+
+/*
+ * Per-user fan-out bus.
+ *
+ * Every reactor (event loop) owns a registry user_id -> subscribers and a
+ * lock-free MPSC inbox woken through an eventfd. bus_publish() may be
+ * called from any thread: the payload is queued to every reactor and each
+ * one delivers its inbox in batches to the local subscribers of that user.
+ *
+ * With a LISTEN connection, publishes are also relayed to the other nodes
+ * through NOTIFY (batched) and notifications from them are delivered
+ * locally, so a user is reached whatever node holds its connections.
+ */
+
+typedef struct bus_reactor_s bus_reactor_t;
+
+typedef void (*bus_cb_t)(int user_id, const char* payload, size_t len, void* user_data);
+typedef void (*bus_batch_cb_t)(void);
+
+/*
+ * Creates the main reactor on the server loop. listen_db is a connection
+ * owned by the bus from now on, INVALID_DB_ID runs single node.
+ */
+int bus_init(DB_ID listen_db);
+void bus_cleanup(void);
+
+bool bus_is_clustered(void);
+bus_reactor_t* bus_main_reactor(void);
+
+/*
+ * Reactors for other event loops: poll bus_reactor_fd() for readability
+ * and call bus_reactor_dispatch() from the reactor's own thread.
+ * Reactors live until bus_cleanup().
+ */
+bus_reactor_t* bus_reactor_new(void);
+int bus_reactor_fd(const bus_reactor_t* r);
+void bus_reactor_dispatch(bus_reactor_t* r);
+
+/* begin/end run around every delivered batch (e.g. cork/uncork sockets) */
+void bus_reactor_on_batch(bus_reactor_t* r, bus_batch_cb_t begin, bus_batch_cb_t end);
+
+/* reactor thread only */
+int bus_subscribe(bus_reactor_t* r, int user_id, bus_cb_t cb, void* user_data);
+void bus_unsubscribe(bus_reactor_t* r, int user_id, bus_cb_t cb, void* user_data);
+
+/* any thread */
+int bus_publish(int user_id, const char* payload, size_t len);
+
+#endif /* BUS_API_H */
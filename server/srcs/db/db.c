@@ -2,9 +2,33 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
+#include <stdbool.h>
+#include <strings.h>
+#include <pthread.h>
 #include "db_api.h"
 #include "../../inc/error_codes.h"
 #include "../../inc/ft_malloc.h"
+#include "../log/log_api.h"
+#include "../trace/trace_api.h"
+#include "../metrics/metrics_api.h"
+#include "../../third_party/uthash-master/src/uthash.h"
+
+#define DB_STATEMENT_LABEL 80    /* leading characters of the SQL naming a statement */
+#define DB_STATEMENT_MAX 1024    /* longer statements share stats with their prefix */
+
+typedef struct
+{
+    db_statement_stats_t stats;     /* stats.sql is the normalized text, the key */
+    bool explained;
+    metric_t* latency;
+    metric_t* errors;
+    metric_t* rows;
+    UT_hash_handle hh;
+} db_statement_t;
+
+static pthread_mutex_t m_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static db_statement_t* m_statements = NULL;
+static int m_slow_ms = 0;
 
 static inline DB_ID m_PGconn_ptr_to_id(PGconn  *db)
 {
@@ -16,6 +40,210 @@ static inline PGconn *m_db_id_to_PGconn(DB_ID db_id)
     return (PGconn *)(uintptr_t)db_id;
 }
 
+/* whitespace runs collapse to one space, so the same statement written
+ * over several lines or indented differently is counted once */
+static size_t m_normalize(const char* sql, char* out, size_t len)
+{
+    size_t n;
+
+    n = 0;
+    for (; *sql && n < len - 1; sql++)
+    {
+        if (*sql == ' ' || *sql == '\n' || *sql == '\t' || *sql == '\r')
+        {
+            if (n > 0 && out[n - 1] != ' ')
+                out[n++] = ' ';
+            continue;
+        }
+        out[n++] = *sql;
+    }
+    while (n > 0 && out[n - 1] == ' ')
+        n--;
+    out[n] = '\0';
+    return n;
+}
+
+static void m_statement_metrics(db_statement_t* st)
+{
+    char head[DB_STATEMENT_LABEL + 1];
+    char escaped[2 * DB_STATEMENT_LABEL + 1];
+    char labels[sizeof(escaped) + 16];
+
+    snprintf(head, sizeof(head), "%s", st->stats.sql);
+    metrics_escape_label(escaped, sizeof(escaped), head);
+    snprintf(labels, sizeof(labels), "statement=\"%s\"", escaped);
+    st->latency = metrics_histogram("db_query_duration_us", "Database round trip time in microseconds", labels);
+    st->errors = metrics_counter("db_query_errors_total", "Failed database statements", labels);
+    st->rows = metrics_counter("db_query_rows_total", "Rows returned or affected", labels);
+}
+
+static db_statement_t* m_statement(const char* sql)
+{
+    char key[DB_STATEMENT_MAX];
+    db_statement_t* st;
+    size_t len;
+
+    len = m_normalize(sql, key, sizeof(key));
+
+    pthread_mutex_lock(&m_stats_lock);
+    HASH_FIND(hh, m_statements, key, len, st);
+    if (!st)
+    {
+        st = calloc(1, sizeof(*st));
+        ft_assert(st != NULL, "calloc failed");
+        st->stats.sql = strdup(key);
+        HASH_ADD_KEYPTR(hh, m_statements, st->stats.sql, len, st);
+        m_statement_metrics(st);
+    }
+    pthread_mutex_unlock(&m_stats_lock);
+    return st;
+}
+
+static bool m_explainable(const char* sql)
+{
+    static const char* verbs[] = { "SELECT", "INSERT", "UPDATE", "DELETE", "WITH" };
+    size_t i;
+
+    for (i = 0; i < sizeof(verbs) / sizeof(verbs[0]); i++)
+    {
+        if (strncasecmp(sql, verbs[i], strlen(verbs[i])) == 0)
+            return true;
+    }
+    return false;
+}
+
+/* plain EXPLAIN: planned with the same parameters, never executed */
+static void m_log_plan(PGconn* conn, const db_statement_t* st, const char* sql,
+                       int nParams, const char* const* paramValues)
+{
+    char plan[3072];
+    char* explain;
+    PGresult* res;
+    size_t n;
+    int i;
+
+    explain = malloc(strlen(sql) + sizeof("EXPLAIN "));
+    sprintf(explain, "EXPLAIN %s", sql);
+    res = PQexecParams(conn, explain, nParams, NULL, paramValues, NULL, NULL, 0);
+    free(explain);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+    {
+        log_msg(LOG_LEVEL_WARN, "db: EXPLAIN failed: %s", PQresultErrorMessage(res));
+        PQclear(res);
+        return;
+    }
+
+    n = 0;
+    plan[0] = '\0';
+    for (i = 0; i < PQntuples(res) && n < sizeof(plan); i++)
+        n += snprintf(plan + n, sizeof(plan) - n, "\n    %s", PQgetvalue(res, i, 0));
+    PQclear(res);
+    log_msg(LOG_LEVEL_WARN, "db: plan of %s:%s\n", st->stats.sql, plan);
+}
+
+static void m_record(PGconn* conn, db_statement_t* st, uint64_t start, PGresult* res, bool failed,
+                     const char* sql, int nParams, const char* const* paramValues)
+{
+    unsigned long long rows;
+    unsigned long long elapsed;
+    bool slow;
+    bool explain;
+
+    elapsed = metrics_now_us() - start;
+    rows = 0;
+    if (!failed)
+        rows = PQresultStatus(res) == PGRES_TUPLES_OK ? (unsigned long long)PQntuples(res)
+                                                       : strtoull(PQcmdTuples(res), NULL, 10);
+    slow = m_slow_ms > 0 && elapsed >= (unsigned long long)m_slow_ms * 1000;
+
+    pthread_mutex_lock(&m_stats_lock);
+    st->stats.count++;
+    st->stats.errors += failed;
+    st->stats.rows += rows;
+    st->stats.total_us += elapsed;
+    if (elapsed > st->stats.max_us)
+        st->stats.max_us = elapsed;
+    explain = slow && !failed && !st->explained && m_explainable(st->stats.sql);
+    if (explain)
+        st->explained = true;
+    pthread_mutex_unlock(&m_stats_lock);
+
+    metrics_observe(st->latency, elapsed);
+    metrics_add(st->rows, rows);
+    if (failed)
+    {
+        metrics_add(st->errors, 1);
+        log_msg(LOG_LEVEL_WARN, "db: statement failed: %s\n    %s",
+                st->stats.sql, res ? PQresultErrorMessage(res) : PQerrorMessage(conn));
+    }
+    if (slow)
+        log_msg(LOG_LEVEL_WARN, "db: slow statement (%llu ms, %llu rows): %s\n",
+                elapsed / 1000, rows, st->stats.sql);
+    if (explain)
+        m_log_plan(conn, st, sql, nParams, paramValues);
+}
+
+void db_set_slow_query_ms(int ms)
+{
+    m_slow_ms = ms > 0 ? ms : 0;
+}
+
+void db_stats_foreach(db_stats_cb_t cb, void* user_data)
+{
+    db_statement_t* st;
+    db_statement_t* tmp;
+
+    pthread_mutex_lock(&m_stats_lock);
+    HASH_ITER(hh, m_statements, st, tmp)
+        cb(&st->stats, user_data);
+    pthread_mutex_unlock(&m_stats_lock);
+}
+
+static int m_by_total_desc(db_statement_t* a, db_statement_t* b)
+{
+    if (a->stats.total_us == b->stats.total_us)
+        return 0;
+    return a->stats.total_us < b->stats.total_us ? 1 : -1;
+}
+
+void db_stats_log(size_t top)
+{
+    db_statement_t* st;
+    size_t i;
+
+    pthread_mutex_lock(&m_stats_lock);
+    HASH_SORT(m_statements, m_by_total_desc);
+    i = 0;
+    for (st = m_statements; st && i < top; st = st->hh.next, i++)
+    {
+        if (st->stats.count == 0)
+            break;
+        log_msg(LOG_LEVEL_INFO,
+                "db: %lu calls, %lu errors, %llu rows, total %llu ms, avg %llu us, max %llu us: %s\n",
+                st->stats.count, st->stats.errors, st->stats.rows, st->stats.total_us / 1000,
+                st->stats.total_us / st->stats.count, st->stats.max_us, st->stats.sql);
+    }
+    pthread_mutex_unlock(&m_stats_lock);
+}
+
+void db_stats_reset(void)
+{
+    db_statement_t* st;
+    db_statement_t* tmp;
+
+    pthread_mutex_lock(&m_stats_lock);
+    HASH_ITER(hh, m_statements, st, tmp)
+    {
+        st->stats.count = 0;
+        st->stats.errors = 0;
+        st->stats.rows = 0;
+        st->stats.total_us = 0;
+        st->stats.max_us = 0;
+        st->explained = false;
+    }
+    pthread_mutex_unlock(&m_stats_lock);
+}
+
 DB_ID db_connect(const char *conninfo)
 {
     PGconn *conn;
@@ -38,11 +266,17 @@ int db_execute(DB_ID db, const char *sql, int nParams, const char *const *paramV
     PGconn* conn;
     PGresult* res;
     ExecStatusType status;
+    db_statement_t* st;
+    uint64_t start;
+    int span;
 
     if ((db == INVALID_DB_ID) || !sql) return ERROR;
 
     conn = m_db_id_to_PGconn(db);
+    st = m_statement(sql);
 
+    start = metrics_now_us();
+    span = trace_span_begin("db_execute", sql);
     res = PQexecParams(
         conn,
         sql,
@@ -53,11 +287,13 @@ int db_execute(DB_ID db, const char *sql, int nParams, const char *const *paramV
         /* paramFormats = */ NULL,       /* all text format */
         0                                /* result in text format */
     );
+    trace_span_end(span);
 
+    status = res ? PQresultStatus(res) : PGRES_FATAL_ERROR;
+    m_record(conn, st, start, res, status != PGRES_COMMAND_OK, sql, nParams, paramValues);
     if (!res)
         return ERROR;
 
-    status = PQresultStatus(res);
     if (status != PGRES_COMMAND_OK)
     {
         PQclear(res);
@@ -73,11 +309,17 @@ PGresult *db_query(DB_ID db, const char *sql, int nParams, const char *const *pa
     PGconn* conn;
     PGresult* res;
     ExecStatusType status;
+    db_statement_t* st;
+    uint64_t start;
+    int span;
 
     if (!db || !sql) return NULL;
 
     conn = m_db_id_to_PGconn(db);
+    st = m_statement(sql);
 
+    start = metrics_now_us();
+    span = trace_span_begin("db_query", sql);
     res = PQexecParams(
         conn,
         sql,
@@ -88,10 +330,12 @@ PGresult *db_query(DB_ID db, const char *sql, int nParams, const char *const *pa
         /* paramFormats = */ NULL,
         0
     );
+    trace_span_end(span);
 
+    status = res ? PQresultStatus(res) : PGRES_FATAL_ERROR;
+    m_record(conn, st, start, res, status != PGRES_TUPLES_OK, sql, nParams, paramValues);
     if (!res) return NULL;
 
-    status = PQresultStatus(res);
     if (status != PGRES_TUPLES_OK)
     {
         PQclear(res);
@@ -101,12 +345,83 @@ PGresult *db_query(DB_ID db, const char *sql, int nParams, const char *const *pa
     return res;
 }
 
+int db_execute_script(DB_ID db, const char *sql)
+{
+    PGconn* conn;
+    PGresult* res;
+    ExecStatusType status;
+    db_statement_t* st;
+    uint64_t start;
+    int span;
+
+    if ((db == INVALID_DB_ID) || !sql) return ERROR;
+
+    conn = m_db_id_to_PGconn(db);
+    st = m_statement(sql);
+
+    start = metrics_now_us();
+    span = trace_span_begin("db_execute_script", sql);
+    res = PQexec(conn, sql);    /* the result of the last statement, or of the failed one */
+    trace_span_end(span);
+
+    status = res ? PQresultStatus(res) : PGRES_FATAL_ERROR;
+    m_record(conn, st, start, res, status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK, sql, 0, NULL);
+    if (res)
+        PQclear(res);
+    return status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK ? SUCCESS : ERROR;
+}
+
 void db_clear_result(PGresult *res)
 {
     if (res)
         PQclear(res);
 }
 
+int db_listen(DB_ID db, const char *channel)
+{
+    PGconn* conn;
+    char* ident;
+    char sql[256];
+
+    if (db == INVALID_DB_ID || !channel) return ERROR;
+
+    conn = m_db_id_to_PGconn(db);
+    ident = PQescapeIdentifier(conn, channel, strlen(channel));
+    if (!ident) return ERROR;
+    snprintf(sql, sizeof(sql), "LISTEN %s;", ident);
+    PQfreemem(ident);
+
+    return db_execute(db, sql, 0, NULL);
+}
+
+int db_socket(DB_ID db)
+{
+    if (db == INVALID_DB_ID) return ERROR;
+    return PQsocket(m_db_id_to_PGconn(db));
+}
+
+int db_poll_notifies(DB_ID db, db_notify_cb_t cb, void *user_data)
+{
+    PGconn* conn;
+    PGnotify* notify;
+    int n;
+
+    if (db == INVALID_DB_ID || !cb) return ERROR;
+
+    conn = m_db_id_to_PGconn(db);
+    if (!PQconsumeInput(conn))
+        return ERROR;
+
+    n = 0;
+    while ((notify = PQnotifies(conn)) != NULL)
+    {
+        cb(notify->relname, notify->extra, user_data);
+        PQfreemem(notify);
+        n++;
+    }
+    return n;
+}
+
 void db_close(DB_ID db)
 {
     PGconn* conn;
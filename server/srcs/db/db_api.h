@@ -3,6 +3,7 @@
 
 #include <libpq-fe.h>
 #include <stdint.h>
+#include <stddef.h>
 // #include "db_users.h"
 
 typedef uintptr_t DB_ID;
@@ -42,6 +43,52 @@ PGresult *db_query(DB_ID db,
 
 void db_clear_result(PGresult *res);
 
+/*
+ * Runs several ;-separated statements in one round trip (simple query
+ * protocol, no parameters). Returns 0 when all of them succeeded.
+ */
+int db_execute_script(DB_ID db, const char *sql);
+
+/*
+ * LISTEN/NOTIFY on a dedicated connection.
+ *   db_listen       : subscribe the connection to channel
+ *   db_socket       : fd to poll for incoming notifications
+ *   db_poll_notifies: read what arrived and call cb for each notification
+ *
+ * db_poll_notifies returns the number of notifications, ERROR if the
+ * connection broke.
+ */
+typedef void (*db_notify_cb_t)(const char *channel, const char *payload, void *user_data);
+
+int db_listen(DB_ID db, const char *channel);
+int db_socket(DB_ID db);
+int db_poll_notifies(DB_ID db, db_notify_cb_t cb, void *user_data);
+
 void db_close(DB_ID db);
 
+/*
+ * Per-statement statistics, kept for every db_execute()/db_query() and
+ * keyed by the SQL with whitespace collapsed. Statements slower than the
+ * slow query threshold are logged, the first time along with their
+ * EXPLAIN plan; failures are logged with the server's error text.
+ */
+typedef struct
+{
+    const char *sql;
+    unsigned long count;
+    unsigned long errors;
+    unsigned long long rows;        /* returned, or affected by commands */
+    unsigned long long total_us;
+    unsigned long long max_us;
+} db_statement_stats_t;
+
+typedef void (*db_stats_cb_t)(const db_statement_stats_t *stats, void *user_data);
+
+/* 0 disables the slow query log */
+void db_set_slow_query_ms(int ms);
+void db_stats_foreach(db_stats_cb_t cb, void *user_data);
+/* logs the top statements by total time */
+void db_stats_log(size_t top);
+void db_stats_reset(void);
+
 #endif /* DB_H */
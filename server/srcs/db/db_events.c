@@ -0,0 +1,59 @@
+#include <stddef.h>
+#include "db_events.h"
+#include "../../inc/error_codes.h"
+
+#define DB_EVENTS_MAX_SUBSCRIBERS 16
+
+typedef struct
+{
+    db_event_cb_t cb;
+    void* user_data;
+} db_subscriber_t;
+
+static db_subscriber_t m_subscribers[DB_EVENTS_MAX_SUBSCRIBERS];
+static int m_n_subscribers = 0;
+
+int db_events_subscribe(db_event_cb_t cb, void* user_data)
+{
+    if (!cb) return INVALID_ARGS;
+    if (m_n_subscribers >= DB_EVENTS_MAX_SUBSCRIBERS) return ERROR;
+
+    m_subscribers[m_n_subscribers].cb = cb;
+    m_subscribers[m_n_subscribers].user_data = user_data;
+    m_n_subscribers++;
+    return SUCCESS;
+}
+
+void db_events_unsubscribe(db_event_cb_t cb, void* user_data)
+{
+    int i;
+
+    for (i = 0; i < m_n_subscribers; i++)
+    {
+        if (m_subscribers[i].cb == cb && m_subscribers[i].user_data == user_data)
+        {
+            m_subscribers[i] = m_subscribers[m_n_subscribers - 1];
+            m_n_subscribers--;
+            return;
+        }
+    }
+}
+
+void db_events_emit(db_event_type_t type, int user_id, int other_id)
+{
+    db_events_emit_data(type, user_id, other_id, NULL);
+}
+
+void db_events_emit_data(db_event_type_t type, int user_id, int other_id, const void* data)
+{
+    db_event_t event;
+    int i;
+
+    event.type = type;
+    event.user_id = user_id;
+    event.other_id = other_id;
+    event.data = data;
+
+    for (i = 0; i < m_n_subscribers; i++)
+        m_subscribers[i].cb(&event, m_subscribers[i].user_data);
+}
@@ -0,0 +1,48 @@
+#ifndef DB_EVENTS_H
+#define DB_EVENTS_H
+
+/*
+ * Row change notifications emitted by the table modules after a write
+ * succeeded, so in-memory consumers (feeds, counters, ...) can update
+ * themselves incrementally instead of polling the database.
+ */
+typedef enum
+{
+    DB_EVENT_USER_CREATED,   /* user_id */
+    DB_EVENT_USER_UPDATED,   /* user_id */
+    DB_EVENT_USER_DELETED,   /* user_id */
+    DB_EVENT_TAG_ADDED,      /* user_id, other_id = tag_id */
+    DB_EVENT_TAG_REMOVED,    /* user_id, other_id = tag_id */
+    DB_EVENT_LIKE_ADDED,     /* user_id = liker, other_id = liked */
+    DB_EVENT_LIKE_REMOVED,   /* user_id = liker, other_id = liked */
+    DB_EVENT_VISIT_ADDED,    /* user_id = viewer, other_id = viewed */
+    DB_EVENT_MESSAGE_ADDED,  /* user_id = sender, other_id = recipient, data = message_t */
+    DB_EVENT_NOTIFICATION_ADDED, /* user_id = recipient, other_id = id, data = notification_t */
+    DB_EVENT_FAME_CHANGED,   /* user_id, other_id = fame_rating, after the write-back */
+    DB_EVENT_MAX
+} db_event_type_t;
+
+typedef struct
+{
+    db_event_type_t type;
+    int user_id;
+    int other_id;
+    const void* data; /* inserted row, only valid during the callback */
+} db_event_t;
+
+typedef void (*db_event_cb_t)(const db_event_t* event, void* user_data);
+
+/*
+ * Register cb for every event. Returns SUCCESS or ERROR when the
+ * subscriber table is full.
+ */
+int db_events_subscribe(db_event_cb_t cb, void* user_data);
+
+void db_events_unsubscribe(db_event_cb_t cb, void* user_data);
+
+void db_events_emit(db_event_type_t type, int user_id, int other_id);
+
+/* same, carrying the row that was written */
+void db_events_emit_data(db_event_type_t type, int user_id, int other_id, const void* data);
+
+#endif /* DB_EVENTS_H */
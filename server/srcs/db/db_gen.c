@@ -1,4 +1,3 @@
-#define _XOPEN_SOURCE
 #include "db_gen.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,9 +6,14 @@
 #include <time.h>
 #include <unistd.h>
 #include "../../inc/ft_malloc.h"
+#include "../../inc/ft_arena.h"
 #include "../../inc/error_codes.h"
 
-static char *m_str_concat(const char *a, const char *b)
+/*
+ * SQL text and parameter arrays are scratch memory of one call: they come
+ * from the thread arena and are released together when the call returns.
+ */
+static char *m_str_concat(ft_arena_t *arena, const char *a, const char *b)
 {
     size_t la;
     size_t lb;
@@ -17,7 +21,7 @@ static char *m_str_concat(const char *a, const char *b)
     
     la = strlen(a);
     lb = strlen(b);
-    out = malloc(la + lb + 1);
+    out = ft_arena_alloc(arena, la + lb + 1);
 
     memcpy(out, a, la);
     memcpy(out + la, b, lb);
@@ -25,22 +29,23 @@ static char *m_str_concat(const char *a, const char *b)
     return out;
 }
 
-int db_gen_create_table(DB_ID db, const tableSchema_t *schema)
+char *db_gen_create_table_sql(const tableSchema_t *schema)
 {
     char* sql = NULL;
-    char* tmp;
+    char* out;
+    ft_arena_t* arena;
+    ft_arena_mark_t mark;
     const char* prefix     = "CREATE TABLE IF NOT EXISTS ";
     const char* open_paren = " (";
     const char* close      = ");";
     char buffer[512];
     int offset;
     int i;
-    int rc;
     int pk_count;
     int first;
 
-    if (db == INVALID_DB_ID || schema == NULL || schema->n_cols <= 0)
-        return ERROR;
+    if (schema == NULL || schema->n_cols <= 0)
+        return NULL;
     
     pk_count = 0;
     for (i = 0; i < schema->n_cols; i++)
@@ -48,10 +53,10 @@ int db_gen_create_table(DB_ID db, const tableSchema_t *schema)
         if (schema->columns[i].is_primary) pk_count++;
     }
 
-    sql = m_str_concat(prefix, schema->name);
-    tmp = m_str_concat(sql, open_paren);
-    free(sql);
-    sql = tmp;
+    arena = ft_arena_thread();
+    mark = ft_arena_mark(arena);
+    sql = m_str_concat(arena, prefix, schema->name);
+    sql = m_str_concat(arena, sql, open_paren);
 
     for (i = 0; i < schema->n_cols; i++)
     {
@@ -79,16 +84,12 @@ int db_gen_create_table(DB_ID db, const tableSchema_t *schema)
             offset += snprintf(buffer + offset, sizeof(buffer) - offset,
                                ", ");
 
-        tmp = m_str_concat(sql, buffer);
-        free(sql);
-        sql = tmp;
+        sql = m_str_concat(arena, sql, buffer);
     }
 
     if (pk_count > 1)
     {
-        tmp = m_str_concat(sql, "PRIMARY KEY (");
-        free(sql);
-        sql = tmp;
+        sql = m_str_concat(arena, sql, "PRIMARY KEY (");
 
         first = 1;
         for (i = 0; i < schema->n_cols; i++)
@@ -97,50 +98,232 @@ int db_gen_create_table(DB_ID db, const tableSchema_t *schema)
             {
                 if (!first)
                 {
-                    tmp = m_str_concat(sql, ", ");
-                    free(sql);
-                    sql = tmp;
+                    sql = m_str_concat(arena, sql, ", ");
                 }
-                tmp = m_str_concat(sql, schema->columns[i].name);
-                free(sql);
-                sql = tmp;
+                sql = m_str_concat(arena, sql, schema->columns[i].name);
                 first = 0;
             }
         }
 
-        tmp = m_str_concat(sql, ")");
-        free(sql);
-        sql = tmp;
+        sql = m_str_concat(arena, sql, ")");
     }
 
-    tmp = m_str_concat(sql, close);
-    free(sql);
-    sql = tmp;
+    sql = m_str_concat(arena, sql, close);
+
+    out = strdup(sql);
+    ft_arena_release(arena, mark);
+    return out;
+}
 
+int db_gen_create_table(DB_ID db, const tableSchema_t *schema)
+{
+    char* sql;
+    int rc;
+
+    if (db == INVALID_DB_ID)
+        return ERROR;
+    sql = db_gen_create_table_sql(schema);
+    if (!sql)
+        return ERROR;
     rc = db_execute(db, sql, 0, NULL);
     free(sql);
     return rc;
 }
 
-int db_gen_parse_timestamp(const char *timestamp_str)
+/* days since 1970-01-01 of a proleptic Gregorian date, no table, no branch on the month */
+static int64_t m_days_from_civil(int64_t y, unsigned m, unsigned d)
 {
-    struct tm tm;
+    int64_t era;
+    unsigned yoe;
+    unsigned doy;
+    unsigned doe;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = (unsigned)(y - era * 400);
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int64_t)doe - 719468;
+}
 
-    if (timestamp_str == NULL || *timestamp_str == '\0')
+static void m_civil_from_days(int64_t z, int64_t *y, unsigned *m, unsigned *d)
+{
+    int64_t era;
+    unsigned doe;
+    unsigned yoe;
+    unsigned doy;
+    unsigned mp;
+
+    z += 719468;
+    era = (z >= 0 ? z : z - 146096) / 146097;
+    doe = (unsigned)(z - era * 146097);
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    *d = doy - (153 * mp + 2) / 5 + 1;
+    *m = mp < 10 ? mp + 3 : mp - 9;
+    *y = (int64_t)yoe + era * 400 + (*m <= 2);
+}
+
+/* n digits at s, the flag collects whether they all were */
+static inline unsigned m_digits(const char *s, int n, unsigned *bad)
+{
+    unsigned v;
+    unsigned c;
+    int i;
+
+    v = 0;
+    for (i = 0; i < n; i++)
+    {
+        c = (unsigned char)s[i] - '0';
+        *bad |= c > 9;
+        v = v * 10 + c;
+    }
+    return v;
+}
+
+int64_t db_gen_parse_timestamp_us(const char *s)
+{
+    static const int32_t scale[7] = { 1000000, 100000, 10000, 1000, 100, 10, 1 };
+    unsigned bad;
+    unsigned year, mon, day, hour, min, sec;
+    int64_t us;
+    int32_t frac;
+    int32_t off;
+    int sign;
+    int n;
+
+    if (s == NULL || strlen(s) < 19)
+        return 0;
+
+    /* the fixed part, every separator and digit checked at once */
+    bad = (s[4] != '-') | (s[7] != '-') | (s[10] != ' ' && s[10] != 'T')
+        | (s[13] != ':') | (s[16] != ':');
+    year = m_digits(s, 4, &bad);
+    mon  = m_digits(s + 5, 2, &bad);
+    day  = m_digits(s + 8, 2, &bad);
+    hour = m_digits(s + 11, 2, &bad);
+    min  = m_digits(s + 14, 2, &bad);
+    sec  = m_digits(s + 17, 2, &bad);
+    bad |= (mon - 1 > 11) | (day - 1 > 30) | (hour > 23) | (min > 59) | (sec > 60);
+    if (bad)
         return 0;
+    s += 19;
 
+    frac = 0;
+    if (*s == '.')
+    {
+        for (n = 0, s++; n < 6 && (unsigned)(*s - '0') <= 9; n++, s++)
+            frac = frac * 10 + (*s - '0');
+        frac *= scale[n];
+        while ((unsigned)(*s - '0') <= 9)   /* more than microseconds */
+            s++;
+    }
 
-    if (strptime(timestamp_str, "%Y-%m-%d %H:%M:%S", &tm) == NULL)
+    /* "+HH", then up to two ":NN" */
+    off = 0;
+    if (*s == '+' || *s == '-')
     {
+        sign = *s == '-' ? -1 : 1;
+        for (n = 0; n < 3 && (n == 0 || *s == ':'); n++)
+        {
+            if (strnlen(s, 3) < 3)
+                return 0;
+            off += m_digits(s + 1, 2, &bad) * (n == 0 ? 3600 : n == 1 ? 60 : 1);
+            s += 3;
+        }
+        off *= sign;
+    }
+    if (bad || *s != '\0')
         return 0;
+
+    us = m_days_from_civil(year, mon, day) * 86400 + hour * 3600 + min * 60 + sec - off;
+    return us * 1000000 + frac;
+}
+
+time_t db_gen_parse_timestamp(const char *timestamp_str)
+{
+    int64_t us;
+
+    us = db_gen_parse_timestamp_us(timestamp_str);
+    return (time_t)(us >= 0 ? us / 1000000 : -((-us + 999999) / 1000000));
+}
+
+static inline char *m_put(char *p, unsigned v, int n)
+{
+    int i;
+
+    for (i = n - 1; i >= 0; i--, v /= 10)
+        p[i] = '0' + v % 10;
+    return p + n;
+}
+
+static const char *m_format(int64_t us, bool with_frac, char *buf, size_t len)
+{
+    int64_t days;
+    int64_t secs;
+    int64_t year;
+    unsigned mon;
+    unsigned day;
+    int64_t frac;
+    char *p;
+
+    frac = us % 1000000;
+    secs = us / 1000000;
+    if (frac < 0)
+    {
+        frac += 1000000;
+        secs--;
+    }
+    days = secs / 86400;
+    secs %= 86400;
+    if (secs < 0)
+    {
+        secs += 86400;
+        days--;
+    }
+    m_civil_from_days(days, &year, &mon, &day);
+    if (len < DB_TIMESTAMP_LEN || year < 0 || year > 9999)
+    {
+        if (len)
+            buf[0] = '\0';
+        return buf;
     }
 
-    return mktime(&tm);
+    p = m_put(buf, (unsigned)year, 4);
+    *p++ = '-';
+    p = m_put(p, mon, 2);
+    *p++ = '-';
+    p = m_put(p, day, 2);
+    *p++ = ' ';
+    p = m_put(p, (unsigned)(secs / 3600), 2);
+    *p++ = ':';
+    p = m_put(p, (unsigned)(secs / 60 % 60), 2);
+    *p++ = ':';
+    p = m_put(p, (unsigned)(secs % 60), 2);
+    if (with_frac)
+    {
+        *p++ = '.';
+        p = m_put(p, (unsigned)frac, 6);
+    }
+    memcpy(p, "+00", 4);
+    return buf;
 }
 
-int db_gen_insert(DB_ID db, const tableSchema_t *schema, ...)
+const char *db_gen_format_timestamp_us(int64_t us, char *buf, size_t len)
 {
-    va_list ap;
+    return m_format(us, true, buf, len);
+}
+
+const char *db_gen_format_timestamp(time_t t, char *buf, size_t len)
+{
+    return m_format((int64_t)t * 1000000, false, buf, len);
+}
+
+/* id: NULL, or where the primary key of the new row goes (INSERT ... RETURNING) */
+static int m_insert(DB_ID db, const tableSchema_t *schema, int *id, va_list ap)
+{
+    PGresult *res;
     int total_cols;
     int included_count;
     int i;
@@ -152,6 +335,8 @@ int db_gen_insert(DB_ID db, const tableSchema_t *schema, ...)
     int placeholder_num;
     int more;
     int rc;
+    ft_arena_t* arena;
+    ft_arena_mark_t mark;
 
     if (db == INVALID_DB_ID || schema == NULL || schema->n_cols <= 0)
     {
@@ -159,14 +344,13 @@ int db_gen_insert(DB_ID db, const tableSchema_t *schema, ...)
     }
 
     total_cols = schema->n_cols;
+    arena = ft_arena_thread();
+    mark = ft_arena_mark(arena);
 
-    const char **values = malloc(sizeof(char *) * total_cols);
+    const char **values = ft_arena_alloc(arena, sizeof(char *) * total_cols);
 
-    va_start(ap, schema);
     for (i = 0; i < total_cols; i++)
         values[i] = va_arg(ap, char *);
-    
-    va_end(ap);
 
     included_count = 0;
     for (i = 0; i < total_cols; i++)
@@ -177,14 +361,14 @@ int db_gen_insert(DB_ID db, const tableSchema_t *schema, ...)
 
     if (included_count == 0)
     {
-        free(values);
+        ft_arena_release(arena, mark);
         return -1;
     }
 
-    const char **paramValues = malloc(sizeof(char *) * included_count);
+    const char **paramValues = ft_arena_alloc(arena, sizeof(char *) * included_count);
 
     buf_est = 256 + (included_count * 64);
-    sql = malloc(buf_est);
+    sql = ft_arena_alloc(arena, buf_est);
 
     pos = snprintf(sql, buf_est, "INSERT INTO %s (", schema->name);
 
@@ -235,13 +419,51 @@ int db_gen_insert(DB_ID db, const tableSchema_t *schema, ...)
         if (more)
             pos += snprintf(sql + pos, buf_est - pos, ", ");
     }
-    pos += snprintf(sql + pos, buf_est - pos, ");");
+    pos += snprintf(sql + pos, buf_est - pos, ")");
 
-    rc = db_execute(db, sql, included_count, paramValues);
+    if (!id)
+    {
+        snprintf(sql + pos, buf_est - pos, ";");
+        rc = db_execute(db, sql, included_count, paramValues);
+        ft_arena_release(arena, mark);
+        return rc;
+    }
 
-    free(values);
-    free(paramValues);
-    free(sql);
+    for (i = 0; i < total_cols && !schema->columns[i].is_primary; i++)
+        ;
+    snprintf(sql + pos, buf_est - pos, " RETURNING %s;", i < total_cols ? schema->columns[i].name : "NULL");
+    res = db_query(db, sql, included_count, paramValues);
+    rc = res && PQntuples(res) == 1 && !PQgetisnull(res, 0, 0) ? SUCCESS : ERROR;
+    if (rc == SUCCESS)
+        *id = atoi(PQgetvalue(res, 0, 0));
+    if (res)
+        PQclear(res);
+
+    ft_arena_release(arena, mark);
+    return rc;
+}
+
+int db_gen_insert(DB_ID db, const tableSchema_t *schema, ...)
+{
+    va_list ap;
+    int rc;
+
+    va_start(ap, schema);
+    rc = m_insert(db, schema, NULL, ap);
+    va_end(ap);
+    return rc;
+}
+
+int db_gen_insert_id(DB_ID db, const tableSchema_t *schema, int *id, ...)
+{
+    va_list ap;
+    int rc;
+
+    if (!id)
+        return INVALID_ARGS;
+    va_start(ap, id);
+    rc = m_insert(db, schema, id, ap);
+    va_end(ap);
     return rc;
 }
 
@@ -250,14 +472,18 @@ PGresult *db_gen_select_all_from(DB_ID db, const tableSchema_t *schema)
     size_t buflen;
     char* sql;
     PGresult* res;
+    ft_arena_t* arena;
+    ft_arena_mark_t mark;
 
     if (db == INVALID_DB_ID || schema == NULL || schema->n_cols <= 0)
     {
         return NULL;
     }
 
+    arena = ft_arena_thread();
+    mark = ft_arena_mark(arena);
     buflen = 256 + strlen(schema->name) + strlen(schema->columns[0].name);
-    sql = malloc(buflen);
+    sql = ft_arena_alloc(arena, buflen);
     
     snprintf(sql, buflen,
              "SELECT * FROM %s ORDER BY %s;",
@@ -265,7 +491,7 @@ PGresult *db_gen_select_all_from(DB_ID db, const tableSchema_t *schema)
              schema->columns[0].name);
 
     res = db_query(db, sql, 0, NULL);
-    free(sql);
+    ft_arena_release(arena, mark);
     return res;
 }
 
@@ -276,6 +502,8 @@ int db_gen_delete_by_pk(DB_ID db, const tableSchema_t *schema, const char *pk_va
     size_t buflen;
     char* sql;
     int rc;
+    ft_arena_t* arena;
+    ft_arena_mark_t mark;
 
     if (db == INVALID_DB_ID || schema == NULL || pk_value == NULL)
     {
@@ -301,8 +529,10 @@ int db_gen_delete_by_pk(DB_ID db, const tableSchema_t *schema, const char *pk_va
         return -1;
     }
 
+    arena = ft_arena_thread();
+    mark = ft_arena_mark(arena);
     buflen = 256 + strlen(schema->name) + strlen(schema->columns[pk_index].name);
-    sql = malloc(buflen);
+    sql = ft_arena_alloc(arena, buflen);
 
     snprintf(sql, buflen,
              "DELETE FROM %s WHERE %s = $1;",
@@ -311,7 +541,7 @@ int db_gen_delete_by_pk(DB_ID db, const tableSchema_t *schema, const char *pk_va
 
     const char *paramValues[1] = { pk_value };
     rc = db_execute(db, sql, 1, paramValues);
-    free(sql);
+    ft_arena_release(arena, mark);
     return rc;
 }
 
@@ -331,6 +561,8 @@ int db_gen_update_by_pk(DB_ID db,
     int j;
     int rc;
     va_list ap;
+    ft_arena_t* arena;
+    ft_arena_mark_t mark;
 
     if (db == INVALID_DB_ID || !schema || schema->n_cols <= 0 || !pk_value)
         return ERROR;
@@ -348,7 +580,9 @@ int db_gen_update_by_pk(DB_ID db,
         return ERROR;
     
     total = schema->n_cols;
-    const char **values = malloc(sizeof(char *) * total);
+    arena = ft_arena_thread();
+    mark = ft_arena_mark(arena);
+    const char **values = ft_arena_alloc(arena, sizeof(char *) * total);
     
     va_start(ap, pk_value);
     for (i = 0; i < total; i++)
@@ -368,14 +602,14 @@ int db_gen_update_by_pk(DB_ID db,
     }
     if (upd_count == 0)
     {
-        free(values);
+        ft_arena_release(arena, mark);
         return SUCCESS;
     }
 
-    const char **paramValues = malloc(sizeof(char *) * (upd_count + 1));
+    const char **paramValues = ft_arena_alloc(arena, sizeof(char *) * (upd_count + 1));
 
     buf_est = 256 + upd_count * 64;
-    char *sql = malloc(buf_est);
+    char *sql = ft_arena_alloc(arena, buf_est);
 
     pos = snprintf(sql, buf_est,
                        "UPDATE %s SET ",
@@ -418,8 +652,158 @@ int db_gen_update_by_pk(DB_ID db,
 
     rc = db_execute(db, sql, upd_count + 1, paramValues);
 
-    free(values);
-    free(paramValues);
-    free(sql);
+    ft_arena_release(arena, mark);
     return rc;
 }
+
+/* names of the columns in cols, "a, b, c" or with suffix: "a = $1, b = $2" */
+static size_t m_column_list(char *out, size_t len, const tableSchema_t *schema,
+                            const int *cols, int n, bool assign)
+{
+    size_t pos;
+    int i;
+
+    pos = 0;
+    for (i = 0; i < n; i++)
+    {
+        pos += snprintf(out + pos, len - pos, "%s%s", i ? ", " : "", schema->columns[cols[i]].name);
+        if (assign)
+            pos += snprintf(out + pos, len - pos, " = $%d", i + 1);
+    }
+    return pos;
+}
+
+int db_table_prepare(db_table_t *table)
+{
+    const tableSchema_t *schema;
+    int all[DB_TABLE_MAX_COLS];
+    int update[DB_TABLE_MAX_COLS];
+    int n_update;
+    size_t len;
+    size_t pos;
+    int i;
+
+    schema = table->schema;
+    if (!schema || schema->n_cols <= 0 || schema->n_cols > DB_TABLE_MAX_COLS)
+        return ERROR;
+    if (table->select)
+        return SUCCESS;
+
+    table->pk = -1;
+    table->n_written = 0;
+    n_update = 0;
+    len = 64 + strlen(schema->name);
+    for (i = 0; i < schema->n_cols; i++)
+    {
+        all[i] = i;
+        len += strlen(schema->columns[i].name) + 16;
+        if (schema->columns[i].is_primary)
+            table->pk = table->pk == -1 ? i : -2;
+    }
+    if (table->pk < 0)
+        table->pk = -1;
+    for (i = 0; i < schema->n_cols; i++)
+    {
+        if (schema->columns[i].is_auto)
+            continue;
+        table->written[table->n_written++] = i;
+        if (i != table->pk)
+            update[n_update++] = i;
+    }
+
+    table->select = malloc(len);
+    pos = snprintf(table->select, len, "SELECT ");
+    pos += m_column_list(table->select + pos, len - pos, schema, all, schema->n_cols, false);
+    snprintf(table->select + pos, len - pos, " FROM %s", schema->name);
+
+    len += strlen(schema->columns[0].name);
+    table->select_all = malloc(len);
+    snprintf(table->select_all, len, "%s ORDER BY %s;", table->select, schema->columns[0].name);
+
+    table->insert = malloc(len);
+    pos = snprintf(table->insert, len, "INSERT INTO %s (", schema->name);
+    pos += m_column_list(table->insert + pos, len - pos, schema, table->written, table->n_written, false);
+    pos += snprintf(table->insert + pos, len - pos, ") VALUES (");
+    for (i = 0; i < table->n_written; i++)
+        pos += snprintf(table->insert + pos, len - pos, "%s$%d", i ? ", " : "", i + 1);
+    snprintf(table->insert + pos, len - pos, ");");
+
+    table->update = NULL;
+    table->delete = NULL;
+    if (table->pk >= 0)
+    {
+        table->update = malloc(len);
+        pos = snprintf(table->update, len, "UPDATE %s SET ", schema->name);
+        pos += m_column_list(table->update + pos, len - pos, schema, update, n_update, true);
+        snprintf(table->update + pos, len - pos, " WHERE %s = $%d;",
+                 schema->columns[table->pk].name, n_update + 1);
+
+        table->delete = malloc(len);
+        snprintf(table->delete, len, "DELETE FROM %s WHERE %s = $1;",
+                 schema->name, schema->columns[table->pk].name);
+    }
+    return SUCCESS;
+}
+
+int db_table_insert(DB_ID db, const db_table_t *table, const db_params_t *params)
+{
+    const char *values[DB_TABLE_MAX_COLS];
+    int i;
+
+    if (!table->insert)
+        return ERROR;
+    for (i = 0; i < table->n_written; i++)
+        values[i] = params->values[table->written[i]];
+    return db_execute(db, table->insert, table->n_written, values);
+}
+
+int db_table_update(DB_ID db, const db_table_t *table, const db_params_t *params)
+{
+    const char *values[DB_TABLE_MAX_COLS];
+    int n;
+    int i;
+
+    if (!table->update || !params->values[table->pk])
+        return ERROR;
+    n = 0;
+    for (i = 0; i < table->n_written; i++)
+    {
+        if (table->written[i] != table->pk)
+            values[n++] = params->values[table->written[i]];
+    }
+    values[n++] = params->values[table->pk];
+    return db_execute(db, table->update, n, values);
+}
+
+int db_table_delete(DB_ID db, const db_table_t *table, const char *pk_value)
+{
+    const char *values[1] = { pk_value };
+
+    if (!table->delete || !pk_value)
+        return ERROR;
+    return db_execute(db, table->delete, 1, values);
+}
+
+PGresult *db_table_select_all(DB_ID db, const db_table_t *table)
+{
+    if (!table->select_all)
+        return NULL;
+    return db_query(db, table->select_all, 0, NULL);
+}
+
+PGresult *db_table_select_where(DB_ID db, const db_table_t *table, const char *where,
+                                int n_params, const char *const *params)
+{
+    PGresult *res;
+    char *sql;
+    size_t len;
+
+    if (!table->select || !where)
+        return NULL;
+    len = strlen(table->select) + 1 + strlen(where) + 1;
+    sql = malloc(len);
+    snprintf(sql, len, "%s %s", table->select, where);
+    res = db_query(db, sql, n_params, params);
+    free(sql);
+    return res;
+}
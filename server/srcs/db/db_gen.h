@@ -3,6 +3,9 @@
 
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 #include <libpq-fe.h>   // for PGresult
 #include "db_api.h"         // for DB_ID, db_execute, db_query, db_clear_result
 
@@ -14,6 +17,7 @@
  *  - is_unique:   true if UNIQUE
  *  - not_null:    true if NOT NULL
  *  - default_val: string literal of DEFAULT (e.g. "'now()'", "0", NULL if no default)
+ *  - is_auto:     true if the database always fills it (db_table_t only)
  *
  * At run‐time you build an array ColumnDef cols[ ] and pass it to TableSchema.
  */
@@ -24,6 +28,7 @@ typedef struct {
     bool   is_unique;
     bool   not_null;
     char  *default_val;  
+    bool   is_auto;      /* SERIAL or DEFAULT: left to the database by db_table_insert/update */
 } columnDef_t;
 
 /*
@@ -44,6 +49,12 @@ typedef struct {
  */
 int db_gen_create_table(DB_ID db, const tableSchema_t *schema);
 
+/*
+ *    The same statement as a malloc'd string, for db_schema. NULL on an
+ *    empty schema.
+ */
+char *db_gen_create_table_sql(const tableSchema_t *schema);
+
 /*
  *    Insert a row into ANY table. You must pass exactly schema->n_cols
  *    C‐strings (char *) in the same order as columns[].  If a given
@@ -56,6 +67,12 @@ int db_gen_create_table(DB_ID db, const tableSchema_t *schema);
  */
 int db_gen_insert(DB_ID db, const tableSchema_t *schema, ...);
 
+/*
+ *    Same, in the same round trip stores the primary key the database
+ *    gave the new row (SERIAL) in *id. Returns SUCCESS or ERROR.
+ */
+int db_gen_insert_id(DB_ID db, const tableSchema_t *schema, int *id, ...);
+
 /*
  *    SELECT * FROM tableName. Returns a PGresult* (must call db_clear_result on it)
  *    or NULL on error.
@@ -82,6 +99,65 @@ int db_gen_update_by_pk(DB_ID db,
                         const char *pk_value,
                         ...);
 
-int db_gen_parse_timestamp(const char *timestamp_str);
+/*
+ *    Timestamps as Postgres prints them with DateStyle ISO:
+ *    "YYYY-MM-DD HH:MM:SS[.ffffff][+HH[:MM[:SS]]]", 'T' accepted between
+ *    date and time, no offset read as UTC. Parsed in UTC epoch
+ *    microseconds without strptime/mktime; 0 on anything else (NULL,
+ *    infinity, BC dates).
+ */
+int64_t db_gen_parse_timestamp_us(const char *timestamp_str);
+time_t db_gen_parse_timestamp(const char *timestamp_str);
+
+/*
+ *    The reverse, in UTC with an explicit "+00" so that a TIMESTAMPTZ
+ *    column does not depend on the session TimeZone. buf needs
+ *    DB_TIMESTAMP_LEN bytes; returns buf, "" when too small.
+ */
+#define DB_TIMESTAMP_LEN 30     /* "YYYY-MM-DD HH:MM:SS.ffffff+00" */
+const char *db_gen_format_timestamp_us(int64_t us, char *buf, size_t len);
+const char *db_gen_format_timestamp(time_t t, char *buf, size_t len);
+
+/*
+ * A table whose statements are built once, by db_table_prepare(), instead
+ * of on every call. Used by the accessors of db_table_gen.h, see there.
+ *  - pk:      index of the primary key column, -1 when it is not one column
+ *  - written: the columns insert and update bind, in that order; the
+ *             DB_COL_AUTO ones are left to the database
+ */
+#define DB_TABLE_MAX_COLS 32
+#define DB_PARAM_LEN 32         /* text of a non TEXT parameter */
+
+typedef struct {
+    const tableSchema_t *schema;
+    int   pk;
+    int   n_written;
+    int   written[DB_TABLE_MAX_COLS];
+    char *select;     /* SELECT <every column> FROM <table>, to append a WHERE to */
+    char *select_all; /* the same ordered by the first column */
+    char *insert;
+    char *update;     /* NULL without pk */
+    char *delete;     /* NULL without pk */
+} db_table_t;
+
+/* one text value per column, by column index; NULL is SQL NULL */
+typedef struct {
+    const char *values[DB_TABLE_MAX_COLS];
+    char        buf[DB_TABLE_MAX_COLS][DB_PARAM_LEN];
+} db_params_t;
+
+/* builds the statements, a second call does nothing */
+int db_table_prepare(db_table_t *table);
+
+int db_table_insert(DB_ID db, const db_table_t *table, const db_params_t *params);
+/* the key is params->values[table->pk] */
+int db_table_update(DB_ID db, const db_table_t *table, const db_params_t *params);
+int db_table_delete(DB_ID db, const db_table_t *table, const char *pk_value);
+/* ordered by the first column */
+PGresult *db_table_select_all(DB_ID db, const db_table_t *table);
+/* table->select followed by `where` ("WHERE ... ORDER BY ..."), the rows
+ * keep the column order of the table and its decoder */
+PGresult *db_table_select_where(DB_ID db, const db_table_t *table, const char *where,
+                                int n_params, const char *const *params);
 
 #endif /* DB_GENERIC_H */
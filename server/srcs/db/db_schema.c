@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "db_schema.h"
+#include "../../inc/ft_malloc.h"
+#include "../log/log_api.h"
+
+#define SCHEMA_LOCK_KEY 0x6d617463   /* pg_advisory_xact_lock key, nodes booting together take turns */
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static const char* m_version_ddl =
+    "CREATE TABLE IF NOT EXISTS schema_version ("
+    "hash TEXT NOT NULL, applied_at TIMESTAMPTZ NOT NULL DEFAULT clock_timestamp());";
+
+/*
+ * Times are TIMESTAMPTZ everywhere. Registered TIMESTAMPTZ columns that
+ * an older build created as TIMESTAMP are converted once, reading them in
+ * the session TimeZone they were written in. Only those columns are
+ * touched: each ALTER rewrites its table.
+ */
+static const char* m_timestamptz_head =
+    "DO $$ DECLARE r record; BEGIN\n"
+    "  FOR r IN SELECT c.table_name, c.column_name FROM information_schema.columns c\n"
+    "    WHERE c.table_schema = current_schema()\n"
+    "      AND c.data_type = 'timestamp without time zone'\n"
+    "      AND (c.table_name::text, c.column_name::text) IN (VALUES ";
+static const char* m_timestamptz_tail =
+    ")\n"
+    "  LOOP\n"
+    "    EXECUTE format('ALTER TABLE %I ALTER COLUMN %I TYPE TIMESTAMPTZ', r.table_name, r.column_name);\n"
+    "  END LOOP;\n"
+    "END $$;";
+
+static char** m_ddl = NULL;
+static size_t m_count = 0;
+static char* m_tz_cols = NULL;      /* "('table','column'),..." */
+static size_t m_tz_len = 0;
+
+static void m_clear(void)
+{
+    size_t i;
+
+    for (i = 0; i < m_count; i++)
+        free(m_ddl[i]);
+    free(m_ddl);
+    m_ddl = NULL;
+    m_count = 0;
+    free(m_tz_cols);
+    m_tz_cols = NULL;
+    m_tz_len = 0;
+}
+
+static int m_add(char* sql)
+{
+    m_ddl = realloc(m_ddl, (m_count + 1) * sizeof(*m_ddl));
+    m_ddl[m_count++] = sql;
+    return SUCCESS;
+}
+
+/* names come from the schemas in the code, not from the outside */
+static void m_add_timestamptz(const char* table, const char* column)
+{
+    size_t len;
+
+    len = strlen(table) + strlen(column) + 10;
+    m_tz_cols = realloc(m_tz_cols, m_tz_len + len);
+    m_tz_len += snprintf(m_tz_cols + m_tz_len, len, "%s('%s','%s')",
+                         m_tz_len ? "," : "", table, column);
+}
+
+int db_schema_table(const tableSchema_t *schema)
+{
+    char* sql;
+    int i;
+
+    sql = db_gen_create_table_sql(schema);
+    if (!sql)
+        return ERROR;
+    for (i = 0; i < schema->n_cols; i++)
+    {
+        if (strncmp(schema->columns[i].type, "TIMESTAMPTZ", 11) == 0)
+            m_add_timestamptz(schema->name, schema->columns[i].name);
+    }
+    return m_add(sql);
+}
+
+int db_schema_ddl(const char *sql)
+{
+    if (!sql)
+        return INVALID_ARGS;
+    return m_add(strdup(sql));
+}
+
+static void m_hash(char* out, size_t len)
+{
+    uint64_t h;
+    const char* p;
+    size_t i;
+
+    h = FNV_OFFSET;
+    for (i = 0; i < m_count; i++)
+    {
+        /* the terminator separates statements, "a" "bc" differs from "ab" "c" */
+        p = m_ddl[i];
+        do
+            h = (h ^ (unsigned char)*p) * FNV_PRIME;
+        while (*p++);
+    }
+    snprintf(out, len, "%016llx", (unsigned long long)h);
+}
+
+/* true when schema_version's last hash is hash; a fresh database has no such table */
+static bool m_current(DB_ID DB, const char* hash)
+{
+    const char* params[1] = { hash };
+    PGresult* res;
+    bool same;
+
+    res = db_query(DB,
+        "SELECT hash = $1 FROM schema_version ORDER BY applied_at DESC LIMIT 1;", 1, params);
+    if (!res)
+        return false;
+    same = PQntuples(res) == 1 && PQgetvalue(res, 0, 0)[0] == 't';
+    PQclear(res);
+    return same;
+}
+
+/* BEGIN; lock; DDL...; TIMESTAMPTZ; version row; COMMIT; */
+static char* m_script(const char* hash)
+{
+    char head[128];
+    char tail[128];
+    char* script;
+    size_t len;
+    size_t n;
+    size_t i;
+
+    snprintf(head, sizeof(head), "BEGIN;\nSELECT pg_advisory_xact_lock(%d);\n", SCHEMA_LOCK_KEY);
+    snprintf(tail, sizeof(tail), "INSERT INTO schema_version (hash) VALUES ('%s');\nCOMMIT;", hash);
+
+    len = strlen(head) + strlen(m_version_ddl) + 1 + strlen(tail) + 1;
+    if (m_tz_len)
+        len += strlen(m_timestamptz_head) + m_tz_len + strlen(m_timestamptz_tail) + 1;
+    for (i = 0; i < m_count; i++)
+        len += strlen(m_ddl[i]) + 2;
+
+    script = malloc(len);
+    n = snprintf(script, len, "%s%s\n", head, m_version_ddl);
+    for (i = 0; i < m_count; i++)
+    {
+        n += snprintf(script + n, len - n, "%s", m_ddl[i]);
+        while (n > 0 && (script[n - 1] == ' ' || script[n - 1] == '\n'))
+            n--;
+        n += snprintf(script + n, len - n, "%s\n", script[n - 1] == ';' ? "" : ";");
+    }
+    if (m_tz_len)
+        n += snprintf(script + n, len - n, "%s%s%s\n", m_timestamptz_head, m_tz_cols, m_timestamptz_tail);
+    snprintf(script + n, len - n, "%s", tail);
+    return script;
+}
+
+int db_schema_apply(DB_ID DB)
+{
+    char hash[17];
+    char* script;
+    int rc;
+
+    if (DB == INVALID_DB_ID)
+        return ERROR;
+
+    m_hash(hash, sizeof(hash));
+    if (m_current(DB, hash))
+    {
+        log_msg(LOG_LEVEL_BOOT, "Schema %s is current, %zu statements skipped\n", hash, m_count);
+        m_clear();
+        return SUCCESS;
+    }
+
+    script = m_script(hash);
+    rc = db_execute_script(DB, script);
+    free(script);
+    if (rc != SUCCESS)
+    {
+        /* the failed statement left the transaction open and aborted */
+        db_execute(DB, "ROLLBACK;", 0, NULL);
+        log_msg(LOG_LEVEL_ERROR, "Schema %s not applied, nothing was changed\n", hash);
+    }
+    else
+        log_msg(LOG_LEVEL_BOOT, "Schema %s applied, %zu statements\n", hash, m_count);
+    m_clear();
+    return rc;
+}
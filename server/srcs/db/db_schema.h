@@ -0,0 +1,26 @@
+#ifndef DB_SCHEMA_H
+#define DB_SCHEMA_H
+
+#include "db_api.h"
+#include "db_gen.h"
+#include "../../inc/error_codes.h"
+
+/*
+ * Schema bootstrap. The db_t*_init() functions register their tables and
+ * the statements that go with them (indexes, constraints, triggers) in
+ * order, then db_schema_apply() hashes the whole list and compares it
+ * with the hash stored in schema_version by the last run:
+ *   - same hash: one query and no DDL at all
+ *   - otherwise: every statement in one transaction, then the new hash
+ *
+ * Statements must be idempotent (IF NOT EXISTS, duplicate_object
+ * handlers), the whole list runs again whenever any of it changes.
+ */
+
+int db_schema_table(const tableSchema_t *schema);
+int db_schema_ddl(const char *sql);
+
+/* runs the registered DDL when needed, the list is freed either way */
+int db_schema_apply(DB_ID DB);
+
+#endif /* DB_SCHEMA_H */
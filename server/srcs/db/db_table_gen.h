@@ -0,0 +1,123 @@
+#ifndef DB_TABLE_GEN_H
+#define DB_TABLE_GEN_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <libpq-fe.h>
+#include "db_gen.h"
+#include "../../inc/ft_malloc.h"
+
+/*
+ * Table accessors generated from one column list (X-macro), instead of
+ * hand-written row decoders, PQgetvalue() column numbers and NULL padded
+ * db_gen_insert() calls.
+ *
+ *     #define VISIT_COLUMNS(X, T) \
+ *         X(T, id,        INT,  "SERIAL",    DB_COL_PK | DB_COL_AUTO, NULL)    \
+ *         X(T, viewer_id, INT,  "INTEGER",   DB_COL_NOT_NULL,         NULL)    \
+ *         X(T, viewed_at, TIME, "TIMESTAMPTZ", DB_COL_AUTO,           "NOW()")
+ *
+ *     DB_TABLE_DEFINE(visit, "visits", visit_t, VISIT_COLUMNS)
+ *
+ * X(T, field, kind, sql type, flags, default): field names both the column
+ * and the struct member, kind is INT, BOOL, DOUBLE, TEXT (char*, strdup'd
+ * by decode) or TIME (time_t). DB_TABLE_DEFINE(visit, ...) declares:
+ *   visit_COL_<field>, visit_N_COLS  positions in m_visit_table.select
+ *   m_visit_schema                   for db_schema_table()
+ *   m_visit_table                    statements, db_table_prepare() at init
+ *   m_visit_decode(res, row, out)    one row of a SELECT in column order
+ *   m_visit_encode(in, params)       a struct as text parameters
+ *   m_visit_insert(DB, in)           every column but the DB_COL_AUTO ones
+ *   m_visit_update(DB, in)           the same, by primary key
+ * Hand-written reads append their WHERE to m_visit_table.select with
+ * db_table_select_where(), so the decoder always matches their columns.
+ */
+
+#define DB_COL_PK       0x1
+#define DB_COL_UNIQUE   0x2
+#define DB_COL_NOT_NULL 0x4
+#define DB_COL_AUTO     0x8     /* SERIAL or DEFAULT the writes leave alone */
+
+#define DB_DECODE_INT(s)    atoi(s)
+#define DB_DECODE_BOOL(s)   ((s)[0] == 't')
+#define DB_DECODE_DOUBLE(s) atof(s)
+#define DB_DECODE_TEXT(s)   strdup(s)
+#define DB_DECODE_TIME(s)   db_gen_parse_timestamp(s)
+
+static inline const char *db_encode_int(int v, char *buf)
+{
+    snprintf(buf, DB_PARAM_LEN, "%d", v);
+    return buf;
+}
+
+static inline const char *db_encode_double(double v, char *buf)
+{
+    snprintf(buf, DB_PARAM_LEN, "%.17g", v);
+    return buf;
+}
+
+#define DB_ENCODE_INT(v, buf)    db_encode_int((v), (buf))
+#define DB_ENCODE_BOOL(v, buf)   ((v) ? "TRUE" : "FALSE")
+#define DB_ENCODE_DOUBLE(v, buf) db_encode_double((v), (buf))
+#define DB_ENCODE_TEXT(v, buf)   ((const char *)(v))
+#define DB_ENCODE_TIME(v, buf)   db_gen_format_timestamp((v), (buf), DB_PARAM_LEN)
+
+#define DB_GEN_ENUM(T, f, kind, sql_type, flags, def) T##_COL_##f,
+
+#define DB_GEN_COLUMN(T, f, kind, sql_type, flags, def)         \
+    { .name = #f, .type = sql_type,                             \
+      .is_primary = ((flags) & DB_COL_PK) != 0,                 \
+      .is_unique = ((flags) & DB_COL_UNIQUE) != 0,              \
+      .not_null = ((flags) & DB_COL_NOT_NULL) != 0,             \
+      .default_val = def,                                       \
+      .is_auto = ((flags) & DB_COL_AUTO) != 0 },
+
+#define DB_GEN_DECODE(T, f, kind, sql_type, flags, def)         \
+    out->f = DB_DECODE_##kind(PQgetvalue(res, row, T##_COL_##f));
+
+/* the key is encoded for update, the other DB_COL_AUTO columns are not sent */
+#define DB_GEN_ENCODE(T, f, kind, sql_type, flags, def)         \
+    params->values[T##_COL_##f] = NULL;                         \
+    if (!((flags) & DB_COL_AUTO) || ((flags) & DB_COL_PK))      \
+        params->values[T##_COL_##f] = DB_ENCODE_##kind(in->f, params->buf[T##_COL_##f]);
+
+#define DB_TABLE_DEFINE(T, sql_name, S, COLUMNS)                                \
+enum { COLUMNS(DB_GEN_ENUM, T) T##_N_COLS };                                    \
+_Static_assert(T##_N_COLS <= DB_TABLE_MAX_COLS, #T ": too many columns");       \
+                                                                                \
+static const columnDef_t m_##T##_cols[] = { COLUMNS(DB_GEN_COLUMN, T) };        \
+static const tableSchema_t m_##T##_schema = {                                   \
+    .name = sql_name, .n_cols = T##_N_COLS, .columns = m_##T##_cols             \
+};                                                                              \
+static db_table_t m_##T##_table = { .schema = &m_##T##_schema };                \
+                                                                                \
+static inline void m_##T##_decode(PGresult *res, int row, S *out)               \
+{                                                                               \
+    COLUMNS(DB_GEN_DECODE, T)                                                   \
+}                                                                               \
+                                                                                \
+static inline void m_##T##_encode(const S *in, db_params_t *params)             \
+{                                                                               \
+    COLUMNS(DB_GEN_ENCODE, T)                                                   \
+}                                                                               \
+                                                                                \
+static inline int m_##T##_insert(DB_ID DB, const S *in)                         \
+{                                                                               \
+    db_params_t params;                                                         \
+                                                                                \
+    m_##T##_encode(in, &params);                                                \
+    return db_table_insert(DB, &m_##T##_table, &params);                        \
+}                                                                               \
+                                                                                \
+static inline int m_##T##_update(DB_ID DB, const S *in)                         \
+{                                                                               \
+    db_params_t params;                                                         \
+                                                                                \
+    m_##T##_encode(in, &params);                                                \
+    return db_table_update(DB, &m_##T##_table, &params);                        \
+}
+
+#endif /* DB_TABLE_GEN_H */
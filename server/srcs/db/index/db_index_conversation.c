@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "db_index_conversation.h"
+#include "../../../inc/ft_malloc.h"
+#include "../../../third_party/uthash-master/src/uthash.h"
+#include "../../../third_party/uthash-master/src/utringbuffer.h"
+
+typedef struct
+{
+    uint64_t key;
+    UT_ringbuffer ring; /* oldest .. newest */
+    bool complete;      /* ring holds the whole conversation */
+    UT_hash_handle hh;
+} conversation_t;
+
+static conversation_t* m_conversations = NULL;
+
+static void m_message_copy(void* dst, const void* src)
+{
+    message_t* d = dst;
+    const message_t* s = src;
+
+    *d = *s;
+    d->content = strdup(s->content ? s->content : "");
+}
+
+static void m_message_dtor(void* elt)
+{
+    free(((message_t*)elt)->content);
+}
+
+static const UT_icd m_message_icd = { sizeof(message_t), NULL, m_message_copy, m_message_dtor };
+
+static inline uint64_t m_pair_key(int user_a, int user_b)
+{
+    int lo = user_a < user_b ? user_a : user_b;
+    int hi = user_a < user_b ? user_b : user_a;
+
+    return ((uint64_t)(uint32_t)lo << 32) | (uint32_t)hi;
+}
+
+/* j = 0 is the newest message */
+static message_t* m_newest(conversation_t* c, unsigned j)
+{
+    unsigned len;
+
+    len = utringbuffer_len(&c->ring);
+    if (j >= len)
+        return NULL;
+    return _utringbuffer_internalptr(&c->ring, _utringbuffer_real_idx(&c->ring, len - 1 - j));
+}
+
+/* utringbuffer_clear() trips -Wtype-limits through utringbuffer_eltptr() */
+static void m_ring_clear(UT_ringbuffer* ring)
+{
+    unsigned len;
+    unsigned j;
+
+    len = utringbuffer_len(ring);
+    for (j = 0; j < len; j++)
+        m_message_dtor(_utringbuffer_internalptr(ring, j));
+    ring->i = 0;
+    ring->f = 0;
+}
+
+static void m_free_conversation(conversation_t* c)
+{
+    HASH_DEL(m_conversations, c);
+    m_ring_clear(&c->ring);
+    free(c->ring.d);
+    free(c);
+}
+
+/* LRU: a hit moves the entry to the tail, eviction takes the head */
+static conversation_t* m_find(int user_a, int user_b)
+{
+    conversation_t* c;
+    uint64_t key;
+
+    key = m_pair_key(user_a, user_b);
+    HASH_FIND(hh, m_conversations, &key, sizeof(key), c);
+    if (c)
+    {
+        HASH_DEL(m_conversations, c);
+        HASH_ADD(hh, m_conversations, key, sizeof(c->key), c);
+    }
+    return c;
+}
+
+void db_iconv_fill(int user_a, int user_b, message_t** msgs, size_t count, bool complete)
+{
+    conversation_t* c;
+    size_t n;
+
+    c = m_find(user_a, user_b);
+    if (c)
+        m_ring_clear(&c->ring);
+    else
+    {
+        if (HASH_COUNT(m_conversations) >= DB_ICONV_MAX_CONVERSATIONS)
+            m_free_conversation(m_conversations);
+
+        c = malloc(sizeof(*c));
+        c->key = m_pair_key(user_a, user_b);
+        utringbuffer_init(&c->ring, DB_ICONV_RING_SIZE, &m_message_icd);
+        HASH_ADD(hh, m_conversations, key, sizeof(c->key), c);
+    }
+
+    n = count < DB_ICONV_RING_SIZE ? count : DB_ICONV_RING_SIZE;
+    c->complete = complete && count <= DB_ICONV_RING_SIZE;
+    while (n > 0)
+    {
+        n--;
+        utringbuffer_push_back(&c->ring, msgs[n]);
+    }
+}
+
+void db_iconv_append(const message_t* msg)
+{
+    conversation_t* c;
+
+    c = m_find(msg->sender_id, msg->recipient_id);
+    if (!c)
+        return;
+
+    if (utringbuffer_full(&c->ring))
+        c->complete = false;
+    utringbuffer_push_back(&c->ring, msg);
+}
+
+void db_iconv_set_read(int user_a, int user_b, int message_id, bool is_read)
+{
+    conversation_t* c;
+    message_t* m;
+    unsigned j;
+
+    c = m_find(user_a, user_b);
+    if (!c)
+        return;
+
+    for (j = 0; (m = m_newest(c, j)) != NULL; j++)
+    {
+        if (m->id == message_id)
+        {
+            m->is_read = is_read;
+            return;
+        }
+    }
+}
+
+void db_iconv_invalidate(int user_a, int user_b)
+{
+    conversation_t* c;
+    uint64_t key;
+
+    key = m_pair_key(user_a, user_b);
+    HASH_FIND(hh, m_conversations, &key, sizeof(key), c);
+    if (c)
+        m_free_conversation(c);
+}
+
+bool db_iconv_page(int user_a, int user_b, int before_id, size_t limit, message_t_array** out)
+{
+    conversation_t* c;
+    message_t_array* arr;
+    message_t* m;
+    unsigned start;
+    unsigned len;
+    unsigned n;
+    unsigned j;
+
+    c = m_find(user_a, user_b);
+    if (!c || !out)
+        return false;
+
+    len = utringbuffer_len(&c->ring);
+    start = 0;
+    if (before_id != 0)
+    {
+        while (start < len && m_newest(c, start)->id != before_id)
+            start++;
+        if (start == len)
+            return false;
+        start++;
+    }
+
+    /* the page must not run past the oldest cached message */
+    if (start + limit > len && !c->complete)
+        return false;
+
+    n = len - start < limit ? len - start : limit;
+    arr = malloc(sizeof(*arr));
+    arr->messages = malloc((n ? n : 1) * sizeof(message_t*));
+    arr->count = n;
+    arr->pg_result = NULL;
+    for (j = 0; j < n; j++)
+    {
+        m = m_newest(c, start + j);
+        arr->messages[j] = malloc(sizeof(message_t));
+        m_message_copy(arr->messages[j], m);
+    }
+
+    *out = arr;
+    return true;
+}
+
+void db_iconv_clear(void)
+{
+    conversation_t* c;
+    conversation_t* tmp;
+
+    HASH_ITER(hh, m_conversations, c, tmp)
+    {
+        m_free_conversation(c);
+    }
+}
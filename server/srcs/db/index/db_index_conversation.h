@@ -0,0 +1,45 @@
+#ifndef DB_INDEX_CONVERSATION_H
+#define DB_INDEX_CONVERSATION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "../tables/db_table_message.h"
+
+/* messages kept per conversation */
+#define DB_ICONV_RING_SIZE 50
+/* conversations kept, least recently used ones are evicted first */
+#define DB_ICONV_MAX_CONVERSATIONS 4096
+
+/*
+ * In-memory ring of the newest messages of recently opened
+ * conversations, keyed by the unordered (user_a, user_b) pair.
+ *
+ * A conversation is only cached after a first page was read from the
+ * database (db_iconv_fill); from then on inserts are appended and read
+ * status changes patched in, so opening the chat again costs no query.
+ */
+
+void db_iconv_clear(void);
+
+/*
+ * Warm a conversation with its newest messages, newest first.
+ * complete is true when msgs holds the whole conversation.
+ */
+void db_iconv_fill(int user_a, int user_b, message_t** msgs, size_t count, bool complete);
+
+/*
+ * Maintenance hooks, called after the matching row is written. No-ops for
+ * conversations that are not cached.
+ */
+void db_iconv_append(const message_t* msg);
+void db_iconv_set_read(int user_a, int user_b, int message_id, bool is_read);
+void db_iconv_invalidate(int user_a, int user_b);
+
+/*
+ * Serve a keyset page (messages older than before_id, or the newest ones
+ * when before_id is 0) from memory. Returns false when the page is not
+ * fully cached and has to be read from the database.
+ */
+bool db_iconv_page(int user_a, int user_b, int before_id, size_t limit, message_t_array** out);
+
+#endif /* DB_INDEX_CONVERSATION_H */
@@ -0,0 +1,362 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "db_index_like.h"
+#include "../../../inc/ft_malloc.h"
+#include "../../../third_party/uthash-master/src/uthash.h"
+
+#define BLOOM_MIN_BITS (1u << 20)
+#define BLOOM_BITS_PER_ITEM 16
+#define BLOOM_HASHES 4
+
+typedef struct
+{
+    int* ids;
+    size_t count;
+    size_t cap;
+} id_vec_t;
+
+typedef struct
+{
+    int user_id;
+    id_vec_t out;
+    id_vec_t in;
+    id_vec_t matches;
+    UT_hash_handle hh;
+} like_node_t;
+
+typedef struct
+{
+    uint64_t* bits;
+    uint64_t n_bits; /* power of two */
+    size_t n_items;
+} bloom_t;
+
+static like_node_t* m_graph = NULL;
+static bloom_t m_bloom = {0};
+static size_t m_n_edges = 0;
+
+/* sorted vectors */
+static bool m_vec_find(const id_vec_t* v, int id, size_t* idx)
+{
+    size_t lo;
+    size_t hi;
+    size_t mid;
+
+    lo = 0;
+    hi = v->count;
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if (v->ids[mid] < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *idx = lo;
+    return (lo < v->count && v->ids[lo] == id);
+}
+
+static bool m_vec_insert(id_vec_t* v, int id)
+{
+    size_t idx;
+
+    if (m_vec_find(v, id, &idx))
+        return false;
+
+    if (v->count == v->cap)
+    {
+        v->cap = v->cap ? v->cap * 2 : 4;
+        v->ids = realloc(v->ids, v->cap * sizeof(int));
+    }
+    memmove(&v->ids[idx + 1], &v->ids[idx], (v->count - idx) * sizeof(int));
+    v->ids[idx] = id;
+    v->count++;
+    return true;
+}
+
+static bool m_vec_remove(id_vec_t* v, int id)
+{
+    size_t idx;
+
+    if (!m_vec_find(v, id, &idx))
+        return false;
+
+    memmove(&v->ids[idx], &v->ids[idx + 1], (v->count - idx - 1) * sizeof(int));
+    v->count--;
+    return true;
+}
+
+/* bloom filter */
+static inline uint64_t m_pair_hash(int liker_id, int liked_id)
+{
+    uint64_t h;
+
+    /* splitmix64 finalizer */
+    h = ((uint64_t)(uint32_t)liker_id << 32) | (uint32_t)liked_id;
+    h += 0x9E3779B97F4A7C15ULL;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    return h ^ (h >> 31);
+}
+
+static void m_bloom_set(int liker_id, int liked_id)
+{
+    uint64_t h;
+    uint64_t h1;
+    uint64_t h2;
+    uint64_t bit;
+    int k;
+
+    h = m_pair_hash(liker_id, liked_id);
+    h1 = h & 0xFFFFFFFF;
+    h2 = (h >> 32) | 1;
+    for (k = 0; k < BLOOM_HASHES; k++)
+    {
+        bit = (h1 + k * h2) & (m_bloom.n_bits - 1);
+        m_bloom.bits[bit >> 6] |= 1ULL << (bit & 63);
+    }
+    m_bloom.n_items++;
+}
+
+static bool m_bloom_test(int liker_id, int liked_id)
+{
+    uint64_t h;
+    uint64_t h1;
+    uint64_t h2;
+    uint64_t bit;
+    int k;
+
+    if (!m_bloom.bits)
+        return false;
+
+    h = m_pair_hash(liker_id, liked_id);
+    h1 = h & 0xFFFFFFFF;
+    h2 = (h >> 32) | 1;
+    for (k = 0; k < BLOOM_HASHES; k++)
+    {
+        bit = (h1 + k * h2) & (m_bloom.n_bits - 1);
+        if (!((m_bloom.bits[bit >> 6] >> (bit & 63)) & 1))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * (Re)builds the filter sized for the current edge count. Removed likes
+ * keep their bits until the next rebuild, which only costs false positives.
+ */
+static void m_bloom_rebuild(void)
+{
+    like_node_t* node;
+    like_node_t* tmp;
+    uint64_t n_bits;
+    size_t i;
+
+    n_bits = BLOOM_MIN_BITS;
+    while (n_bits < (uint64_t)m_n_edges * 2 * BLOOM_BITS_PER_ITEM)
+        n_bits <<= 1;
+
+    free(m_bloom.bits);
+    m_bloom.bits = calloc(n_bits / 64, sizeof(uint64_t));
+    ft_assert(m_bloom.bits != NULL, "calloc failed");
+    m_bloom.n_bits = n_bits;
+    m_bloom.n_items = 0;
+
+    HASH_ITER(hh, m_graph, node, tmp)
+    {
+        for (i = 0; i < node->out.count; i++)
+            m_bloom_set(node->user_id, node->out.ids[i]);
+    }
+}
+
+static like_node_t* m_node(int user_id, bool create)
+{
+    like_node_t* node;
+
+    HASH_FIND_INT(m_graph, &user_id, node);
+    if (!node && create)
+    {
+        node = calloc(1, sizeof(*node));
+        ft_assert(node != NULL, "calloc failed");
+        node->user_id = user_id;
+        HASH_ADD_INT(m_graph, user_id, node);
+    }
+    return node;
+}
+
+static void m_edge_add(int liker_id, int liked_id)
+{
+    like_node_t* liker;
+    like_node_t* liked;
+    size_t idx;
+
+    liker = m_node(liker_id, true);
+    liked = m_node(liked_id, true);
+
+    if (!m_vec_insert(&liker->out, liked_id))
+        return;
+    m_vec_insert(&liked->in, liker_id);
+    m_n_edges++;
+
+    if (m_vec_find(&liked->out, liker_id, &idx))
+    {
+        m_vec_insert(&liker->matches, liked_id);
+        m_vec_insert(&liked->matches, liker_id);
+    }
+}
+
+void db_ilike_add(int liker_id, int liked_id)
+{
+    m_edge_add(liker_id, liked_id);
+
+    if (!m_bloom.bits || m_bloom.n_items * BLOOM_BITS_PER_ITEM >= m_bloom.n_bits)
+        m_bloom_rebuild();
+    else
+        m_bloom_set(liker_id, liked_id);
+}
+
+void db_ilike_remove(int liker_id, int liked_id)
+{
+    like_node_t* liker;
+    like_node_t* liked;
+
+    liker = m_node(liker_id, false);
+    liked = m_node(liked_id, false);
+    if (!liker || !liked)
+        return;
+
+    if (!m_vec_remove(&liker->out, liked_id))
+        return;
+    m_vec_remove(&liked->in, liker_id);
+    m_n_edges--;
+
+    m_vec_remove(&liker->matches, liked_id);
+    m_vec_remove(&liked->matches, liker_id);
+}
+
+bool db_ilike_has_liked(int liker_id, int liked_id)
+{
+    like_node_t* liker;
+    size_t idx;
+
+    if (!m_bloom_test(liker_id, liked_id))
+        return false;
+
+    liker = m_node(liker_id, false);
+    return liker && m_vec_find(&liker->out, liked_id, &idx);
+}
+
+bool db_ilike_is_mutual(int user_a, int user_b)
+{
+    like_node_t* a;
+    size_t idx;
+
+    a = m_node(user_a, false);
+    return a && m_vec_find(&a->matches, user_b, &idx);
+}
+
+static const int* m_vec_view(const id_vec_t* v, size_t* count)
+{
+    if (count)
+        *count = v ? v->count : 0;
+    return v ? v->ids : NULL;
+}
+
+const int* db_ilike_matches(int user_id, size_t* count)
+{
+    like_node_t* node;
+
+    node = m_node(user_id, false);
+    return m_vec_view(node ? &node->matches : NULL, count);
+}
+
+const int* db_ilike_liked_by(int user_id, size_t* count)
+{
+    like_node_t* node;
+
+    node = m_node(user_id, false);
+    return m_vec_view(node ? &node->out : NULL, count);
+}
+
+const int* db_ilike_likers_of(int user_id, size_t* count)
+{
+    like_node_t* node;
+
+    node = m_node(user_id, false);
+    return m_vec_view(node ? &node->in : NULL, count);
+}
+
+void db_ilike_clear(void)
+{
+    like_node_t* node;
+    like_node_t* tmp;
+
+    HASH_ITER(hh, m_graph, node, tmp)
+    {
+        HASH_DEL(m_graph, node);
+        free(node->out.ids);
+        free(node->in.ids);
+        free(node->matches.ids);
+        free(node);
+    }
+
+    free(m_bloom.bits);
+    memset(&m_bloom, 0, sizeof(m_bloom));
+    m_n_edges = 0;
+}
+
+void db_ilike_foreach(db_ilike_cb_t cb, void* user_data)
+{
+    like_node_t* node;
+    like_node_t* tmp;
+    size_t i;
+
+    HASH_ITER(hh, m_graph, node, tmp)
+    {
+        for (i = 0; i < node->out.count; i++)
+            cb(node->user_id, node->out.ids[i], user_data);
+    }
+}
+
+static void m_add_rows(PGresult* res)
+{
+    int n;
+    int i;
+
+    n = PQntuples(res);
+    for (i = 0; i < n; i++)
+        m_edge_add(atoi(PQgetvalue(res, i, 0)), atoi(PQgetvalue(res, i, 1)));
+    m_bloom_rebuild();
+}
+
+int db_ilike_load(DB_ID DB)
+{
+    PGresult* res;
+
+    const char *sql = "SELECT liker_id, liked_id FROM likes;";
+    res = db_query(DB, sql, 0, NULL);
+    if (!res) return ERROR;
+
+    db_ilike_clear();
+    m_add_rows(res);
+
+    PQclear(res);
+    return SUCCESS;
+}
+
+int db_ilike_load_since(DB_ID DB, const char* since)
+{
+    PGresult* res;
+    const char* params[1] = { since };
+
+    const char *sql = "SELECT liker_id, liked_id FROM likes WHERE updated_at > to_timestamp($1);";
+    res = db_query(DB, sql, 1, params);
+    if (!res) return ERROR;
+
+    m_add_rows(res);
+
+    PQclear(res);
+    return SUCCESS;
+}
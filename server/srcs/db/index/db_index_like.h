@@ -0,0 +1,71 @@
+#ifndef DB_INDEX_LIKE_H
+#define DB_INDEX_LIKE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "../db_api.h"
+#include "../../../inc/error_codes.h"
+
+/*
+ * In-memory like graph. Every user keeps three sorted id vectors:
+ *   - out:     users this user liked
+ *   - in:      users that liked this user
+ *   - matches: users with a like in both directions
+ *
+ * A bloom filter over (liker, liked) pairs sits in front of the "has
+ * liked" lookup so most negative checks never touch the graph.
+ *
+ * Loaded once at startup with db_ilike_load() and kept up to date by
+ * db_tlike_insert() / db_tlike_delete_by_pk().
+ */
+
+/*
+ * Load every likes row into the graph. Any previous content is dropped.
+ */
+int db_ilike_load(DB_ID DB);
+
+/*
+ * Warm start (db_index_snapshot.h): add the rows written after since,
+ * epoch seconds as text. Nothing is dropped.
+ */
+int db_ilike_load_since(DB_ID DB, const char* since);
+
+typedef void (*db_ilike_cb_t)(int liker_id, int liked_id, void* user_data);
+
+/* every like, grouped by liker with ascending liked ids */
+void db_ilike_foreach(db_ilike_cb_t cb, void* user_data);
+
+/*
+ * Release all graph memory.
+ */
+void db_ilike_clear(void);
+
+/*
+ * Maintenance hooks, called after the matching row is written.
+ */
+void db_ilike_add(int liker_id, int liked_id);
+void db_ilike_remove(int liker_id, int liked_id);
+
+/*
+ * true if liker_id liked liked_id. O(1) bloom reject, O(log n) otherwise.
+ */
+bool db_ilike_has_liked(int liker_id, int liked_id);
+
+/*
+ * true if both users liked each other.
+ */
+bool db_ilike_is_mutual(int user_a, int user_b);
+
+/*
+ * Sorted ids of the users user_id matched with. Borrowed pointer, valid
+ * until the next graph update. *count is set to the number of entries.
+ */
+const int* db_ilike_matches(int user_id, size_t* count);
+
+/*
+ * Sorted ids liked by / liking user_id. Same ownership rules as above.
+ */
+const int* db_ilike_liked_by(int user_id, size_t* count);
+const int* db_ilike_likers_of(int user_id, size_t* count);
+
+#endif /* DB_INDEX_LIKE_H */
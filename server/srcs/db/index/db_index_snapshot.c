@@ -0,0 +1,529 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "db_index_snapshot.h"
+#include "db_index_user.h"
+#include "db_index_tag.h"
+#include "db_index_like.h"
+#include "../db_schema.h"
+#include "../../log/log_api.h"
+#include "../../../inc/ft_malloc.h"
+
+#define ISNAP_MAGIC "MATCHIDX"
+#define ISNAP_VERSION 1
+#define ISNAP_OVERLAP_SEC 60.0              /* a row committed late carries an earlier updated_at */
+#define ISNAP_MAX_AGE_SEC (7 * 86400.0)     /* tombstones are kept this long */
+#define ISNAP_PRUNE_BATCH 1000              /* expired tombstones deleted per save */
+#define ISNAP_STR_(x) #x
+#define ISNAP_STR(x) ISNAP_STR_(x)
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+enum
+{
+    ISNAP_USERS,
+    ISNAP_TAGS,
+    ISNAP_LIKES,
+    ISNAP_N_SECTIONS
+};
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t n_sections;
+    double synced_at;           /* database clock, epoch seconds */
+    uint64_t file_size;
+    uint64_t checksum;          /* FNV-1a of the records, then of the section table */
+} isnap_header_t;
+
+typedef struct
+{
+    uint32_t id;
+    uint32_t record_size;
+    uint64_t offset;
+    uint64_t count;
+} isnap_section_t;
+
+typedef struct
+{
+    int32_t id;
+    int32_t fame_rating;
+    double gps_lat;
+    double gps_lon;
+    uint8_t has_location;
+    uint8_t gender;
+    uint8_t orientation;
+    uint8_t pad[5];
+} isnap_user_t;
+
+/* (user, tag) and (liker, liked) */
+typedef struct
+{
+    int32_t a;
+    int32_t b;
+} isnap_pair_t;
+
+typedef struct
+{
+    FILE* fp;
+    uint64_t hash;
+    uint64_t count;
+    bool failed;
+} isnap_writer_t;
+
+_Static_assert(sizeof(isnap_header_t) == 40, "snapshot header layout changed");
+_Static_assert(sizeof(isnap_section_t) == 24, "snapshot section layout changed");
+_Static_assert(sizeof(isnap_user_t) == 32, "snapshot user layout changed");
+
+#define ISNAP_DATA_OFFSET (sizeof(isnap_header_t) + ISNAP_N_SECTIONS * sizeof(isnap_section_t))
+
+static double m_synced_at = 0.0;    /* database clock the indexes are current to */
+
+static const uint32_t m_record_size[ISNAP_N_SECTIONS] = {
+    [ISNAP_USERS] = sizeof(isnap_user_t),
+    [ISNAP_TAGS] = sizeof(isnap_pair_t),
+    [ISNAP_LIKES] = sizeof(isnap_pair_t),
+};
+
+static uint64_t m_fnv(uint64_t h, const void* data, size_t len)
+{
+    const uint8_t* p;
+    size_t i;
+
+    p = data;
+    for (i = 0; i < len; i++)
+        h = (h ^ p[i]) * FNV_PRIME;
+    return h;
+}
+
+static int m_db_clock(DB_ID DB, double* out)
+{
+    PGresult* res;
+
+    res = db_query(DB, "SELECT EXTRACT(EPOCH FROM clock_timestamp());", 0, NULL);
+    if (!res)
+        return ERROR;
+    *out = atof(PQgetvalue(res, 0, 0));
+    PQclear(res);
+    return SUCCESS;
+}
+
+int db_isnap_init(void)
+{
+    size_t i;
+
+    const char* ddl[] = {
+        "CREATE TABLE IF NOT EXISTS index_tombstones ("
+        "tbl TEXT NOT NULL, a INTEGER NOT NULL, b INTEGER NOT NULL DEFAULT 0, "
+        "deleted_at TIMESTAMPTZ NOT NULL DEFAULT clock_timestamp());",
+        "CREATE INDEX IF NOT EXISTS index_tombstones_deleted_at ON index_tombstones(deleted_at);",
+
+        "ALTER TABLE users ADD COLUMN IF NOT EXISTS updated_at TIMESTAMPTZ NOT NULL DEFAULT clock_timestamp();",
+        "ALTER TABLE likes ADD COLUMN IF NOT EXISTS updated_at TIMESTAMPTZ NOT NULL DEFAULT clock_timestamp();",
+        "ALTER TABLE user_tags ADD COLUMN IF NOT EXISTS updated_at TIMESTAMPTZ NOT NULL DEFAULT clock_timestamp();",
+        "CREATE INDEX IF NOT EXISTS users_updated_at ON users(updated_at);",
+        "CREATE INDEX IF NOT EXISTS likes_updated_at ON likes(updated_at);",
+        "CREATE INDEX IF NOT EXISTS user_tags_updated_at ON user_tags(updated_at);",
+
+        /* last_online moves on every request and is not indexed, it alone does not count */
+        "CREATE OR REPLACE FUNCTION index_touch() RETURNS trigger LANGUAGE plpgsql AS $$\n"
+        "BEGIN\n"
+        "  IF TG_OP = 'UPDATE' AND to_jsonb(NEW) - 'last_online' - 'updated_at'\n"
+        "                        = to_jsonb(OLD) - 'last_online' - 'updated_at' THEN\n"
+        "    NEW.updated_at := OLD.updated_at;\n"
+        "  ELSE\n"
+        "    NEW.updated_at := clock_timestamp();\n"
+        "  END IF;\n"
+        "  RETURN NEW;\n"
+        "END $$;",
+        "CREATE OR REPLACE FUNCTION index_tombstone() RETURNS trigger LANGUAGE plpgsql AS $$\n"
+        "BEGIN\n"
+        "  IF TG_TABLE_NAME = 'users' THEN\n"
+        "    INSERT INTO index_tombstones(tbl, a) VALUES ('users', OLD.id);\n"
+        "  ELSIF TG_TABLE_NAME = 'likes' THEN\n"
+        "    INSERT INTO index_tombstones(tbl, a, b) VALUES ('likes', OLD.liker_id, OLD.liked_id);\n"
+        "  ELSE\n"
+        "    INSERT INTO index_tombstones(tbl, a, b) VALUES ('user_tags', OLD.user_id, OLD.tag_id);\n"
+        "  END IF;\n"
+        "  RETURN OLD;\n"
+        "END $$;",
+
+        "DO $$ BEGIN\n"
+        "  CREATE TRIGGER users_touch BEFORE INSERT OR UPDATE ON users "
+        "FOR EACH ROW EXECUTE FUNCTION index_touch();\n"
+        "  CREATE TRIGGER users_tombstone AFTER DELETE ON users "
+        "FOR EACH ROW EXECUTE FUNCTION index_tombstone();\n"
+        "EXCEPTION WHEN duplicate_object THEN NULL; END $$;",
+        "DO $$ BEGIN\n"
+        "  CREATE TRIGGER likes_touch BEFORE INSERT OR UPDATE ON likes "
+        "FOR EACH ROW EXECUTE FUNCTION index_touch();\n"
+        "  CREATE TRIGGER likes_tombstone AFTER DELETE ON likes "
+        "FOR EACH ROW EXECUTE FUNCTION index_tombstone();\n"
+        "EXCEPTION WHEN duplicate_object THEN NULL; END $$;",
+        "DO $$ BEGIN\n"
+        "  CREATE TRIGGER user_tags_touch BEFORE INSERT OR UPDATE ON user_tags "
+        "FOR EACH ROW EXECUTE FUNCTION index_touch();\n"
+        "  CREATE TRIGGER user_tags_tombstone AFTER DELETE ON user_tags "
+        "FOR EACH ROW EXECUTE FUNCTION index_tombstone();\n"
+        "EXCEPTION WHEN duplicate_object THEN NULL; END $$;",
+    };
+
+    for (i = 0; i < sizeof(ddl) / sizeof(ddl[0]); i++)
+    {
+        if (db_schema_ddl(ddl[i]) != SUCCESS)
+            return ERROR;
+    }
+    return SUCCESS;
+}
+
+/* deletes first: a row deleted and written again comes back with the rows */
+static int m_catch_up(DB_ID DB, double synced_at)
+{
+    PGresult* res;
+    const char* tbl;
+    char since[32];
+    const char* params[1] = { since };
+    int a;
+    int b;
+    int n;
+    int i;
+
+    snprintf(since, sizeof(since), "%.6f", synced_at - ISNAP_OVERLAP_SEC);
+    res = db_query(DB,
+        "SELECT tbl, a, b FROM index_tombstones "
+        "WHERE deleted_at > to_timestamp($1) ORDER BY deleted_at;", 1, params);
+    if (!res)
+        return ERROR;
+    n = PQntuples(res);
+    for (i = 0; i < n; i++)
+    {
+        tbl = PQgetvalue(res, i, 0);
+        a = atoi(PQgetvalue(res, i, 1));
+        b = atoi(PQgetvalue(res, i, 2));
+        if (strcmp(tbl, "users") == 0)
+            db_iuser_remove(a);
+        else if (strcmp(tbl, "likes") == 0)
+            db_ilike_remove(a, b);
+        else if (strcmp(tbl, "user_tags") == 0)
+            db_itag_remove(a, b);
+    }
+    PQclear(res);
+
+    if (db_iuser_load_since(DB, since) != SUCCESS
+        || db_itag_load_since(DB, since) != SUCCESS
+        || db_ilike_load_since(DB, since) != SUCCESS)
+        return ERROR;
+    return SUCCESS;
+}
+
+static int m_full_load(DB_ID DB)
+{
+    if (db_itag_load(DB) == ERROR)
+        return ERROR;
+    if (db_ilike_load(DB) == ERROR)
+        return ERROR;
+    if (db_iuser_load(DB) == ERROR)
+        return ERROR;
+    return SUCCESS;
+}
+
+static const char* m_check(const uint8_t* map, size_t size, double now)
+{
+    const isnap_header_t* h;
+    const isnap_section_t* s;
+    uint64_t hash;
+    int i;
+
+    if (size < ISNAP_DATA_OFFSET)
+        return "truncated";
+    h = (const isnap_header_t*)map;
+    if (memcmp(h->magic, ISNAP_MAGIC, sizeof(h->magic)) != 0)
+        return "not a snapshot";
+    if (h->version != ISNAP_VERSION || h->n_sections != ISNAP_N_SECTIONS)
+        return "other version";
+    if (h->file_size != size)
+        return "truncated";
+
+    s = (const isnap_section_t*)(map + sizeof(*h));
+    for (i = 0; i < ISNAP_N_SECTIONS; i++)
+    {
+        if (s[i].id != (uint32_t)i || s[i].record_size != m_record_size[i]
+            || s[i].offset < ISNAP_DATA_OFFSET || s[i].offset % 8 != 0 || s[i].offset > size
+            || s[i].count > (size - s[i].offset) / s[i].record_size)
+            return "bad section table";
+    }
+
+    hash = m_fnv(FNV_OFFSET, map + ISNAP_DATA_OFFSET, size - ISNAP_DATA_OFFSET);
+    hash = m_fnv(hash, s, ISNAP_N_SECTIONS * sizeof(*s));
+    if (hash != h->checksum)
+        return "checksum mismatch";
+
+    /* the tombstones needed to catch up are gone */
+    if (h->synced_at < now - ISNAP_MAX_AGE_SEC)
+        return "too old";
+    return NULL;
+}
+
+static void m_replay(const uint8_t* map)
+{
+    const isnap_section_t* s;
+    const isnap_user_t* u;
+    const isnap_pair_t* p;
+    user_profile_t profile;
+    uint64_t i;
+
+    db_iuser_clear();
+    db_itag_clear();
+    db_ilike_clear();
+
+    s = (const isnap_section_t*)(map + sizeof(isnap_header_t));
+    u = (const isnap_user_t*)(map + s[ISNAP_USERS].offset);
+    for (i = 0; i < s[ISNAP_USERS].count; i++)
+    {
+        memset(&profile, 0, sizeof(profile));
+        profile.id = u[i].id;
+        profile.fame_rating = u[i].fame_rating;
+        profile.gps_lat = u[i].gps_lat;
+        profile.gps_lon = u[i].gps_lon;
+        profile.has_location = u[i].has_location;
+        profile.gender = u[i].gender;
+        profile.orientation = u[i].orientation;
+        db_iuser_put(&profile);
+    }
+
+    p = (const isnap_pair_t*)(map + s[ISNAP_TAGS].offset);
+    for (i = 0; i < s[ISNAP_TAGS].count; i++)
+        db_itag_add(p[i].a, p[i].b);
+
+    p = (const isnap_pair_t*)(map + s[ISNAP_LIKES].offset);
+    for (i = 0; i < s[ISNAP_LIKES].count; i++)
+        db_ilike_add(p[i].a, p[i].b);
+}
+
+/* maps and replays path, ERROR when it is missing or unusable */
+static int m_load_file(const char* path, double now)
+{
+    struct stat st;
+    const char* why;
+    uint8_t* map;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        log_msg(LOG_LEVEL_INFO, "Index snapshot %s: %s\n", path, strerror(errno));
+        return ERROR;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return ERROR;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return ERROR;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    why = m_check(map, st.st_size, now);
+    if (why)
+    {
+        log_msg(LOG_LEVEL_WARN, "Index snapshot %s ignored: %s\n", path, why);
+        munmap(map, st.st_size);
+        return ERROR;
+    }
+    m_replay(map);
+    m_synced_at = ((const isnap_header_t*)map)->synced_at;
+    munmap(map, st.st_size);
+    return SUCCESS;
+}
+
+int db_isnap_load(DB_ID DB, const char* path)
+{
+    double now;
+
+    if (m_db_clock(DB, &now) != SUCCESS)
+        return ERROR;
+
+    if (path && path[0] && m_load_file(path, now) == SUCCESS)
+    {
+        if (m_catch_up(DB, m_synced_at) == SUCCESS)
+        {
+            log_msg(LOG_LEVEL_BOOT, "Indexes warm started from %s, %.0f s behind\n", path, now - m_synced_at);
+            m_synced_at = now;
+            return SUCCESS;
+        }
+        log_msg(LOG_LEVEL_WARN, "Index snapshot catch up failed, loading the tables\n");
+    }
+
+    if (m_full_load(DB) != SUCCESS)
+        return ERROR;
+    m_synced_at = now;
+    return SUCCESS;
+}
+
+static void m_write(isnap_writer_t* w, const void* data, size_t len)
+{
+    if (fwrite(data, 1, len, w->fp) != len)
+        w->failed = true;
+    w->hash = m_fnv(w->hash, data, len);
+    w->count++;
+}
+
+static void m_write_user(const user_profile_t* profile, void* user_data)
+{
+    isnap_user_t u;
+
+    memset(&u, 0, sizeof(u));
+    u.id = profile->id;
+    u.fame_rating = profile->fame_rating;
+    u.gps_lat = profile->gps_lat;
+    u.gps_lon = profile->gps_lon;
+    u.has_location = profile->has_location;
+    u.gender = profile->gender;
+    u.orientation = profile->orientation;
+    m_write(user_data, &u, sizeof(u));
+}
+
+static void m_write_pair(int a, int b, void* user_data)
+{
+    isnap_pair_t p;
+
+    p.a = a;
+    p.b = b;
+    m_write(user_data, &p, sizeof(p));
+}
+
+/* FILE* so a failed write only shows in w.failed, checked once at the end */
+static int m_write_file(FILE* fp, double synced_at)
+{
+    isnap_header_t h;
+    isnap_section_t s[ISNAP_N_SECTIONS];
+    isnap_writer_t w;
+    int i;
+
+    memset(&w, 0, sizeof(w));
+    w.fp = fp;
+    w.hash = FNV_OFFSET;
+    if (fseek(fp, ISNAP_DATA_OFFSET, SEEK_SET) != 0)
+        return ERROR;
+
+    for (i = 0; i < ISNAP_N_SECTIONS; i++)
+    {
+        s[i].id = i;
+        s[i].record_size = m_record_size[i];
+        s[i].offset = ftell(fp);
+        w.count = 0;
+        if (i == ISNAP_USERS)
+            db_iuser_foreach(m_write_user, &w);
+        else if (i == ISNAP_TAGS)
+            db_itag_foreach(m_write_pair, &w);
+        else
+            db_ilike_foreach(m_write_pair, &w);
+        s[i].count = w.count;
+    }
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, ISNAP_MAGIC, sizeof(h.magic));
+    h.version = ISNAP_VERSION;
+    h.n_sections = ISNAP_N_SECTIONS;
+    h.synced_at = synced_at;
+    h.file_size = ftell(fp);
+    h.checksum = m_fnv(w.hash, s, sizeof(s));
+
+    if (fseek(fp, 0, SEEK_SET) != 0
+        || fwrite(&h, sizeof(h), 1, fp) != 1
+        || fwrite(s, sizeof(s), 1, fp) != 1
+        || fflush(fp) != 0 || fsync(fileno(fp)) != 0 || w.failed)
+        return ERROR;
+    return SUCCESS;
+}
+
+/* a rename is only durable once the directory holding it is synced */
+static int m_sync_dir(const char* path)
+{
+    char dir[4096];
+    char* slash;
+    int fd;
+    int ret;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    slash = strrchr(dir, '/');
+    if (!slash)
+        snprintf(dir, sizeof(dir), ".");
+    else if (slash == dir)
+        dir[1] = '\0';
+    else
+        *slash = '\0';
+
+    fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return ERROR;
+    ret = fsync(fd) == 0 ? SUCCESS : ERROR;
+    close(fd);
+    return ret;
+}
+
+/* expired tombstones, a bounded batch per save so that it never takes long */
+static void m_prune(DB_ID DB, double now)
+{
+    const char* params[1];
+    char cutoff[32];
+
+    snprintf(cutoff, sizeof(cutoff), "%.6f", now - ISNAP_MAX_AGE_SEC);
+    params[0] = cutoff;
+    db_execute(DB,
+        "DELETE FROM index_tombstones WHERE ctid = ANY (ARRAY("
+        "SELECT ctid FROM index_tombstones WHERE deleted_at < to_timestamp($1) "
+        "LIMIT " ISNAP_STR(ISNAP_PRUNE_BATCH) "));", 1, params);
+}
+
+int db_isnap_save(DB_ID DB, const char* path)
+{
+    char tmp[4096];
+    FILE* fp;
+    double now;
+    int ret;
+
+    if (!path || !path[0])
+        return INVALID_ARGS;
+
+    /*
+     * The indexes follow every committed write through db_events, so they
+     * are current to the clock read now; a late commit is covered by
+     * ISNAP_OVERLAP_SEC on load.
+     */
+    if (m_db_clock(DB, &now) != SUCCESS)
+        return ERROR;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fp = fopen(tmp, "wb");
+    if (!fp)
+    {
+        log_msg(LOG_LEVEL_ERROR, "Index snapshot %s: %s\n", tmp, strerror(errno));
+        return ERROR;
+    }
+    ret = m_write_file(fp, now);
+    if (fclose(fp) != 0)
+        ret = ERROR;
+    if (ret == SUCCESS && (rename(tmp, path) != 0 || m_sync_dir(path) != SUCCESS))
+        ret = ERROR;
+    if (ret != SUCCESS)
+    {
+        log_msg(LOG_LEVEL_ERROR, "Index snapshot %s not written: %s\n", path, strerror(errno));
+        unlink(tmp);
+        return ERROR;
+    }
+    m_synced_at = now;
+    log_msg(LOG_LEVEL_INFO, "Index snapshot written to %s\n", path);
+    m_prune(DB, now);
+    return SUCCESS;
+}
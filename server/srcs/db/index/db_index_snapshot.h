@@ -0,0 +1,35 @@
+#ifndef DB_INDEX_SNAPSHOT_H
+#define DB_INDEX_SNAPSHOT_H
+
+#include "../db_api.h"
+#include "../../../inc/error_codes.h"
+
+/*
+ * Warm start of the in-memory indexes (users, tags, likes).
+ *
+ * The snapshot is one file of fixed-size records in native byte order,
+ * stamped with the database clock its content is current to. At boot it
+ * is mapped and replayed into the indexes, then the indexes catch up with
+ * the rows whose updated_at is later than the stamp and with the deletes
+ * recorded in index_tombstones since then. A missing, corrupt or too old
+ * snapshot falls back to the full db_i*_load() scans.
+ */
+
+/*
+ * Registers the updated_at columns, the triggers keeping them and the
+ * tombstone table with db_schema, after the tables they alter.
+ */
+int db_isnap_init(void);
+
+/* fills the indexes, path NULL or "" always does the full scans */
+int db_isnap_load(DB_ID DB, const char* path);
+
+/*
+ * Writes the indexes as they are in memory through a temporary file,
+ * stamped with the database clock read just before: db_events keep them
+ * current, so only one clock query runs, no catch-up. Then deletes a
+ * bounded batch of expired tombstones. Blocks the caller for the write.
+ */
+int db_isnap_save(DB_ID DB, const char* path);
+
+#endif /* DB_INDEX_SNAPSHOT_H */
@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "db_index_tag.h"
+#include "../../../inc/ft_malloc.h"
+#include "../../../third_party/uthash-master/src/uthash.h"
+
+typedef struct
+{
+    int tag_id;
+    ft_bitmap_t users;
+    UT_hash_handle hh;
+} tag_users_t;
+
+typedef struct
+{
+    int user_id;
+    uint64_t* words;
+    uint32_t n_words;
+    UT_hash_handle hh;
+} user_tags_t;
+
+static tag_users_t* m_by_tag = NULL;
+static user_tags_t* m_by_user = NULL;
+
+static tag_users_t* m_tag_entry(int tag_id, bool create)
+{
+    tag_users_t* entry;
+
+    HASH_FIND_INT(m_by_tag, &tag_id, entry);
+    if (!entry && create)
+    {
+        entry = calloc(1, sizeof(*entry));
+        ft_assert(entry != NULL, "calloc failed");
+        entry->tag_id = tag_id;
+        ft_bitmap_init(&entry->users);
+        HASH_ADD_INT(m_by_tag, tag_id, entry);
+    }
+    return entry;
+}
+
+static user_tags_t* m_user_entry(int user_id, bool create)
+{
+    user_tags_t* entry;
+
+    HASH_FIND_INT(m_by_user, &user_id, entry);
+    if (!entry && create)
+    {
+        entry = calloc(1, sizeof(*entry));
+        ft_assert(entry != NULL, "calloc failed");
+        entry->user_id = user_id;
+        HASH_ADD_INT(m_by_user, user_id, entry);
+    }
+    return entry;
+}
+
+void db_itag_add(int user_id, int tag_id)
+{
+    user_tags_t* u;
+    uint32_t word;
+    uint32_t n;
+
+    if (user_id < 0 || tag_id < 0) return;
+
+    ft_bitmap_add(&m_tag_entry(tag_id, true)->users, (uint32_t)user_id);
+
+    u = m_user_entry(user_id, true);
+    word = (uint32_t)tag_id >> 6;
+    if (word >= u->n_words)
+    {
+        n = u->n_words ? u->n_words : 1;
+        while (n <= word)
+            n *= 2;
+        u->words = realloc(u->words, n * sizeof(uint64_t));
+        memset(u->words + u->n_words, 0, (n - u->n_words) * sizeof(uint64_t));
+        u->n_words = n;
+    }
+    u->words[word] |= 1ULL << (tag_id & 63);
+}
+
+void db_itag_remove(int user_id, int tag_id)
+{
+    tag_users_t* t;
+    user_tags_t* u;
+    uint32_t word;
+
+    if (user_id < 0 || tag_id < 0) return;
+
+    t = m_tag_entry(tag_id, false);
+    if (t)
+    {
+        ft_bitmap_remove(&t->users, (uint32_t)user_id);
+        if (t->users.count == 0)
+        {
+            HASH_DEL(m_by_tag, t);
+            ft_bitmap_clear(&t->users);
+            free(t);
+        }
+    }
+
+    u = m_user_entry(user_id, false);
+    word = (uint32_t)tag_id >> 6;
+    if (u && word < u->n_words)
+        u->words[word] &= ~(1ULL << (tag_id & 63));
+}
+
+bool db_itag_user_has_tag(int user_id, int tag_id)
+{
+    user_tags_t* u;
+    uint32_t word;
+
+    if (tag_id < 0) return false;
+
+    u = m_user_entry(user_id, false);
+    word = (uint32_t)tag_id >> 6;
+    if (!u || word >= u->n_words)
+        return false;
+    return (u->words[word] >> (tag_id & 63)) & 1;
+}
+
+int db_itag_common_tags(int user_a, int user_b)
+{
+    user_tags_t* a;
+    user_tags_t* b;
+    uint32_t n;
+    uint32_t i;
+    int count;
+
+    a = m_user_entry(user_a, false);
+    b = m_user_entry(user_b, false);
+    if (!a || !b)
+        return 0;
+
+    n = a->n_words < b->n_words ? a->n_words : b->n_words;
+    count = 0;
+    for (i = 0; i < n; i++)
+        count += __builtin_popcountll(a->words[i] & b->words[i]);
+    return count;
+}
+
+const ft_bitmap_t* db_itag_users_for_tag(int tag_id)
+{
+    tag_users_t* t;
+
+    t = m_tag_entry(tag_id, false);
+    return t ? &t->users : NULL;
+}
+
+ft_bitmap_t* db_itag_filter(const int* with_tags, size_t n_with,
+                            const int* without_tags, size_t n_without)
+{
+    const ft_bitmap_t* smallest;
+    const ft_bitmap_t* bm;
+    ft_bitmap_t* out;
+    size_t i;
+
+    if (!with_tags || n_with == 0)
+        return NULL;
+
+    /* start from the rarest tag so every AND works on the smallest set */
+    smallest = NULL;
+    for (i = 0; i < n_with; i++)
+    {
+        bm = db_itag_users_for_tag(with_tags[i]);
+        if (!bm)
+            return ft_bitmap_new();
+        if (!smallest || ft_bitmap_cardinality(bm) < ft_bitmap_cardinality(smallest))
+            smallest = bm;
+    }
+
+    out = ft_bitmap_copy(smallest);
+    for (i = 0; i < n_with && out->count; i++)
+    {
+        bm = db_itag_users_for_tag(with_tags[i]);
+        if (bm != smallest)
+            ft_bitmap_and_inplace(out, bm);
+    }
+
+    for (i = 0; i < n_without && without_tags && out->count; i++)
+    {
+        bm = db_itag_users_for_tag(without_tags[i]);
+        if (bm)
+            ft_bitmap_andnot_inplace(out, bm);
+    }
+
+    return out;
+}
+
+void db_itag_clear(void)
+{
+    tag_users_t* t;
+    tag_users_t* ttmp;
+    user_tags_t* u;
+    user_tags_t* utmp;
+
+    HASH_ITER(hh, m_by_tag, t, ttmp)
+    {
+        HASH_DEL(m_by_tag, t);
+        ft_bitmap_clear(&t->users);
+        free(t);
+    }
+
+    HASH_ITER(hh, m_by_user, u, utmp)
+    {
+        HASH_DEL(m_by_user, u);
+        free(u->words);
+        free(u);
+    }
+}
+
+void db_itag_foreach(db_itag_cb_t cb, void* user_data)
+{
+    user_tags_t* u;
+    user_tags_t* tmp;
+    uint64_t bits;
+    uint32_t w;
+
+    HASH_ITER(hh, m_by_user, u, tmp)
+    {
+        for (w = 0; w < u->n_words; w++)
+        {
+            for (bits = u->words[w]; bits; bits &= bits - 1)
+                cb(u->user_id, (int)(w * 64 + __builtin_ctzll(bits)), user_data);
+        }
+    }
+}
+
+static void m_add_rows(PGresult* res)
+{
+    int n;
+    int i;
+
+    n = PQntuples(res);
+    for (i = 0; i < n; i++)
+        db_itag_add(atoi(PQgetvalue(res, i, 0)), atoi(PQgetvalue(res, i, 1)));
+}
+
+int db_itag_load(DB_ID DB)
+{
+    PGresult* res;
+
+    const char *sql = "SELECT user_id, tag_id FROM user_tags;";
+    res = db_query(DB, sql, 0, NULL);
+    if (!res) return ERROR;
+
+    db_itag_clear();
+    m_add_rows(res);
+
+    PQclear(res);
+    return SUCCESS;
+}
+
+int db_itag_load_since(DB_ID DB, const char* since)
+{
+    PGresult* res;
+    const char* params[1] = { since };
+
+    const char *sql = "SELECT user_id, tag_id FROM user_tags WHERE updated_at > to_timestamp($1);";
+    res = db_query(DB, sql, 1, params);
+    if (!res) return ERROR;
+
+    m_add_rows(res);
+
+    PQclear(res);
+    return SUCCESS;
+}
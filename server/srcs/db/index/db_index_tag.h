@@ -0,0 +1,65 @@
+#ifndef DB_INDEX_TAG_H
+#define DB_INDEX_TAG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "../db_api.h"
+#include "../../../inc/ft_bitmap.h"
+#include "../../../inc/error_codes.h"
+
+/*
+ * In-memory inverted index over user_tags:
+ *   - tag id  -> compressed bitmap of user ids
+ *   - user id -> bitset of tag ids
+ *
+ * Loaded once at startup with db_itag_load() and kept up to date by
+ * db_ttag_insert_user_tag() / db_ttag_delete_user_tag().
+ */
+
+/*
+ * Load every user_tags row into the index. Any previous content is dropped.
+ */
+int db_itag_load(DB_ID DB);
+
+/*
+ * Warm start (db_index_snapshot.h): add the rows written after since,
+ * epoch seconds as text. Nothing is dropped.
+ */
+int db_itag_load_since(DB_ID DB, const char* since);
+
+typedef void (*db_itag_cb_t)(int user_id, int tag_id, void* user_data);
+
+/* every (user, tag) pair, by user */
+void db_itag_foreach(db_itag_cb_t cb, void* user_data);
+
+/*
+ * Release all index memory.
+ */
+void db_itag_clear(void);
+
+/*
+ * Maintenance hooks, called after the matching row is written.
+ */
+void db_itag_add(int user_id, int tag_id);
+void db_itag_remove(int user_id, int tag_id);
+
+bool db_itag_user_has_tag(int user_id, int tag_id);
+
+/*
+ * Number of tags both users share (AND + popcount of their tag bitsets).
+ */
+int db_itag_common_tags(int user_a, int user_b);
+
+/*
+ * Users having tag_id. Borrowed pointer, NULL if nobody has it.
+ */
+const ft_bitmap_t* db_itag_users_for_tag(int tag_id);
+
+/*
+ * Users having every tag in with_tags and none of without_tags.
+ * n_with must be > 0. Returns a new bitmap (ft_bitmap_free) or NULL.
+ */
+ft_bitmap_t* db_itag_filter(const int* with_tags, size_t n_with,
+                            const int* without_tags, size_t n_without);
+
+#endif /* DB_INDEX_TAG_H */
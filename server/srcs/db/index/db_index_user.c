@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "db_index_user.h"
+#include "../../../inc/ft_malloc.h"
+#include "../../../third_party/uthash-master/src/uthash.h"
+
+#define EARTH_RADIUS_KM 6371.0
+
+typedef struct
+{
+    user_profile_t profile;
+    UT_hash_handle hh;
+} user_entry_t;
+
+static user_entry_t* m_users = NULL;
+
+static user_gender_t m_parse_gender(const char* s)
+{
+    if (!s || !*s) return GENDER_UNKNOWN;
+    if (strcmp(s, "male") == 0) return GENDER_MALE;
+    if (strcmp(s, "female") == 0) return GENDER_FEMALE;
+    return GENDER_OTHER;
+}
+
+static user_orientation_t m_parse_orientation(const char* s)
+{
+    if (!s) return ORIENTATION_BISEXUAL;
+    if (strcmp(s, "heterosexual") == 0) return ORIENTATION_HETEROSEXUAL;
+    if (strcmp(s, "homosexual") == 0) return ORIENTATION_HOMOSEXUAL;
+    return ORIENTATION_BISEXUAL;
+}
+
+static user_entry_t* m_entry(int user_id, bool create)
+{
+    user_entry_t* entry;
+
+    HASH_FIND_INT(m_users, &user_id, entry);
+    if (!entry && create)
+    {
+        entry = calloc(1, sizeof(*entry));
+        ft_assert(entry != NULL, "calloc failed");
+        entry->profile.id = user_id;
+        HASH_ADD_INT(m_users, profile.id, entry);
+    }
+    return entry;
+}
+
+void db_iuser_upsert(const user_t* u)
+{
+    user_profile_t* p;
+
+    if (!u) return;
+
+    p = &m_entry(u->id, true)->profile;
+    p->fame_rating = u->fame_rating;
+    p->gps_lat = u->gps_lat;
+    p->gps_lon = u->gps_lon;
+    p->has_location = !u->location_optout && USER_HAS_GPS(u);
+    if (u->gender)
+        p->gender = m_parse_gender(u->gender);
+    if (u->orientation)
+        p->orientation = m_parse_orientation(u->orientation);
+}
+
+void db_iuser_put(const user_profile_t* profile)
+{
+    m_entry(profile->id, true)->profile = *profile;
+}
+
+void db_iuser_remove(int user_id)
+{
+    user_entry_t* entry;
+
+    entry = m_entry(user_id, false);
+    if (!entry) return;
+
+    HASH_DEL(m_users, entry);
+    free(entry);
+}
+
+void db_iuser_set_fame(int user_id, int fame_rating)
+{
+    user_entry_t* entry;
+
+    entry = m_entry(user_id, false);
+    if (entry)
+        entry->profile.fame_rating = fame_rating;
+}
+
+const user_profile_t* db_iuser_get(int user_id)
+{
+    user_entry_t* entry;
+
+    entry = m_entry(user_id, false);
+    return entry ? &entry->profile : NULL;
+}
+
+size_t db_iuser_count(void)
+{
+    return HASH_COUNT(m_users);
+}
+
+void db_iuser_foreach(db_iuser_cb_t cb, void* user_data)
+{
+    user_entry_t* entry;
+    user_entry_t* tmp;
+
+    HASH_ITER(hh, m_users, entry, tmp)
+    {
+        cb(&entry->profile, user_data);
+    }
+}
+
+static bool m_interested_in(const user_profile_t* who, user_gender_t gender)
+{
+    if (who->orientation == ORIENTATION_BISEXUAL
+        || who->gender == GENDER_UNKNOWN || gender == GENDER_UNKNOWN)
+        return true;
+    if (who->orientation == ORIENTATION_HETEROSEXUAL)
+        return who->gender != gender;
+    return who->gender == gender;
+}
+
+bool db_iuser_compatible(const user_profile_t* a, const user_profile_t* b)
+{
+    return m_interested_in(a, b->gender) && m_interested_in(b, a->gender);
+}
+
+double db_iuser_distance_km(const user_profile_t* a, const user_profile_t* b)
+{
+    double dlat;
+    double dlon;
+    double h;
+
+    if (!a->has_location || !b->has_location)
+        return -1.0;
+
+    dlat = (b->gps_lat - a->gps_lat) * M_PI / 180.0;
+    dlon = (b->gps_lon - a->gps_lon) * M_PI / 180.0;
+    h = sin(dlat / 2) * sin(dlat / 2)
+        + cos(a->gps_lat * M_PI / 180.0) * cos(b->gps_lat * M_PI / 180.0)
+        * sin(dlon / 2) * sin(dlon / 2);
+    return 2.0 * EARTH_RADIUS_KM * atan2(sqrt(h), sqrt(1.0 - h));
+}
+
+void db_iuser_clear(void)
+{
+    user_entry_t* entry;
+    user_entry_t* tmp;
+
+    HASH_ITER(hh, m_users, entry, tmp)
+    {
+        HASH_DEL(m_users, entry);
+        free(entry);
+    }
+}
+
+#define USER_PROFILE_COLUMNS \
+    "SELECT id, gender, orientation, fame_rating, gps_lat, gps_lon, " \
+    "COALESCE(location_optout, FALSE) FROM users"
+
+static void m_apply_rows(PGresult* res)
+{
+    user_profile_t* p;
+    int n;
+    int i;
+
+    n = PQntuples(res);
+    for (i = 0; i < n; i++)
+    {
+        p = &m_entry(atoi(PQgetvalue(res, i, 0)), true)->profile;
+        p->gender = PQgetisnull(res, i, 1) ? GENDER_UNKNOWN : m_parse_gender(PQgetvalue(res, i, 1));
+        p->orientation = m_parse_orientation(PQgetisnull(res, i, 2) ? NULL : PQgetvalue(res, i, 2));
+        p->fame_rating = atoi(PQgetvalue(res, i, 3));
+        p->gps_lat = atof(PQgetvalue(res, i, 4));
+        p->gps_lon = atof(PQgetvalue(res, i, 5));
+        p->has_location = !PQgetisnull(res, i, 4) && !PQgetisnull(res, i, 5)
+                          && USER_HAS_GPS(p)
+                          && strcmp(PQgetvalue(res, i, 6), "t") != 0;
+    }
+}
+
+int db_iuser_load(DB_ID DB)
+{
+    PGresult* res;
+
+    res = db_query(DB, USER_PROFILE_COLUMNS ";", 0, NULL);
+    if (!res) return ERROR;
+
+    db_iuser_clear();
+    m_apply_rows(res);
+
+    PQclear(res);
+    return SUCCESS;
+}
+
+int db_iuser_load_since(DB_ID DB, const char* since)
+{
+    PGresult* res;
+    const char* params[1] = { since };
+
+    res = db_query(DB, USER_PROFILE_COLUMNS " WHERE updated_at > to_timestamp($1);", 1, params);
+    if (!res) return ERROR;
+
+    m_apply_rows(res);
+
+    PQclear(res);
+    return SUCCESS;
+}
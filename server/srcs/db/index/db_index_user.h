@@ -0,0 +1,84 @@
+#ifndef DB_INDEX_USER_H
+#define DB_INDEX_USER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "../db_api.h"
+#include "../tables/db_table_user.h"
+#include "../../../inc/error_codes.h"
+
+typedef enum
+{
+    GENDER_UNKNOWN = 0,
+    GENDER_MALE,
+    GENDER_FEMALE,
+    GENDER_OTHER
+} user_gender_t;
+
+typedef enum
+{
+    ORIENTATION_BISEXUAL = 0,
+    ORIENTATION_HETEROSEXUAL,
+    ORIENTATION_HOMOSEXUAL
+} user_orientation_t;
+
+/*
+ * The part of a users row needed to rank suggestions.
+ */
+typedef struct
+{
+    int id;
+    int fame_rating;
+    double gps_lat;
+    double gps_lon;
+    bool has_location; /* coordinates set and location_optout false */
+    user_gender_t gender;
+    user_orientation_t orientation;
+} user_profile_t;
+
+typedef void (*db_iuser_cb_t)(const user_profile_t* profile, void* user_data);
+
+/*
+ * Load the profile of every user. Any previous content is dropped.
+ */
+int db_iuser_load(DB_ID DB);
+
+/*
+ * Warm start (db_index_snapshot.h): apply only the rows written after
+ * since, epoch seconds as text. Nothing is dropped.
+ */
+int db_iuser_load_since(DB_ID DB, const char* since);
+
+void db_iuser_clear(void);
+
+/* inserts or replaces the whole profile */
+void db_iuser_put(const user_profile_t* profile);
+
+/*
+ * Maintenance hooks, called after the matching row is written. Only the
+ * non-NULL string fields of u overwrite the cached profile, mirroring
+ * db_gen_update_by_pk().
+ */
+void db_iuser_upsert(const user_t* u);
+void db_iuser_remove(int user_id);
+void db_iuser_set_fame(int user_id, int fame_rating);
+
+/*
+ * Borrowed pointer, NULL if the user is unknown.
+ */
+const user_profile_t* db_iuser_get(int user_id);
+
+size_t db_iuser_count(void);
+void db_iuser_foreach(db_iuser_cb_t cb, void* user_data);
+
+/*
+ * true if a is interested in b's gender and b in a's.
+ */
+bool db_iuser_compatible(const user_profile_t* a, const user_profile_t* b);
+
+/*
+ * Great-circle distance in km, negative if either has no location.
+ */
+double db_iuser_distance_km(const user_profile_t* a, const user_profile_t* b);
+
+#endif /* DB_INDEX_USER_H */
@@ -0,0 +1,163 @@
+#include "db_table_counter.h"
+#include "../db_schema.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../../inc/ft_malloc.h"
+#include "../../../third_party/uthash-master/src/uthash.h"
+
+/* Column schema for unread_counters */
+static const columnDef_t m_counters_cols[] =
+{
+    { .name="user_id",       .type="INTEGER", .is_primary=true,  .is_unique=false, .not_null=true, .default_val=NULL },
+    { .name="messages",      .type="INTEGER", .is_primary=false, .is_unique=false, .not_null=true, .default_val="0" },
+    { .name="notifications", .type="INTEGER", .is_primary=false, .is_unique=false, .not_null=true, .default_val="0" }
+};
+static const int m_n_counters_cols = sizeof(m_counters_cols)/sizeof(*m_counters_cols);
+static const tableSchema_t m_counters_schema =
+{
+    .name    = "unread_counters",
+    .n_cols  = m_n_counters_cols,
+    .columns = m_counters_cols
+};
+
+typedef struct
+{
+    int user_id;
+    unread_counters_t counters;
+    UT_hash_handle hh;
+} counter_entry_t;
+
+static counter_entry_t* m_counters = NULL;
+
+static counter_entry_t* m_entry(int user_id, bool create)
+{
+    counter_entry_t* e;
+
+    HASH_FIND_INT(m_counters, &user_id, e);
+    if (!e && create)
+    {
+        e = calloc(1, sizeof(*e));
+        ft_assert(e != NULL, "calloc failed");
+        e->user_id = user_id;
+        HASH_ADD_INT(m_counters, user_id, e);
+    }
+    return e;
+}
+
+unread_counters_t db_tcounter_get(int user_id)
+{
+    counter_entry_t* e;
+    unread_counters_t zero = {0, 0};
+
+    e = m_entry(user_id, false);
+    return e ? e->counters : zero;
+}
+
+int db_tcounter_fetch(DB_ID DB, int user_id, unread_counters_t* out)
+{
+    PGresult* res;
+    counter_entry_t* e;
+    char ubuf[16];
+
+    if (!out) return INVALID_ARGS;
+
+    snprintf(ubuf, sizeof(ubuf), "%d", user_id);
+    const char *params[1] = { ubuf };
+
+    const char *sql =
+      "SELECT messages, notifications FROM unread_counters WHERE user_id = $1;";
+    res = db_query(DB, sql, 1, params);
+    if (!res) return ERROR;
+
+    out->messages = 0;
+    out->notifications = 0;
+    if (PQntuples(res) == 1)
+    {
+        out->messages      = atoi(PQgetvalue(res, 0, 0));
+        out->notifications = atoi(PQgetvalue(res, 0, 1));
+    }
+    PQclear(res);
+
+    e = m_entry(user_id, out->messages || out->notifications);
+    if (e)
+        e->counters = *out;
+    return SUCCESS;
+}
+
+void db_tcounter_add_messages(int user_id, int delta)
+{
+    counter_entry_t* e;
+
+    e = m_entry(user_id, true);
+    e->counters.messages += delta;
+    if (e->counters.messages < 0)
+        e->counters.messages = 0;
+}
+
+void db_tcounter_add_notifications(int user_id, int delta)
+{
+    counter_entry_t* e;
+
+    e = m_entry(user_id, true);
+    e->counters.notifications += delta;
+    if (e->counters.notifications < 0)
+        e->counters.notifications = 0;
+}
+
+void db_tcounter_clear(void)
+{
+    counter_entry_t* e;
+    counter_entry_t* tmp;
+
+    HASH_ITER(hh, m_counters, e, tmp)
+    {
+        HASH_DEL(m_counters, e);
+        free(e);
+    }
+}
+
+int db_tcounter_init(void)
+{
+    return db_schema_table(&m_counters_schema);
+}
+
+int db_tcounter_load(DB_ID DB)
+{
+    PGresult* res;
+    counter_entry_t* e;
+    int n;
+    int i;
+
+    /* first start on an existing database: count once, then stay incremental */
+    const char *seed_sql =
+      "INSERT INTO unread_counters (user_id, messages, notifications) "
+      "SELECT user_id, SUM(m), SUM(n) FROM ("
+      "  SELECT recipient_id AS user_id, 1 AS m, 0 AS n FROM messages WHERE is_read IS NOT TRUE "
+      "  UNION ALL "
+      "  SELECT user_id, 0, 1 FROM notifications WHERE is_read IS NOT TRUE"
+      ") s "
+      "WHERE NOT EXISTS (SELECT 1 FROM unread_counters) "
+      "GROUP BY user_id;";
+    if (db_execute(DB, seed_sql, 0, NULL) != SUCCESS)
+        return ERROR;
+
+    const char *sql =
+      "SELECT user_id, messages, notifications FROM unread_counters "
+      "WHERE messages > 0 OR notifications > 0;";
+    res = db_query(DB, sql, 0, NULL);
+    if (!res) return ERROR;
+
+    db_tcounter_clear();
+
+    n = PQntuples(res);
+    for (i = 0; i < n; i++)
+    {
+        e = m_entry(atoi(PQgetvalue(res, i, 0)), true);
+        e->counters.messages      = atoi(PQgetvalue(res, i, 1));
+        e->counters.notifications = atoi(PQgetvalue(res, i, 2));
+    }
+
+    PQclear(res);
+    return SUCCESS;
+}
@@ -0,0 +1,57 @@
+#ifndef DB_TABLE_COUNTER_H
+#define DB_TABLE_COUNTER_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <libpq-fe.h>
+#include "../db_gen.h"
+#include "../db_api.h"
+#include "../../../inc/error_codes.h"
+
+/*
+ * Unread badge counts of one user.
+ *
+ * The unread_counters table is kept in sync by the message and
+ * notification statements themselves (same statement, same transaction),
+ * this module only owns the table and its in-memory copy.
+ */
+typedef struct
+{
+    int messages;
+    int notifications;
+} unread_counters_t;
+
+/*
+ * Register the unread_counters table with db_schema.
+ */
+int db_tcounter_init(void);
+
+/*
+ * Load the counters in memory, after db_schema_apply(). An empty table
+ * is seeded from the unread messages and notifications.
+ */
+int db_tcounter_load(DB_ID DB);
+
+/*
+ * Current unread counts of a user, zeroes if it has none.
+ */
+unread_counters_t db_tcounter_get(int user_id);
+
+/*
+ * Same, read from the table and stored in the in-memory copy. For
+ * clustered nodes, whose copy misses the writes done by the others.
+ */
+int db_tcounter_fetch(DB_ID DB, int user_id, unread_counters_t* out);
+
+/*
+ * Apply a change already committed to the table to the in-memory copy.
+ */
+void db_tcounter_add_messages(int user_id, int delta);
+void db_tcounter_add_notifications(int user_id, int delta);
+
+/*
+ * Drop the in-memory copy
+ */
+void db_tcounter_clear(void);
+
+#endif /* DB_TABLE_COUNTER_H */
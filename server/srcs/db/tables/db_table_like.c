@@ -1,39 +1,41 @@
 #include "db_table_like.h"
+#include "../db_schema.h"
+#include "../index/db_index_like.h"
+#include "../db_events.h"
+#include "../db_table_gen.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "../../../inc/ft_slab.h"
 
 /* Column schema for likes */
-static const columnDef_t m_likes_cols[] =
-{
-    { .name="id",        .type="SERIAL",            .is_primary=true,  .is_unique=false, .not_null=true,  .default_val=NULL },
-    { .name="liker_id",  .type="INTEGER",           .is_primary=false, .is_unique=false, .not_null=true,  .default_val=NULL },
-    { .name="liked_id",  .type="INTEGER",           .is_primary=false, .is_unique=false, .not_null=true,  .default_val=NULL },
-    { .name="liked_at",  .type="TIMESTAMP NOT NULL",.is_primary=false, .is_unique=false, .not_null=true,  .default_val="NOW()" }
-};
-static const int m_n_likes_cols = sizeof(m_likes_cols)/sizeof(*m_likes_cols);
-static const tableSchema_t m_likes_schema =
-{
-    .name    = "likes",
-    .n_cols  = m_n_likes_cols,
-    .columns = m_likes_cols
-};
+#define LIKE_COLUMNS(X, T) \
+    X(T, id,       INT,  "SERIAL",               DB_COL_PK | DB_COL_NOT_NULL | DB_COL_AUTO, NULL)    \
+    X(T, liker_id, INT,  "INTEGER",              DB_COL_NOT_NULL,                           NULL)    \
+    X(T, liked_id, INT,  "INTEGER",              DB_COL_NOT_NULL,                           NULL)    \
+    X(T, liked_at, TIME, "TIMESTAMPTZ NOT NULL", DB_COL_NOT_NULL | DB_COL_AUTO,             "NOW()")
+
+DB_TABLE_DEFINE(like, "likes", like_t, LIKE_COLUMNS)
+
+static ft_slab_cache_t *m_like_cache = NULL;
 
 static like_t *make_like_from_row(PGresult *res, int row)
 {
     like_t *l;
     
-    l = calloc(1, sizeof(*l));
-    l->id        = atoi(PQgetvalue(res, row, 0));
-    l->liker_id  = atoi(PQgetvalue(res, row, 1));
-    l->liked_id  = atoi(PQgetvalue(res, row, 2));
-    l->liked_at  = db_gen_parse_timestamp(PQgetvalue(res, row, 3));
+    l = FT_SLAB_NEW(m_like_cache, like_t);
+    m_like_decode(res, row, l);
     return l;
 }
 
-int db_tlike_init(DB_ID DB)
+int db_tlike_init(void)
 {
-    if (db_gen_create_table(DB, &m_likes_schema) != 0)
+    if (!m_like_cache)
+        m_like_cache = FT_SLAB_CACHE(like_t);
+
+    if (db_table_prepare(&m_like_table) != SUCCESS)
+        return ERROR;
+    if (db_schema_table(&m_like_schema) != 0)
     {
         return ERROR;
     }
@@ -43,26 +45,23 @@ int db_tlike_init(DB_ID DB)
       "  ALTER TABLE likes "
       "ADD CONSTRAINT likes_unique_liker_liked UNIQUE(liker_id, liked_id);\n"
       "EXCEPTION WHEN duplicate_object THEN NULL; END $$;";
-    db_execute(DB, do_block, 0, NULL);
+    if (db_schema_ddl(do_block) != SUCCESS)
+        return ERROR;
 
     return SUCCESS;
 }
 
 int db_tlike_insert(DB_ID DB, int liker_id, int liked_id)
 {
-    char lbuf[16];
-    char dbuf[16];
+    like_t l = { .liker_id = liker_id, .liked_id = liked_id };
     int rc;
 
-    snprintf(lbuf, sizeof(lbuf), "%d", liker_id);
-    snprintf(dbuf, sizeof(dbuf), "%d", liked_id);
-
-    rc = db_gen_insert(DB, &m_likes_schema,
-        /* id       */ NULL,
-        /* liker_id */ lbuf,
-        /* liked_id */ dbuf,
-        /* liked_at */ NULL
-    );
+    rc = m_like_insert(DB, &l);
+    if (rc == SUCCESS)
+    {
+        db_ilike_add(liker_id, liked_id);
+        db_events_emit(DB_EVENT_LIKE_ADDED, liker_id, liked_id);
+    }
     return rc;
 }
 
@@ -74,7 +73,7 @@ like_t_array *db_tlike_select_all(DB_ID DB)
     like_t_array *arr;
     like_t **ls;
     
-    res = db_gen_select_all_from(DB, &m_likes_schema);
+    res = db_table_select_all(DB, &m_like_table);
     if (!res) return NULL;
     n = PQntuples(res);
     if (n < 0) { PQclear(res); return NULL; }
@@ -104,11 +103,10 @@ like_t_array *db_tlike_select_by_liker(DB_ID DB, int liker_id)
     snprintf(lbuf, sizeof(lbuf), "%d", liker_id);
     const char *params[1] = { lbuf };
 
-    const char *sql =
-      "SELECT id,liker_id,liked_id,liked_at "
-      "FROM likes WHERE liker_id = $1 ORDER BY liked_at DESC;";
+    const char *where =
+      "WHERE liker_id = $1 ORDER BY liked_at DESC;";
 
-    res = db_query(DB, sql, 1, params);
+    res = db_table_select_where(DB, &m_like_table, where, 1, params);
     if (!res) return NULL;
     n = PQntuples(res);
     arr = malloc(sizeof(*arr));
@@ -135,11 +133,10 @@ like_t_array *db_tlike_select_by_liked(DB_ID DB, int liked_id)
     snprintf(dbuf, sizeof(dbuf), "%d", liked_id);
     const char *params[1] = { dbuf };
 
-    const char *sql =
-      "SELECT id,liker_id,liked_id,liked_at "
-      "FROM likes WHERE liked_id = $1 ORDER BY liked_at DESC;";
+    const char *where =
+      "WHERE liked_id = $1 ORDER BY liked_at DESC;";
 
-    res = db_query(DB, sql, 1, params);
+    res = db_table_select_where(DB, &m_like_table, where, 1, params);
     if (!res) return NULL;
     n = PQntuples(res);
     arr = malloc(sizeof(*arr));
@@ -156,12 +153,30 @@ like_t_array *db_tlike_select_by_liked(DB_ID DB, int liked_id)
 
 int db_tlike_delete_by_pk(DB_ID DB, int id)
 {
-    int rc;
+    PGresult* res;
+    int liker_id;
+    int liked_id;
     char ibuf[16];
     
     snprintf(ibuf, sizeof(ibuf), "%d", id);
-    rc = db_gen_delete_by_pk(DB, &m_likes_schema, ibuf);
-    return (rc == 0 ? SUCCESS : ERROR);
+    const char *params[1] = { ibuf };
+
+    /* RETURNING gives us the edge to drop from the like graph */
+    const char *sql =
+      "DELETE FROM likes WHERE id = $1 RETURNING liker_id, liked_id;";
+
+    res = db_query(DB, sql, 1, params);
+    if (!res) return ERROR;
+    if (PQntuples(res) == 1)
+    {
+        liker_id = atoi(PQgetvalue(res, 0, 0));
+        liked_id = atoi(PQgetvalue(res, 0, 1));
+        db_ilike_remove(liker_id, liked_id);
+        db_events_emit(DB_EVENT_LIKE_REMOVED, liker_id, liked_id);
+    }
+
+    PQclear(res);
+    return SUCCESS;
 }
 
 int db_tlike_free_array(like_t_array *arr)
@@ -171,7 +186,7 @@ int db_tlike_free_array(like_t_array *arr)
     if (!arr) return ERROR;
     for (i = 0; i < arr->count; i++)
     {
-        free(arr->likes[i]);
+        ft_slab_free(arr->likes[i]);
     }
     free(arr->likes);
     PQclear(arr->pg_result);
@@ -30,9 +30,9 @@ typedef struct
 } like_t_array;
 
 /*
- * Initialize the likes table (and its UNIQUE constraint)
+ * Register the likes table (and its UNIQUE constraint) with db_schema
  */
-int db_tlike_init(DB_ID DB);
+int db_tlike_init(void);
 
 /*
  * Insert a new like (liker → liked), liked_at defaults to NOW()
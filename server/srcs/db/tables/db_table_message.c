@@ -1,24 +1,22 @@
 #include "db_table_message.h"
+#include "../db_schema.h"
+#include "../db_table_gen.h"
+#include "../index/db_index_conversation.h"
+#include "db_table_counter.h"
+#include "../db_events.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-static const columnDef_t m_messages_cols[] =
-{
-    { .name="id",           .type="SERIAL",            .is_primary=true,  .is_unique=false, .not_null=true,  .default_val=NULL },
-    { .name="sender_id",    .type="INTEGER",           .is_primary=false, .is_unique=false, .not_null=true,  .default_val=NULL },
-    { .name="recipient_id", .type="INTEGER",           .is_primary=false, .is_unique=false, .not_null=true,  .default_val=NULL },
-    { .name="content",      .type="TEXT",              .is_primary=false, .is_unique=false, .not_null=true,  .default_val=NULL },
-    { .name="sent_at",      .type="TIMESTAMP NOT NULL",.is_primary=false, .is_unique=false, .not_null=true,  .default_val="NOW()" },
-    { .name="is_read",      .type="BOOLEAN",           .is_primary=false, .is_unique=false, .not_null=false, .default_val="FALSE" }
-};
-static const int m_n_messages_cols = sizeof(m_messages_cols)/sizeof(*m_messages_cols);
-static const tableSchema_t m_messages_schema =
-{
-    .name    = "messages",
-    .n_cols  = m_n_messages_cols,
-    .columns = m_messages_cols
-};
+#define MESSAGE_COLUMNS(X, T) \
+    X(T, id,           INT,  "SERIAL",               DB_COL_PK | DB_COL_NOT_NULL | DB_COL_AUTO, NULL)    \
+    X(T, sender_id,    INT,  "INTEGER",              DB_COL_NOT_NULL,                           NULL)    \
+    X(T, recipient_id, INT,  "INTEGER",              DB_COL_NOT_NULL,                           NULL)    \
+    X(T, content,      TEXT, "TEXT",                 DB_COL_NOT_NULL,                           NULL)    \
+    X(T, sent_at,      TIME, "TIMESTAMPTZ NOT NULL", DB_COL_NOT_NULL | DB_COL_AUTO,             "NOW()") \
+    X(T, is_read,      BOOL, "BOOLEAN",              DB_COL_AUTO,                               "FALSE")
+
+DB_TABLE_DEFINE(message, "messages", message_t, MESSAGE_COLUMNS)
 
 /* Helper: build a message_t from a PGresult row */
 static message_t *make_message_from_row(PGresult *res, int row)
@@ -26,18 +24,30 @@ static message_t *make_message_from_row(PGresult *res, int row)
     message_t *m;
     
     m = calloc(1, sizeof(*m));
-    m->id           = atoi(PQgetvalue(res, row, 0));
-    m->sender_id    = atoi(PQgetvalue(res, row, 1));
-    m->recipient_id = atoi(PQgetvalue(res, row, 2));
-    m->content      = strdup(PQgetvalue(res, row, 3));
-    m->sent_at      = db_gen_parse_timestamp(PQgetvalue(res, row, 4));
-    m->is_read      = (strcmp(PQgetvalue(res, row, 5), "t") == 0);
+    m_message_decode(res, row, m);
     return m;
 }
 
-int db_tmessage_init(DB_ID DB)
+int db_tmessage_init(void)
 {
-    if (db_gen_create_table(DB, &m_messages_schema) != 0)
+    if (db_table_prepare(&m_message_table) != SUCCESS)
+        return ERROR;
+    if (db_schema_table(&m_message_schema) != 0)
+        return ERROR;
+
+    /* one entry per conversation, newest first: backs the keyset pages */
+    const char *conversation_idx =
+      "CREATE INDEX IF NOT EXISTS messages_conversation_idx ON messages "
+      "(LEAST(sender_id, recipient_id), GREATEST(sender_id, recipient_id), "
+      "sent_at DESC, id DESC);";
+    if (db_schema_ddl(conversation_idx) != SUCCESS)
+        return ERROR;
+
+    /* keeps "mark read up to" and the counter seed off the read rows */
+    const char *unread_idx =
+      "CREATE INDEX IF NOT EXISTS messages_unread_idx ON messages "
+      "(recipient_id, id) WHERE is_read IS NOT TRUE;";
+    if (db_schema_ddl(unread_idx) != SUCCESS)
         return ERROR;
 
     return SUCCESS;
@@ -49,7 +59,8 @@ int db_tmessage_insert(DB_ID DB,
                        const char *content,
                        bool        is_read)
 {
-    int rc;
+    PGresult* res;
+    message_t msg;
     char sbuf[16];
     char rbuf[16];
     char readbuf[8];
@@ -59,15 +70,38 @@ int db_tmessage_insert(DB_ID DB,
     snprintf(rbuf,   sizeof(rbuf),   "%d", recipient_id);
     snprintf(readbuf,sizeof(readbuf),"%s", is_read ? "TRUE":"FALSE");
 
-    rc = db_gen_insert(DB, &m_messages_schema,
-        /* id           */ NULL,
-        /* sender_id    */ sbuf,
-        /* recipient_id */ rbuf,
-        /* content      */ content,
-        /* sent_at      */ NULL,       /* DEFAULT NOW() */
-        /* is_read      */ readbuf
-    );
-    return rc;
+    const char *params[4] = { sbuf, rbuf, content, readbuf };
+
+    /* RETURNING gives us the row to append to the conversation cache */
+    const char *sql =
+      "WITH m AS ("
+      "  INSERT INTO messages (sender_id, recipient_id, content, is_read) "
+      "  VALUES ($1, $2, $3, $4) RETURNING id, sent_at, recipient_id, is_read"
+      "), c AS ("
+      "  INSERT INTO unread_counters (user_id, messages) "
+      "  SELECT recipient_id, 1 FROM m WHERE is_read IS NOT TRUE "
+      "  ON CONFLICT (user_id) DO UPDATE SET messages = unread_counters.messages + 1"
+      ") SELECT id, sent_at FROM m;";
+
+    res = db_query(DB, sql, 4, params);
+    if (!res) return ERROR;
+
+    if (PQntuples(res) == 1)
+    {
+        msg.id           = atoi(PQgetvalue(res, 0, 0));
+        msg.sender_id    = sender_id;
+        msg.recipient_id = recipient_id;
+        msg.content      = (char*)content;
+        msg.sent_at      = db_gen_parse_timestamp(PQgetvalue(res, 0, 1));
+        msg.is_read      = is_read;
+        db_iconv_append(&msg);
+        if (!is_read)
+            db_tcounter_add_messages(recipient_id, 1);
+        db_events_emit_data(DB_EVENT_MESSAGE_ADDED, sender_id, recipient_id, &msg);
+    }
+
+    PQclear(res);
+    return SUCCESS;
 }
 
 message_t_array *db_tmessage_select_all(DB_ID DB) 
@@ -78,7 +112,7 @@ message_t_array *db_tmessage_select_all(DB_ID DB)
     int n;
     int i;
     
-    res = db_gen_select_all_from(DB, &m_messages_schema);
+    res = db_table_select_all(DB, &m_message_table);
     if (!res) return NULL;
     n = PQntuples(res);
     if (n < 0) { PQclear(res); return NULL; }
@@ -107,11 +141,10 @@ message_t_array *db_tmessage_select_by_sender(DB_ID DB, int sender_id)
     snprintf(sbuf, sizeof(sbuf), "%d", sender_id);
     const char *params[1] = { sbuf };
 
-    const char *sql =
-      "SELECT id,sender_id,recipient_id,content,sent_at,is_read "
-      "FROM messages WHERE sender_id = $1 ORDER BY sent_at DESC;";
+    const char *where =
+      "WHERE sender_id = $1 ORDER BY sent_at DESC;";
 
-    res = db_query(DB, sql, 1, params);
+    res = db_table_select_where(DB, &m_message_table, where, 1, params);
     if (!res) return NULL;
     n = PQntuples(res);
     arr = malloc(sizeof(*arr));
@@ -138,11 +171,10 @@ message_t_array *db_tmessage_select_by_recipient(DB_ID DB, int recipient_id)
     snprintf(rbuf, sizeof(rbuf), "%d", recipient_id);
     const char *params[1] = { rbuf };
 
-    const char *sql =
-      "SELECT id,sender_id,recipient_id,content,sent_at,is_read "
-      "FROM messages WHERE recipient_id = $1 ORDER BY sent_at DESC;";
+    const char *where =
+      "WHERE recipient_id = $1 ORDER BY sent_at DESC;";
 
-    res = db_query(DB, sql, 1, params);
+    res = db_table_select_where(DB, &m_message_table, where, 1, params);
     if (!res) return NULL;
     n = PQntuples(res);
     arr = malloc(sizeof(*arr));
@@ -157,32 +189,197 @@ message_t_array *db_tmessage_select_by_recipient(DB_ID DB, int recipient_id)
     return arr;
 }
 
+message_t_array *db_tmessage_select_conversation(DB_ID DB, int user_a, int user_b,
+                                                  int before_id, int limit)
+{
+    PGresult* res;
+    message_t_array* arr;
+    message_t** ms;
+    int fetch;
+    int n;
+    int i;
+    char lobuf[16];
+    char hibuf[16];
+    char beforebuf[16];
+    char limitbuf[16];
+
+    if (limit <= 0) return NULL;
+
+    if (db_iconv_page(user_a, user_b, before_id, limit, &arr))
+        return arr;
+
+    /* a first page also warms the cache with a full ring */
+    fetch = limit;
+    if (before_id == 0 && fetch < DB_ICONV_RING_SIZE)
+        fetch = DB_ICONV_RING_SIZE;
+
+    snprintf(lobuf,     sizeof(lobuf),     "%d", user_a < user_b ? user_a : user_b);
+    snprintf(hibuf,     sizeof(hibuf),     "%d", user_a < user_b ? user_b : user_a);
+    snprintf(beforebuf, sizeof(beforebuf), "%d", before_id);
+    snprintf(limitbuf,  sizeof(limitbuf),  "%d", fetch);
+
+    const char *first_where =
+      "WHERE LEAST(sender_id, recipient_id) = $1 "
+      "AND GREATEST(sender_id, recipient_id) = $2 "
+      "ORDER BY sent_at DESC, id DESC LIMIT $3;";
+
+    /*
+     * The anchor may have been deleted since the previous page: its time
+     * is then taken from the closest older id of the conversation, ids
+     * follow sent_at, so scrolling resumes right after it.
+     */
+    const char *next_where =
+      "WHERE LEAST(sender_id, recipient_id) = $1 "
+      "AND GREATEST(sender_id, recipient_id) = $2 "
+      "AND (sent_at, id) < (COALESCE("
+      "(SELECT sent_at FROM messages WHERE id = $3), "
+      "(SELECT sent_at FROM messages "
+      "WHERE LEAST(sender_id, recipient_id) = $1 "
+      "AND GREATEST(sender_id, recipient_id) = $2 "
+      "AND id < $3 ORDER BY id DESC LIMIT 1)), $3::integer) "
+      "ORDER BY sent_at DESC, id DESC LIMIT $4;";
+
+    if (before_id == 0)
+        res = db_table_select_where(DB, &m_message_table, first_where, 3, (const char*[]){ lobuf, hibuf, limitbuf });
+    else
+        res = db_table_select_where(DB, &m_message_table, next_where, 4, (const char*[]){ lobuf, hibuf, beforebuf, limitbuf });
+    if (!res) return NULL;
+
+    n = PQntuples(res);
+    arr = malloc(sizeof(*arr));
+    ms = malloc((n ? n : 1) * sizeof(message_t*));
+    arr->messages  = ms;
+    arr->count     = n;
+    arr->pg_result = res;
+    for (i = 0; i < n; i++)
+    {
+        ms[i] = make_message_from_row(res, i);
+    }
+
+    if (before_id == 0)
+        db_iconv_fill(user_a, user_b, ms, n, n < fetch);
+
+    for (i = limit; i < n; i++)
+    {
+        free(ms[i]->content);
+        free(ms[i]);
+    }
+    if (n > limit)
+        arr->count = limit;
+
+    return arr;
+}
+
 int db_tmessage_update_read_status(DB_ID DB, int message_id, bool is_read)
 {
+    PGresult* res;
+    int recipient_id;
     char idbuf[16], readbuf[8];
     snprintf(idbuf,   sizeof(idbuf),   "%d", message_id);
     snprintf(readbuf, sizeof(readbuf), "%s", is_read ? "TRUE" : "FALSE");
 
-    int rc = db_gen_update_by_pk(DB, &m_messages_schema,
-        /* pk_value */ idbuf,
-        /* sender_id    */ NULL,
-        /* recipient_id */ NULL,
-        /* content      */ NULL,
-        /* sent_at      */ NULL,
-        /* is_read      */ readbuf
-    );
-    return rc;
+    /* the counter only moves when the flag actually flips */
+    const char *sql =
+      "WITH old AS ("
+      "  SELECT id, is_read IS TRUE AS was_read FROM messages WHERE id = $1 FOR UPDATE"
+      "), u AS ("
+      "  UPDATE messages m SET is_read = $2 FROM old WHERE m.id = old.id "
+      "  RETURNING m.sender_id, m.recipient_id, old.was_read"
+      "), c AS ("
+      "  INSERT INTO unread_counters (user_id, messages) "
+      "  SELECT recipient_id, CASE WHEN $2 THEN 0 ELSE 1 END FROM u WHERE was_read <> $2 "
+      "  ON CONFLICT (user_id) DO UPDATE SET messages = "
+      "  GREATEST(unread_counters.messages + CASE WHEN $2 THEN -1 ELSE 1 END, 0)"
+      ") SELECT sender_id, recipient_id, was_read FROM u;";
+
+    res = db_query(DB, sql, 2, (const char*[]){ idbuf, readbuf });
+    if (!res) return ERROR;
+    if (PQntuples(res) == 1)
+    {
+        recipient_id = atoi(PQgetvalue(res, 0, 1));
+        db_iconv_set_read(atoi(PQgetvalue(res, 0, 0)), recipient_id, message_id, is_read);
+        if ((strcmp(PQgetvalue(res, 0, 2), "t") == 0) != is_read)
+            db_tcounter_add_messages(recipient_id, is_read ? -1 : 1);
+    }
+
+    PQclear(res);
+    return SUCCESS;
+}
+
+int db_tmessage_mark_read_up_to(DB_ID DB, int recipient_id, int sender_id, int up_to_id)
+{
+    PGresult* res;
+    int marked;
+    int n;
+    int i;
+    char rbuf[16];
+    char sbuf[16];
+    char ubuf[16];
+
+    snprintf(rbuf, sizeof(rbuf), "%d", recipient_id);
+    snprintf(sbuf, sizeof(sbuf), "%d", sender_id);
+    snprintf(ubuf, sizeof(ubuf), "%d", up_to_id);
+    const char *params[3] = { rbuf, sbuf, ubuf };
+
+    /* one set-based UPDATE, one counter write, one row back per sender */
+    const char *sql =
+      "WITH r AS ("
+      "  UPDATE messages SET is_read = TRUE "
+      "  WHERE recipient_id = $1 AND ($2 = 0 OR sender_id = $2) "
+      "  AND id <= $3 AND is_read IS NOT TRUE "
+      "  RETURNING sender_id"
+      "), c AS ("
+      "  UPDATE unread_counters SET messages = "
+      "  GREATEST(messages - (SELECT COUNT(*) FROM r), 0) WHERE user_id = $1"
+      ") SELECT sender_id, COUNT(*) FROM r GROUP BY sender_id;";
+
+    res = db_query(DB, sql, 3, params);
+    if (!res) return ERROR;
+
+    marked = 0;
+    n = PQntuples(res);
+    for (i = 0; i < n; i++)
+    {
+        db_iconv_invalidate(recipient_id, atoi(PQgetvalue(res, i, 0)));
+        marked += atoi(PQgetvalue(res, i, 1));
+    }
+    db_tcounter_add_messages(recipient_id, -marked);
+
+    PQclear(res);
+    return marked;
 }
 
 /* 7) Delete by PK */
 int db_tmessage_delete_by_pk(DB_ID DB, int id)
 {
+    PGresult* res;
+    int recipient_id;
     char ibuf[16];
-    int rc;
 
     snprintf(ibuf, sizeof(ibuf), "%d", id);
-    rc = db_gen_delete_by_pk(DB, &m_messages_schema, ibuf);
-    return rc;
+    const char *params[1] = { ibuf };
+
+    const char *sql =
+      "WITH d AS ("
+      "  DELETE FROM messages WHERE id = $1 "
+      "  RETURNING sender_id, recipient_id, is_read IS TRUE AS was_read"
+      "), c AS ("
+      "  UPDATE unread_counters SET messages = GREATEST(messages - 1, 0) "
+      "  FROM d WHERE user_id = d.recipient_id AND NOT d.was_read"
+      ") SELECT sender_id, recipient_id, was_read FROM d;";
+
+    res = db_query(DB, sql, 1, params);
+    if (!res) return ERROR;
+    if (PQntuples(res) == 1)
+    {
+        recipient_id = atoi(PQgetvalue(res, 0, 1));
+        db_iconv_invalidate(atoi(PQgetvalue(res, 0, 0)), recipient_id);
+        if (strcmp(PQgetvalue(res, 0, 2), "t") != 0)
+            db_tcounter_add_messages(recipient_id, -1);
+    }
+
+    PQclear(res);
+    return SUCCESS;
 }
 
 int db_tmessage_free_array(message_t_array *arr)
@@ -33,9 +33,9 @@ typedef struct
 } message_t_array;
 
 /*
- * Initialize the messages table
+ * Register the messages table and its indexes with db_schema
  */
-int db_tmessage_init(DB_ID DB);
+int db_tmessage_init(void);
 
 /*
  * Insert a new message.
@@ -67,11 +67,30 @@ message_t_array *db_tmessage_select_by_sender(DB_ID DB, int sender_id);
  */
 message_t_array *db_tmessage_select_by_recipient(DB_ID DB, int recipient_id);
 
+/*
+ * One page of the conversation between user_a and user_b, newest first.
+ *   - before_id : id of the last message of the previous page, 0 for the
+ *                 newest messages (keyset on (sent_at, id))
+ *   - limit     : page size
+ *
+ * Recently opened conversations are served from an in-memory ring
+ * without touching the database.
+ */
+message_t_array *db_tmessage_select_conversation(DB_ID DB, int user_a, int user_b,
+                                                  int before_id, int limit);
+
 /*
  * Mark a message as read (or unread) by its ID
  */
 int db_tmessage_update_read_status(DB_ID DB, int message_id, bool is_read);
 
+/*
+ * Mark every unread message of recipient_id with id <= up_to_id as read,
+ * only those from sender_id unless it is 0.
+ * Returns the number of messages marked, ERROR on failure.
+ */
+int db_tmessage_mark_read_up_to(DB_ID DB, int recipient_id, int sender_id, int up_to_id);
+
 /*
  * Delete a message by its primary key (id)
  */
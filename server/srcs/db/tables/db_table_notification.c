@@ -1,25 +1,22 @@
 #include "db_table_notification.h"
+#include "../db_schema.h"
+#include "../db_table_gen.h"
+#include "db_table_counter.h"
+#include "../db_events.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 /* Column schema for notifications */
-static const columnDef_t m_notifications_cols[] =
-{
-    { .name="id",          .type="SERIAL",            .is_primary=true,  .is_unique=false, .not_null=true,  .default_val=NULL },
-    { .name="user_id",     .type="INTEGER",           .is_primary=false, .is_unique=false, .not_null=true,  .default_val=NULL },
-    { .name="type",        .type="VARCHAR(32)",       .is_primary=false, .is_unique=false, .not_null=true,  .default_val=NULL },
-    { .name="related_id",  .type="INTEGER",           .is_primary=false, .is_unique=false, .not_null=false, .default_val=NULL },
-    { .name="created_at",  .type="TIMESTAMP NOT NULL",.is_primary=false, .is_unique=false, .not_null=true,  .default_val="NOW()" },
-    { .name="is_read",     .type="BOOLEAN",           .is_primary=false, .is_unique=false, .not_null=false, .default_val="FALSE" }
-};
-static const int m_n_notifications_cols = sizeof(m_notifications_cols)/sizeof(*m_notifications_cols);
-static const tableSchema_t m_notifications_schema =
-{
-    .name    = "notifications",
-    .n_cols  = m_n_notifications_cols,
-    .columns = m_notifications_cols
-};
+#define NOTIFICATION_COLUMNS(X, T) \
+    X(T, id,         INT,  "SERIAL",               DB_COL_PK | DB_COL_NOT_NULL | DB_COL_AUTO, NULL)    \
+    X(T, user_id,    INT,  "INTEGER",              DB_COL_NOT_NULL,                           NULL)    \
+    X(T, type,       TEXT, "VARCHAR(32)",          DB_COL_NOT_NULL,                           NULL)    \
+    X(T, related_id, INT,  "INTEGER",              0,                                         NULL)    \
+    X(T, created_at, TIME, "TIMESTAMPTZ NOT NULL", DB_COL_NOT_NULL | DB_COL_AUTO,             "NOW()") \
+    X(T, is_read,    BOOL, "BOOLEAN",              DB_COL_AUTO,                               "FALSE")
+
+DB_TABLE_DEFINE(notification, "notifications", notification_t, NOTIFICATION_COLUMNS)
 
 /* Helper: build notification_t from PGresult row */
 static notification_t *make_notification_from_row(PGresult *res, int row)
@@ -27,45 +24,66 @@ static notification_t *make_notification_from_row(PGresult *res, int row)
     notification_t *n;
     
     n = calloc(1, sizeof(*n));
-    n->id         = atoi(PQgetvalue(res, row, 0));
-    n->user_id    = atoi(PQgetvalue(res, row, 1));
-    n->type       = strdup(PQgetvalue(res, row, 2));
-    {
-        const char *rid = PQgetvalue(res, row, 3);
-        n->related_id = (rid && *rid) ? atoi(rid) : 0;
-    }
-    n->created_at = db_gen_parse_timestamp(PQgetvalue(res, row, 4));
-    n->is_read    = (strcmp(PQgetvalue(res, row, 5), "t") == 0);
+    m_notification_decode(res, row, n);     /* a NULL related_id reads as 0 */
     return n;
 }
 
-int db_tnotification_init(DB_ID DB)
+int db_tnotification_init(void)
 {
-    if (db_gen_create_table(DB, &m_notifications_schema) != 0)
+    if (db_table_prepare(&m_notification_table) != SUCCESS)
         return ERROR;
-    
+    if (db_schema_table(&m_notification_schema) != 0)
+        return ERROR;
+
+    const char *unread_idx =
+      "CREATE INDEX IF NOT EXISTS notifications_unread_idx ON notifications "
+      "(user_id, id) WHERE is_read IS NOT TRUE;";
+    if (db_schema_ddl(unread_idx) != SUCCESS)
+        return ERROR;
+
     return SUCCESS;
 }
 
 int db_tnotification_insert(DB_ID DB, int user_id, const char* type, int related_id)
 {
+    PGresult* res;
+    notification_t n;
     char ubuf[16];
     char rbuf[16];
-    int rc;
 
     if (!type) return ERROR;
     snprintf(ubuf, sizeof(ubuf), "%d", user_id);
     snprintf(rbuf, sizeof(rbuf), "%d", related_id);
+    const char *params[3] = { ubuf, type, rbuf };
+
+    /* new notifications are unread, bump the badge in the same statement */
+    const char *sql =
+      "WITH n AS ("
+      "  INSERT INTO notifications (user_id, type, related_id) "
+      "  VALUES ($1, $2, $3) RETURNING id, user_id, created_at"
+      "), c AS ("
+      "  INSERT INTO unread_counters (user_id, notifications) "
+      "  SELECT user_id, 1 FROM n "
+      "  ON CONFLICT (user_id) DO UPDATE SET notifications = unread_counters.notifications + 1"
+      ") SELECT id, created_at FROM n;";
+
+    res = db_query(DB, sql, 3, params);
+    if (!res) return ERROR;
+
+    if (PQntuples(res) == 1)
+    {
+        db_tcounter_add_notifications(user_id, 1);
+        n.id         = atoi(PQgetvalue(res, 0, 0));
+        n.user_id    = user_id;
+        n.type       = (char*)type;
+        n.related_id = related_id;
+        n.created_at = db_gen_parse_timestamp(PQgetvalue(res, 0, 1));
+        n.is_read    = false;
+        db_events_emit_data(DB_EVENT_NOTIFICATION_ADDED, user_id, n.id, &n);
+    }
 
-    rc = db_gen_insert(DB, &m_notifications_schema,
-        /* id         */ NULL,
-        /* user_id    */ ubuf,
-        /* type       */ type,
-        /* related_id */ rbuf,
-        /* created_at */ NULL,
-        /* is_read    */ NULL
-    );
-    return rc == 0 ? SUCCESS : ERROR;
+    PQclear(res);
+    return SUCCESS;
 }
 
 notification_t_array *db_tnotification_select_all(DB_ID DB)
@@ -76,7 +94,7 @@ notification_t_array *db_tnotification_select_all(DB_ID DB)
     notification_t_array *arr;
     notification_t **ns;
     
-    res = db_gen_select_all_from(DB, &m_notifications_schema);
+    res = db_table_select_all(DB, &m_notification_table);
     if (!res) return NULL;
     n = PQntuples(res);
     if (n < 0) { PQclear(res); return NULL; }
@@ -108,12 +126,11 @@ notification_t_array *db_tnotification_select_for_user(DB_ID DB, int user_id)
     snprintf(ubuf, sizeof(ubuf), "%d", user_id);
     const char *params[1] = { ubuf };
 
-    const char *sql =
-      "SELECT id,user_id,type,related_id,created_at,is_read "
-      "FROM notifications WHERE user_id = $1 "
+    const char *where =
+      "WHERE user_id = $1 "
       "ORDER BY created_at DESC;";
 
-    res = db_query(DB, sql, 1, params);
+    res = db_table_select_where(DB, &m_notification_table, where, 1, params);
     if (!res) return NULL;
     n = PQntuples(res);
     arr = malloc(sizeof(*arr));
@@ -130,33 +147,91 @@ notification_t_array *db_tnotification_select_for_user(DB_ID DB, int user_id)
 
 int db_tnotification_update_read_status(DB_ID DB, int notification_id, bool is_read)
 {
+    PGresult* res;
     char ibuf[16];
     char readbuf[8];
-    int rc;
 
     snprintf(ibuf,   sizeof(ibuf),   "%d", notification_id);
     snprintf(readbuf,sizeof(readbuf), "%s", is_read ? "TRUE":"FALSE");
 
-    rc = db_gen_update_by_pk(DB, &m_notifications_schema,
-        /* pk_value    */ ibuf,
-        /* user_id     */ NULL,
-        /* type        */ NULL,
-        /* related_id  */ NULL,
-        /* created_at  */ NULL,
-        /* is_read     */ readbuf
-    );
-    return rc == 0 ? SUCCESS : ERROR;
+    /* the counter only moves when the flag actually flips */
+    const char *sql =
+      "WITH old AS ("
+      "  SELECT id, is_read IS TRUE AS was_read FROM notifications WHERE id = $1 FOR UPDATE"
+      "), u AS ("
+      "  UPDATE notifications n SET is_read = $2 FROM old WHERE n.id = old.id "
+      "  RETURNING n.user_id, old.was_read"
+      "), c AS ("
+      "  INSERT INTO unread_counters (user_id, notifications) "
+      "  SELECT user_id, CASE WHEN $2 THEN 0 ELSE 1 END FROM u WHERE was_read <> $2 "
+      "  ON CONFLICT (user_id) DO UPDATE SET notifications = "
+      "  GREATEST(unread_counters.notifications + CASE WHEN $2 THEN -1 ELSE 1 END, 0)"
+      ") SELECT user_id, was_read FROM u;";
+
+    res = db_query(DB, sql, 2, (const char*[]){ ibuf, readbuf });
+    if (!res) return ERROR;
+    if (PQntuples(res) == 1 && (strcmp(PQgetvalue(res, 0, 1), "t") == 0) != is_read)
+        db_tcounter_add_notifications(atoi(PQgetvalue(res, 0, 0)), is_read ? -1 : 1);
+
+    PQclear(res);
+    return SUCCESS;
+}
+
+int db_tnotification_mark_read_up_to(DB_ID DB, int user_id, int up_to_id)
+{
+    PGresult* res;
+    int marked;
+    char ubuf[16];
+    char idbuf[16];
+
+    snprintf(ubuf,  sizeof(ubuf),  "%d", user_id);
+    snprintf(idbuf, sizeof(idbuf), "%d", up_to_id);
+    const char *params[2] = { ubuf, idbuf };
+
+    const char *sql =
+      "WITH r AS ("
+      "  UPDATE notifications SET is_read = TRUE "
+      "  WHERE user_id = $1 AND id <= $2 AND is_read IS NOT TRUE RETURNING 1"
+      "), c AS ("
+      "  UPDATE unread_counters SET notifications = "
+      "  GREATEST(notifications - (SELECT COUNT(*) FROM r), 0) WHERE user_id = $1"
+      ") SELECT COUNT(*) FROM r;";
+
+    res = db_query(DB, sql, 2, params);
+    if (!res) return ERROR;
+
+    marked = PQntuples(res) == 1 ? atoi(PQgetvalue(res, 0, 0)) : 0;
+    db_tcounter_add_notifications(user_id, -marked);
+
+    PQclear(res);
+    return marked;
 }
 
 /* 6) Delete by PK */
 int db_tnotification_delete_by_pk(DB_ID DB, int id)
 {
+    PGresult* res;
     char ibuf[16];
-    int rc;
 
     snprintf(ibuf, sizeof(ibuf), "%d", id);
-    rc = db_gen_delete_by_pk(DB, &m_notifications_schema, ibuf);
-    return rc == 0 ? SUCCESS : ERROR;
+    const char *params[1] = { ibuf };
+
+    const char *sql =
+      "WITH d AS ("
+      "  DELETE FROM notifications WHERE id = $1 "
+      "  RETURNING user_id, is_read IS TRUE AS was_read"
+      "), c AS ("
+      "  UPDATE unread_counters SET notifications = GREATEST(notifications - 1, 0) "
+      "  FROM d WHERE unread_counters.user_id = d.user_id AND NOT d.was_read"
+      ") SELECT user_id, was_read FROM d;";
+
+    res = db_query(DB, sql, 1, params);
+    if (!res) return ERROR;
+    if (PQntuples(res) == 1 && strcmp(PQgetvalue(res, 0, 1), "t") != 0)
+        db_tcounter_add_notifications(atoi(PQgetvalue(res, 0, 0)), -1);
+
+    PQclear(res);
+    return SUCCESS;
 }
 
 int db_tnotification_free_array(notification_t_array *arr)
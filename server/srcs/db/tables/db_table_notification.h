@@ -33,9 +33,9 @@ typedef struct
 } notification_t_array;
 
 /*
- * Initialize the notifications table
+ * Register the notifications table and its index with db_schema
  */
-int db_tnotification_init(DB_ID DB);
+int db_tnotification_init(void);
 
 /*
  * Insert a notification.
@@ -67,6 +67,12 @@ int db_tnotification_update_read_status(DB_ID DB,
                                          int notification_id,
                                          bool is_read);
 
+/*
+ * Mark every unread notification of user_id with id <= up_to_id as read.
+ * Returns the number of notifications marked, ERROR on failure.
+ */
+int db_tnotification_mark_read_up_to(DB_ID DB, int user_id, int up_to_id);
+
 /*
  * Delete a notification by PK
  */
@@ -32,9 +32,9 @@ typedef struct
 } picture_t_array;
 
 /*
- * Initialize the pictures table
+ * Register the pictures table with db_schema
  */
-int db_tpicture_init(DB_ID DB);
+int db_tpicture_init(void);
 
 /*
  * Insert a new picture.
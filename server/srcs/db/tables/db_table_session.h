@@ -29,9 +29,9 @@ typedef struct {
 } session_t_array;
 
 /*
- * Initialize the sessions table
+ * Register the sessions table with db_schema
  */
-int db_tsession_init(DB_ID DB);
+int db_tsession_init(void);
 
 /*
  * Insert a new session.
@@ -72,6 +72,11 @@ int db_tsession_update(DB_ID DB,
  */
 int db_tsession_delete_by_id(DB_ID DB, const char *session_id);
 
+/*
+ * Free a session returned by db_tsession_select_by_id
+ */
+void db_tsession_free(session_t *s);
+
 /*
  * Free a session_t_array
  */
@@ -1,4 +1,7 @@
 #include "db_table_tag.h"
+#include "../db_schema.h"
+#include "../index/db_index_tag.h"
+#include "../db_events.h"
 #include "../../../inc/ft_malloc.h"
 #include <stdio.h>
 #include <string.h>
@@ -29,12 +32,12 @@ static const tableSchema_t m_user_tags_schema =
     .columns= (columnDef_t*)m_user_tags_cols
 };
 
-int db_ttag_init(DB_ID DB)
+int db_ttag_init(void)
 {
-    if (db_gen_create_table(DB, &m_tags_schema) != 0)
+    if (db_schema_table(&m_tags_schema) != 0)
         return ERROR;
 
-    if (db_gen_create_table(DB, &m_user_tags_schema) != 0)
+    if (db_schema_table(&m_user_tags_schema) != 0)
         return ERROR;
 
     return SUCCESS;
@@ -186,6 +189,11 @@ int db_ttag_insert_user_tag(DB_ID DB, int user_id, int tag_id)
     rc = db_gen_insert(DB, &m_user_tags_schema,
                            /* user_id */ ubuf,
                            /* tag_id  */ tbuf);
+    if (rc == SUCCESS)
+    {
+        db_itag_add(user_id, tag_id);
+        db_events_emit(DB_EVENT_TAG_ADDED, user_id, tag_id);
+    }
     return rc;
 }
 
@@ -236,6 +244,11 @@ int db_ttag_delete_user_tag(DB_ID DB, int user_id, int tag_id)
     snprintf(ubuf, sizeof(ubuf), "%d", user_id);
     snprintf(tbuf, sizeof(tbuf), "%d", tag_id);
     rc = db_execute(DB, sql, 2, (const char*[]){ubuf, tbuf});
+    if (rc == SUCCESS)
+    {
+        db_itag_remove(user_id, tag_id);
+        db_events_emit(DB_EVENT_TAG_REMOVED, user_id, tag_id);
+    }
     return rc;
 }
 
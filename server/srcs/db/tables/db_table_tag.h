@@ -46,11 +46,11 @@ typedef struct
 } user_tag_array;
 
 /*
- * Initialize both tables:
+ * Register both tables with db_schema:
  *   - tags
  *   - user_tags
  */
-int db_ttag_init(DB_ID DB);
+int db_ttag_init(void);
 
 /*
  * CRUD for tags:
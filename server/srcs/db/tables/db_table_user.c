@@ -1,8 +1,11 @@
 #include "../../../inc/error_codes.h"
 #include "../../../inc/ft_malloc.h"
 #include "../db_gen.h"
+#include "../db_schema.h"
 #include "../db_api.h"
 #include "db_table_user.h"
+#include "../index/db_index_user.h"
+#include "../db_events.h"
 #include <string.h>
 
 const columnDef_t m_users_cols[] =
@@ -20,8 +23,8 @@ const columnDef_t m_users_cols[] =
     { .name = "gps_lat",       .type = "DOUBLE PRECISION", .is_primary = false, .is_unique = false, .not_null = false, .default_val = NULL },
     { .name = "gps_lon",       .type = "DOUBLE PRECISION", .is_primary = false, .is_unique = false, .not_null = false, .default_val = NULL },
     { .name = "location_optout", .type = "BOOLEAN",        .is_primary = false, .is_unique = false, .not_null = false, .default_val = "FALSE" },
-    { .name = "last_online",   .type = "TIMESTAMP",        .is_primary = false, .is_unique = false, .not_null = false, .default_val = NULL },
-    { .name = "created_at",    .type = "TIMESTAMP NOT NULL", .is_primary = false, .is_unique = false, .not_null = true, .default_val = "NOW()" },
+    { .name = "last_online",   .type = "TIMESTAMPTZ",      .is_primary = false, .is_unique = false, .not_null = false, .default_val = NULL },
+    { .name = "created_at",    .type = "TIMESTAMPTZ NOT NULL", .is_primary = false, .is_unique = false, .not_null = true, .default_val = "NOW()" },
     { .name = "email_verified", .type = "BOOLEAN",         .is_primary = false, .is_unique = false, .not_null = false, .default_val = "FALSE" }
 };
 
@@ -34,9 +37,9 @@ const tableSchema_t m_users_schema =
     .columns = m_users_cols
 };
 
-int db_tuser_init(DB_ID DB)
+int db_tuser_init(void)
 {
-    if (db_gen_create_table(DB, &m_users_schema) != 0)
+    if (db_schema_table(&m_users_schema) != 0)
     {
         /* ERROR */
         return ERROR;
@@ -47,17 +50,22 @@ int db_tuser_init(DB_ID DB)
 
 int db_tuser_insert_user(DB_ID DB, user_t* u)
 {
+    user_t created;
     char fame_buf[16];
     char lat_buf[32];
     char lon_buf[32];
     char bool_buf[8];
+    bool gps;
+    int id;
     
+    gps = USER_HAS_GPS(u);
     snprintf(fame_buf, sizeof(fame_buf),  "%d",  u->fame_rating);
     snprintf(lat_buf,  sizeof(lat_buf),   "%f",  u->gps_lat);
     snprintf(lon_buf,  sizeof(lon_buf),   "%f",  u->gps_lon);
     snprintf(bool_buf, sizeof(bool_buf),  "%s",  u->location_optout ? "TRUE" : "FALSE");
 
-   if (db_gen_insert(DB, &m_users_schema,
+   /* the id generated by the database comes back with the insert */
+   if (db_gen_insert_id(DB, &m_users_schema, &id,
         /* id            */ NULL, /* Allways wanting default */
         /* username      */ u->username,
         /* email         */ u->email,
@@ -68,8 +76,8 @@ int db_tuser_insert_user(DB_ID DB, user_t* u)
         /* orientation   */ u->orientation,
         /* bio           */ u->bio,
         /* fame_rating   */ fame_buf,
-        /* gps_lat       */ lat_buf,
-        /* gps_lon       */ lon_buf,
+        /* gps_lat       */ gps ? lat_buf : NULL,
+        /* gps_lon       */ gps ? lon_buf : NULL,
         /* location_optout */ bool_buf,
         /* last_online   */ u->last_online,
         /* created_at    */ NULL, /* Allways wanting default */
@@ -77,8 +85,13 @@ int db_tuser_insert_user(DB_ID DB, user_t* u)
     ) != 0)
     {
         /* ERROR. but could be that it already exists */
+        return SUCCESS;
     }
 
+    created = *u;
+    created.id = id;
+    db_iuser_upsert(&created);
+    db_events_emit(DB_EVENT_USER_CREATED, id, 0);
     return SUCCESS;
 }
 
@@ -199,6 +212,8 @@ int db_tuser_delete_user_from_pk(DB_ID DB, const char* name)
         else
         {
             /* SUCCESS */
+            db_iuser_remove(atoi(id));
+            db_events_emit(DB_EVENT_USER_DELETED, atoi(id), 0);
         }
     }
     else
@@ -246,5 +261,10 @@ int db_tuser_update_user(DB_ID DB, const user_t *u)
         /* email_verified */ u->email_verified ? "TRUE" : "FALSE"
     );
 
+    if (rc == SUCCESS)
+    {
+        db_iuser_upsert(u);
+        db_events_emit(DB_EVENT_USER_UPDATED, u->id, 0);
+    }
     return rc;
 }
@@ -24,6 +24,9 @@ typedef struct
     bool email_verified;
 } user_t;
 
+/* a profile without coordinates carries 0,0, never a real position here */
+#define USER_HAS_GPS(u) ((u)->gps_lat != 0.0 || (u)->gps_lon != 0.0)
+
 typedef struct 
 {
     user_t **users;
@@ -31,7 +34,7 @@ typedef struct
     PGresult *pg_result;
 } user_t_array;
 
-int db_tuser_init(DB_ID DB);
+int db_tuser_init(void);
 int db_tuser_insert_user(DB_ID DB, user_t* u);
 user_t_array* db_tuser_select_all_users(DB_ID DB);
 int db_select_user_by_username(DB_ID DB, const char* username, user_t** user);
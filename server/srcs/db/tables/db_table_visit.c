@@ -1,38 +1,41 @@
 #include "db_table_visit.h"
+#include "../db_schema.h"
+#include "../db_table_gen.h"
+#include "../db_events.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "../../../inc/ft_slab.h"
 
 /* Column schema for visits */
-static const columnDef_t m_visits_cols[] = {
-    { .name="id",        .type="SERIAL",            .is_primary=true,  .is_unique=false, .not_null=true,  .default_val=NULL },
-    { .name="viewer_id", .type="INTEGER",           .is_primary=false, .is_unique=false, .not_null=true,  .default_val=NULL },
-    { .name="viewed_id", .type="INTEGER",           .is_primary=false, .is_unique=false, .not_null=true,  .default_val=NULL },
-    { .name="viewed_at", .type="TIMESTAMP NOT NULL",.is_primary=false, .is_unique=false, .not_null=true,  .default_val="NOW()" }
-};
-static const int m_n_visits_cols = sizeof(m_visits_cols)/sizeof(*m_visits_cols);
-static const tableSchema_t m_visits_schema = {
-    .name    = "visits",
-    .n_cols  = m_n_visits_cols,
-    .columns = m_visits_cols
-};
+#define VISIT_COLUMNS(X, T) \
+    X(T, id,        INT,  "SERIAL",               DB_COL_PK | DB_COL_NOT_NULL | DB_COL_AUTO, NULL)    \
+    X(T, viewer_id, INT,  "INTEGER",              DB_COL_NOT_NULL,                           NULL)    \
+    X(T, viewed_id, INT,  "INTEGER",              DB_COL_NOT_NULL,                           NULL)    \
+    X(T, viewed_at, TIME, "TIMESTAMPTZ NOT NULL", DB_COL_NOT_NULL | DB_COL_AUTO,             "NOW()")
+
+DB_TABLE_DEFINE(visit, "visits", visit_t, VISIT_COLUMNS)
 
 /* Helper: build a visit_t from PGresult row */
+static ft_slab_cache_t *m_visit_cache = NULL;
+
 static visit_t *make_visit_from_row(PGresult *res, int row)
 {
     visit_t *v;
 
-    v = calloc(1, sizeof(*v));
-    v->id        = atoi(PQgetvalue(res, row, 0));
-    v->viewer_id = atoi(PQgetvalue(res, row, 1));
-    v->viewed_id = atoi(PQgetvalue(res, row, 2));
-    v->viewed_at = db_gen_parse_timestamp(PQgetvalue(res, row, 3));
+    v = FT_SLAB_NEW(m_visit_cache, visit_t);
+    m_visit_decode(res, row, v);
     return v;
 }
 
-int db_tvisit_init(DB_ID DB)
+int db_tvisit_init(void)
 {
-    if (db_gen_create_table(DB, &m_visits_schema) != 0)
+    if (!m_visit_cache)
+        m_visit_cache = FT_SLAB_CACHE(visit_t);
+
+    if (db_table_prepare(&m_visit_table) != SUCCESS)
+        return ERROR;
+    if (db_schema_table(&m_visit_schema) != 0)
         return ERROR;
     
     return SUCCESS;
@@ -40,19 +43,12 @@ int db_tvisit_init(DB_ID DB)
 
 int db_tvisit_insert(DB_ID DB, int viewer_id, int viewed_id)
 {
-    char vbuf[16];
-    char dbuf[16];
+    visit_t v = { .viewer_id = viewer_id, .viewed_id = viewed_id };
     int rc;
 
-    snprintf(vbuf, sizeof(vbuf), "%d", viewer_id);
-    snprintf(dbuf, sizeof(dbuf), "%d", viewed_id);
-
-    rc = db_gen_insert(DB, &m_visits_schema,
-        /* id        */ NULL,
-        /* viewer_id */ vbuf,
-        /* viewed_id */ dbuf,
-        /* viewed_at */ NULL  /* DEFAULT NOW() */
-    );
+    rc = m_visit_insert(DB, &v);
+    if (rc == SUCCESS)
+        db_events_emit(DB_EVENT_VISIT_ADDED, viewer_id, viewed_id);
     return rc;
 }
 
@@ -64,7 +60,7 @@ visit_t_array *db_tvisit_select_all(DB_ID DB)
     visit_t_array* arr;
     visit_t** vs;
 
-    res = db_gen_select_all_from(DB, &m_visits_schema);
+    res = db_table_select_all(DB, &m_visit_table);
     if (!res) return NULL;
     n = PQntuples(res);
     if (n < 0) { PQclear(res); return NULL; }
@@ -93,11 +89,10 @@ visit_t_array *db_tvisit_select_by_viewer(DB_ID DB, int viewer_id)
     snprintf(vbuf, sizeof(vbuf), "%d", viewer_id);
     const char *params[1] = { vbuf };
 
-    const char *sql =
-      "SELECT id,viewer_id,viewed_id,viewed_at "
-      "FROM visits WHERE viewer_id = $1 ORDER BY viewed_at DESC;";
+    const char *where =
+      "WHERE viewer_id = $1 ORDER BY viewed_at DESC;";
 
-    res = db_query(DB, sql, 1, params);
+    res = db_table_select_where(DB, &m_visit_table, where, 1, params);
     if (!res) return NULL;
     n = PQntuples(res);
     arr = malloc(sizeof(*arr));
@@ -125,11 +120,10 @@ visit_t_array *db_tvisit_select_by_viewed(DB_ID DB, int viewed_id)
     snprintf(dbuf, sizeof(dbuf), "%d", viewed_id);
     const char *params[1] = { dbuf };
 
-    const char *sql =
-      "SELECT id,viewer_id,viewed_id,viewed_at "
-      "FROM visits WHERE viewed_id = $1 ORDER BY viewed_at DESC;";
+    const char *where =
+      "WHERE viewed_id = $1 ORDER BY viewed_at DESC;";
 
-    res = db_query(DB, sql, 1, params);
+    res = db_table_select_where(DB, &m_visit_table, where, 1, params);
     if (!res) return NULL;
     n = PQntuples(res);
     arr = malloc(sizeof(*arr));
@@ -151,7 +145,7 @@ int db_tvisit_delete_by_pk(DB_ID DB, int id)
     int rc;
 
     snprintf(ibuf, sizeof(ibuf), "%d", id);
-    rc = db_gen_delete_by_pk(DB, &m_visits_schema, ibuf);
+    rc = db_table_delete(DB, &m_visit_table, ibuf);
     return rc;
 }
 
@@ -160,7 +154,7 @@ int db_tvisit_free_array(visit_t_array *arr)
     size_t i;
     if (!arr) return ERROR;
     for (i = 0; i < arr->count; i++)
-        free(arr->visits[i]);
+        ft_slab_free(arr->visits[i]);
 
     free(arr->visits);
     PQclear(arr->pg_result);
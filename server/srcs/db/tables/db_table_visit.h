@@ -30,9 +30,9 @@ typedef struct
 } visit_t_array;
 
 /*
- * Initialize the visits table
+ * Register the visits table with db_schema
  */
-int db_tvisit_init(DB_ID DB);
+int db_tvisit_init(void);
 
 /*
  * Insert a visit (viewer → viewed). viewed_at defaults to NOW()
@@ -0,0 +1,351 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <math.h>
+#include <time.h>
+#include "../log/log_api.h"
+#include "../db/db_events.h"
+#include "../db/index/db_index_user.h"
+#include "../db/index/db_index_like.h"
+#include "../../inc/ft_malloc.h"
+#include "../../inc/error_codes.h"
+#include "../../third_party/uthash-master/src/uthash.h"
+#include "fame_api.h"
+
+#define FAME_HALF_LIFE_SEC (7 * 24 * 3600)
+#define FAME_SCALE 50.0
+
+/* activity weights */
+#define FAME_W_VISIT 1.0
+#define FAME_W_LIKE 5.0
+#define FAME_W_MATCH 10.0
+#define FAME_W_UNLIKE -5.0
+
+#define FAME_FLUSH_BATCH 512
+#define FAME_FLUSH_INTERVAL_SEC 5
+#define FAME_DECAY_INTERVAL_SEC 600
+
+typedef struct
+{
+    int user_id;
+    fame_counters_t counters;
+    double score;    /* decayed activity, valid at score_at */
+    time_t score_at;
+    bool dirty;      /* fame_rating not written back yet */
+    UT_hash_handle hh;
+} fame_entry_t;
+
+static DB_ID m_db = INVALID_DB_ID;
+static fame_entry_t* m_fame = NULL;
+static int* m_dirty = NULL;
+static size_t m_n_dirty = 0;
+static size_t m_dirty_cap = 0;
+static time_t m_last_flush = 0;
+static time_t m_last_decay = 0;
+
+static fame_entry_t* m_entry(int user_id, bool create)
+{
+    fame_entry_t* e;
+    const user_profile_t* profile;
+
+    HASH_FIND_INT(m_fame, &user_id, e);
+    if (!e && create)
+    {
+        e = calloc(1, sizeof(*e));
+        ft_assert(e != NULL, "calloc failed");
+        e->user_id = user_id;
+        e->score_at = time(NULL);
+        profile = db_iuser_get(user_id);
+        e->counters.fame_rating = profile ? profile->fame_rating : 0;
+        HASH_ADD_INT(m_fame, user_id, e);
+    }
+    return e;
+}
+
+static double m_decay(double score, time_t from, time_t now)
+{
+    if (now <= from)
+        return score;
+    return score * exp2(-(double)(now - from) / FAME_HALF_LIFE_SEC);
+}
+
+static int m_rating(double score)
+{
+    if (score <= 0)
+        return 0;
+    return (int)lround(100.0 * (1.0 - exp(-score / FAME_SCALE)));
+}
+
+static void m_refresh_rating(fame_entry_t* e)
+{
+    int rating;
+
+    rating = m_rating(e->score);
+    if (rating == e->counters.fame_rating)
+        return;
+
+    e->counters.fame_rating = rating;
+    db_iuser_set_fame(e->user_id, rating);
+
+    if (!e->dirty)
+    {
+        e->dirty = true;
+        if (m_n_dirty == m_dirty_cap)
+        {
+            m_dirty_cap = m_dirty_cap ? m_dirty_cap * 2 : 256;
+            m_dirty = realloc(m_dirty, m_dirty_cap * sizeof(int));
+        }
+        m_dirty[m_n_dirty++] = e->user_id;
+    }
+}
+
+static fame_entry_t* m_touch(int user_id, double weight)
+{
+    fame_entry_t* e;
+    time_t now;
+
+    now = time(NULL);
+    e = m_entry(user_id, true);
+    e->score = m_decay(e->score, e->score_at, now) + weight;
+    if (e->score < 0)
+        e->score = 0;
+    e->score_at = now;
+    m_refresh_rating(e);
+    return e;
+}
+
+static void m_on_db_event(const db_event_t* event, void* user_data)
+{
+    fame_entry_t* e;
+
+    (void)user_data;
+    switch (event->type)
+    {
+        case DB_EVENT_VISIT_ADDED:
+            if (event->user_id != event->other_id)
+                m_touch(event->other_id, FAME_W_VISIT)->counters.visits_received++;
+            break;
+        case DB_EVENT_LIKE_ADDED:
+            m_touch(event->other_id, FAME_W_LIKE)->counters.likes_received++;
+            if (db_ilike_is_mutual(event->user_id, event->other_id))
+            {
+                m_touch(event->user_id, FAME_W_MATCH)->counters.matches++;
+                m_touch(event->other_id, FAME_W_MATCH)->counters.matches++;
+            }
+            break;
+        case DB_EVENT_LIKE_REMOVED:
+            m_touch(event->other_id, FAME_W_UNLIKE)->counters.unlikes++;
+            break;
+        case DB_EVENT_USER_DELETED:
+            e = m_entry(event->user_id, false);
+            if (e)
+            {
+                HASH_DEL(m_fame, e);
+                free(e);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/* writes up to FAME_FLUSH_BATCH ratings in a single UPDATE ... FROM unnest() */
+static int m_flush_batch(void)
+{
+    fame_entry_t* e;
+    char* ids;
+    char* fames;
+    size_t len;
+    size_t ipos;
+    size_t fpos;
+    size_t n;
+    size_t i;
+    int rc;
+
+    const char *sql =
+      "UPDATE users AS u SET fame_rating = v.fame "
+      "FROM unnest($1::int[], $2::int[]) AS v(id, fame) "
+      "WHERE u.id = v.id;";
+
+    n = m_n_dirty < FAME_FLUSH_BATCH ? m_n_dirty : FAME_FLUSH_BATCH;
+    len = n * 16 + 3;
+    ids = malloc(len);
+    fames = malloc(len);
+    ipos = snprintf(ids, len, "{");
+    fpos = snprintf(fames, len, "{");
+
+    for (i = 0; i < n; i++)
+    {
+        e = m_entry(m_dirty[m_n_dirty - 1 - i], false);
+        if (!e)
+            continue;
+        ipos += snprintf(ids + ipos, len - ipos, "%s%d", ipos > 1 ? "," : "", e->user_id);
+        fpos += snprintf(fames + fpos, len - fpos, "%s%d", fpos > 1 ? "," : "", e->counters.fame_rating);
+    }
+    snprintf(ids + ipos, len - ipos, "}");
+    snprintf(fames + fpos, len - fpos, "}");
+
+    rc = db_execute(m_db, sql, 2, (const char*[]){ids, fames});
+    free(ids);
+    free(fames);
+    if (rc != SUCCESS)
+        return ERROR;
+
+    for (i = 0; i < n; i++)
+    {
+        e = m_entry(m_dirty[m_n_dirty - 1], false);
+        m_n_dirty--;
+        if (!e)
+            continue;
+        e->dirty = false;
+        db_events_emit(DB_EVENT_FAME_CHANGED, e->user_id, e->counters.fame_rating);
+    }
+    return SUCCESS;
+}
+
+int fame_flush(void)
+{
+    m_last_flush = time(NULL);
+    while (m_n_dirty > 0)
+    {
+        if (m_flush_batch() != SUCCESS)
+        {
+            log_msg(LOG_LEVEL_WARN, "fame: write-back of %zu ratings failed\n", m_n_dirty);
+            return ERROR;
+        }
+    }
+    return SUCCESS;
+}
+
+/* idle users drift down without events, catch their ratings up */
+static void m_decay_all(time_t now)
+{
+    fame_entry_t* e;
+    fame_entry_t* tmp;
+
+    HASH_ITER(hh, m_fame, e, tmp)
+    {
+        e->score = m_decay(e->score, e->score_at, now);
+        e->score_at = now;
+        m_refresh_rating(e);
+    }
+    m_last_decay = now;
+}
+
+void fame_tick(void)
+{
+    time_t now;
+
+    now = time(NULL);
+    if (now - m_last_decay >= FAME_DECAY_INTERVAL_SEC)
+        m_decay_all(now);
+
+    if (m_n_dirty >= FAME_FLUSH_BATCH
+        || (m_n_dirty > 0 && now - m_last_flush >= FAME_FLUSH_INTERVAL_SEC))
+        fame_flush();
+}
+
+bool fame_get(int user_id, fame_counters_t* out)
+{
+    fame_entry_t* e;
+
+    e = m_entry(user_id, false);
+    if (!e || !out)
+        return false;
+    *out = e->counters;
+    return true;
+}
+
+/*
+ * One grouped query per source: user id, count, decayed sum of events.
+ * Only run at startup, afterwards everything is incremental.
+ */
+static int m_seed(const char* sql, double weight, size_t counter_offset)
+{
+    PGresult* res;
+    fame_entry_t* e;
+    char half_life[16];
+    int n;
+    int i;
+
+    snprintf(half_life, sizeof(half_life), "%d", FAME_HALF_LIFE_SEC);
+    const char *params[1] = { half_life };
+
+    res = db_query(m_db, sql, 1, params);
+    if (!res) return ERROR;
+
+    n = PQntuples(res);
+    for (i = 0; i < n; i++)
+    {
+        e = m_entry(atoi(PQgetvalue(res, i, 0)), true);
+        *(int*)((char*)&e->counters + counter_offset) += atoi(PQgetvalue(res, i, 1));
+        e->score += weight * atof(PQgetvalue(res, i, 2));
+    }
+
+    PQclear(res);
+    return SUCCESS;
+}
+
+int fame_init(DB_ID DB)
+{
+    fame_entry_t* e;
+    fame_entry_t* tmp;
+    time_t now;
+
+    m_db = DB;
+
+    if (m_seed("SELECT viewed_id, COUNT(*), "
+               "SUM(power(0.5, EXTRACT(EPOCH FROM (NOW() - viewed_at))::float8 / $1::float8)) "
+               "FROM visits WHERE viewer_id <> viewed_id GROUP BY viewed_id;",
+               FAME_W_VISIT, offsetof(fame_counters_t, visits_received)) != SUCCESS)
+        return ERROR;
+
+    if (m_seed("SELECT liked_id, COUNT(*), "
+               "SUM(power(0.5, EXTRACT(EPOCH FROM (NOW() - liked_at))::float8 / $1::float8)) "
+               "FROM likes GROUP BY liked_id;",
+               FAME_W_LIKE, offsetof(fame_counters_t, likes_received)) != SUCCESS)
+        return ERROR;
+
+    if (m_seed("SELECT a.liker_id, COUNT(*), "
+               "SUM(power(0.5, EXTRACT(EPOCH FROM (NOW() - GREATEST(a.liked_at, b.liked_at)))::float8 / $1::float8)) "
+               "FROM likes a JOIN likes b ON a.liker_id = b.liked_id AND a.liked_id = b.liker_id "
+               "GROUP BY a.liker_id;",
+               FAME_W_MATCH, offsetof(fame_counters_t, matches)) != SUCCESS)
+        return ERROR;
+
+    now = time(NULL);
+    HASH_ITER(hh, m_fame, e, tmp)
+    {
+        e->score_at = now;
+        m_refresh_rating(e);
+    }
+    m_last_decay = now;
+    m_last_flush = now;
+
+    if (db_events_subscribe(m_on_db_event, NULL) != SUCCESS)
+        return ERROR;
+
+    log_msg(LOG_LEVEL_BOOT, "Fame engine initialized: %u users, %zu ratings pending\n",
+            HASH_COUNT(m_fame), m_n_dirty);
+    return SUCCESS;
+}
+
+void fame_cleanup(void)
+{
+    fame_entry_t* e;
+    fame_entry_t* tmp;
+
+    db_events_unsubscribe(m_on_db_event, NULL);
+    fame_flush();
+
+    HASH_ITER(hh, m_fame, e, tmp)
+    {
+        HASH_DEL(m_fame, e);
+        free(e);
+    }
+    free(m_dirty);
+    m_dirty = NULL;
+    m_n_dirty = 0;
+    m_dirty_cap = 0;
+}
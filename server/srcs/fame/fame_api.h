@@ -0,0 +1,46 @@
+#ifndef FAME_API_H
+#define FAME_API_H
+
+#include <stdbool.h>
+#include "../db/db_api.h"
+
+/*
+ * Incremental fame_rating engine.
+ *
+ * Each user keeps activity counters (visits and likes received, matches,
+ * unlikes) and an exponentially decayed activity score, both updated in
+ * O(1) from db_events. The score maps to the 0..100 users.fame_rating
+ * column; changed ratings are written back in batches by fame_tick().
+ */
+
+typedef struct
+{
+    int visits_received;
+    int likes_received;
+    int matches;
+    int unlikes;
+    int fame_rating;
+} fame_counters_t;
+
+/*
+ * Seeds the counters with one aggregate query per table and subscribes
+ * to db_events. DB is kept for the write-back.
+ */
+int fame_init(DB_ID DB);
+
+/*
+ * Flushes pending ratings when the batch is full or the flush interval
+ * elapsed, and periodically applies decay to idle users.
+ */
+void fame_tick(void);
+
+/*
+ * Writes every pending rating now.
+ */
+int fame_flush(void);
+
+void fame_cleanup(void);
+
+bool fame_get(int user_id, fame_counters_t* out);
+
+#endif /* FAME_API_H */
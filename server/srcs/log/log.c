@@ -1,78 +1,396 @@
 #include "log_api.h"
+#include "log_format.h"
+#include "log_file.h"
+#include "../metrics/metrics_api.h"
 #include <stdarg.h>
 #include <time.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <sys/time.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
 
-#define LOG_QUEUE_SIZE 1024
-#define LOG_MSG_MAX_LEN 1024
+#define LOG_RING_SIZE (1u << 20)    /* bytes, power of two */
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+#define LOG_MSG_MAX_LEN 4096
+#define LOG_BATCH_SIZE (64 * 1024)  /* bytes per console write() */
+#define LOG_IDLE_MS 500             /* worker wakes up at least this often */
 
+#define LOG_MAX_FORMATS 1024
+#define LOG_RECORD_BINARY 0x100u    /* level flag: payload is log_bin_header_t + packed args */
+
+#define LOG_ALIGN(x) (((x) + 7u) & ~7u)
+
+/*
+ * Records are 8 byte aligned so a header never straddles the end of the
+ * ring, the text after it may wrap. len stays 0 until the producer has
+ * copied the text: the worker stops at the first record not yet committed.
+ */
 typedef struct
 {
-    log_level level;
-    char message[LOG_MSG_MAX_LEN];
-} t_logEntry;
+    atomic_uint len;
+    uint32_t level;
+} t_logRecord;
 
-static t_logEntry *log_queue;
-static int log_queue_head = 0, log_queue_tail = 0;
+typedef struct
+{
+    int fd;
+    size_t len;
+    char data[LOG_BATCH_SIZE];
+} t_logBatch;
+
+static char* log_ring = NULL;
+static _Atomic uint64_t log_ring_head = 0;   /* next byte to reserve */
+static _Atomic uint64_t log_ring_tail = 0;   /* next byte to consume */
+static atomic_ulong log_dropped_count = 0;
+static metric_t* log_depth = NULL;           /* ring bytes pending per drain */
+
+/* the worker only sleeps on the condvar when it announced it */
 static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
-static bool log_running = true;
+static atomic_bool log_sleeping = false;
+static atomic_bool log_running = false;
 static pthread_t log_thread;
 
-static FILE *m_log_fp        = NULL;
-static log_level  m_log_threshold = LOG_LEVEL_INFO;
+static log_file_t* m_log_file = NULL;
+static _Atomic log_level m_log_threshold = LOG_LEVEL_INFO;
+static log_writer_options m_writer_options = {
+    .rotate_size = 0,
+    .rotate_interval = 0,
+    .rotate_keep = 5,
+    .compress = true,
+    .flush_ms = 200,
+    .direct = false,
+};
+
+static __thread char m_staging[LOG_MSG_MAX_LEN];
+
+static t_logBatch m_out_batch;
+static t_logBatch m_err_batch;
+
+/* deferred formats, read lock-free once published */
+static const char* m_format_src[LOG_MAX_FORMATS];
+static log_format_t* m_formats[LOG_MAX_FORMATS];
+static atomic_int m_n_formats = 0;
+static pthread_mutex_t m_format_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* binary mode: deferred records are written raw for log_decode */
+static log_file_t* m_bin_file = NULL;
+static bool m_format_written[LOG_MAX_FORMATS];
+
+static void m_batch_flush(t_logBatch* batch)
+{
+    size_t off;
+    ssize_t n;
+
+    off = 0;
+    while (off < batch->len)
+    {
+        n = write(batch->fd, batch->data + off, batch->len - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        off += n;
+    }
+    batch->len = 0;
+}
+
+static void m_batch_append(t_logBatch* batch, const char* data, size_t len)
+{
+    size_t chunk;
+
+    while (len > 0)
+    {
+        if (batch->len == sizeof(batch->data))
+            m_batch_flush(batch);
+        chunk = sizeof(batch->data) - batch->len;
+        if (chunk > len)
+            chunk = len;
+        memcpy(batch->data + batch->len, data, chunk);
+        batch->len += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+static void m_emit(log_level level, const char* text, size_t len)
+{
+    t_logBatch* console;
+    const char* color;
+
+    log_file_write(m_log_file, text, len);
+
+    /* log_msg already filtered on the threshold */
+    console = (level == LOG_LEVEL_ERROR || level == LOG_LEVEL_WARN) ? &m_err_batch : &m_out_batch;
+    color = (level == LOG_LEVEL_ERROR) ? "\033[1;31m" :
+            (level == LOG_LEVEL_WARN) ? "\033[1;33m" : "";
+    if (color[0])
+        m_batch_append(console, color, strlen(color));
+    m_batch_append(console, text, len);
+    if (color[0])
+        m_batch_append(console, "\033[0m", 4);
+}
+
+static void m_emit_binary(log_level level, const char* payload, size_t len)
+{
+    static char text[LOG_MSG_MAX_LEN];
+    log_bin_header_t header;
+    const char* src;
+    uint32_t u32;
+    uint8_t u8;
+    size_t n;
+
+    memcpy(&header, payload, sizeof(header));
+    if (m_bin_file)
+    {
+        if (!m_format_written[header.fmt_id])
+        {
+            src = m_format_src[header.fmt_id];
+            u8 = LOG_BIN_FORMAT;
+            log_file_write(m_bin_file, &u8, sizeof(u8));
+            log_file_write(m_bin_file, &header.fmt_id, sizeof(header.fmt_id));
+            u32 = strlen(src);
+            log_file_write(m_bin_file, &u32, sizeof(u32));
+            log_file_write(m_bin_file, src, u32);
+            m_format_written[header.fmt_id] = true;
+        }
+        u8 = LOG_BIN_MESSAGE;
+        log_file_write(m_bin_file, &u8, sizeof(u8));
+        u8 = level;
+        log_file_write(m_bin_file, &u8, sizeof(u8));
+        u32 = len;
+        log_file_write(m_bin_file, &u32, sizeof(u32));
+        log_file_write(m_bin_file, payload, len);
+        return;
+    }
+
+    n = log_format_timestamp(header.ts_ns, text, sizeof(text));
+    n += log_format_render(m_formats[header.fmt_id], payload + sizeof(header), len - sizeof(header),
+                           text + n, sizeof(text) - n);
+    m_emit(level, text, n);
+}
+
+static void m_ring_copy_out(uint64_t pos, char* dst, size_t len)
+{
+    size_t off;
+    size_t first;
+
+    off = pos & LOG_RING_MASK;
+    first = LOG_RING_SIZE - off;
+    if (first > len)
+        first = len;
+    memcpy(dst, log_ring + off, first);
+    memcpy(dst + first, log_ring, len - first);
+}
+
+static void m_ring_zero(uint64_t pos, size_t len)
+{
+    size_t off;
+    size_t first;
+
+    off = pos & LOG_RING_MASK;
+    first = LOG_RING_SIZE - off;
+    if (first > len)
+        first = len;
+    memset(log_ring + off, 0, first);
+    memset(log_ring, 0, len - first);
+}
+
+/* consumes every committed record, returns how many */
+static int m_drain(void)
+{
+    static char text[LOG_MSG_MAX_LEN];
+    t_logRecord* rec;
+    uint64_t tail;
+    uint64_t head;
+    unsigned len;
+    size_t need;
+    int n;
+
+    n = 0;
+    tail = atomic_load_explicit(&log_ring_tail, memory_order_relaxed);
+    head = atomic_load_explicit(&log_ring_head, memory_order_acquire);
+    if (tail < head)
+        metrics_observe(log_depth, head - tail);
+    while (tail < head)
+    {
+        rec = (t_logRecord*)(log_ring + (tail & LOG_RING_MASK));
+        len = atomic_load_explicit(&rec->len, memory_order_acquire);
+        if (len == 0)
+            break;
+
+        need = LOG_ALIGN(sizeof(t_logRecord) + len);
+        m_ring_copy_out(tail + sizeof(t_logRecord), text, len);
+        if (rec->level & LOG_RECORD_BINARY)
+            m_emit_binary(rec->level & ~LOG_RECORD_BINARY, text, len);
+        else
+            m_emit(rec->level, text, len);
+
+        /* stale bytes must not look like a committed header later on */
+        m_ring_zero(tail, need);
+        tail += need;
+        atomic_store_explicit(&log_ring_tail, tail, memory_order_release);
+        n++;
+    }
+
+    /* the files flush on their own interval, the console right away */
+    if (n > 0)
+    {
+        m_batch_flush(&m_err_batch);
+        m_batch_flush(&m_out_batch);
+    }
+    return n;
+}
+
+static void m_report_dropped(unsigned long* reported)
+{
+    unsigned long dropped;
+    char line[96];
+    int len;
+
+    dropped = atomic_load_explicit(&log_dropped_count, memory_order_relaxed);
+    if (dropped == *reported)
+        return;
+
+    len = snprintf(line, sizeof(line), "[log] %lu messages dropped, ring full\n", dropped - *reported);
+    *reported = dropped;
+    m_emit(LOG_LEVEL_WARN, line, len);
+    m_batch_flush(&m_err_batch);
+}
+
+static void m_wait(int timeout_ms)
+{
+    struct timespec deadline;
+
+    pthread_mutex_lock(&log_mutex);
+    atomic_store(&log_sleeping, true);
+    /* a record committed before the flag was seen would not wake us */
+    if (atomic_load(&log_ring_tail) == atomic_load(&log_ring_head) && atomic_load(&log_running))
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += timeout_ms * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (atomic_load(&log_sleeping) && atomic_load(&log_running))
+        {
+            if (pthread_cond_timedwait(&log_cond, &log_mutex, &deadline) == ETIMEDOUT)
+                break;
+        }
+    }
+    atomic_store(&log_sleeping, false);
+    pthread_mutex_unlock(&log_mutex);
+}
+
+/* timed flushes and rotation, returns how long the worker may sleep */
+static int m_tick_files(void)
+{
+    int timeout;
+    int due;
+
+    timeout = LOG_IDLE_MS;
+    due = log_file_tick(m_log_file);
+    if (due >= 0 && due < timeout)
+        timeout = due;
+    if (m_bin_file)
+    {
+        due = log_file_tick(m_bin_file);
+        if (due >= 0 && due < timeout)
+            timeout = due;
+    }
+    return timeout;
+}
 
 static void* log_worker_thread(void* arg)
 {
-    t_logEntry entry;
-    FILE* out;
+    unsigned long reported;
+    int drained;
+    int timeout;
 
     (void)arg;
+    reported = 0;
     while (1)
     {
-        pthread_mutex_lock(&log_mutex);
-
-        while (log_queue_head == log_queue_tail && log_running)
-            pthread_cond_wait(&log_cond, &log_mutex);
+        m_report_dropped(&reported);
+        drained = m_drain();
+        timeout = m_tick_files();
+        if (drained > 0 || timeout == 0)
+            continue;
 
-        if (!log_running && log_queue_head == log_queue_tail)
+        if (!atomic_load(&log_running))
         {
-            pthread_mutex_unlock(&log_mutex);
+            /* producers that reserved before log_close() */
+            while (atomic_load(&log_ring_tail) != atomic_load(&log_ring_head))
+            {
+                if (m_drain() == 0)
+                    sched_yield();
+            }
             break;
         }
+        m_wait(timeout);
+    }
 
-        entry = log_queue[log_queue_tail];
-        log_queue_tail = (log_queue_tail + 1) % LOG_QUEUE_SIZE;
+    return NULL;
+}
 
+static void m_wake_worker(void)
+{
+    if (atomic_load(&log_sleeping) && atomic_exchange(&log_sleeping, false))
+    {
+        pthread_mutex_lock(&log_mutex);
+        pthread_cond_signal(&log_cond);
         pthread_mutex_unlock(&log_mutex);
+    }
+}
 
-        fprintf(m_log_fp, "%s", entry.message);
-        fflush(m_log_fp);
+static void m_ring_copy_in(uint64_t pos, const char* src, size_t len)
+{
+    size_t off;
+    size_t first;
+
+    off = pos & LOG_RING_MASK;
+    first = LOG_RING_SIZE - off;
+    if (first > len)
+        first = len;
+    memcpy(log_ring + off, src, first);
+    memcpy(log_ring, src + first, len - first);
+}
 
-        if ((entry.level <= m_log_threshold) || (entry.level == LOG_LEVEL_BOOT))
-        {
-            out = (entry.level == LOG_LEVEL_ERROR) ? stderr :
-                        (entry.level == LOG_LEVEL_WARN) ? stderr : stdout;
-            const char* color = (entry.level == LOG_LEVEL_ERROR) ? "\033[1;31m" :
-                                (entry.level == LOG_LEVEL_WARN) ? "\033[1;33m" : "";
-            const char* reset = "\033[0m";
+static void m_push(uint32_t level, const char* text, size_t len)
+{
+    t_logRecord* rec;
+    uint64_t pos;
+    size_t need;
 
-            fprintf(out, "%s%s%s", color, entry.message, color[0] ? reset : "");
+    need = LOG_ALIGN(sizeof(t_logRecord) + len);
+    pos = atomic_load_explicit(&log_ring_head, memory_order_relaxed);
+    do
+    {
+        if (pos + need - atomic_load_explicit(&log_ring_tail, memory_order_acquire) > LOG_RING_SIZE)
+        {
+            atomic_fetch_add_explicit(&log_dropped_count, 1, memory_order_relaxed);
+            return;
         }
-    }
+    } while (!atomic_compare_exchange_weak_explicit(&log_ring_head, &pos, pos + need,
+                                                    memory_order_seq_cst, memory_order_relaxed));
 
-    return NULL;
+    rec = (t_logRecord*)(log_ring + (pos & LOG_RING_MASK));
+    rec->level = level;
+    m_ring_copy_in(pos + sizeof(t_logRecord), text, len);
+    atomic_store(&rec->len, (unsigned)len);
+
+    m_wake_worker();
 }
 
 static void get_timestamp(char *buffer, size_t buffer_size)
 {
-    static char cached_time_prefix[64] = {0};
-    static time_t last_sec = 0;
+    static __thread char cached_time_prefix[64] = {0};
+    static __thread time_t last_sec = 0;
     struct timeval tv;
     struct tm tm_info;
 
@@ -103,22 +421,53 @@ static void get_timestamp(char *buffer, size_t buffer_size)
     snprintf(buffer, buffer_size, "%s.%03ld", cached_time_prefix, (long)(tv.tv_usec / 1000));
 }
 
-int log_init(char* log_file_path, bool log_erase, log_level log_level)
+static void m_on_binary_create(log_file_t* f)
+{
+    /* a fresh file has to define its formats again */
+    memset(m_format_written, 0, sizeof(m_format_written));
+    log_file_write(f, LOG_BIN_MAGIC, strlen(LOG_BIN_MAGIC));
+}
+
+void log_set_writer_options(const log_writer_options* opts)
+{
+    if (opts && !m_log_file)
+        m_writer_options = *opts;
+}
+
+static int64_t m_dropped_metric(void)
+{
+    return log_dropped();
+}
+
+void log_set_level(log_level level)
+{
+    atomic_store_explicit(&m_log_threshold, level, memory_order_relaxed);
+}
+
+int log_init(char* log_file_path, bool log_erase, log_level log_level, char* log_binary_path)
 {
-    char* options;
+    log_set_level(log_level);
 
-    options = log_erase == true ? "w+" : "a";
-    m_log_threshold = log_level;
+    log_ring = calloc(1, LOG_RING_SIZE);
+    if (!log_ring)
+        return -1;
 
-    m_log_fp = fopen(log_file_path, options);
-    if (!m_log_fp)
+    m_log_file = log_file_open(log_file_path, log_erase, &m_writer_options, NULL);
+    if (!m_log_file)
     {
-        perror("fopen");
+        free(log_ring);
+        log_ring = NULL;
         return -1;
     }
+    if (log_binary_path && log_binary_path[0])
+        m_bin_file = log_file_open(log_binary_path, log_erase, &m_writer_options, m_on_binary_create);
+    m_out_batch.fd = STDOUT_FILENO;
+    m_err_batch.fd = STDERR_FILENO;
+
+    log_depth = metrics_histogram("log_queue_bytes", "Log ring bytes pending when the writer drains", NULL);
+    metrics_counter_fn("log_dropped_total", "Log messages dropped on a full ring", NULL, m_dropped_metric);
 
-    log_queue = malloc(LOG_QUEUE_SIZE * sizeof(t_logEntry));
-    log_running = true;
+    atomic_store(&log_running, true);
     pthread_create(&log_thread, NULL, log_worker_thread, NULL);
 
     return 0;
@@ -126,54 +475,108 @@ int log_init(char* log_file_path, bool log_erase, log_level log_level)
 
 void log_close(void)
 {
+    if (!m_log_file)
+        return;
+
     pthread_mutex_lock(&log_mutex);
-    log_running = false;
+    atomic_store(&log_running, false);
     pthread_cond_signal(&log_cond);
     pthread_mutex_unlock(&log_mutex);
 
     pthread_join(log_thread, NULL);
 
-    if (m_log_fp)
-    {
-        fclose(m_log_fp);
-        m_log_fp = NULL;
-    }
+    log_file_close(m_log_file);
+    m_log_file = NULL;
+    log_file_close(m_bin_file);
+    m_bin_file = NULL;
+    free(log_ring);
+    log_ring = NULL;
+}
+
+unsigned long log_dropped(void)
+{
+    return atomic_load_explicit(&log_dropped_count, memory_order_relaxed);
 }
 
 void log_msg(log_level level, const char *fmt, ...)
 {
     char timestamp[90];
-    char log_line[LOG_MSG_MAX_LEN];
     va_list args;
     int offset;
-    int next_head;
+    int len;
 
-    if (!m_log_fp) return;
+    if (!m_log_file || !atomic_load_explicit(&log_running, memory_order_relaxed)) return;
 
-    if (level > m_log_threshold && level != LOG_LEVEL_BOOT)
+    if (level > atomic_load_explicit(&m_log_threshold, memory_order_relaxed) && level != LOG_LEVEL_BOOT)
         return;
 
     get_timestamp(timestamp, sizeof(timestamp));
 
     va_start(args, fmt);
-    offset = snprintf(log_line, sizeof(log_line), "[%s] ", timestamp);
-    vsnprintf(log_line + offset, sizeof(log_line) - offset, fmt, args);
+    offset = snprintf(m_staging, sizeof(m_staging), "[%s] ", timestamp);
+    len = vsnprintf(m_staging + offset, sizeof(m_staging) - offset, fmt, args);
     va_end(args);
 
-    pthread_mutex_lock(&log_mutex);
-    next_head = (log_queue_head + 1) % LOG_QUEUE_SIZE;
-    if (next_head != log_queue_tail)
+    if (len < 0)
+        return;
+    len += offset;
+    if (len >= (int)sizeof(m_staging))
+        len = sizeof(m_staging) - 1;
+
+    m_push(level, m_staging, len);
+}
+
+int log_register_format(const char* fmt)
+{
+    log_format_t* f;
+    int n;
+    int i;
+
+    pthread_mutex_lock(&m_format_mutex);
+    n = atomic_load_explicit(&m_n_formats, memory_order_relaxed);
+    for (i = 0; i < n; i++)
     {
-        log_queue[log_queue_head].level = level;
-        strncpy(log_queue[log_queue_head].message, log_line, LOG_MSG_MAX_LEN - 1);
-        log_queue[log_queue_head].message[LOG_MSG_MAX_LEN - 1] = '\0';
-        log_queue_head = next_head;
-        pthread_cond_signal(&log_cond);
+        if (m_format_src[i] == fmt)
+        {
+            pthread_mutex_unlock(&m_format_mutex);
+            return i;
+        }
     }
-    else
+
+    f = (n < LOG_MAX_FORMATS) ? log_format_parse(fmt) : NULL;
+    if (!f)
     {
-        /* foo */
+        pthread_mutex_unlock(&m_format_mutex);
+        return -1;
     }
+    m_format_src[n] = fmt;
+    m_formats[n] = f;
+    atomic_store_explicit(&m_n_formats, n + 1, memory_order_release);
+    pthread_mutex_unlock(&m_format_mutex);
+    return n;
+}
 
-    pthread_mutex_unlock(&log_mutex);
+void log_fast(log_level level, int fmt_id, ...)
+{
+    log_bin_header_t header;
+    struct timespec ts;
+    va_list args;
+    size_t len;
+
+    if (!m_log_file || !atomic_load_explicit(&log_running, memory_order_relaxed)) return;
+
+    if (level > atomic_load_explicit(&m_log_threshold, memory_order_relaxed) && level != LOG_LEVEL_BOOT)
+        return;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.ts_ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+    header.fmt_id = fmt_id;
+    memcpy(m_staging, &header, sizeof(header));
+
+    va_start(args, fmt_id);
+    len = log_format_pack(m_formats[fmt_id], m_staging + sizeof(header),
+                          sizeof(m_staging) - sizeof(header), args);
+    va_end(args);
+
+    m_push(level | LOG_RECORD_BINARY, m_staging, sizeof(header) + len);
 }
@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef enum
 {
@@ -13,10 +14,51 @@ typedef enum
     LOG_LEVEL_DEBUG,
 } log_level;
 
-int log_init(char* log_file_path, bool log_erase, log_level log_level);
+typedef struct
+{
+    size_t rotate_size;     /* bytes, 0 = never */
+    int rotate_interval;    /* seconds, 0 = never */
+    int rotate_keep;        /* rotated files kept, 0 = all */
+    bool compress;          /* gzip rotated files in the background */
+    int flush_ms;           /* longest a line waits in the write buffer */
+    bool direct;            /* O_DIRECT, falls back when unsupported */
+} log_writer_options;
+
+/* before log_init(), defaults: no rotation, keep 5, gzip, 200 ms, buffered */
+void log_set_writer_options(const log_writer_options* opts);
+
+/* log_binary_path: file for LOG_FAST records (decoded with log_decode), NULL formats them as text */
+int log_init(char* log_file_path, bool log_erase, log_level log_level, char* log_binary_path);
 
 void log_close(void);
 
+/* any time, from any thread */
+void log_set_level(log_level level);
+
 void log_msg(log_level level, const char *fmt, ...);
 
+/*
+ * Deferred formatting for hot paths: the format is registered once per
+ * call site, then only a format id, a timestamp and the raw arguments are
+ * copied into the ring. The writer thread (or log_decode) formats them.
+ * Formats that cannot be deferred (%n, '*' width, long double) fall back
+ * to log_msg.
+ */
+#define LOG_FAST(level, fmt, ...) \
+    do { \
+        static int log_fmt_id_ = -2; \
+        if (__atomic_load_n(&log_fmt_id_, __ATOMIC_ACQUIRE) == -2) \
+            __atomic_store_n(&log_fmt_id_, log_register_format(fmt), __ATOMIC_RELEASE); \
+        if (log_fmt_id_ >= 0) \
+            log_fast(level, log_fmt_id_, ##__VA_ARGS__); \
+        else \
+            log_msg(level, fmt, ##__VA_ARGS__); \
+    } while (0)
+
+int log_register_format(const char* fmt);
+void log_fast(log_level level, int fmt_id, ...);
+
+/* messages lost because the ring was full, since log_init() */
+unsigned long log_dropped(void);
+
 #endif /* LOG_API_H */
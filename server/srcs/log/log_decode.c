@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "log_format.h"
+
+/* Decodes a LOG_BINARY_PATH file into the text log format. */
+
+#define LOG_DECODE_MAX_FORMATS 1024
+#define LOG_DECODE_MAX_RECORD (64 * 1024)
+
+static log_format_t* m_formats[LOG_DECODE_MAX_FORMATS];
+
+static int m_read(FILE* fp, void* dst, size_t len)
+{
+    return fread(dst, 1, len, fp) == len ? 0 : -1;
+}
+
+static int m_read_format(FILE* fp)
+{
+    char* src;
+    uint32_t id;
+    uint32_t len;
+
+    if (m_read(fp, &id, sizeof(id)) || m_read(fp, &len, sizeof(len))
+        || id >= LOG_DECODE_MAX_FORMATS || len >= LOG_DECODE_MAX_RECORD)
+        return -1;
+
+    src = malloc(len + 1);
+    if (!src || m_read(fp, src, len))
+    {
+        free(src);
+        return -1;
+    }
+    src[len] = '\0';
+    log_format_free(m_formats[id]);
+    m_formats[id] = log_format_parse(src);
+    free(src);
+    return 0;
+}
+
+static int m_read_message(FILE* fp, char* payload, char* text, size_t text_len)
+{
+    log_bin_header_t header;
+    uint8_t level;
+    uint32_t len;
+    size_t n;
+
+    if (m_read(fp, &level, sizeof(level)) || m_read(fp, &len, sizeof(len))
+        || len < sizeof(header) || len > LOG_DECODE_MAX_RECORD || m_read(fp, payload, len))
+        return -1;
+
+    memcpy(&header, payload, sizeof(header));
+    if (header.fmt_id >= LOG_DECODE_MAX_FORMATS || !m_formats[header.fmt_id])
+    {
+        fprintf(stderr, "log_decode: unknown format id %u\n", header.fmt_id);
+        return 0;
+    }
+
+    n = log_format_timestamp(header.ts_ns, text, text_len);
+    n += log_format_render(m_formats[header.fmt_id], payload + sizeof(header), len - sizeof(header),
+                           text + n, text_len - n);
+    fwrite(text, 1, n, stdout);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    static char payload[LOG_DECODE_MAX_RECORD];
+    static char text[LOG_DECODE_MAX_RECORD];
+    char magic[sizeof(LOG_BIN_MAGIC) - 1];
+    FILE* fp;
+    int kind;
+    int rc;
+    int i;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s <binary log>\n", argv[0]);
+        return 1;
+    }
+
+    fp = fopen(argv[1], "rb");
+    if (!fp)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    if (m_read(fp, magic, sizeof(magic)) || memcmp(magic, LOG_BIN_MAGIC, sizeof(magic)) != 0)
+    {
+        fprintf(stderr, "log_decode: %s is not a binary log\n", argv[1]);
+        fclose(fp);
+        return 1;
+    }
+
+    rc = 0;
+    while ((kind = fgetc(fp)) != EOF)
+    {
+        if (kind == LOG_BIN_FORMAT)
+            rc = m_read_format(fp);
+        else if (kind == LOG_BIN_MESSAGE)
+            rc = m_read_message(fp, payload, text, sizeof(text));
+        else
+            rc = -1;
+        if (rc != 0)
+        {
+            fprintf(stderr, "log_decode: truncated or corrupt record at offset %ld\n", ftell(fp));
+            break;
+        }
+    }
+
+    for (i = 0; i < LOG_DECODE_MAX_FORMATS; i++)
+        log_format_free(m_formats[i]);
+    fclose(fp);
+    return rc == 0 ? 0 : 1;
+}
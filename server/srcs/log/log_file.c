@@ -0,0 +1,367 @@
+#define _GNU_SOURCE     /* O_DIRECT */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <glob.h>
+#include <spawn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "log_file.h"
+
+#define LOG_FILE_BUFFER (1024 * 1024)
+#define LOG_FILE_ALIGN 4096
+#define LOG_FILE_MAX_CHILDREN 8
+
+#define LOG_FILE_ALIGN_UP(x) (((x) + LOG_FILE_ALIGN - 1) & ~(size_t)(LOG_FILE_ALIGN - 1))
+#define LOG_FILE_ALIGN_DOWN(x) ((x) & ~(size_t)(LOG_FILE_ALIGN - 1))
+
+extern char** environ;
+
+struct log_file_s
+{
+    char* path;
+    int fd;
+    bool direct;
+    log_writer_options opts;
+    log_file_create_cb on_create;
+
+    char* buf;              /* LOG_FILE_BUFFER bytes, LOG_FILE_ALIGN aligned */
+    size_t len;
+    size_t written;         /* leading bytes of buf already on disk */
+    off_t off;              /* file offset of buf[0] */
+
+    time_t opened_at;
+    uint64_t pending_since; /* ms, 0 when everything is written */
+    pid_t children[LOG_FILE_MAX_CHILDREN];
+};
+
+static uint64_t m_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int m_pwrite_all(log_file_t* f, const char* data, size_t len, off_t off)
+{
+    ssize_t n;
+    int flags;
+
+    while (len > 0)
+    {
+        n = pwrite(f->fd, data, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EINVAL && f->direct)
+        {
+            /* the filesystem refused direct I/O after all */
+            flags = fcntl(f->fd, F_GETFL);
+            fcntl(f->fd, F_SETFL, flags & ~O_DIRECT);
+            f->direct = false;
+            continue;
+        }
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+/* partial: also write the unaligned tail (padded with direct I/O) */
+static void m_flush(log_file_t* f, bool partial)
+{
+    size_t full;
+    size_t n;
+
+    if (f->len == f->written)
+        return;
+
+    if (!f->direct)
+    {
+        m_pwrite_all(f, f->buf + f->written, f->len - f->written, f->off + f->written);
+        f->off += f->len;
+        f->len = 0;
+        f->written = 0;
+        f->pending_since = 0;
+        return;
+    }
+
+    full = LOG_FILE_ALIGN_DOWN(f->len);
+    n = partial ? LOG_FILE_ALIGN_UP(f->len) : full;
+    if (n == 0)
+        return;
+    memset(f->buf + f->len, 0, n - f->len);
+    m_pwrite_all(f, f->buf, n, f->off);
+    if (n > f->len && ftruncate(f->fd, f->off + f->len) < 0)
+        perror("ftruncate");
+
+    memmove(f->buf, f->buf + full, f->len - full);
+    f->off += full;
+    f->len -= full;
+    f->written = n > full ? f->len : 0;
+    if (f->written == f->len)
+        f->pending_since = 0;
+}
+
+static int m_open_fd(log_file_t* f, bool truncate)
+{
+    struct stat st;
+    int flags;
+
+    flags = O_RDWR | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0);
+    f->direct = f->opts.direct;
+    f->fd = f->direct ? open(f->path, flags | O_DIRECT, 0644) : -1;
+    if (f->fd < 0)
+    {
+        f->direct = false;
+        f->fd = open(f->path, flags, 0644);
+    }
+    if (f->fd < 0 || fstat(f->fd, &st) < 0)
+    {
+        perror("open");
+        return -1;
+    }
+
+    f->opened_at = time(NULL);
+    f->len = 0;
+    f->written = 0;
+    f->pending_since = 0;
+    f->off = st.st_size;
+    if (f->direct && st.st_size % LOG_FILE_ALIGN)
+    {
+        /* direct writes start on a block: reload the partial last one */
+        f->off = LOG_FILE_ALIGN_DOWN((size_t)st.st_size);
+        if (pread(f->fd, f->buf, LOG_FILE_ALIGN, f->off) != st.st_size - f->off)
+        {
+            f->direct = false;
+            fcntl(f->fd, F_SETFL, fcntl(f->fd, F_GETFL) & ~O_DIRECT);
+            f->off = st.st_size;
+        }
+        else
+        {
+            f->len = st.st_size - f->off;
+            f->written = f->len;
+        }
+    }
+
+    if (st.st_size == 0 && f->on_create)
+        f->on_create(f);
+    return 0;
+}
+
+static void m_reap(log_file_t* f, bool block)
+{
+    int i;
+
+    for (i = 0; i < LOG_FILE_MAX_CHILDREN; i++)
+    {
+        if (f->children[i] > 0 && waitpid(f->children[i], NULL, block ? 0 : WNOHANG) != 0)
+            f->children[i] = 0;
+    }
+}
+
+static void m_compress(log_file_t* f, char* rotated)
+{
+    char* argv[] = { "gzip", "-f", rotated, NULL };
+    pid_t pid;
+    int i;
+
+    m_reap(f, false);
+    for (i = 0; i < LOG_FILE_MAX_CHILDREN && f->children[i] > 0; i++)
+        ;
+    if (i == LOG_FILE_MAX_CHILDREN)
+        return;     /* too many pending, this one stays plain */
+    if (posix_spawnp(&pid, "gzip", NULL, NULL, argv, environ) == 0)
+        f->children[i] = pid;
+}
+
+/* a rotated file and its .gz twin (while gzip runs) count once */
+static bool m_same_rotation(const char* a, const char* b)
+{
+    size_t la;
+    size_t lb;
+
+    la = strlen(a);
+    lb = strlen(b);
+    if (la > 3 && strcmp(a + la - 3, ".gz") == 0)
+        la -= 3;
+    if (lb > 3 && strcmp(b + lb - 3, ".gz") == 0)
+        lb -= 3;
+    return la == lb && strncmp(a, b, la) == 0;
+}
+
+/* rotated names sort by age, the newest rotate_keep survive */
+static void m_prune(log_file_t* f)
+{
+    char pattern[4096];
+    glob_t g;
+    size_t count;
+    size_t i;
+
+    snprintf(pattern, sizeof(pattern), "%s.[0-9]*", f->path);
+    if (glob(pattern, 0, NULL, &g) != 0)
+        return;
+
+    count = 0;
+    for (i = 0; i < g.gl_pathc; i++)
+        if (i == 0 || !m_same_rotation(g.gl_pathv[i - 1], g.gl_pathv[i]))
+            count++;
+    for (i = 0; i < g.gl_pathc && count > (size_t)f->opts.rotate_keep; i++)
+    {
+        unlink(g.gl_pathv[i]);
+        if (i + 1 == g.gl_pathc || !m_same_rotation(g.gl_pathv[i], g.gl_pathv[i + 1]))
+            count--;
+    }
+    globfree(&g);
+}
+
+static void m_rotate_file(log_file_t* f)
+{
+    char rotated[4096];
+    struct timespec ts;
+    struct tm tm_info;
+    size_t n;
+    int i;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    localtime_r(&ts.tv_sec, &tm_info);
+    n = snprintf(rotated, sizeof(rotated), "%s.", f->path);
+    n += strftime(rotated + n, sizeof(rotated) - n, "%Y%m%d-%H%M%S", &tm_info);
+    n += snprintf(rotated + n, sizeof(rotated) - n, ".%03ld", ts.tv_nsec / 1000000);
+    for (i = 1; access(rotated, F_OK) == 0 && n < sizeof(rotated) - 8; i++)
+        snprintf(rotated + n, sizeof(rotated) - n, "-%d", i);
+
+    if (rename(f->path, rotated) < 0)
+    {
+        perror("rename");
+        return;
+    }
+    if (f->opts.compress)
+        m_compress(f, rotated);
+    if (f->opts.rotate_keep > 0)
+        m_prune(f);
+}
+
+static void m_rotate(log_file_t* f)
+{
+    m_flush(f, true);
+    close(f->fd);
+    f->fd = -1;
+    m_rotate_file(f);
+    m_open_fd(f, true);
+}
+
+log_file_t* log_file_open(const char* path, bool erase, const log_writer_options* opts,
+                          log_file_create_cb on_create)
+{
+    log_file_t* f;
+    struct stat st;
+
+    f = calloc(1, sizeof(*f));
+    if (!f)
+        return NULL;
+    if (posix_memalign((void**)&f->buf, LOG_FILE_ALIGN, LOG_FILE_BUFFER) != 0)
+    {
+        free(f);
+        return NULL;
+    }
+    f->path = strdup(path);
+    f->opts = *opts;
+    f->on_create = on_create;
+    if (f->opts.flush_ms <= 0)
+        f->opts.flush_ms = 1;
+
+    /* with rotation on, erasing keeps the previous run as a rotated file */
+    if (erase && (opts->rotate_size || opts->rotate_interval)
+        && stat(path, &st) == 0 && st.st_size > 0)
+    {
+        m_rotate_file(f);
+        erase = false;
+    }
+
+    if (m_open_fd(f, erase) < 0)
+    {
+        free(f->buf);
+        free(f->path);
+        free(f);
+        return NULL;
+    }
+    return f;
+}
+
+void log_file_write(log_file_t* f, const void* data, size_t len)
+{
+    const char* p;
+    size_t chunk;
+
+    if (f->fd < 0)
+        return;
+    if (f->pending_since == 0 && len > 0)
+        f->pending_since = m_now_ms();
+
+    p = data;
+    while (len > 0)
+    {
+        if (f->len == LOG_FILE_BUFFER)
+        {
+            m_flush(f, false);
+            if (f->pending_since == 0)
+                f->pending_since = m_now_ms();
+        }
+        chunk = LOG_FILE_BUFFER - f->len;
+        if (chunk > len)
+            chunk = len;
+        memcpy(f->buf + f->len, p, chunk);
+        f->len += chunk;
+        p += chunk;
+        len -= chunk;
+    }
+}
+
+int log_file_tick(log_file_t* f)
+{
+    uint64_t now;
+    uint64_t due;
+
+    if (f->fd < 0)
+        return -1;
+
+    m_reap(f, false);
+    if ((f->opts.rotate_size && (size_t)f->off + f->len >= f->opts.rotate_size)
+        || (f->opts.rotate_interval && time(NULL) - f->opened_at >= f->opts.rotate_interval))
+        m_rotate(f);
+    if (f->fd < 0 || f->pending_since == 0)
+        return -1;
+
+    now = m_now_ms();
+    due = f->pending_since + f->opts.flush_ms;
+    if (now >= due)
+    {
+        m_flush(f, true);
+        return -1;
+    }
+    return (int)(due - now);
+}
+
+void log_file_close(log_file_t* f)
+{
+    if (!f)
+        return;
+    if (f->fd >= 0)
+    {
+        m_flush(f, true);
+        close(f->fd);
+    }
+    m_reap(f, true);
+    free(f->buf);
+    free(f->path);
+    free(f);
+}
@@ -0,0 +1,34 @@
+#ifndef LOG_FILE_H
+#define LOG_FILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "log_api.h"
+
+/*
+ * Buffered log file owned by the writer thread.
+ *
+ * Lines collect in a large aligned buffer that is written when full or
+ * once flush_ms has passed since the oldest unwritten line. With direct
+ * I/O only whole blocks are written, the partial tail block is padded,
+ * the file truncated back, and rewritten in place on the next flush.
+ *
+ * Rotation renames the file to <path>.<YYYYmmdd-HHMMSS.mmm>, gzips it
+ * in the background and keeps the newest rotate_keep rotated files.
+ */
+
+typedef struct log_file_s log_file_t;
+
+/* called on every fresh (empty) file, e.g. to write a header */
+typedef void (*log_file_create_cb)(log_file_t* f);
+
+log_file_t* log_file_open(const char* path, bool erase, const log_writer_options* opts,
+                          log_file_create_cb on_create);
+void log_file_write(log_file_t* f, const void* data, size_t len);
+
+/* timed flush and rotation, returns ms until the next timed flush or -1 */
+int log_file_tick(log_file_t* f);
+
+void log_file_close(log_file_t* f);
+
+#endif /* LOG_FILE_H */
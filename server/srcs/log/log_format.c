@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include "log_format.h"
+
+#define LOG_STR_MAX 4096
+#define LOG_STR_NULL UINT32_MAX
+
+typedef enum
+{
+    LOG_ARG_NONE,       /* trailing literal, %% already collapsed */
+    LOG_ARG_INT,
+    LOG_ARG_LONG,
+    LOG_ARG_LLONG,
+    LOG_ARG_SIZE,
+    LOG_ARG_INTMAX,
+    LOG_ARG_PTRDIFF,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_STR,
+    LOG_ARG_PTR,
+} log_arg_type;
+
+typedef struct
+{
+    char* fmt;
+    size_t len;
+    log_arg_type type;
+} log_segment_t;
+
+struct log_format_s
+{
+    log_segment_t* segs;
+    size_t count;
+};
+
+static void m_add_segment(log_format_t* f, const char* start, size_t len, log_arg_type type)
+{
+    log_segment_t* seg;
+    size_t i;
+    size_t j;
+
+    f->segs = realloc(f->segs, (f->count + 1) * sizeof(log_segment_t));
+    seg = &f->segs[f->count++];
+    seg->fmt = malloc(len + 1);
+    seg->type = type;
+    if (type != LOG_ARG_NONE)
+    {
+        memcpy(seg->fmt, start, len);
+        seg->len = len;
+    }
+    else
+    {
+        for (i = 0, j = 0; i < len; i++, j++)
+        {
+            seg->fmt[j] = start[i];
+            if (start[i] == '%' && i + 1 < len && start[i + 1] == '%')
+                i++;
+        }
+        seg->len = j;
+    }
+    seg->fmt[seg->len] = '\0';
+}
+
+/* *p is the conversion after '%', returns the argument type or -1 */
+static int m_conversion(const char** p)
+{
+    const char* q;
+    int length;
+
+    q = *p;
+    while (*q && strchr("-+ #0'", *q))
+        q++;
+    while (*q >= '0' && *q <= '9')
+        q++;
+    if (*q == '.')
+    {
+        q++;
+        while (*q >= '0' && *q <= '9')
+            q++;
+    }
+    if (*q == '*')
+        return -1;
+
+    length = LOG_ARG_INT;
+    if (q[0] == 'h')
+        q += (q[1] == 'h') ? 2 : 1;
+    else if (q[0] == 'l' && q[1] == 'l')
+    {
+        length = LOG_ARG_LLONG;
+        q += 2;
+    }
+    else if (q[0] == 'l')
+    {
+        length = LOG_ARG_LONG;
+        q++;
+    }
+    else if (q[0] == 'z')
+    {
+        length = LOG_ARG_SIZE;
+        q++;
+    }
+    else if (q[0] == 'j')
+    {
+        length = LOG_ARG_INTMAX;
+        q++;
+    }
+    else if (q[0] == 't')
+    {
+        length = LOG_ARG_PTRDIFF;
+        q++;
+    }
+
+    *p = q + 1;
+    switch (*q)
+    {
+        case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+            return length;
+        case 'c':
+            return length == LOG_ARG_INT ? LOG_ARG_INT : -1;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            return LOG_ARG_DOUBLE;
+        case 's':
+            return length == LOG_ARG_INT ? LOG_ARG_STR : -1;
+        case 'p':
+            return LOG_ARG_PTR;
+        default:
+            return -1;
+    }
+}
+
+log_format_t* log_format_parse(const char* fmt)
+{
+    log_format_t* f;
+    const char* start;
+    const char* p;
+    int type;
+
+    if (!fmt)
+        return NULL;
+
+    f = calloc(1, sizeof(*f));
+    start = fmt;
+    p = fmt;
+    while (*p)
+    {
+        if (*p != '%')
+        {
+            p++;
+            continue;
+        }
+        if (p[1] == '%')
+        {
+            p += 2;
+            continue;
+        }
+        p++;
+        type = m_conversion(&p);
+        if (type < 0)
+        {
+            log_format_free(f);
+            return NULL;
+        }
+        m_add_segment(f, start, p - start, type);
+        start = p;
+    }
+    if (p > start)
+        m_add_segment(f, start, p - start, LOG_ARG_NONE);
+    return f;
+}
+
+void log_format_free(log_format_t* f)
+{
+    size_t i;
+
+    if (!f)
+        return;
+    for (i = 0; i < f->count; i++)
+        free(f->segs[i].fmt);
+    free(f->segs);
+    free(f);
+}
+
+size_t log_format_pack(const log_format_t* f, char* out, size_t cap, va_list ap)
+{
+    const char* s;
+    uint64_t v;
+    uint32_t len;
+    size_t off;
+    size_t i;
+    double d;
+
+    off = 0;
+    for (i = 0; i < f->count; i++)
+    {
+        v = 0;
+        switch (f->segs[i].type)
+        {
+            case LOG_ARG_NONE:
+                continue;
+            case LOG_ARG_INT: v = (uint64_t)(int64_t)va_arg(ap, int); break;
+            case LOG_ARG_LONG: v = (uint64_t)(int64_t)va_arg(ap, long); break;
+            case LOG_ARG_LLONG: v = (uint64_t)va_arg(ap, long long); break;
+            case LOG_ARG_SIZE: v = (uint64_t)va_arg(ap, size_t); break;
+            case LOG_ARG_INTMAX: v = (uint64_t)va_arg(ap, intmax_t); break;
+            case LOG_ARG_PTRDIFF: v = (uint64_t)(int64_t)va_arg(ap, ptrdiff_t); break;
+            case LOG_ARG_PTR: v = (uint64_t)(uintptr_t)va_arg(ap, void*); break;
+            case LOG_ARG_DOUBLE:
+                d = va_arg(ap, double);
+                memcpy(&v, &d, sizeof(v));
+                break;
+            case LOG_ARG_STR:
+                s = va_arg(ap, const char*);
+                if (off + sizeof(len) > cap)
+                    return off;
+                len = s ? strnlen(s, LOG_STR_MAX - 1) : LOG_STR_NULL;
+                if (s && len > cap - off - sizeof(len))
+                    len = cap - off - sizeof(len);
+                memcpy(out + off, &len, sizeof(len));
+                off += sizeof(len);
+                if (s)
+                {
+                    memcpy(out + off, s, len);
+                    off += len;
+                }
+                continue;
+        }
+        if (off + sizeof(v) > cap)
+            return off;
+        memcpy(out + off, &v, sizeof(v));
+        off += sizeof(v);
+    }
+    return off;
+}
+
+static int m_render_str(const log_segment_t* seg, const char* args, size_t len, size_t* off,
+                        char* out, size_t cap)
+{
+    char str[LOG_STR_MAX];
+    uint32_t n;
+
+    if (*off + sizeof(n) > len)
+        return -1;
+    memcpy(&n, args + *off, sizeof(n));
+    *off += sizeof(n);
+    if (n == LOG_STR_NULL)
+        return snprintf(out, cap, seg->fmt, "(null)");
+    if (n > len - *off || n >= sizeof(str))
+        return -1;
+    memcpy(str, args + *off, n);
+    str[n] = '\0';
+    *off += n;
+    return snprintf(out, cap, seg->fmt, str);
+}
+
+size_t log_format_render(const log_format_t* f, const char* args, size_t len, char* out, size_t cap)
+{
+    const log_segment_t* seg;
+    size_t pos;
+    size_t off;
+    size_t i;
+    uint64_t v;
+    double d;
+    int n;
+
+    if (cap == 0)
+        return 0;
+    out[0] = '\0';
+    pos = 0;
+    off = 0;
+    for (i = 0; i < f->count && pos < cap - 1; i++)
+    {
+        seg = &f->segs[i];
+        if (seg->type == LOG_ARG_NONE)
+        {
+            n = seg->len < cap - 1 - pos ? seg->len : cap - 1 - pos;
+            memcpy(out + pos, seg->fmt, n);
+            pos += n;
+            out[pos] = '\0';
+            continue;
+        }
+        if (seg->type == LOG_ARG_STR)
+        {
+            n = m_render_str(seg, args, len, &off, out + pos, cap - pos);
+            if (n < 0)
+                break;
+        }
+        else
+        {
+            if (off + sizeof(v) > len)
+                break;
+            memcpy(&v, args + off, sizeof(v));
+            off += sizeof(v);
+            switch (seg->type)
+            {
+                case LOG_ARG_LONG: n = snprintf(out + pos, cap - pos, seg->fmt, (long)v); break;
+                case LOG_ARG_LLONG: n = snprintf(out + pos, cap - pos, seg->fmt, (long long)v); break;
+                case LOG_ARG_SIZE: n = snprintf(out + pos, cap - pos, seg->fmt, (size_t)v); break;
+                case LOG_ARG_INTMAX: n = snprintf(out + pos, cap - pos, seg->fmt, (intmax_t)v); break;
+                case LOG_ARG_PTRDIFF: n = snprintf(out + pos, cap - pos, seg->fmt, (ptrdiff_t)v); break;
+                case LOG_ARG_PTR: n = snprintf(out + pos, cap - pos, seg->fmt, (void*)(uintptr_t)v); break;
+                case LOG_ARG_DOUBLE:
+                    memcpy(&d, &v, sizeof(d));
+                    n = snprintf(out + pos, cap - pos, seg->fmt, d);
+                    break;
+                default: n = snprintf(out + pos, cap - pos, seg->fmt, (int)v); break;
+            }
+        }
+        if (n < 0)
+            break;
+        pos += (size_t)n < cap - pos ? (size_t)n : cap - pos - 1;
+    }
+    return pos;
+}
+
+size_t log_format_timestamp(uint64_t ts_ns, char* out, size_t cap)
+{
+    static __thread char cached_time_prefix[64] = {0};
+    static __thread time_t last_sec = 0;
+    struct tm tm_info;
+    time_t sec;
+    int n;
+
+    sec = (time_t)(ts_ns / 1000000000ull);
+    if (sec != last_sec)
+    {
+        localtime_r(&sec, &tm_info);
+        snprintf(cached_time_prefix, sizeof(cached_time_prefix),
+                 "%02d.%02d.%04d %02d:%02d:%02d",
+                 tm_info.tm_mday,
+                 tm_info.tm_mon + 1,
+                 tm_info.tm_year + 1900,
+                 tm_info.tm_hour,
+                 tm_info.tm_min,
+                 tm_info.tm_sec);
+        last_sec = sec;
+    }
+
+    n = snprintf(out, cap, "[%s.%03ld] ", cached_time_prefix, (long)((ts_ns / 1000000ull) % 1000));
+    if (n < 0)
+        return 0;
+    return (size_t)n < cap ? (size_t)n : cap - 1;
+}
@@ -0,0 +1,42 @@
+#ifndef LOG_FORMAT_H
+#define LOG_FORMAT_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Deferred printf formatting, shared by the logger and log_decode.
+ *
+ * A format is split once into segments holding at most one conversion.
+ * pack() copies the raw arguments (8 bytes per scalar, length + bytes
+ * per string) and render() replays them segment by segment.
+ */
+
+#define LOG_BIN_MAGIC "MTCHLOG1"
+#define LOG_BIN_FORMAT 'F'      /* u32 id, u32 len, format text */
+#define LOG_BIN_MESSAGE 'M'     /* u8 level, u32 len, payload */
+
+/* payload of a binary record: header then packed arguments */
+typedef struct
+{
+    uint64_t ts_ns;
+    uint32_t fmt_id;
+} __attribute__((packed)) log_bin_header_t;
+
+typedef struct log_format_s log_format_t;
+
+/* NULL when the format uses something that cannot be deferred (%n, *, L) */
+log_format_t* log_format_parse(const char* fmt);
+void log_format_free(log_format_t* f);
+
+/* returns the packed size, at most cap */
+size_t log_format_pack(const log_format_t* f, char* out, size_t cap, va_list ap);
+
+/* returns the rendered length, out is always terminated */
+size_t log_format_render(const log_format_t* f, const char* args, size_t len, char* out, size_t cap);
+
+/* "[dd.mm.yyyy hh:mm:ss.mmm] " like the text log lines */
+size_t log_format_timestamp(uint64_t ts_ns, char* out, size_t cap);
+
+#endif /* LOG_FORMAT_H */
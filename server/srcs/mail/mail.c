@@ -1,16 +1,46 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <glob.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "mail_api.h"
+#include "mail_smtp.h"
+#include "../log/log_api.h"
+#include "../metrics/metrics_api.h"
 #include "../../inc/ft_malloc.h"
 #include "../../inc/error_codes.h"
+#include "../../inc/ft_ilist.h"
 
-typedef struct 
+#define MAIL_IO_TIMEOUT_MS 30000    /* defaults of mail_options */
+#define MAIL_IDLE_SECONDS 30
+#define MAIL_RETRY_BASE 5           /* seconds before the first retry, doubled per attempt */
+#define MAIL_RETRY_MAX 900
+#define MAIL_SPOOL_EXT ".mail"
+
+typedef struct
 {
     mail_subject_t subject_type;
     char* subject;
 } mail_subject_map_t;
 
+typedef struct mail_item_s
+{
+    char name[64];              /* spool file name, unique per mail */
+    char* to;
+    char* msg;                  /* headers and body */
+    int attempts;
+    time_t next_attempt;
+    ft_ilist_node_t link;       /* in m_pending */
+} mail_item_t;
+
 static mail_subject_map_t subject_map[] =
 {
     {SUBJECT_LOGIN, "Login Notification"},
@@ -22,50 +52,468 @@ static mail_subject_map_t subject_map[] =
     {SUBJECT_ACCOUNT_VERIFIED, "Account Verified"}
 };
 
+/* producers -> sender thread */
+static pthread_mutex_t m_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t m_cond = PTHREAD_COND_INITIALIZER;
+static mail_item_t** m_queue = NULL;
+static size_t m_queue_cap = 0;
+static size_t m_queue_head = 0;
+static size_t m_queue_count = 0;
+static bool m_running = false;
+static pthread_t m_thread;
+static _Atomic size_t m_depth = 0;
+static _Atomic unsigned m_seq = 0;
+
+/* sender thread */
+static ft_ilist_t m_pending;    /* spooled, in send order */
+static mail_smtp_t* m_smtp = NULL;
+static time_t m_relay_hold = 0;     /* no attempt before, the relay is down */
+static int m_relay_failures = 0;
+static unsigned m_rand_seed = 0;
+
+static char* m_from = NULL;
+static char* m_spool = NULL;
+static int m_max_attempts = 0;
+static int m_idle_seconds = MAIL_IDLE_SECONDS;
+
+static metric_t* m_sent = NULL;
+static metric_t* m_retried = NULL;
+static metric_t* m_failed = NULL;
+static metric_t* m_rejected = NULL;
+static metric_t* m_send_time = NULL;
+
+static void m_item_free(mail_item_t* item)
+{
+    free(item->to);
+    free(item->msg);
+    free(item);
+}
+
+/* addresses end up in the envelope and the headers */
+static bool m_valid_address(const char* to)
+{
+    if (!*to || strlen(to) > 254 || !strchr(to, '@'))
+        return false;
+    return strpbrk(to, "<>\r\n \t,;\"") == NULL;
+}
+
+static char* m_format(const mail_context_t* ctx, const char* id)
+{
+    char date[64];
+    char host[64];
+    struct tm tm_info;
+    time_t now;
+    size_t len;
+    char* msg;
+
+    now = time(NULL);
+    gmtime_r(&now, &tm_info);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S +0000", &tm_info);
+    if (gethostname(host, sizeof(host)) != 0)
+        snprintf(host, sizeof(host), "localhost");
+    host[sizeof(host) - 1] = '\0';
+
+    len = strlen(ctx->to) + strlen(ctx->body) + strlen(m_from) + 512;
+    msg = malloc(len);
+    snprintf(msg, len,
+        "From: %s\r\n"
+        "To: %s\r\n"
+        "Subject: %s\r\n"
+        "Date: %s\r\n"
+        "Message-ID: <%s@%s>\r\n"
+        "MIME-Version: 1.0\r\n"
+        "Content-Type: text/plain; charset=UTF-8\r\n"
+        "\r\n"
+        "%s\r\n",
+        m_from, ctx->to, subject_map[ctx->subject].subject, date, id, host, ctx->body);
+    return msg;
+}
+
 int mail_notify_msg(mail_context_t* ctx)
 {
-    FILE *mail;
-    int status;
-    char command[512];
- 
-    if (!ctx || !ctx->to || !ctx->body || (ctx->subject < 0) || (ctx->subject >= SUBJECT_MAX))
+    mail_item_t* item;
+    struct timespec ts;
+
+    if (!ctx || !ctx->to || !ctx->body || (ctx->subject < 0) || (ctx->subject >= SUBJECT_MAX)
+        || !m_valid_address(ctx->to))
+    {
+        log_msg(LOG_LEVEL_ERROR, "mail: invalid mail context\n");
+        return INVALID_ARGS;
+    }
+    if (!m_queue)
+        return ERROR;
+
+    item = calloc(1, sizeof(*item));
+    ft_assert(item != NULL, "calloc failed");
+    clock_gettime(CLOCK_REALTIME, &ts);
+    snprintf(item->name, sizeof(item->name), "%013llu-%d-%u" MAIL_SPOOL_EXT,
+             (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000, (int)getpid(),
+             atomic_fetch_add_explicit(&m_seq, 1, memory_order_relaxed));
+    item->to = strdup(ctx->to);
+    item->msg = m_format(ctx, item->name);
+
+    pthread_mutex_lock(&m_lock);
+    if (m_queue_count == m_queue_cap)
+    {
+        pthread_mutex_unlock(&m_lock);
+        metrics_add(m_rejected, 1);
+        log_msg(LOG_LEVEL_WARN, "mail: queue full, mail to %s rejected\n", ctx->to);
+        m_item_free(item);
+        return ERROR;
+    }
+    m_queue[(m_queue_head + m_queue_count) % m_queue_cap] = item;
+    m_queue_count++;
+    atomic_fetch_add_explicit(&m_depth, 1, memory_order_relaxed);
+    pthread_cond_signal(&m_cond);
+    pthread_mutex_unlock(&m_lock);
+    return SUCCESS;
+}
+
+size_t mail_queue_depth(void)
+{
+    return atomic_load_explicit(&m_depth, memory_order_relaxed);
+}
+
+static int64_t m_depth_metric(void)
+{
+    return (int64_t)mail_queue_depth();
+}
+
+/* spool: <dir>/<name> holds the recipient on the first line, then the message */
+static void m_spool_path(char* path, size_t len, const mail_item_t* item, const char* suffix)
+{
+    snprintf(path, len, "%s/%s%s", m_spool, item->name, suffix);
+}
+
+static void m_spool_write(const mail_item_t* item)
+{
+    char tmp[4096];
+    char path[4096];
+    FILE* fp;
+    bool ok;
+
+    if (!m_spool)
+        return;
+    m_spool_path(tmp, sizeof(tmp), item, ".tmp");
+    m_spool_path(path, sizeof(path), item, "");
+    fp = fopen(tmp, "w");
+    if (!fp)
+    {
+        log_msg(LOG_LEVEL_ERROR, "mail: cannot spool %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+    ok = fprintf(fp, "%s\n%s", item->to, item->msg) > 0 && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp, path) != 0)
+    {
+        log_msg(LOG_LEVEL_ERROR, "mail: cannot spool %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+static mail_item_t* m_spool_read(const char* path)
+{
+    mail_item_t* item;
+    const char* name;
+    char* data;
+    char* nl;
+    FILE* fp;
+    long size;
+
+    fp = fopen(path, "r");
+    if (!fp)
+        return NULL;
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+    data = malloc(size + 1);
+    if (size <= 0 || fread(data, 1, size, fp) != (size_t)size)
+    {
+        fclose(fp);
+        free(data);
+        return NULL;
+    }
+    fclose(fp);
+    data[size] = '\0';
+
+    nl = strchr(data, '\n');
+    name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    if (!nl || strlen(name) >= sizeof(item->name))
+    {
+        free(data);
+        return NULL;
+    }
+    *nl = '\0';
+
+    item = calloc(1, sizeof(*item));
+    ft_assert(item != NULL, "calloc failed");
+    snprintf(item->name, sizeof(item->name), "%s", name);
+    item->to = strdup(data);
+    item->msg = strdup(nl + 1);
+    free(data);
+    return item;
+}
+
+/* names start with the enqueue time, glob's order is the send order */
+static void m_spool_load(void)
+{
+    char pattern[4096];
+    mail_item_t* item;
+    glob_t g;
+    size_t i;
+
+    snprintf(pattern, sizeof(pattern), "%s/*" MAIL_SPOOL_EXT, m_spool);
+    if (glob(pattern, 0, NULL, &g) != 0)
+        return;
+    for (i = 0; i < g.gl_pathc; i++)
+    {
+        item = m_spool_read(g.gl_pathv[i]);
+        if (!item)
+        {
+            log_msg(LOG_LEVEL_WARN, "mail: unreadable spool file %s\n", g.gl_pathv[i]);
+            continue;
+        }
+        ft_ilist_push_back(&m_pending, &item->link);
+        atomic_fetch_add_explicit(&m_depth, 1, memory_order_relaxed);
+    }
+    if (g.gl_pathc)
+        log_msg(LOG_LEVEL_BOOT, "mail: %zu spooled mails resumed\n", g.gl_pathc);
+    globfree(&g);
+}
+
+/* sender thread */
+static time_t m_backoff(int failures)
+{
+    time_t delay;
+
+    delay = MAIL_RETRY_BASE;
+    while (--failures > 0 && delay < MAIL_RETRY_MAX)
+        delay *= 2;
+    if (delay > MAIL_RETRY_MAX)
+        delay = MAIL_RETRY_MAX;
+    /* +-20% so mails deferred together do not retry in lockstep */
+    return delay + (time_t)(rand_r(&m_rand_seed) % (delay * 2 / 5 + 1)) - delay / 5;
+}
+
+static void m_done(mail_item_t* item, bool sent, const char* err)
+{
+    char path[4096];
+    char failed[4096];
+
+    if (m_spool)
+    {
+        m_spool_path(path, sizeof(path), item, "");
+        m_spool_path(failed, sizeof(failed), item, ".failed");
+        if (sent)
+            unlink(path);
+        else
+            rename(path, failed);
+    }
+    if (sent)
+        metrics_add(m_sent, 1);
+    else
+    {
+        metrics_add(m_failed, 1);
+        log_msg(LOG_LEVEL_ERROR, "mail: giving up on mail to %s after %d attempts: %s\n",
+                item->to, item->attempts, err);
+    }
+    ft_ilist_remove(&m_pending, &item->link);
+    atomic_fetch_sub_explicit(&m_depth, 1, memory_order_relaxed);
+    m_item_free(item);
+}
+
+static void m_send_due(void)
+{
+    mail_item_t* item;
+    mail_item_t* tmp;
+    smtp_result_t res;
+    uint64_t start;
+    char err[512];
+    time_t now;
+
+    now = time(NULL);
+    if (now < m_relay_hold)
+        return;
+
+    FT_ILIST_FOREACH_SAFE(&m_pending, item, tmp, link)
+    {
+        if (item->next_attempt > now)
+            continue;
+
+        err[0] = '\0';
+        start = metrics_now_us();
+        res = mail_smtp_send(m_smtp, m_from, item->to, item->msg, err, sizeof(err));
+        metrics_observe(m_send_time, metrics_now_us() - start);
+        item->attempts++;
+
+        if (res == SMTP_SENT)
+        {
+            m_relay_failures = 0;
+            m_done(item, true, NULL);
+            continue;
+        }
+        if (res == SMTP_PERMFAIL || item->attempts >= m_max_attempts)
+        {
+            m_done(item, false, err);
+            continue;
+        }
+
+        metrics_add(m_retried, 1);
+        item->next_attempt = now + m_backoff(item->attempts);
+        log_msg(LOG_LEVEL_WARN, "mail: mail to %s deferred (attempt %d): %s\n", item->to, item->attempts, err);
+        if (!mail_smtp_connected(m_smtp))
+        {
+            /* the relay itself is unreachable: hold the whole queue */
+            m_relay_hold = now + m_backoff(++m_relay_failures);
+            return;
+        }
+    }
+}
+
+/* the earliest retry, or the idle check of the connection */
+static time_t m_next_wakeup(void)
+{
+    mail_item_t* item;
+    time_t next;
+
+    next = time(NULL) + m_idle_seconds;
+    FT_ILIST_FOREACH(&m_pending, item, link)
     {
-        fprintf(stderr, "Invalid mail context.\n");
-        return -1;
+        if (item->next_attempt < next)
+            next = item->next_attempt;
     }
+    if (!ft_ilist_empty(&m_pending) && next < m_relay_hold)
+        next = m_relay_hold;
+    return next;
+}
 
-    snprintf(command, sizeof(command), "msmtp --from=default %s", ctx->to);
+static void* m_sender_thread(void* arg)
+{
+    mail_item_t* taken[64];
+    struct timespec deadline;
+    size_t n;
+    size_t i;
+    bool stopping;
+    bool more;
 
-    mail = popen(command, "w");
-    if (!mail)
+    (void)arg;
+    while (1)
     {
-        perror("Failed to open msmtp");
-        return -1;
+        pthread_mutex_lock(&m_lock);
+        deadline.tv_sec = m_next_wakeup();
+        deadline.tv_nsec = 0;
+        while (m_running && m_queue_count == 0 && time(NULL) < deadline.tv_sec)
+        {
+            if (pthread_cond_timedwait(&m_cond, &m_lock, &deadline) == ETIMEDOUT)
+                break;
+        }
+        for (n = 0; n < sizeof(taken) / sizeof(taken[0]) && m_queue_count > 0; n++)
+        {
+            taken[n] = m_queue[m_queue_head];
+            m_queue_head = (m_queue_head + 1) % m_queue_cap;
+            m_queue_count--;
+        }
+        stopping = !m_running;
+        more = m_queue_count > 0;
+        pthread_mutex_unlock(&m_lock);
+
+        /* on disk before the first attempt */
+        for (i = 0; i < n; i++)
+        {
+            m_spool_write(taken[i]);
+            ft_ilist_push_back(&m_pending, &taken[i]->link);
+        }
+        if (stopping && more)
+            continue;
+        if (stopping)
+            break;
+
+        m_send_due();
+        mail_smtp_idle(m_smtp, m_idle_seconds);
     }
+    return NULL;
+}
+
+int mail_init(const mail_options* opts)
+{
+    char helo[256];
 
-    fprintf(mail,
-        "To: %s\n"
-        "Subject: %s\n"
-        "Content-Type: text/plain\n\n"
-        "%s\n",
-        ctx->to, subject_map[ctx->subject].subject, ctx->body);
+    if (!opts || !opts->relay_host || !opts->from || opts->queue_size == 0 || opts->max_attempts <= 0)
+        return INVALID_ARGS;
 
-    status = pclose(mail);
-    if (status == -1)
+    m_from = strdup(opts->from);
+    m_spool = (opts->spool_dir && opts->spool_dir[0]) ? strdup(opts->spool_dir) : NULL;
+    m_max_attempts = opts->max_attempts;
+    m_idle_seconds = opts->idle_seconds > 0 ? opts->idle_seconds : MAIL_IDLE_SECONDS;
+    if (m_spool && mkdir(m_spool, 0700) != 0 && errno != EEXIST)
     {
-        perror("Failed to close msmtp");
-        return -1;
+        log_msg(LOG_LEVEL_ERROR, "mail: cannot create spool %s: %s\n", m_spool, strerror(errno));
+        free(m_spool);
+        m_spool = NULL;
     }
-    else if (WEXITSTATUS(status) != 0)
+
+    if (gethostname(helo, sizeof(helo)) != 0)
+        snprintf(helo, sizeof(helo), "localhost");
+    helo[sizeof(helo) - 1] = '\0';
+    m_smtp = mail_smtp_new(opts->relay_host, opts->relay_port, helo,
+                           opts->io_timeout_ms > 0 ? opts->io_timeout_ms : MAIL_IO_TIMEOUT_MS);
+    m_rand_seed = (unsigned)time(NULL) ^ (unsigned)getpid();
+
+    m_queue = calloc(opts->queue_size, sizeof(*m_queue));
+    ft_assert(m_queue != NULL, "calloc failed");
+    m_queue_cap = opts->queue_size;
+    ft_ilist_init(&m_pending);
+    if (m_spool)
+        m_spool_load();
+
+    m_sent = metrics_counter("mail_sent_total", "Mails accepted by the relay", NULL);
+    m_retried = metrics_counter("mail_deferred_total", "Temporary delivery failures", NULL);
+    m_failed = metrics_counter("mail_failed_total", "Mails given up on", NULL);
+    m_rejected = metrics_counter("mail_rejected_total", "Mails refused on a full queue", NULL);
+    m_send_time = metrics_histogram("mail_send_duration_us", "SMTP transaction time in microseconds", NULL);
+    metrics_gauge_fn("mail_queue_depth", "Mails queued or waiting for a retry", NULL, m_depth_metric);
+
+    m_running = true;
+    if (pthread_create(&m_thread, NULL, m_sender_thread, NULL) != 0)
     {
-        fprintf(stderr, "msmtp exited with status %d\n", WEXITSTATUS(status));
-        return -1;
+        m_running = false;
+        log_msg(LOG_LEVEL_ERROR, "mail: cannot start the sender thread\n");
+        return ERROR;
     }
 
-    return 0;
+    log_msg(LOG_LEVEL_BOOT, "Mail initialized: relay %s:%d, spool %s\n", opts->relay_host, opts->relay_port,
+            m_spool ? m_spool : "off");
+    return SUCCESS;
 }
 
-void mail_init()
+/* pending mail stays in the spool for the next start */
+void mail_cleanup(void)
 {
-    printf("Mail system initialized.\n");
+    mail_item_t* item;
+    mail_item_t* tmp;
+
+    if (!m_queue)
+        return;
+
+    pthread_mutex_lock(&m_lock);
+    m_running = false;
+    pthread_cond_signal(&m_cond);
+    pthread_mutex_unlock(&m_lock);
+    pthread_join(m_thread, NULL);
+
+    FT_ILIST_FOREACH_SAFE(&m_pending, item, tmp, link)
+    {
+        ft_ilist_remove(&m_pending, &item->link);
+        m_item_free(item);
+    }
+    atomic_store(&m_depth, 0);
+    mail_smtp_free(m_smtp);
+    m_smtp = NULL;
+    free(m_queue);
+    m_queue = NULL;
+    free(m_from);
+    free(m_spool);
+    m_from = NULL;
+    m_spool = NULL;
 }
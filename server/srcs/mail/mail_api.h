@@ -1,6 +1,8 @@
 #ifndef MAIL_API_H
 #define MAIL_API_H
 
+#include <stddef.h>
+
 typedef enum
 {
     SUBJECT_LOGIN = 0,
@@ -20,6 +22,33 @@ typedef struct
     char* body;
 } mail_context_t;
 
+typedef struct
+{
+    const char* relay_host;     /* SMTP relay, plain SMTP without AUTH */
+    int relay_port;
+    const char* from;
+    const char* spool_dir;      /* NULL or "": queued mail does not survive a restart */
+    size_t queue_size;          /* mails waiting for the sender thread */
+    int max_attempts;           /* temporary failures before a mail is given up */
+    int io_timeout_ms;          /* per SMTP read or write, 0 = 30 s */
+    int idle_seconds;           /* the relay connection is closed after this long unused, 0 = 30 */
+} mail_options;
+
+/*
+ * Mail goes out from a dedicated sender thread over one persistent SMTP
+ * connection. Every mail is written to the spool before its first
+ * attempt and removed once the relay accepted it; temporary failures
+ * are retried with exponential backoff, spooled mail is picked up again
+ * by mail_init() after a restart. Mail given up on is kept in the spool
+ * as <id>.mail.failed.
+ */
+int mail_init(const mail_options* opts);
+void mail_cleanup(void);
+
+/* Queues the mail, never blocks. ERROR when the queue is full. */
 int mail_notify_msg(mail_context_t* context);
 
+/* mails queued or waiting for a retry */
+size_t mail_queue_depth(void);
+
 #endif /* MAIL_API_H */
@@ -0,0 +1,360 @@
+#define _GNU_SOURCE     /* strcasestr */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "../log/log_api.h"
+#include "../../inc/ft_malloc.h"
+#include "mail_smtp.h"
+
+#define SMTP_LINE_MAX 1024
+
+struct mail_smtp_s
+{
+    char* host;
+    int port;
+    char* helo;
+    int timeout_ms;
+    int fd;
+    bool pipelining;
+    time_t last_used;
+    char rbuf[4096];
+    size_t rlen;
+    size_t rpos;
+};
+
+mail_smtp_t* mail_smtp_new(const char* host, int port, const char* helo, int timeout_ms)
+{
+    mail_smtp_t* s;
+
+    s = calloc(1, sizeof(*s));
+    ft_assert(s != NULL, "calloc failed");
+    s->host = strdup(host);
+    s->port = port;
+    s->helo = strdup(helo);
+    s->timeout_ms = timeout_ms;
+    s->fd = -1;
+    return s;
+}
+
+static void m_disconnect(mail_smtp_t* s)
+{
+    if (s->fd >= 0)
+        close(s->fd);
+    s->fd = -1;
+    s->rlen = 0;
+    s->rpos = 0;
+}
+
+static int m_write_all(mail_smtp_t* s, const char* data, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = send(s->fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int m_read_line(mail_smtp_t* s, char* line, size_t len)
+{
+    size_t n;
+    ssize_t r;
+    char c;
+
+    n = 0;
+    while (1)
+    {
+        if (s->rpos == s->rlen)
+        {
+            r = recv(s->fd, s->rbuf, sizeof(s->rbuf), 0);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0)
+                return -1;
+            s->rlen = r;
+            s->rpos = 0;
+        }
+        c = s->rbuf[s->rpos++];
+        if (c == '\n')
+            break;
+        if (c != '\r' && n < len - 1)
+            line[n++] = c;
+    }
+    line[n] = '\0';
+    return 0;
+}
+
+/* reads a possibly multi-line reply, text gets its lines; -1 on I/O error */
+static int m_read_reply(mail_smtp_t* s, char* text, size_t text_len)
+{
+    char line[SMTP_LINE_MAX];
+    size_t n;
+    int code;
+
+    n = 0;
+    if (text_len)
+        text[0] = '\0';
+    do
+    {
+        if (m_read_line(s, line, sizeof(line)) < 0 || strlen(line) < 3)
+        {
+            m_disconnect(s);
+            return -1;
+        }
+        code = atoi(line);
+        if (n < text_len)
+            n += snprintf(text + n, text_len - n, "%s%s", n ? "\n" : "", line);
+    } while (line[3] == '-');
+    return code;
+}
+
+static int m_command(mail_smtp_t* s, const char* cmd, char* text, size_t text_len)
+{
+    if (m_write_all(s, cmd, strlen(cmd)) < 0)
+    {
+        m_disconnect(s);
+        return -1;
+    }
+    return m_read_reply(s, text, text_len);
+}
+
+static int m_connect(mail_smtp_t* s, char* err, size_t err_len)
+{
+    struct addrinfo hints;
+    struct addrinfo* res;
+    struct addrinfo* ai;
+    struct timeval tv;
+    char port[16];
+    char cmd[300];
+    char text[2048];
+    int code;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", s->port);
+    if (getaddrinfo(s->host, port, &hints, &res) != 0)
+    {
+        snprintf(err, err_len, "cannot resolve %s", s->host);
+        return -1;
+    }
+
+    /* the timeouts bound connect() as well as every reply */
+    tv.tv_sec = s->timeout_ms / 1000;
+    tv.tv_usec = (s->timeout_ms % 1000) * 1000;
+    for (ai = res; ai; ai = ai->ai_next)
+    {
+        s->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (s->fd < 0)
+            continue;
+        setsockopt(s->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(s->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (connect(s->fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        m_disconnect(s);
+    }
+    freeaddrinfo(res);
+    if (s->fd < 0)
+    {
+        snprintf(err, err_len, "cannot connect to %s:%d: %s", s->host, s->port, strerror(errno));
+        return -1;
+    }
+
+    code = m_read_reply(s, text, sizeof(text));
+    if (code != 220)
+    {
+        snprintf(err, err_len, "greeting: %s", code < 0 ? "connection lost" : text);
+        m_disconnect(s);
+        return -1;
+    }
+
+    snprintf(cmd, sizeof(cmd), "EHLO %s\r\n", s->helo);
+    code = m_command(s, cmd, text, sizeof(text));
+    s->pipelining = code == 250 && strcasestr(text, "PIPELINING") != NULL;
+    if (code >= 500)
+    {
+        snprintf(cmd, sizeof(cmd), "HELO %s\r\n", s->helo);
+        code = m_command(s, cmd, text, sizeof(text));
+    }
+    if (code != 250)
+    {
+        snprintf(err, err_len, "EHLO: %s", code < 0 ? "connection lost" : text);
+        m_disconnect(s);
+        return -1;
+    }
+
+    log_msg(LOG_LEVEL_INFO, "mail: connected to %s:%d%s\n", s->host, s->port,
+            s->pipelining ? " (pipelining)" : "");
+    return 0;
+}
+
+/* CRLF line endings, leading dots doubled, terminated by <CRLF>.<CRLF> */
+static char* m_encode_body(const char* msg, size_t* out_len)
+{
+    char* out;
+    size_t n;
+    bool bol;
+
+    out = malloc(strlen(msg) * 2 + 8);
+    n = 0;
+    bol = true;
+    for (; *msg; msg++)
+    {
+        if (bol && *msg == '.')
+            out[n++] = '.';
+        if (*msg == '\n' && (n == 0 || out[n - 1] != '\r'))
+            out[n++] = '\r';
+        out[n++] = *msg;
+        bol = *msg == '\n';
+    }
+    if (!bol)
+    {
+        out[n++] = '\r';
+        out[n++] = '\n';
+    }
+    memcpy(out + n, ".\r\n", 3);
+    *out_len = n + 3;
+    return out;
+}
+
+static smtp_result_t m_result(int code)
+{
+    if (code >= 500)
+        return SMTP_PERMFAIL;
+    return SMTP_TEMPFAIL;
+}
+
+/* MAIL, RCPT and DATA replies; the commands go out in one write when pipelining */
+static int m_envelope(mail_smtp_t* s, const char* from, const char* to, char* text, size_t text_len)
+{
+    const char* cmds[3];
+    char mail[512];
+    char rcpt[512];
+    char reply[SMTP_LINE_MAX];
+    char batch[sizeof(mail) + sizeof(rcpt) + 8];
+    int expect[3] = { 250, 250, 354 };
+    int failed;
+    int code;
+    int i;
+
+    snprintf(mail, sizeof(mail), "MAIL FROM:<%s>\r\n", from);
+    snprintf(rcpt, sizeof(rcpt), "RCPT TO:<%s>\r\n", to);
+    cmds[0] = mail;
+    cmds[1] = rcpt;
+    cmds[2] = "DATA\r\n";
+
+    if (s->pipelining)
+    {
+        snprintf(batch, sizeof(batch), "%s%s%s", mail, rcpt, cmds[2]);
+        if (m_write_all(s, batch, strlen(batch)) < 0)
+        {
+            m_disconnect(s);
+            return -1;
+        }
+    }
+
+    failed = 0;
+    for (i = 0; i < 3; i++)
+    {
+        if (!s->pipelining && failed)
+            break;
+        code = s->pipelining ? m_read_reply(s, reply, sizeof(reply)) : m_command(s, cmds[i], reply, sizeof(reply));
+        if (code < 0)
+            return -1;
+        if (code == 354 && failed)
+        {
+            /* the relay took DATA anyway, end it empty and drop the transaction */
+            m_command(s, ".\r\n", NULL, 0);
+            break;
+        }
+        if (code != expect[i] && !(i == 1 && code == 251) && !failed)
+        {
+            failed = code;
+            snprintf(text, text_len, "%s", reply);
+        }
+    }
+    if (failed)
+    {
+        m_command(s, "RSET\r\n", NULL, 0);
+        return failed;
+    }
+    return 354;
+}
+
+smtp_result_t mail_smtp_send(mail_smtp_t* s, const char* from, const char* to, const char* msg,
+                             char* err, size_t err_len)
+{
+    char text[1024];
+    char* body;
+    size_t body_len;
+    int code;
+
+    if (s->fd < 0 && m_connect(s, err, err_len) < 0)
+        return SMTP_TEMPFAIL;
+    s->last_used = time(NULL);
+
+    code = m_envelope(s, from, to, text, sizeof(text));
+    if (code != 354)
+    {
+        snprintf(err, err_len, "envelope: %s", code < 0 ? "connection lost" : text);
+        return code < 0 ? SMTP_TEMPFAIL : m_result(code);
+    }
+
+    body = m_encode_body(msg, &body_len);
+    if (m_write_all(s, body, body_len) < 0)
+    {
+        free(body);
+        m_disconnect(s);
+        snprintf(err, err_len, "DATA: connection lost");
+        return SMTP_TEMPFAIL;
+    }
+    free(body);
+
+    code = m_read_reply(s, text, sizeof(text));
+    if (code != 250)
+    {
+        snprintf(err, err_len, "DATA: %s", code < 0 ? "connection lost" : text);
+        return code < 0 ? SMTP_TEMPFAIL : m_result(code);
+    }
+    return SMTP_SENT;
+}
+
+bool mail_smtp_connected(const mail_smtp_t* s)
+{
+    return s->fd >= 0;
+}
+
+void mail_smtp_idle(mail_smtp_t* s, int idle_seconds)
+{
+    if (s->fd < 0 || time(NULL) - s->last_used < idle_seconds)
+        return;
+    m_command(s, "QUIT\r\n", NULL, 0);
+    m_disconnect(s);
+}
+
+void mail_smtp_free(mail_smtp_t* s)
+{
+    if (!s)
+        return;
+    if (s->fd >= 0)
+        m_command(s, "QUIT\r\n", NULL, 0);
+    m_disconnect(s);
+    free(s->host);
+    free(s->helo);
+    free(s);
+}
@@ -0,0 +1,37 @@
+#ifndef MAIL_SMTP_H
+#define MAIL_SMTP_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Minimal SMTP client owned by the mail sender thread.
+ *
+ * The connection to the relay is opened on the first send and kept
+ * across messages; with PIPELINING the envelope (MAIL, RCPT, DATA) goes
+ * out in one write. Any I/O error drops the connection, the next send
+ * reconnects.
+ */
+
+typedef struct mail_smtp_s mail_smtp_t;
+
+typedef enum
+{
+    SMTP_SENT = 0,
+    SMTP_TEMPFAIL,      /* 4xx or connection trouble, retry later */
+    SMTP_PERMFAIL       /* 5xx, the relay will never take this mail */
+} smtp_result_t;
+
+mail_smtp_t* mail_smtp_new(const char* host, int port, const char* helo, int timeout_ms);
+void mail_smtp_free(mail_smtp_t* s);
+
+/* msg holds the headers and body, line endings and dot-stuffing are handled here */
+smtp_result_t mail_smtp_send(mail_smtp_t* s, const char* from, const char* to, const char* msg,
+                             char* err, size_t err_len);
+
+bool mail_smtp_connected(const mail_smtp_t* s);
+
+/* QUIT once the connection has been unused for idle_seconds */
+void mail_smtp_idle(mail_smtp_t* s, int idle_seconds);
+
+#endif /* MAIL_SMTP_H */
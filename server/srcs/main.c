@@ -1,12 +1,23 @@
 #include <sys/signal.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
 #include "../inc/error_codes.h"
+#include "../inc/ft_malloc.h"
+#include "../inc/ft_arena.h"
 #include "log/log_api.h"
 #include "parse/config_file.h"
 #include "server/server_api.h"
 #include "router/router_api.h"
 #include "mail/mail_api.h"
+#include "suggest/suggest_api.h"
+#include "fame/fame_api.h"
+#include "push/push_api.h"
+#include "bus/bus_api.h"
+#include "trace/trace_api.h"
+#include "metrics/metrics_api.h"
 #include "db/db_api.h"
+#include "db/db_schema.h"
 #include "db/tables/db_table_user.h"
 #include "db/tables/db_table_tag.h"
 #include "db/tables/db_table_pic.h"
@@ -15,16 +26,103 @@
 #include "db/tables/db_table_message.h"
 #include "db/tables/db_table_notification.h"
 #include "db/tables/db_table_session.h"
+#include "db/tables/db_table_counter.h"
+#include "db/index/db_index_tag.h"
+#include "db/index/db_index_like.h"
+#include "db/index/db_index_snapshot.h"
+#include "db/index/db_index_user.h"
 #include "db/db_gen.h"
 
+#define ALLOC_REPORT_TOP 20
+
 static bool m_die = false;
+static bool m_drain = false;
+static bool m_dump_allocs = false;
+static bool m_reload = false;
+static int m_config_fd = -1;
+static DB_ID m_db = INVALID_DB_ID;
 
 void signal_handler(int signum)
 {
     if (signum == SIGINT || signum == SIGTERM)
     {
-        m_die = true;
+        /* the first one drains, a second one exits right away */
+        if (m_drain)
+            m_die = true;
+        m_drain = true;
+    }
+    else if (signum == SIGUSR1)
+    {
+        m_dump_allocs = true;
+    }
+    else if (signum == SIGHUP)
+    {
+        m_reload = true;
+    }
+}
+
+/* negative counts in the file fall back to the default */
+static size_t m_config_count(int value)
+{
+    return value > 0 ? (size_t)value : 0;
+}
+
+static void m_set_server_options(const config_t* config)
+{
+    server_set_options(&(server_options){
+        .backlog = config->SERVER_BACKLOG,
+        .read_buffer = config->SERVER_READ_BUFFER,
+        .ws_max_message = config->WS_MAX_MESSAGE,
+        .ws_max_pending = config->WS_MAX_PENDING,
+        .ws_ping_interval = config->WS_PING_INTERVAL,
+        .ws_pong_timeout = config->WS_PONG_TIMEOUT,
+        .handoff_path = config->HANDOFF_SOCKET,
+    });
+}
+
+/* the keys marked hot in config_file.c; ROUTER_SEND_TIMEOUT_MS is read by the router itself */
+static void m_on_config_reload(const config_t* old, const config_t* now, void* user_data)
+{
+    (void)old;
+    (void)user_data;
+
+    log_set_level(now->LOG_LEVEL);
+    if (trace_set_sample_rate(now->TRACE_SAMPLE_RATE) != SUCCESS)
+        log_msg(LOG_LEVEL_WARN, "config: TRACE_SAMPLE_RATE %f out of range, ignored\n", now->TRACE_SAMPLE_RATE);
+    db_set_slow_query_ms(now->DB_SLOW_QUERY_MS);
+    suggest_set_max_feeds(m_config_count(now->SUGGEST_MAX_FEEDS));
+    m_set_server_options(now);
+}
+
+/* editors save by writing or by renaming over the file */
+static void m_on_config_event(int fd, void* user_data)
+{
+    (void)user_data;
+    if (parse_config_changed(fd))
+        m_reload = true;
+}
+
+/* SIGUSR1: call sites holding the most memory, needs a MALLOC_TRACK=1 build */
+static void m_log_allocations(void)
+{
+    ft_malloc_site_t sites[ALLOC_REPORT_TOP];
+    ft_malloc_totals_t totals;
+    size_t n;
+    size_t i;
+
+    if (!ft_malloc_tracking())
+    {
+        log_msg(LOG_LEVEL_INFO, "Allocation report: not a MALLOC_TRACK build\n");
+        return;
     }
+    ft_malloc_totals(&totals);
+    n = ft_malloc_top_sites(sites, ALLOC_REPORT_TOP);
+    log_msg(LOG_LEVEL_INFO, "Allocation report: %zu bytes live, %zu peak, %zu allocs, %zu frees\n",
+            totals.live_bytes, totals.peak_bytes, totals.allocs, totals.frees);
+    for (i = 0; i < n; i++)
+        log_msg(LOG_LEVEL_INFO, "  %10zu B live in %6zu blocks, %10zu allocs %12zu B total  %s:%d\n",
+                sites[i].live_bytes, sites[i].live_count, sites[i].allocs, sites[i].bytes,
+                sites[i].file, sites[i].line);
 }
 
 static int m_http_request_handler(int fd, const char *request, size_t request_len)
@@ -32,6 +130,61 @@ static int m_http_request_handler(int fd, const char *request, size_t request_le
     return router_handle_http_request(fd, request, request_len);
 }
 
+static long m_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/* the listener went to a new instance, this one finishes its work and exits */
+static void m_on_handoff(void)
+{
+    m_drain = true;
+}
+
+/* stop accepting, let the in-flight work finish, give up at SHUTDOWN_DRAIN_MS */
+static bool m_drain_done(void)
+{
+    static long deadline = -1;
+
+    if (deadline == -1)
+    {
+        server_drain();
+        deadline = m_now_ms() + parse_get_config()->SHUTDOWN_DRAIN_MS;
+    }
+    if (server_drained())
+    {
+        log_msg(LOG_LEVEL_INFO, "Drained\n");
+        return true;
+    }
+    if (m_now_ms() >= deadline)
+    {
+        log_msg(LOG_LEVEL_WARN, "Drain deadline reached, closing what is left\n");
+        return true;
+    }
+    return false;
+}
+
+/* saves the indexes every INDEX_SNAPSHOT_INTERVAL seconds */
+static void m_snapshot_tick(void)
+{
+    static long last = -1;
+    const config_t* config;
+    long now;
+
+    config = parse_get_config();
+    now = m_now_ms();
+    if (last == -1)
+        last = now;
+    if (config->INDEX_SNAPSHOT_INTERVAL <= 0 || !config->INDEX_SNAPSHOT_PATH[0]
+        || now - last < config->INDEX_SNAPSHOT_INTERVAL * 1000L)
+        return;
+    last = now;
+    db_isnap_save(m_db, config->INDEX_SNAPSHOT_PATH);
+}
+
 int main_loop()
 {
     int ret;
@@ -43,9 +196,40 @@ int main_loop()
             log_msg(LOG_LEVEL_ERROR, "Error in server_select\n");
             return ERROR;
         }
+
+        suggest_tick();
+        fame_tick();
+        trace_tick();
+        m_snapshot_tick();
+        if (m_reload)
+        {
+            m_reload = false;
+            parse_reload_config();
+        }
+        if (m_dump_allocs)
+        {
+            m_dump_allocs = false;
+            m_log_allocations();
+        }
+        if (m_drain && m_drain_done())
+            break;
     }
 
+    if (m_config_fd != -1)
+    {
+        server_unwatch_fd(m_config_fd);
+        close(m_config_fd);
+        m_config_fd = -1;
+    }
+    if (parse_get_config()->INDEX_SNAPSHOT_PATH[0])
+        db_isnap_save(m_db, parse_get_config()->INDEX_SNAPSHOT_PATH);
+    push_cleanup();
+    bus_cleanup();
+    mail_cleanup();
+    fame_cleanup();
+    suggest_cleanup();
     server_cleanup();
+    trace_cleanup();
     return 0;
 }
 
@@ -55,56 +239,148 @@ static int m_init_dbs(DB_ID *DB)
     parse_set_db_config(&db_config);
     if (db_init(DB, db_config.DB_HOST, db_config.DB_PORT, db_config.DB_USER, db_config.DB_PASSWORD, db_config.DB_NAME) == ERROR)
         return ERROR;
+    db_set_slow_query_ms(db_config.DB_SLOW_QUERY_MS);
 
-    if (db_tuser_init(*DB) == ERROR)
+    /* tables register their DDL, db_schema_apply() runs it only when it changed */
+    if (db_tuser_init() == ERROR)
+        return ERROR;
+    if (db_ttag_init() == ERROR)
         return ERROR;
-    if (db_ttag_init(*DB) == ERROR)
+    if (db_tpicture_init() == ERROR)
         return ERROR;
-    if (db_tpicture_init(*DB) == ERROR)
+    if (db_tvisit_init() == ERROR)
         return ERROR;
-    if (db_tvisit_init(*DB) == ERROR)
+    if (db_tlike_init() == ERROR)
         return ERROR;
-    if (db_tlike_init(*DB) == ERROR)
+    if (db_tmessage_init() == ERROR)
         return ERROR;
-    if (db_tmessage_init(*DB) == ERROR)
+    if (db_tnotification_init() == ERROR)
         return ERROR;
-    if (db_tnotification_init(*DB) == ERROR)
+    if (db_tsession_init() == ERROR)
         return ERROR;
-    if (db_tsession_init(*DB) == ERROR)
+    if (db_tcounter_init() == ERROR)
+        return ERROR;
+
+    if (db_isnap_init() == ERROR)
+        return ERROR;
+    if (db_schema_apply(*DB) == ERROR)
+        return ERROR;
+    if (db_tcounter_load(*DB) == ERROR)
+        return ERROR;
+
+    /* in-memory indexes, warm started from the last snapshot */
+    if (db_isnap_load(*DB, parse_get_config()->INDEX_SNAPSHOT_PATH) == ERROR)
         return ERROR;
 
     return SUCCESS;
 }
 
+/* notifications are read off a connection of their own */
+static int m_init_bus(void)
+{
+    db_config db_config;
+    DB_ID listen_db;
+
+    parse_set_db_config(&db_config);
+    if (db_init(&listen_db, db_config.DB_HOST, db_config.DB_PORT, db_config.DB_USER, db_config.DB_PASSWORD, db_config.DB_NAME) == ERROR)
+    {
+        log_msg(LOG_LEVEL_WARN, "Bus: no LISTEN connection, running single node\n");
+        listen_db = INVALID_DB_ID;
+    }
+    return bus_init(listen_db);
+}
+
 int main()
 {
     ssl_config ssl_config;
     log_config log_config;
+    trace_config trace_config;
+    mail_config mail_config;
     DB_ID DB;
 
     if (parse_config("config") == ERROR)
             goto error;
 
     parse_set_log_config(&log_config);
-    log_init(log_config.LOG_FILE_PATH, log_config.LOG_ERASE, log_config.LOG_LEVEL);
+    log_set_writer_options(&(log_writer_options){
+        .rotate_size = log_config.LOG_ROTATE_SIZE,
+        .rotate_interval = log_config.LOG_ROTATE_INTERVAL,
+        .rotate_keep = log_config.LOG_ROTATE_KEEP,
+        .compress = log_config.LOG_COMPRESS,
+        .flush_ms = log_config.LOG_FLUSH_MS,
+        .direct = log_config.LOG_DIRECT,
+    });
+    log_init(log_config.LOG_FILE_PATH, log_config.LOG_ERASE, log_config.LOG_LEVEL, log_config.LOG_BINARY_PATH);
+
+    parse_set_trace_config(&trace_config);
+    if (trace_init(trace_config.TRACE_SAMPLE_RATE, trace_config.TRACE_RING_SIZE) != SUCCESS)
+        goto error;
 
+    ft_arena_set_thread_block_size(parse_get_config()->REQUEST_ARENA_SIZE);
+    m_set_server_options(parse_get_config());
     parse_set_ssl_config(&ssl_config);
     if (server_init(ssl_config.PORT) == ERROR)
         goto error;
 
     server_set_http_request_handler(m_http_request_handler);
+    server_set_handoff_handler(m_on_handoff);
+
+    if (metrics_init() == ERROR)
+        goto error;
+
+    parse_set_mail_config(&mail_config);
+    if (mail_init(&(mail_options){
+            .relay_host = mail_config.MAIL_RELAY_HOST,
+            .relay_port = mail_config.MAIL_RELAY_PORT,
+            .from = mail_config.MAIL_FROM,
+            .spool_dir = mail_config.MAIL_SPOOL_DIR,
+            .queue_size = mail_config.MAIL_QUEUE_SIZE > 0 ? mail_config.MAIL_QUEUE_SIZE : 0,
+            .max_attempts = mail_config.MAIL_MAX_ATTEMPTS,
+            .io_timeout_ms = mail_config.MAIL_IO_TIMEOUT_MS,
+            .idle_seconds = mail_config.MAIL_IDLE_SECONDS,
+        }) != SUCCESS)
+        goto error;
 
     if (m_init_dbs(&DB) == ERROR)
         goto error;
+    m_db = DB;
 
-    parse_free_config(); /* init config */
+    if (suggest_init() == ERROR)
+        goto error;
+    suggest_set_max_feeds(m_config_count(parse_get_config()->SUGGEST_MAX_FEEDS));
+
+    if (fame_init(DB) == ERROR)
+        goto error;
+
+    if (m_init_bus() == ERROR)
+        goto error;
+
+    if (push_init(DB) == ERROR)
+        goto error;
+
+    /* SIGHUP or a save of the file reloads it, see m_on_config_reload() */
+    parse_on_reload(m_on_config_reload, NULL);
+    m_config_fd = parse_config_watch();
+    if (m_config_fd != -1 && server_watch_fd(m_config_fd, m_on_config_event, NULL) != SUCCESS)
+    {
+        close(m_config_fd);
+        m_config_fd = -1;
+    }
+    if (m_config_fd == -1)
+        log_msg(LOG_LEVEL_WARN, "config: not watching the file, reload with SIGHUP\n");
 
     /* if server closes us something weird could happen */
     signal(SIGPIPE, SIG_IGN);
     signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGUSR1, signal_handler);
+    signal(SIGHUP, signal_handler);
     main_loop();
     log_msg(LOG_LEVEL_INFO, "Exiting...\n");
+    db_stats_log(20);
     log_close();
+    metrics_cleanup();
+    parse_free_config(); /* the log held on to its paths until log_close() */
 
     return 0;
 
@@ -0,0 +1,576 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include "../log/log_api.h"
+#include "../router/router_api.h"
+#include "../../inc/ft_malloc.h"
+#include "../../inc/ft_slab.h"
+#include "../../inc/error_codes.h"
+#include "metrics_api.h"
+
+#define METRICS_ROUTE "/metrics"
+#define METRICS_ALLOC_SITES 20
+#define METRICS_MAX_THREADS 16      /* counter slots, threads beyond share them */
+#define METRICS_CACHE_LINE 64
+
+/* HDR layout: values below 2 * HIST_SUB are exact, then HIST_SUB linear
+ * sub-buckets per power of two, up to 2^HIST_MAX_EXP */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 36
+#define HIST_MAX_VALUE ((1ull << HIST_MAX_EXP) - 1)
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef enum
+{
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM
+} metric_type_t;
+
+typedef struct
+{
+    _Atomic uint64_t v;
+    char pad[METRICS_CACHE_LINE - sizeof(uint64_t)];
+} metric_slot_t;
+
+typedef struct
+{
+    _Atomic uint64_t buckets[HIST_BUCKETS];
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+} metric_hist_t;
+
+typedef struct metric_family_s metric_family_t;
+
+struct metric_s
+{
+    char* key;                  /* name{labels}, registry key */
+    char* labels;
+    metric_fn_t fn;
+    metric_slot_t* slots;       /* counters */
+    _Atomic int64_t value;      /* gauges */
+    metric_hist_t* hist;
+    struct metric_s* next;
+    UT_hash_handle hh;
+};
+
+struct metric_family_s
+{
+    char* name;
+    char* help;
+    metric_type_t type;
+    metric_t* first;
+    metric_t* last;
+    struct metric_family_s* next;
+    UT_hash_handle hh;
+};
+
+typedef struct
+{
+    ft_arena_t* arena;
+    char* data;
+    size_t len;
+    size_t cap;
+} metrics_buf_t;
+
+static pthread_mutex_t m_lock = PTHREAD_MUTEX_INITIALIZER;
+static metric_t* m_metrics = NULL;
+static metric_family_t* m_families = NULL;
+static metric_family_t* m_first_family = NULL;
+static metric_family_t* m_last_family = NULL;
+
+static _Atomic unsigned m_next_slot = 0;
+static __thread int m_slot = -1;
+
+static const uint64_t m_le_bounds[] = {
+    1, 4, 16, 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576,
+    4194304, 16777216, 67108864, 268435456, 1073741824, 4294967296ull, 17179869184ull
+};
+static const struct { const char* label; double q; } m_quantiles[] = {
+    { "0.5", 0.5 }, { "0.9", 0.9 }, { "0.99", 0.99 }
+};
+
+uint64_t metrics_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* registry */
+static metric_family_t* m_family(const char* name, const char* help, metric_type_t type)
+{
+    metric_family_t* f;
+
+    HASH_FIND_STR(m_families, name, f);
+    if (f)
+        return f->type == type ? f : NULL;
+
+    f = calloc(1, sizeof(*f));
+    ft_assert(f != NULL, "calloc failed");
+    f->name = strdup(name);
+    f->help = strdup(help ? help : "");
+    f->type = type;
+    HASH_ADD_KEYPTR(hh, m_families, f->name, strlen(f->name), f);
+    if (m_last_family)
+        m_last_family->next = f;
+    else
+        m_first_family = f;
+    m_last_family = f;
+    return f;
+}
+
+static metric_t* m_register(const char* name, const char* help, const char* labels,
+                            metric_type_t type, metric_fn_t fn)
+{
+    metric_family_t* family;
+    metric_t* m;
+    char key[512];
+
+    if (!name)
+        return NULL;
+    if (!labels)
+        labels = "";
+    snprintf(key, sizeof(key), "%s{%s}", name, labels);
+
+    pthread_mutex_lock(&m_lock);
+    HASH_FIND_STR(m_metrics, key, m);
+    if (m)
+    {
+        pthread_mutex_unlock(&m_lock);
+        return m;
+    }
+
+    family = m_family(name, help, type);
+    if (!family)
+    {
+        pthread_mutex_unlock(&m_lock);
+        log_msg(LOG_LEVEL_ERROR, "metrics: %s registered with two types\n", name);
+        return NULL;
+    }
+
+    m = calloc(1, sizeof(*m));
+    ft_assert(m != NULL, "calloc failed");
+    m->key = strdup(key);
+    m->labels = strdup(labels);
+    m->fn = fn;
+    if (type == METRIC_COUNTER && !fn)
+    {
+        if (posix_memalign((void**)&m->slots, METRICS_CACHE_LINE,
+                           METRICS_MAX_THREADS * sizeof(metric_slot_t)) != 0)
+            ft_assert(0, "posix_memalign failed");
+        memset(m->slots, 0, METRICS_MAX_THREADS * sizeof(metric_slot_t));
+    }
+    else if (type == METRIC_HISTOGRAM)
+    {
+        m->hist = calloc(1, sizeof(*m->hist));
+        ft_assert(m->hist != NULL, "calloc failed");
+    }
+
+    HASH_ADD_KEYPTR(hh, m_metrics, m->key, strlen(m->key), m);
+    if (family->last)
+        family->last->next = m;
+    else
+        family->first = m;
+    family->last = m;
+    pthread_mutex_unlock(&m_lock);
+    return m;
+}
+
+metric_t* metrics_counter(const char* name, const char* help, const char* labels)
+{
+    return m_register(name, help, labels, METRIC_COUNTER, NULL);
+}
+
+metric_t* metrics_counter_fn(const char* name, const char* help, const char* labels, metric_fn_t fn)
+{
+    return m_register(name, help, labels, METRIC_COUNTER, fn);
+}
+
+metric_t* metrics_gauge(const char* name, const char* help, const char* labels)
+{
+    return m_register(name, help, labels, METRIC_GAUGE, NULL);
+}
+
+metric_t* metrics_gauge_fn(const char* name, const char* help, const char* labels, metric_fn_t fn)
+{
+    return m_register(name, help, labels, METRIC_GAUGE, fn);
+}
+
+metric_t* metrics_histogram(const char* name, const char* help, const char* labels)
+{
+    return m_register(name, help, labels, METRIC_HISTOGRAM, NULL);
+}
+
+size_t metrics_escape_label(char* out, size_t out_len, const char* value)
+{
+    size_t n;
+
+    n = 0;
+    for (; value && *value && n + 3 < out_len; value++)
+    {
+        if (*value == '"' || *value == '\\')
+            out[n++] = '\\';
+        out[n++] = ((unsigned char)*value < 0x20) ? ' ' : *value;
+    }
+    if (out_len)
+        out[n] = '\0';
+    return n;
+}
+
+/* recording */
+void metrics_add(metric_t* m, uint64_t n)
+{
+    if (!m || !m->slots)
+        return;
+    if (m_slot < 0)
+        m_slot = atomic_fetch_add_explicit(&m_next_slot, 1, memory_order_relaxed) % METRICS_MAX_THREADS;
+    atomic_fetch_add_explicit(&m->slots[m_slot].v, n, memory_order_relaxed);
+}
+
+void metrics_set(metric_t* m, int64_t v)
+{
+    if (m)
+        atomic_store_explicit(&m->value, v, memory_order_relaxed);
+}
+
+static inline unsigned m_bucket(uint64_t v)
+{
+    unsigned e;
+
+    if (v < 2 * HIST_SUB)
+        return (unsigned)v;
+    if (v > HIST_MAX_VALUE)
+        v = HIST_MAX_VALUE;
+    e = 63 - __builtin_clzll(v);
+    return (e - HIST_SUB_BITS) * HIST_SUB + (unsigned)(v >> (e - HIST_SUB_BITS));
+}
+
+/* highest value counted in bucket i */
+static uint64_t m_bucket_upper(unsigned i)
+{
+    unsigned shift;
+
+    if (i < 2 * HIST_SUB)
+        return i;
+    shift = i / HIST_SUB - 1;
+    return ((uint64_t)(HIST_SUB + i % HIST_SUB + 1) << shift) - 1;
+}
+
+void metrics_observe(metric_t* m, uint64_t v)
+{
+    metric_hist_t* h;
+    uint64_t max;
+
+    if (!m || !m->hist)
+        return;
+    h = m->hist;
+    atomic_fetch_add_explicit(&h->buckets[m_bucket(v)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, v, memory_order_relaxed);
+    max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (v > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, v,
+                                                             memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+/* exposition */
+static void m_printf(metrics_buf_t* b, const char* fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    while (1)
+    {
+        va_start(ap, fmt);
+        n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if ((size_t)n < b->cap - b->len)
+        {
+            b->len += n;
+            return;
+        }
+        /* the old buffer stays in the request arena until the response is out */
+        b->cap = b->cap * 2 + n;
+        b->data = memcpy(ft_arena_alloc(b->arena, b->cap), b->data, b->len);
+    }
+}
+
+/* name{labels,extra} with the braces dropped when empty */
+static void m_series(metrics_buf_t* b, const char* name, const char* suffix,
+                     const char* labels, const char* extra)
+{
+    const char* sep;
+
+    sep = (*labels && extra) ? "," : "";
+    if (!*labels && !extra)
+        m_printf(b, "%s%s ", name, suffix);
+    else
+        m_printf(b, "%s%s{%s%s%s} ", name, suffix, labels, sep, extra ? extra : "");
+}
+
+static uint64_t m_snapshot(const metric_t* m, uint64_t* counts)
+{
+    uint64_t total;
+    unsigned i;
+
+    total = 0;
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        counts[i] = atomic_load_explicit(&m->hist->buckets[i], memory_order_relaxed);
+        total += counts[i];
+    }
+    return total;
+}
+
+/* le is exact below 2 * HIST_SUB, within a sub-bucket above */
+static void m_write_histogram(metrics_buf_t* b, const metric_family_t* f, const metric_t* m,
+                              const uint64_t* counts, uint64_t total)
+{
+    char extra[64];
+    uint64_t cumul;
+    size_t n_le;
+    size_t le;
+    unsigned i;
+
+    n_le = sizeof(m_le_bounds) / sizeof(m_le_bounds[0]);
+    cumul = 0;
+    le = 0;
+    for (i = 0; i < HIST_BUCKETS && le < n_le; i++)
+    {
+        while (le < n_le && m_bucket_upper(i) > m_le_bounds[le])
+        {
+            snprintf(extra, sizeof(extra), "le=\"%llu\"", (unsigned long long)m_le_bounds[le++]);
+            m_series(b, f->name, "_bucket", m->labels, extra);
+            m_printf(b, "%llu\n", (unsigned long long)cumul);
+        }
+        cumul += counts[i];
+    }
+    m_series(b, f->name, "_bucket", m->labels, "le=\"+Inf\"");
+    m_printf(b, "%llu\n", (unsigned long long)total);
+    m_series(b, f->name, "_sum", m->labels, NULL);
+    m_printf(b, "%llu\n", (unsigned long long)atomic_load_explicit(&m->hist->sum, memory_order_relaxed));
+    m_series(b, f->name, "_count", m->labels, NULL);
+    m_printf(b, "%llu\n", (unsigned long long)total);
+}
+
+/* quantiles report the highest value of the bucket reaching the rank, capped by the max */
+static void m_write_quantiles(metrics_buf_t* b, const metric_family_t* f, const metric_t* m,
+                              const uint64_t* counts, uint64_t total)
+{
+    char extra[64];
+    uint64_t cumul;
+    uint64_t rank;
+    uint64_t max;
+    uint64_t v;
+    size_t q;
+    unsigned i;
+
+    max = atomic_load_explicit(&m->hist->max, memory_order_relaxed);
+    for (q = 0; q < sizeof(m_quantiles) / sizeof(m_quantiles[0]); q++)
+    {
+        rank = (uint64_t)(m_quantiles[q].q * total + 0.999999);
+        cumul = 0;
+        for (i = 0; i < HIST_BUCKETS - 1 && (cumul += counts[i]) < rank; i++)
+            ;
+        snprintf(extra, sizeof(extra), "quantile=\"%s\"", m_quantiles[q].label);
+        m_series(b, f->name, "_quantile", m->labels, extra);
+        v = total ? m_bucket_upper(i) : 0;
+        m_printf(b, "%llu\n", (unsigned long long)(v > max ? max : v));
+    }
+    m_series(b, f->name, "_quantile", m->labels, "quantile=\"1\"");
+    m_printf(b, "%llu\n", (unsigned long long)max);
+}
+
+static void m_write_family(metrics_buf_t* b, const metric_family_t* f, uint64_t* counts)
+{
+    static const char* types[] = { "counter", "gauge", "histogram" };
+    const metric_t* m;
+    uint64_t sum;
+    int i;
+
+    m_printf(b, "# HELP %s %s\n# TYPE %s %s\n", f->name, f->help, f->name, types[f->type]);
+    for (m = f->first; m; m = m->next)
+    {
+        if (f->type == METRIC_HISTOGRAM)
+        {
+            m_write_histogram(b, f, m, counts, m_snapshot(m, counts));
+            continue;
+        }
+        m_series(b, f->name, "", m->labels, NULL);
+        if (m->fn)
+            m_printf(b, "%lld\n", (long long)m->fn());
+        else if (m->slots)
+        {
+            sum = 0;
+            for (i = 0; i < METRICS_MAX_THREADS; i++)
+                sum += atomic_load_explicit(&m->slots[i].v, memory_order_relaxed);
+            m_printf(b, "%llu\n", (unsigned long long)sum);
+        }
+        else
+            m_printf(b, "%lld\n", (long long)atomic_load_explicit(&m->value, memory_order_relaxed));
+    }
+}
+
+/* slab pools are not registered metrics, their stats are read at scrape time */
+typedef struct
+{
+    metrics_buf_t* b;
+    int field;
+} slab_scrape_t;
+
+static void m_write_slab(const ft_slab_stats_t* s, void* user_data)
+{
+    slab_scrape_t* scrape;
+    char labels[96];
+
+    scrape = user_data;
+    metrics_escape_label(labels, sizeof(labels), s->name);
+    m_printf(scrape->b, "%s{cache=\"%s\"} ", scrape->field == 0 ? "slab_objects_live"
+             : scrape->field == 1 ? "slab_slabs" : "slab_fragmentation_ratio", labels);
+    if (scrape->field == 0)
+        m_printf(scrape->b, "%zu\n", s->live);
+    else if (scrape->field == 1)
+        m_printf(scrape->b, "%zu\n", s->slabs);
+    else
+        m_printf(scrape->b, "%.4f\n", s->fragmentation);
+}
+
+static void m_write_slabs(metrics_buf_t* b)
+{
+    static const char* families[] = {
+        "# HELP slab_objects_live Objects allocated from the slab cache\n# TYPE slab_objects_live gauge\n",
+        "# HELP slab_slabs Slabs held by the slab cache\n# TYPE slab_slabs gauge\n",
+        "# HELP slab_fragmentation_ratio Share of slab space not holding a live object\n"
+        "# TYPE slab_fragmentation_ratio gauge\n"
+    };
+    slab_scrape_t scrape;
+
+    scrape.b = b;
+    for (scrape.field = 0; scrape.field < 3; scrape.field++)
+    {
+        m_printf(b, "%s", families[scrape.field]);
+        ft_slab_foreach(m_write_slab, &scrape);
+    }
+}
+
+/* MALLOC_TRACK builds only: totals and the call sites holding the most memory */
+static void m_write_allocations(metrics_buf_t* b)
+{
+    ft_malloc_site_t sites[METRICS_ALLOC_SITES];
+    ft_malloc_totals_t totals;
+    char site[256];
+    char label[300];
+    size_t n;
+    size_t i;
+
+    if (!ft_malloc_tracking())
+        return;
+
+    ft_malloc_totals(&totals);
+    m_printf(b, "# HELP malloc_live_bytes Bytes allocated through ft_malloc and not freed\n"
+                "# TYPE malloc_live_bytes gauge\nmalloc_live_bytes %zu\n", totals.live_bytes);
+    m_printf(b, "# HELP malloc_peak_bytes Highest malloc_live_bytes seen\n"
+                "# TYPE malloc_peak_bytes gauge\nmalloc_peak_bytes %zu\n", totals.peak_bytes);
+    m_printf(b, "# HELP malloc_allocations_total Allocations through ft_malloc\n"
+                "# TYPE malloc_allocations_total counter\nmalloc_allocations_total %zu\n", totals.allocs);
+
+    n = ft_malloc_top_sites(sites, METRICS_ALLOC_SITES);
+    m_printf(b, "# HELP malloc_site_live_bytes Live bytes per call site, top %d\n"
+                "# TYPE malloc_site_live_bytes gauge\n", METRICS_ALLOC_SITES);
+    for (i = 0; i < n; i++)
+    {
+        snprintf(site, sizeof(site), "%s:%d", sites[i].file, sites[i].line);
+        metrics_escape_label(label, sizeof(label), site);
+        m_printf(b, "malloc_site_live_bytes{site=\"%s\"} %zu\n", label, sites[i].live_bytes);
+    }
+    m_printf(b, "# HELP malloc_site_allocations_total Allocations per call site, top %d\n"
+                "# TYPE malloc_site_allocations_total counter\n", METRICS_ALLOC_SITES);
+    for (i = 0; i < n; i++)
+    {
+        snprintf(site, sizeof(site), "%s:%d", sites[i].file, sites[i].line);
+        metrics_escape_label(label, sizeof(label), site);
+        m_printf(b, "malloc_site_allocations_total{site=\"%s\"} %zu\n", label, sites[i].allocs);
+    }
+}
+
+static void m_handle_metrics(http_request_ctx_t* ctx, void* user_data)
+{
+    static uint64_t counts[HIST_BUCKETS];
+    const metric_family_t* f;
+    const metric_t* m;
+    metrics_buf_t b;
+
+    (void)user_data;
+    if (strncmp(ctx->request, "GET ", 4) != 0)
+    {
+        router_http_generate_response(ctx->fd, CODE_405_METHOD_NOT_ALLOWED, NULL);
+        return;
+    }
+
+    b.arena = ctx->arena;
+    b.cap = 16384;
+    b.len = 0;
+    b.data = ft_arena_alloc(b.arena, b.cap);
+
+    pthread_mutex_lock(&m_lock);
+    for (f = m_first_family; f; f = f->next)
+    {
+        m_write_family(&b, f, counts);
+        if (f->type != METRIC_HISTOGRAM)
+            continue;
+        m_printf(&b, "# HELP %s_quantile %s (HDR quantiles, 1 is the max)\n# TYPE %s_quantile gauge\n",
+                 f->name, f->help, f->name);
+        for (m = f->first; m; m = m->next)
+            m_write_quantiles(&b, f, m, counts, m_snapshot(m, counts));
+    }
+    pthread_mutex_unlock(&m_lock);
+    m_write_slabs(&b);
+    m_write_allocations(&b);
+
+    router_http_send(ctx->fd, CODE_200_OK, "text/plain; version=0.0.4", b.data, b.len);
+}
+
+int metrics_init(void)
+{
+    router_add(METRICS_ROUTE, m_handle_metrics, NULL);
+    log_msg(LOG_LEVEL_BOOT, "Metrics served on %s\n", METRICS_ROUTE);
+    return SUCCESS;
+}
+
+void metrics_cleanup(void)
+{
+    metric_family_t* f;
+    metric_family_t* ftmp;
+    metric_t* m;
+    metric_t* tmp;
+
+    pthread_mutex_lock(&m_lock);
+    HASH_ITER(hh, m_metrics, m, tmp)
+    {
+        HASH_DEL(m_metrics, m);
+        free(m->key);
+        free(m->labels);
+        free(m->slots);
+        free(m->hist);
+        free(m);
+    }
+    HASH_ITER(hh, m_families, f, ftmp)
+    {
+        HASH_DEL(m_families, f);
+        free(f->name);
+        free(f->help);
+        free(f);
+    }
+    m_first_family = NULL;
+    m_last_family = NULL;
+    pthread_mutex_unlock(&m_lock);
+}
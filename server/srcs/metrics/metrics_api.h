@@ -0,0 +1,47 @@
+#ifndef METRICS_API_H
+#define METRICS_API_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Prometheus-style metrics registry.
+ *
+ * Metrics are registered once (typically at init or on first use of a
+ * call site) and the returned handle is cached by the caller; recording
+ * is then lock-free:
+ *  - counters keep one cache-line slot per thread, summed on scrape;
+ *  - histograms are HDR-style log-linear buckets (~6% precision) with
+ *    relaxed atomic bucket counts, exported as cumulative buckets plus
+ *    p50/p90/p99/max quantiles;
+ *  - gauges are a single atomic value or a callback sampled on scrape.
+ *
+ * Registering the same name and labels twice returns the same handle.
+ * labels is the rendered label set without braces, e.g. route="/login",
+ * or NULL. Recording into a NULL handle is a no-op.
+ */
+
+typedef struct metric_s metric_t;
+typedef int64_t (*metric_fn_t)(void);
+
+metric_t* metrics_counter(const char* name, const char* help, const char* labels);
+metric_t* metrics_counter_fn(const char* name, const char* help, const char* labels, metric_fn_t fn);
+metric_t* metrics_gauge(const char* name, const char* help, const char* labels);
+metric_t* metrics_gauge_fn(const char* name, const char* help, const char* labels, metric_fn_t fn);
+metric_t* metrics_histogram(const char* name, const char* help, const char* labels);
+
+void metrics_add(metric_t* m, uint64_t n);
+void metrics_set(metric_t* m, int64_t v);
+void metrics_observe(metric_t* m, uint64_t v);
+
+/* monotonic clock for latency histograms */
+uint64_t metrics_now_us(void);
+
+/* copies value into out escaped for a label, truncated to out_len - 1 */
+size_t metrics_escape_label(char* out, size_t out_len, const char* value);
+
+/* registers the /metrics route */
+int metrics_init(void);
+void metrics_cleanup(void);
+
+#endif /* METRICS_API_H */
@@ -6,92 +6,327 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/inotify.h>
 
 #include <error_codes.h>
+#include <ft_malloc.h>
 #include "../log/log_api.h"
 #include "config_file.h"
 
+#define CONFIG_MAX_HOOKS 16
+
+typedef enum
+{
+    CFG_INT,
+    CFG_BOOL,
+    CFG_SIZE,
+    CFG_DOUBLE,
+    CFG_STRING,
+    CFG_LEVEL,
+} cfg_type_t;
+
 typedef struct
-{   
-    log_level LOG_LEVEL;
-    char* LOG_FILE_PATH;
-    bool LOG_ERASE;
+{
+    const char* key;
+    cfg_type_t type;
+    size_t offset;
+    bool hot;                   /* applied by a reload, the others need a restart */
+} cfg_key_t;
+
+typedef struct
+{
+    on_config_reload cb;
+    void* user_data;
+} cfg_hook_t;
+
+#define CFG_KEY(name, type, hot) { #name, type, offsetof(config_t, name), hot }
+#define CFG_FIELD(c, k, type) ((type*)((char*)(c) + (k)->offset))
+
+static const cfg_key_t m_keys[] = {
+    CFG_KEY(LOG_LEVEL, CFG_LEVEL, true),
+    CFG_KEY(LOG_FILE_PATH, CFG_STRING, false),
+    CFG_KEY(LOG_ERASE, CFG_BOOL, false),
+    CFG_KEY(LOG_BINARY_PATH, CFG_STRING, false),
+    CFG_KEY(LOG_ROTATE_SIZE, CFG_SIZE, false),
+    CFG_KEY(LOG_ROTATE_INTERVAL, CFG_INT, false),
+    CFG_KEY(LOG_ROTATE_KEEP, CFG_INT, false),
+    CFG_KEY(LOG_COMPRESS, CFG_BOOL, false),
+    CFG_KEY(LOG_FLUSH_MS, CFG_INT, false),
+    CFG_KEY(LOG_DIRECT, CFG_BOOL, false),
 
-    char* CERT_PATH;
-    char* KEY_PATH;
-    int PORT;
+    CFG_KEY(CERT_PATH, CFG_STRING, false),
+    CFG_KEY(KEY_PATH, CFG_STRING, false),
+    CFG_KEY(PORT, CFG_INT, false),
+    CFG_KEY(SERVER_BACKLOG, CFG_INT, false),
+    CFG_KEY(SERVER_READ_BUFFER, CFG_SIZE, true),
+    CFG_KEY(REQUEST_ARENA_SIZE, CFG_SIZE, false),
+    CFG_KEY(ROUTER_SEND_TIMEOUT_MS, CFG_INT, true),
+    CFG_KEY(HANDOFF_SOCKET, CFG_STRING, false),
+    CFG_KEY(SHUTDOWN_DRAIN_MS, CFG_INT, true),
 
-    char* DB_HOST;
-    char* DB_PORT;
-    char* DB_USER;
-    char* DB_PASSWORD;
-    char* DB_NAME;
+    CFG_KEY(WS_MAX_MESSAGE, CFG_SIZE, true),
+    CFG_KEY(WS_MAX_PENDING, CFG_SIZE, true),
+    CFG_KEY(WS_PING_INTERVAL, CFG_INT, true),
+    CFG_KEY(WS_PONG_TIMEOUT, CFG_INT, true),
 
-} config_t;
+    CFG_KEY(DB_HOST, CFG_STRING, false),
+    CFG_KEY(DB_PORT, CFG_STRING, false),
+    CFG_KEY(DB_USER, CFG_STRING, false),
+    CFG_KEY(DB_PASSWORD, CFG_STRING, false),
+    CFG_KEY(DB_NAME, CFG_STRING, false),
+    CFG_KEY(DB_SLOW_QUERY_MS, CFG_INT, true),
+    CFG_KEY(INDEX_SNAPSHOT_PATH, CFG_STRING, false),
+    CFG_KEY(INDEX_SNAPSHOT_INTERVAL, CFG_INT, true),
 
-config_t* m_config_content = NULL;
+    CFG_KEY(TRACE_SAMPLE_RATE, CFG_DOUBLE, true),
+    CFG_KEY(TRACE_RING_SIZE, CFG_INT, false),
 
-static void m_init_config_content()
+    CFG_KEY(SUGGEST_MAX_FEEDS, CFG_INT, true),
+
+    CFG_KEY(MAIL_RELAY_HOST, CFG_STRING, false),
+    CFG_KEY(MAIL_RELAY_PORT, CFG_INT, false),
+    CFG_KEY(MAIL_FROM, CFG_STRING, false),
+    CFG_KEY(MAIL_SPOOL_DIR, CFG_STRING, false),
+    CFG_KEY(MAIL_QUEUE_SIZE, CFG_INT, false),
+    CFG_KEY(MAIL_MAX_ATTEMPTS, CFG_INT, false),
+    CFG_KEY(MAIL_IO_TIMEOUT_MS, CFG_INT, false),
+    CFG_KEY(MAIL_IDLE_SECONDS, CFG_INT, false),
+};
+
+#define CFG_KEY_COUNT (sizeof(m_keys) / sizeof(m_keys[0]))
+
+/*
+ * Readers only load m_current. Replaced snapshots are parked in
+ * m_retired instead of freed: the config is small and reloads are rare,
+ * so keeping them until exit is cheaper than tracking readers.
+ */
+static _Atomic(config_t*) m_current = NULL;
+static config_t** m_retired = NULL;
+static size_t m_retired_count = 0;
+static char* m_filename = NULL;
+static cfg_hook_t m_hooks[CONFIG_MAX_HOOKS];
+static int m_hook_count = 0;
+static pthread_mutex_t m_reload_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void m_init_config_content(config_t* c)
 {
-    if (!m_config_content)
-        return;
+    c->LOG_LEVEL = LOG_LEVEL_WARN;
+    c->LOG_FILE_PATH = strdup("log.txt");
+    c->LOG_ERASE = true;
+    c->LOG_BINARY_PATH = NULL;
+    c->LOG_ROTATE_SIZE = 0;
+    c->LOG_ROTATE_INTERVAL = 0;
+    c->LOG_ROTATE_KEEP = 5;
+    c->LOG_COMPRESS = true;
+    c->LOG_FLUSH_MS = 200;
+    c->LOG_DIRECT = false;
+
+    c->CERT_PATH = strdup("cert.pem");
+    c->KEY_PATH = strdup("key.pem");
+    c->PORT = 12345;
+    c->SERVER_BACKLOG = 0;
+    c->SERVER_READ_BUFFER = 4096;
+    c->REQUEST_ARENA_SIZE = 64 * 1024;
+    c->ROUTER_SEND_TIMEOUT_MS = 1000;
+    c->HANDOFF_SOCKET = strdup("");
+    c->SHUTDOWN_DRAIN_MS = 10000;
+
+    c->WS_MAX_MESSAGE = 64 * 1024;
+    c->WS_MAX_PENDING = 1024 * 1024;
+    c->WS_PING_INTERVAL = 30;
+    c->WS_PONG_TIMEOUT = 30;
+
+    c->DB_HOST = strdup("localhost");
+    c->DB_PORT = strdup("5432");
+    c->DB_USER = strdup("user");
+    c->DB_PASSWORD = strdup("password");
+    c->DB_NAME = strdup("database");
+    c->DB_SLOW_QUERY_MS = 200;
+    c->INDEX_SNAPSHOT_PATH = strdup("index.snap");
+    c->INDEX_SNAPSHOT_INTERVAL = 300;
+
+    c->TRACE_SAMPLE_RATE = 0.01;
+    c->TRACE_RING_SIZE = 256;
 
-    m_config_content->LOG_LEVEL = LOG_LEVEL_WARN;
-    m_config_content->LOG_FILE_PATH = strdup("log.txt");
-    m_config_content->LOG_ERASE = true;
+    c->SUGGEST_MAX_FEEDS = 4096;
 
-    m_config_content->CERT_PATH = strdup("cert.pem");
-    m_config_content->KEY_PATH = strdup("key.pem");
-    m_config_content->PORT = 12345;
+    c->MAIL_RELAY_HOST = strdup("localhost");
+    c->MAIL_RELAY_PORT = 25;
+    c->MAIL_FROM = strdup("matcha@localhost");
+    c->MAIL_SPOOL_DIR = strdup("mail_spool");
+    c->MAIL_QUEUE_SIZE = 1024;
+    c->MAIL_MAX_ATTEMPTS = 8;
+    c->MAIL_IO_TIMEOUT_MS = 30000;
+    c->MAIL_IDLE_SECONDS = 30;
+}
 
-    m_config_content->DB_HOST = strdup("localhost");
-    m_config_content->DB_PORT = strdup("5432");
-    m_config_content->DB_USER = strdup("user");
-    m_config_content->DB_PASSWORD = strdup("password");
-    m_config_content->DB_NAME = strdup("database");
+const config_t* parse_get_config(void)
+{
+    return atomic_load_explicit(&m_current, memory_order_acquire);
 }
 
 void parse_set_log_config(log_config* log)
 {
-    log->LOG_ERASE = m_config_content->LOG_ERASE;
-    log->LOG_FILE_PATH = m_config_content->LOG_FILE_PATH;
-    log->LOG_LEVEL = m_config_content->LOG_LEVEL;
+    const config_t* c = parse_get_config();
+
+    log->LOG_ERASE = c->LOG_ERASE;
+    log->LOG_FILE_PATH = c->LOG_FILE_PATH;
+    log->LOG_LEVEL = c->LOG_LEVEL;
+    log->LOG_BINARY_PATH = c->LOG_BINARY_PATH;
+    log->LOG_ROTATE_SIZE = c->LOG_ROTATE_SIZE;
+    log->LOG_ROTATE_INTERVAL = c->LOG_ROTATE_INTERVAL;
+    log->LOG_ROTATE_KEEP = c->LOG_ROTATE_KEEP;
+    log->LOG_COMPRESS = c->LOG_COMPRESS;
+    log->LOG_FLUSH_MS = c->LOG_FLUSH_MS;
+    log->LOG_DIRECT = c->LOG_DIRECT;
 }
 
 void parse_set_ssl_config(ssl_config* ssl)
 {
-    ssl->CERT_PATH = m_config_content->CERT_PATH;
-    ssl->KEY_PATH = m_config_content->KEY_PATH;
-    ssl->PORT = m_config_content->PORT;
+    const config_t* c = parse_get_config();
+
+    ssl->CERT_PATH = c->CERT_PATH;
+    ssl->KEY_PATH = c->KEY_PATH;
+    ssl->PORT = c->PORT;
 }
 
 void parse_set_db_config(db_config* db)
 {
-    db->DB_HOST = m_config_content->DB_HOST;
-    db->DB_PORT = m_config_content->DB_PORT;
-    db->DB_USER = m_config_content->DB_USER;
-    db->DB_PASSWORD = m_config_content->DB_PASSWORD;
-    db->DB_NAME = m_config_content->DB_NAME;
+    const config_t* c = parse_get_config();
+
+    db->DB_HOST = c->DB_HOST;
+    db->DB_PORT = c->DB_PORT;
+    db->DB_USER = c->DB_USER;
+    db->DB_PASSWORD = c->DB_PASSWORD;
+    db->DB_NAME = c->DB_NAME;
+    db->DB_SLOW_QUERY_MS = c->DB_SLOW_QUERY_MS;
 }
 
-void parse_free_config()
+void parse_set_trace_config(trace_config* trace)
 {
-    free(m_config_content->LOG_FILE_PATH);
+    const config_t* c = parse_get_config();
 
-    free(m_config_content->CERT_PATH);
-    free(m_config_content->KEY_PATH);
+    trace->TRACE_SAMPLE_RATE = c->TRACE_SAMPLE_RATE;
+    trace->TRACE_RING_SIZE = c->TRACE_RING_SIZE;
+}
 
-    free(m_config_content->DB_HOST);
-    free(m_config_content->DB_PORT);
-    free(m_config_content->DB_USER);
-    free(m_config_content->DB_PASSWORD);
-    free(m_config_content->DB_NAME);
+void parse_set_mail_config(mail_config* mail)
+{
+    const config_t* c = parse_get_config();
 
-    free(m_config_content);
-    m_config_content = NULL;
+    mail->MAIL_RELAY_HOST = c->MAIL_RELAY_HOST;
+    mail->MAIL_RELAY_PORT = c->MAIL_RELAY_PORT;
+    mail->MAIL_FROM = c->MAIL_FROM;
+    mail->MAIL_SPOOL_DIR = c->MAIL_SPOOL_DIR;
+    mail->MAIL_QUEUE_SIZE = c->MAIL_QUEUE_SIZE;
+    mail->MAIL_MAX_ATTEMPTS = c->MAIL_MAX_ATTEMPTS;
+    mail->MAIL_IO_TIMEOUT_MS = c->MAIL_IO_TIMEOUT_MS;
+    mail->MAIL_IDLE_SECONDS = c->MAIL_IDLE_SECONDS;
 }
 
-int parse_config(const char *filename)
+static bool m_parse_bool(const char* val)
+{
+    return val[0] == 'y' || val[0] == 'Y' || val[0] == '1';
+}
+
+/* bytes with an optional K, M or G suffix */
+static size_t m_parse_size(const char* val)
+{
+    char* end;
+    size_t size;
+
+    size = strtoull(val, &end, 10);
+    if (*end == 'k' || *end == 'K')
+        size <<= 10;
+    else if (*end == 'm' || *end == 'M')
+        size <<= 20;
+    else if (*end == 'g' || *end == 'G')
+        size <<= 30;
+    return size;
+}
+
+static const cfg_key_t* m_find_key(const char* key)
+{
+    size_t i;
+
+    for (i = 0; i < CFG_KEY_COUNT; i++)
+    {
+        if (strcmp(m_keys[i].key, key) == 0)
+            return &m_keys[i];
+    }
+    return NULL;
+}
+
+static void m_set(config_t* c, const cfg_key_t* k, const char* val)
+{
+    switch (k->type)
+    {
+        case CFG_INT:
+            *CFG_FIELD(c, k, int) = atoi(val);
+            break;
+        case CFG_BOOL:
+            *CFG_FIELD(c, k, bool) = m_parse_bool(val);
+            break;
+        case CFG_SIZE:
+            *CFG_FIELD(c, k, size_t) = m_parse_size(val);
+            break;
+        case CFG_DOUBLE:
+            *CFG_FIELD(c, k, double) = atof(val);
+            break;
+        case CFG_STRING:
+            free(*CFG_FIELD(c, k, char*));
+            *CFG_FIELD(c, k, char*) = strdup(val);
+            break;
+        case CFG_LEVEL:
+            *CFG_FIELD(c, k, log_level) = atoi(val);
+            break;
+    }
+}
+
+static bool m_equal(const config_t* a, const config_t* b, const cfg_key_t* k)
+{
+    const char* sa;
+    const char* sb;
+
+    switch (k->type)
+    {
+        case CFG_INT:
+            return *CFG_FIELD(a, k, int) == *CFG_FIELD(b, k, int);
+        case CFG_BOOL:
+            return *CFG_FIELD(a, k, bool) == *CFG_FIELD(b, k, bool);
+        case CFG_SIZE:
+            return *CFG_FIELD(a, k, size_t) == *CFG_FIELD(b, k, size_t);
+        case CFG_DOUBLE:
+            return *CFG_FIELD(a, k, double) == *CFG_FIELD(b, k, double);
+        case CFG_STRING:
+            sa = *CFG_FIELD(a, k, char*);
+            sb = *CFG_FIELD(b, k, char*);
+            return sa == sb || (sa && sb && strcmp(sa, sb) == 0);
+        case CFG_LEVEL:
+            return *CFG_FIELD(a, k, log_level) == *CFG_FIELD(b, k, log_level);
+    }
+    return false;
+}
+
+static void m_free_snapshot(config_t* c)
+{
+    size_t i;
+
+    if (!c)
+        return;
+    for (i = 0; i < CFG_KEY_COUNT; i++)
+    {
+        if (m_keys[i].type == CFG_STRING)
+            free(*CFG_FIELD(c, &m_keys[i], char*));
+    }
+    free(c);
+}
+
+/* *out gets the defaults overridden by the file, even when it cannot be opened */
+static int m_parse_file(const char* filename, config_t** out)
 {
     char    line[256];
     FILE*   fp;
@@ -99,19 +334,19 @@ int parse_config(const char *filename)
     char*   eq;
     char*   key;
     char*   val;
-    char    c;
+    config_t* c;
+    const cfg_key_t* k;
 
-    m_config_content = malloc(sizeof(config_t));
+    c = calloc(1, sizeof(config_t));
+    ft_assert(c != NULL, "calloc failed");
 
     /* Set default values */
-    m_init_config_content();
+    m_init_config_content(c);
+    *out = c;
 
     fp = fopen(filename, "r");
     if (!fp)
-    {
-        perror("Unable to open config file");
         return ERROR;
-    }
 
     while (fgets(line, sizeof(line), fp))
     {
@@ -136,57 +371,175 @@ int parse_config(const char *filename)
         while (vend > val && (isspace((unsigned char)*vend) || *vend=='\r' || *vend=='\n'))
             *vend-- = '\0';
 
-        if (strcmp(key, "LOG_LEVEL") == 0)
-            m_config_content->LOG_LEVEL = atoi(val);
-        else if (strcmp(key, "LOG_FILE_PATH") == 0)
-        {
-            free(m_config_content->LOG_FILE_PATH);
-            m_config_content->LOG_FILE_PATH = strdup(val);
-        }
-        else if (strcmp(key, "LOG_ERASE") == 0)
-        {
-            c = val[0];
-            m_config_content->LOG_ERASE = (c=='y'||c=='Y'||c=='1');
-        }
-        else if (strcmp(key, "CERT_PATH") == 0)
-        {
-            free(m_config_content->CERT_PATH);
-            m_config_content->CERT_PATH = strdup(val);
-        }
-        else if (strcmp(key, "KEY_PATH") == 0)
-        {
-            free(m_config_content->KEY_PATH);
-            m_config_content->KEY_PATH = strdup(val);
-        }
-        else if (strcmp(key, "PORT") == 0)
-            m_config_content->PORT = atoi(val);
-        else if (strcmp(key, "DB_HOST") == 0)
-        {
-            free(m_config_content->DB_HOST);
-            m_config_content->DB_HOST = strdup(val);
-        }
-        else if (strcmp(key, "DB_PORT") == 0)
-        {
-            free(m_config_content->DB_PORT);
-            m_config_content->DB_PORT = strdup(val);
-        }
-        else if (strcmp(key, "DB_USER") == 0)
-        {
-            free(m_config_content->DB_USER);
-            m_config_content->DB_USER = strdup(val);
-        }
-        else if (strcmp(key, "DB_PASSWORD") == 0)
-        {
-            free(m_config_content->DB_PASSWORD);
-            m_config_content->DB_PASSWORD = strdup(val);
-        }
-        else if (strcmp(key, "DB_NAME") == 0)
-        {
-            free(m_config_content->DB_NAME);
-            m_config_content->DB_NAME = strdup(val);
-        }
+        k = m_find_key(key);
+        if (k)
+            m_set(c, k, val);
     }
 
     fclose(fp);
     return SUCCESS;
 }
+
+void parse_free_config()
+{
+    size_t i;
+
+    m_free_snapshot(atomic_exchange(&m_current, NULL));
+    for (i = 0; i < m_retired_count; i++)
+        m_free_snapshot(m_retired[i]);
+    free(m_retired);
+    m_retired = NULL;
+    m_retired_count = 0;
+    free(m_filename);
+    m_filename = NULL;
+    m_hook_count = 0;
+}
+
+int parse_config(const char *filename)
+{
+    config_t* c;
+    int ret;
+
+    free(m_filename);
+    m_filename = strdup(filename);
+
+    ret = m_parse_file(filename, &c);
+    if (ret != SUCCESS)
+        perror("Unable to open config file");
+    m_free_snapshot(atomic_exchange_explicit(&m_current, c, memory_order_acq_rel));
+    return ret;
+}
+
+/* number of keys that differ, the ones needing a restart are warned about */
+static int m_log_changes(const config_t* old, const config_t* now)
+{
+    size_t i;
+    int changed;
+
+    changed = 0;
+    for (i = 0; i < CFG_KEY_COUNT; i++)
+    {
+        if (m_equal(old, now, &m_keys[i]))
+            continue;
+        changed++;
+        if (m_keys[i].hot)
+            log_msg(LOG_LEVEL_INFO, "config: %s reloaded\n", m_keys[i].key);
+        else
+            log_msg(LOG_LEVEL_WARN, "config: %s changed, restart to apply it\n", m_keys[i].key);
+    }
+    return changed;
+}
+
+int parse_reload_config(void)
+{
+    config_t* next;
+    config_t* old;
+    int i;
+
+    if (!m_filename)
+        return ERROR;
+
+    if (m_parse_file(m_filename, &next) != SUCCESS)
+    {
+        log_msg(LOG_LEVEL_WARN, "config: cannot reload %s: %s\n", m_filename, strerror(errno));
+        m_free_snapshot(next);
+        return ERROR;
+    }
+
+    pthread_mutex_lock(&m_reload_lock);
+    old = atomic_load_explicit(&m_current, memory_order_relaxed);
+    if (m_log_changes(old, next) == 0)
+    {
+        /* never published, nobody can hold it */
+        pthread_mutex_unlock(&m_reload_lock);
+        m_free_snapshot(next);
+        return SUCCESS;
+    }
+
+    m_retired = realloc(m_retired, (m_retired_count + 1) * sizeof(*m_retired));
+    m_retired[m_retired_count++] = old;
+    atomic_store_explicit(&m_current, next, memory_order_release);
+
+    for (i = 0; i < m_hook_count; i++)
+        m_hooks[i].cb(old, next, m_hooks[i].user_data);
+    pthread_mutex_unlock(&m_reload_lock);
+
+    log_msg(LOG_LEVEL_INFO, "config: %s reloaded\n", m_filename);
+    return SUCCESS;
+}
+
+int parse_on_reload(on_config_reload cb, void* user_data)
+{
+    int ret;
+
+    if (!cb)
+        return INVALID_ARGS;
+
+    ret = ERROR;
+    pthread_mutex_lock(&m_reload_lock);
+    if (m_hook_count < CONFIG_MAX_HOOKS)
+    {
+        m_hooks[m_hook_count].cb = cb;
+        m_hooks[m_hook_count].user_data = user_data;
+        m_hook_count++;
+        ret = SUCCESS;
+    }
+    pthread_mutex_unlock(&m_reload_lock);
+    return ret;
+}
+
+int parse_config_watch(void)
+{
+    char dir[PATH_MAX];
+    const char* slash;
+    int fd;
+
+    if (!m_filename)
+        return ERROR;
+
+    slash = strrchr(m_filename, '/');
+    if (!slash)
+        snprintf(dir, sizeof(dir), ".");
+    else if (slash == m_filename)
+        snprintf(dir, sizeof(dir), "/");
+    else
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - m_filename), m_filename);
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0)
+        return ERROR;
+    /* not IN_CREATE: a new file is still empty at that point */
+    if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        close(fd);
+        return ERROR;
+    }
+    return fd;
+}
+
+bool parse_config_changed(int fd)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event* ev;
+    const char* base;
+    ssize_t len;
+    ssize_t off;
+    bool changed;
+
+    if (!m_filename)
+        return false;
+    base = strrchr(m_filename, '/');
+    base = base ? base + 1 : m_filename;
+
+    changed = false;
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+    {
+        for (off = 0; off < len; off += sizeof(*ev) + ev->len)
+        {
+            ev = (const struct inotify_event*)(buf + off);
+            if (ev->len && strcmp(ev->name, base) == 0)
+                changed = true;
+        }
+    }
+    return changed;
+}
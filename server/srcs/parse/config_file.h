@@ -1,11 +1,22 @@
 #ifndef CONFIG_FILE_H
 #define CONFIG_FILE_H
 
+#include <stddef.h>
+#include <stdbool.h>
+#include "../log/log_api.h"
+
 typedef struct
 {
     log_level LOG_LEVEL;
     char* LOG_FILE_PATH;
     bool LOG_ERASE;
+    char* LOG_BINARY_PATH;
+    size_t LOG_ROTATE_SIZE;
+    int LOG_ROTATE_INTERVAL;
+    int LOG_ROTATE_KEEP;
+    bool LOG_COMPRESS;
+    int LOG_FLUSH_MS;
+    bool LOG_DIRECT;
 } log_config;
 
 typedef struct
@@ -22,13 +33,118 @@ typedef struct
     char* DB_USER;
     char* DB_PASSWORD;
     char* DB_NAME;
+    int DB_SLOW_QUERY_MS;       /* 0 disables the slow query log */
 } db_config;
 
+typedef struct
+{
+    double TRACE_SAMPLE_RATE;
+    int TRACE_RING_SIZE;
+} trace_config;
+
+typedef struct
+{
+    char* MAIL_RELAY_HOST;
+    int MAIL_RELAY_PORT;
+    char* MAIL_FROM;
+    char* MAIL_SPOOL_DIR;       /* empty disables the spool */
+    int MAIL_QUEUE_SIZE;
+    int MAIL_MAX_ATTEMPTS;
+    int MAIL_IO_TIMEOUT_MS;
+    int MAIL_IDLE_SECONDS;
+} mail_config;
+
+/*
+ * One parsed config file. A snapshot is never modified once published:
+ * a reload parses a new one and swaps the pointer, so readers on any
+ * thread use parse_get_config() without a lock.
+ */
+typedef struct
+{
+    log_level LOG_LEVEL;
+    char* LOG_FILE_PATH;
+    bool LOG_ERASE;
+    char* LOG_BINARY_PATH;
+    size_t LOG_ROTATE_SIZE;
+    int LOG_ROTATE_INTERVAL;
+    int LOG_ROTATE_KEEP;
+    bool LOG_COMPRESS;
+    int LOG_FLUSH_MS;
+    bool LOG_DIRECT;
+
+    char* CERT_PATH;
+    char* KEY_PATH;
+    int PORT;
+    int SERVER_BACKLOG;
+    size_t SERVER_READ_BUFFER;
+    size_t REQUEST_ARENA_SIZE;
+    int ROUTER_SEND_TIMEOUT_MS;
+    char* HANDOFF_SOCKET;       /* empty disables the listener handoff */
+    int SHUTDOWN_DRAIN_MS;
+
+    size_t WS_MAX_MESSAGE;
+    size_t WS_MAX_PENDING;
+    int WS_PING_INTERVAL;
+    int WS_PONG_TIMEOUT;
+
+    char* DB_HOST;
+    char* DB_PORT;
+    char* DB_USER;
+    char* DB_PASSWORD;
+    char* DB_NAME;
+    int DB_SLOW_QUERY_MS;
+    char* INDEX_SNAPSHOT_PATH;  /* empty disables the index snapshot */
+    int INDEX_SNAPSHOT_INTERVAL;    /* seconds, 0 saves on exit only */
+
+    double TRACE_SAMPLE_RATE;
+    int TRACE_RING_SIZE;
+
+    int SUGGEST_MAX_FEEDS;
+
+    char* MAIL_RELAY_HOST;
+    int MAIL_RELAY_PORT;
+    char* MAIL_FROM;
+    char* MAIL_SPOOL_DIR;
+    int MAIL_QUEUE_SIZE;
+    int MAIL_MAX_ATTEMPTS;
+    int MAIL_IO_TIMEOUT_MS;
+    int MAIL_IDLE_SECONDS;
+} config_t;
+
 int parse_config(const char *filename);
+
+/* frees every snapshot, nothing may read the config afterwards */
 void parse_free_config();
 
+/* the current snapshot, NULL before parse_config() */
+const config_t* parse_get_config(void);
+
+/*
+ * Parses the file again and publishes the result. Replaced snapshots
+ * stay allocated until parse_free_config(), so a pointer obtained from
+ * parse_get_config() is valid for the whole run. On error the current
+ * snapshot is kept. Keys that cannot change at runtime are logged.
+ */
+int parse_reload_config(void);
+
+/* runs on the reloading thread after the swap */
+typedef void (*on_config_reload)(const config_t* old, const config_t* now, void* user_data);
+
+int parse_on_reload(on_config_reload cb, void* user_data);
+
+/*
+ * inotify fd (non blocking) reporting writes and renames in the config
+ * file's directory; editors usually replace the file rather than write
+ * it in place. parse_config_changed() drains it and tells whether one of
+ * the events was about the config file.
+ */
+int parse_config_watch(void);
+bool parse_config_changed(int fd);
+
 void parse_set_log_config(log_config* log);
 void parse_set_ssl_config(ssl_config* ssl);
 void parse_set_db_config(db_config* db);
+void parse_set_trace_config(trace_config* trace);
+void parse_set_mail_config(mail_config* mail);
 
 #endif /* CONFIG_FILE_H */
@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "../log/log_api.h"
+#include "../router/router_api.h"
+#include "../server/server_api.h"
+#include "../bus/bus_api.h"
+#include "../db/db_events.h"
+#include "../db/tables/db_table_message.h"
+#include "../db/tables/db_table_notification.h"
+#include "../db/tables/db_table_session.h"
+#include "../db/tables/db_table_counter.h"
+#include "../../inc/ft_malloc.h"
+#include "../../inc/error_codes.h"
+#include "push_api.h"
+
+#define PUSH_ROUTE "/ws"
+#define PUSH_SESSION_COOKIE "session_id"
+
+typedef struct
+{
+    char* data;
+    size_t len;
+    size_t cap;
+} json_buf_t;
+
+static DB_ID m_db = INVALID_DB_ID;
+static bus_reactor_t* m_reactor = NULL;
+
+/* json */
+static void m_json_reserve(json_buf_t* b, size_t extra)
+{
+    if (b->len + extra + 1 <= b->cap)
+        return;
+    b->cap = b->cap ? b->cap : 256;
+    while (b->cap < b->len + extra + 1)
+        b->cap *= 2;
+    b->data = realloc(b->data, b->cap);
+}
+
+__attribute__((format(printf, 2, 3)))
+static void m_json_printf(json_buf_t* b, const char* fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    m_json_reserve(b, 128);
+    va_start(ap, fmt);
+    n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+    if ((size_t)n >= b->cap - b->len)
+    {
+        m_json_reserve(b, n);
+        va_start(ap, fmt);
+        vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+        va_end(ap);
+    }
+    b->len += n;
+}
+
+static void m_json_raw(json_buf_t* b, const char* s)
+{
+    size_t len;
+
+    len = strlen(s);
+    m_json_reserve(b, len);
+    memcpy(b->data + b->len, s, len + 1);
+    b->len += len;
+}
+
+static void m_json_string(json_buf_t* b, const char* s)
+{
+    const unsigned char* p;
+
+    m_json_reserve(b, strlen(s) * 6 + 2);
+    b->data[b->len++] = '"';
+    for (p = (const unsigned char*)s; *p; p++)
+    {
+        if (*p == '"' || *p == '\\')
+        {
+            b->data[b->len++] = '\\';
+            b->data[b->len++] = *p;
+        }
+        else if (*p == '\n')
+        {
+            b->data[b->len++] = '\\';
+            b->data[b->len++] = 'n';
+        }
+        else if (*p < 0x20)
+            b->len += snprintf(b->data + b->len, 7, "\\u%04x", *p);
+        else
+            b->data[b->len++] = *p;
+    }
+    b->data[b->len++] = '"';
+    b->data[b->len] = '\0';
+}
+
+static void m_json_unread(json_buf_t* b, int user_id)
+{
+    unread_counters_t counters;
+
+    /* clustered, the writes of the other nodes only reached the table */
+    if (!bus_is_clustered() || db_tcounter_fetch(m_db, user_id, &counters) != SUCCESS)
+        counters = db_tcounter_get(user_id);
+    m_json_printf(b, ",\"unread\":{\"messages\":%d,\"notifications\":%d}}",
+                  counters.messages, counters.notifications);
+}
+
+/* other nodes may hold the user's connections */
+static bool m_maybe_online(int user_id)
+{
+    return bus_is_clustered() || server_ws_user_online(user_id);
+}
+
+static void m_push_message(const message_t* msg)
+{
+    json_buf_t b = {0};
+    size_t head;
+
+    if (!m_maybe_online(msg->recipient_id) && !m_maybe_online(msg->sender_id))
+        return;
+
+    m_json_printf(&b, "{\"type\":\"message\",\"id\":%d,\"sender_id\":%d,\"recipient_id\":%d,"
+                  "\"sent_at\":%ld,\"content\":",
+                  msg->id, msg->sender_id, msg->recipient_id, (long)msg->sent_at);
+    m_json_string(&b, msg->content ? msg->content : "");
+    head = b.len;
+
+    /* the recipient gets its badge, the sender's other devices just sync */
+    m_json_unread(&b, msg->recipient_id);
+    if (m_maybe_online(msg->recipient_id))
+        bus_publish(msg->recipient_id, b.data, b.len);
+
+    if (msg->sender_id != msg->recipient_id && m_maybe_online(msg->sender_id))
+    {
+        b.len = head;
+        m_json_raw(&b, "}");
+        bus_publish(msg->sender_id, b.data, b.len);
+    }
+    free(b.data);
+}
+
+static void m_push_notification(const notification_t* n)
+{
+    json_buf_t b = {0};
+
+    if (!m_maybe_online(n->user_id))
+        return;
+
+    m_json_printf(&b, "{\"type\":\"notification\",\"id\":%d,\"related_id\":%d,"
+                  "\"created_at\":%ld,\"kind\":",
+                  n->id, n->related_id, (long)n->created_at);
+    m_json_string(&b, n->type ? n->type : "");
+    m_json_unread(&b, n->user_id);
+    bus_publish(n->user_id, b.data, b.len);
+    free(b.data);
+}
+
+static void m_on_db_event(const db_event_t* event, void* user_data)
+{
+    (void)user_data;
+    if (!event->data)
+        return;
+
+    if (event->type == DB_EVENT_MESSAGE_ADDED)
+        m_push_message(event->data);
+    else if (event->type == DB_EVENT_NOTIFICATION_ADDED)
+        m_push_notification(event->data);
+}
+
+/* delivery, one subscription per connection */
+static void m_deliver(int user_id, const char* payload, size_t len, void* user_data)
+{
+    (void)user_id;
+    server_ws_send_text((int)(intptr_t)user_data, payload, len);
+}
+
+static void m_on_ws_close(int fd, int user_id)
+{
+    bus_unsubscribe(m_reactor, user_id, m_deliver, (void*)(intptr_t)fd);
+}
+
+/* upgrade */
+static int m_cookie_value(const char* cookies, const char* name, char* out, size_t out_len)
+{
+    const char* p;
+    size_t name_len;
+    size_t len;
+
+    name_len = strlen(name);
+    p = cookies;
+    while (*p)
+    {
+        while (*p == ' ' || *p == ';')
+            p++;
+        len = strcspn(p, ";");
+        if (len > name_len && p[name_len] == '=' && strncmp(p, name, name_len) == 0)
+        {
+            len -= name_len + 1;
+            if (len >= out_len)
+                return ERROR;
+            memcpy(out, p + name_len + 1, len);
+            out[len] = '\0';
+            return SUCCESS;
+        }
+        p += len;
+    }
+    return ERROR;
+}
+
+static int m_session_id(const http_request_ctx_t* ctx, char* out, size_t out_len)
+{
+    char cookies[1024];
+
+    /* cookie only: a session id in the URL ends up in logs and history */
+    if (router_get_header(ctx->request, ctx->request_len, "Cookie", cookies, sizeof(cookies)) != SUCCESS)
+        return ERROR;
+    return m_cookie_value(cookies, PUSH_SESSION_COOKIE, out, out_len);
+}
+
+static void m_on_ws_route(http_request_ctx_t* ctx, void* user_data)
+{
+    session_t* session;
+    char key[64];
+    char version[8];
+    char session_id[160];
+    int user_id;
+
+    (void)user_data;
+    if (!router_is_websocket_upgrade(ctx->request, ctx->request_len)
+        || router_get_header(ctx->request, ctx->request_len, "Sec-WebSocket-Key", key, sizeof(key)) != SUCCESS
+        || router_get_header(ctx->request, ctx->request_len, "Sec-WebSocket-Version", version, sizeof(version)) != SUCCESS
+        || strcmp(version, "13") != 0)
+    {
+        router_http_generate_response(ctx->fd, CODE_400_BAD_REQUEST, NULL);
+        return;
+    }
+
+    if (m_session_id(ctx, session_id, sizeof(session_id)) != SUCCESS)
+    {
+        router_http_generate_response(ctx->fd, CODE_401_UNAUTHORIZED, NULL);
+        return;
+    }
+
+    session = db_tsession_select_by_id(m_db, session_id);
+    user_id = -1;
+    if (session)
+    {
+        if (session->expires_at > time(NULL))
+            user_id = session->user_id;
+        db_tsession_free(session);
+    }
+    if (user_id < 0)
+    {
+        router_http_generate_response(ctx->fd, CODE_401_UNAUTHORIZED, NULL);
+        return;
+    }
+
+    if (server_ws_accept(ctx->fd, key, user_id) != SUCCESS)
+    {
+        log_msg(LOG_LEVEL_WARN, "push: upgrade failed for fd=%d\n", ctx->fd);
+        router_http_generate_response(ctx->fd, CODE_400_BAD_REQUEST, NULL);
+        return;
+    }
+    bus_subscribe(m_reactor, user_id, m_deliver, (void*)(intptr_t)ctx->fd);
+}
+
+int push_init(DB_ID DB)
+{
+    m_db = DB;
+    m_reactor = bus_main_reactor();
+    if (!m_reactor)
+    {
+        log_msg(LOG_LEVEL_ERROR, "push: bus is not initialized\n");
+        return ERROR;
+    }
+
+    /* a batch of deliveries goes out in one write per connection */
+    bus_reactor_on_batch(m_reactor, server_ws_cork, server_ws_uncork);
+    server_ws_set_close_handler(m_on_ws_close);
+
+    if (db_events_subscribe(m_on_db_event, NULL) != SUCCESS)
+    {
+        log_msg(LOG_LEVEL_ERROR, "push: unable to subscribe to db events\n");
+        return ERROR;
+    }
+    router_add(PUSH_ROUTE, m_on_ws_route, NULL);
+
+    log_msg(LOG_LEVEL_BOOT, "Push channel initialized on %s\n", PUSH_ROUTE);
+    return SUCCESS;
+}
+
+void push_cleanup(void)
+{
+    db_events_unsubscribe(m_on_db_event, NULL);
+    server_ws_set_close_handler(NULL);
+    bus_reactor_on_batch(m_reactor, NULL, NULL);
+    m_reactor = NULL;
+}
@@ -0,0 +1,18 @@
+#ifndef PUSH_API_H
+#define PUSH_API_H
+
+#include "../db/db_api.h"
+
+/*
+ * Realtime push over WebSocket.
+ *
+ * Registers the /ws route: a client upgrades with its session cookie and
+ * from then on every message and notification
+ * inserted for that user is pushed as a JSON text frame, together with
+ * the fresh unread counters, instead of being polled for.
+ */
+
+int push_init(DB_ID DB);
+void push_cleanup(void);
+
+#endif /* PUSH_API_H */
@@ -1,15 +1,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include "../log/log_api.h"
 #include "../parse/config_file.h"
 #include "../../inc/ft_malloc.h"
+#include "../../inc/ft_slab.h"
 #include "../../inc/error_codes.h"
 #include "router_api.h"
 
+#define ROUTER_DEFAULT_SEND_TIMEOUT_MS 1000 /* without a parsed config */
+
 static route_entry_t* m_routes = NULL;
+static ft_slab_cache_t* m_route_cache = NULL;
+static route_entry_t m_unmatched = { .path = "(unmatched)" };
+static __thread int m_status = 0;     /* last response code sent by this thread */
 
 static const char* m_http_code_to_status_text(HTTP_response_code_t code)
 {
@@ -19,6 +28,7 @@ static const char* m_http_code_to_status_text(HTTP_response_code_t code)
         case CODE_201_CREATED: return "Created";
         case CODE_204_NO_CONTENT: return "No Content";
         case CODE_400_BAD_REQUEST: return "Bad Request";
+        case CODE_401_UNAUTHORIZED: return "Unauthorized";
         case CODE_404_NOT_FOUND: return "Not Found";
         case CODE_405_METHOD_NOT_ALLOWED: return "Method Not Allowed";
         case CODE_500_INTERNAL_SERVER_ERROR: return "Internal Server Error";
@@ -27,81 +37,130 @@ static const char* m_http_code_to_status_text(HTTP_response_code_t code)
     }
 }
 
-int router_http_generate_response(int fd, HTTP_response_code_t code, const char* body)
+/* client sockets are non-blocking, large bodies need several sends */
+static void m_send_all(int fd, const char* data, size_t len)
+{
+    const config_t* config;
+    struct pollfd pfd;
+    ssize_t n;
+    int timeout;
+
+    config = parse_get_config();
+    timeout = ROUTER_DEFAULT_SEND_TIMEOUT_MS;
+    if (config && config->ROUTER_SEND_TIMEOUT_MS > 0)
+        timeout = config->ROUTER_SEND_TIMEOUT_MS;
+    while (len > 0)
+    {
+        n = send(fd, data, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            if (poll(&pfd, 1, timeout) <= 0)
+                return;
+            continue;
+        }
+        if (n <= 0)
+            return;
+        data += n;
+        len -= n;
+    }
+}
+
+int router_http_send(int fd, HTTP_response_code_t code, const char* content_type,
+    const char* body, size_t body_len)
 {
-    char body_buf[128];
     char header[512];
-    size_t body_len;
-    const char* status_text;
     int header_len;
+    int span;
+
+    m_status = code;
+    trace_set_status(code);
+    span = trace_span_begin("send", NULL);
+    header_len = snprintf(header, sizeof(header),
+        "HTTP/1.1 %d %s\r\n"
+        "Content-Type: %s\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "Access-Control-Allow-Methods: POST\r\n"
+        "Access-Control-Allow-Headers: Content-Type\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n\r\n",
+        code, m_http_code_to_status_text(code), content_type, body_len);
+
+    if (header_len <= 0 || (size_t)header_len >= sizeof(header))
+    {
+        log_msg(1, "Header formatting error\n");
+        trace_span_end(span);
+        return ERROR;
+    }
+
+    m_send_all(fd, header, header_len);
+    m_send_all(fd, body, body_len);
+
+    trace_span_end(span);
+    log_msg(0, "Response sent to fd=%d with code %d\n", fd, code);
+    return SUCCESS;
+}
+
+int router_http_generate_response(int fd, HTTP_response_code_t code, const char* body)
+{
+    char body_buf[128];
+    char header[128];
+    int span;
 
     if (code == CODE_204_NO_CONTENT)
     {
+        m_status = code;
+        trace_set_status(code);
+        span = trace_span_begin("send", NULL);
         snprintf(header, sizeof(header), "HTTP/1.1 204 No Content\r\nConnection: close\r\n\r\n");
 
         send(fd, header, strlen(header), 0);
+        trace_span_end(span);
+        log_msg(0, "Response sent to fd=%d with code %d\n", fd, code);
+        return SUCCESS;
     }
-    else if (body)
-    {
-        status_text = m_http_code_to_status_text(code);
-        body_len = strlen(body);
-
-        header_len = snprintf(header, sizeof(header),
-            "HTTP/1.1 %d %s\r\n"
-            "Content-Type: application/json\r\n"
-            "Access-Control-Allow-Origin: *\r\n"
-            "Access-Control-Allow-Methods: POST\r\n"
-            "Access-Control-Allow-Headers: Content-Type\r\n"
-            "Content-Length: %zu\r\n"
-            "Connection: close\r\n\r\n",
-            code, status_text, body_len);
-
-        if (header_len <= 0 || (size_t)header_len >= sizeof(header))
-        {
-            log_msg(1, "Header formatting error\n");
-            return ERROR;
-        }
 
-        send(fd, header, header_len, 0);
-        send(fd, body, body_len, 0);
-    }
-    else
+    if (!body)
     {
-        status_text = m_http_code_to_status_text(code);
-
-        body_len = snprintf(body_buf, sizeof(body_buf), "{\"error\": \"%s\"}", status_text);
-
-        header_len = snprintf(header, sizeof(header),
-            "HTTP/1.1 %d %s\r\n"
-            "Content-Type: application/json\r\n"
-            "Access-Control-Allow-Origin: *\r\n"
-            "Access-Control-Allow-Methods: POST\r\n"
-            "Access-Control-Allow-Headers: Content-Type\r\n"
-            "Content-Length: %zu\r\n"
-            "Connection: close\r\n\r\n",
-            code, status_text, body_len);
-
-        if (header_len <= 0 || (size_t)header_len >= sizeof(header))
-        {
-            log_msg(1, "Header formatting error\n");
-            return ERROR;
-        }
-
-        send(fd, header, header_len, 0);
-        send(fd, body_buf, body_len, 0);
+        snprintf(body_buf, sizeof(body_buf), "{\"error\": \"%s\"}", m_http_code_to_status_text(code));
+        body = body_buf;
     }
+    return router_http_send(fd, code, "application/json", body, strlen(body));
+}
 
-    log_msg(0, "Response sent to fd=%d with code %d\n", fd, code);
-    return SUCCESS;
+static void m_route_metrics(route_entry_t* entry)
+{
+    char labels[256];
+    char route[192];
+    size_t n;
+    int i;
+
+    metrics_escape_label(route, sizeof(route), entry->path);
+    snprintf(labels, sizeof(labels), "route=\"%s\"", route);
+    entry->latency = metrics_histogram("http_request_duration_us",
+                                       "HTTP request handling time in microseconds", labels);
+    n = strlen(labels);
+    for (i = 0; i < 5; i++)
+    {
+        snprintf(labels + n, sizeof(labels) - n, ",code=\"%dxx\"", i + 1);
+        entry->responses[i] = metrics_counter("http_responses_total", "HTTP responses by status class", labels);
+    }
 }
 
 void router_add(const char* path, route_cb_t cb, void* user_data)
 {
-    route_entry_t* entry = malloc(sizeof(*entry));
+    route_entry_t* entry;
 
+    if (!m_route_cache)
+        m_route_cache = FT_SLAB_CACHE(route_entry_t);
+    entry = FT_SLAB_NEW(m_route_cache, route_entry_t);
     entry->path = strdup(path);
     entry->handler = cb;
     entry->user_data = user_data;
+    m_route_metrics(entry);
     HASH_ADD_KEYPTR(hh, m_routes, entry->path, strlen(entry->path), entry);
 }
 
@@ -117,7 +176,7 @@ void router_delete(route_entry_t* entry)
 {
     HASH_DEL(m_routes, entry);
     free(entry->path);
-    free(entry);
+    ft_slab_free(entry);
 }
 
 void router_clear()
@@ -129,11 +188,14 @@ void router_clear()
     {
         HASH_DEL(m_routes, current);
         free(current->path);
-        free(current);
+        ft_slab_free(current);
     }
+    ft_slab_destroy(m_route_cache);
+    m_route_cache = NULL;
 }
 
-int router_parse_http_request(const char* request, size_t request_len, char** method, char** route, char** headers, char** body)
+int router_parse_http_request(ft_arena_t* arena, const char* request, size_t request_len,
+    char** method, char** route, char** headers, char** body)
 {
     const char* first_line_end;
     const char* line_start;
@@ -145,7 +207,7 @@ int router_parse_http_request(const char* request, size_t request_len, char** me
     size_t headers_len;
     size_t line_len;
 
-    if (!request || request_len == 0 || !method || !route || !headers || !body)
+    if (!arena || !request || request_len == 0 || !method || !route || !headers || !body)
         return ERROR;
 
     first_line_end = strstr(request, "\r\n");
@@ -160,31 +222,114 @@ int router_parse_http_request(const char* request, size_t request_len, char** me
     if (!space1 || space1 >= line_end)
         return ERROR;
 
-    *method = strndup(line_start, space1 - line_start);
+    *method = ft_arena_strndup(arena, line_start, space1 - line_start);
 
     space2 = memchr(space1 + 1, ' ', line_end - space1 - 1);
     if (!space2 || space2 >= line_end)
         return ERROR;
 
-    *route = strndup(space1 + 1, space2 - (space1 + 1));
+    *route = ft_arena_strndup(arena, space1 + 1, space2 - (space1 + 1));
 
     headers_end = strstr(first_line_end + 2, "\r\n\r\n");
     if (!headers_end)
         return ERROR;
 
     headers_len = headers_end - (first_line_end + 2);
-    *headers = strndup(first_line_end + 2, headers_len);
+    *headers = ft_arena_strndup(arena, first_line_end + 2, headers_len);
 
     body_start = headers_end + 4;
     if ((size_t)(body_start - request) < request_len)
-        *body = strndup(body_start, request + request_len - body_start);
+        *body = ft_arena_strndup(arena, body_start, request + request_len - body_start);
     else
         *body = NULL;
 
     return SUCCESS;
 }
 
-int router_handle_http_request(int fd, const char* request, size_t request_len)
+int router_get_header(const char* request, size_t request_len, const char* name,
+    char* out, size_t out_len)
+{
+    const char* line;
+    const char* end;
+    const char* eol;
+    const char* value;
+    size_t name_len;
+    size_t value_len;
+
+    if (!request || !name || !out || out_len == 0)
+        return ERROR;
+
+    end = request + request_len;
+    name_len = strlen(name);
+
+    line = memchr(request, '\n', request_len);
+    while (line && ++line < end)
+    {
+        eol = memchr(line, '\n', end - line);
+        if (!eol)
+            eol = end;
+        if (eol == line || (eol == line + 1 && *line == '\r'))
+            break; /* end of headers */
+
+        if ((size_t)(eol - line) > name_len && line[name_len] == ':'
+            && strncasecmp(line, name, name_len) == 0)
+        {
+            value = line + name_len + 1;
+            while (value < eol && (*value == ' ' || *value == '\t'))
+                value++;
+            value_len = eol - value;
+            while (value_len > 0 && (value[value_len - 1] == '\r'
+                   || value[value_len - 1] == ' ' || value[value_len - 1] == '\t'))
+                value_len--;
+            if (value_len >= out_len)
+                return ERROR;
+            memcpy(out, value, value_len);
+            out[value_len] = '\0';
+            return SUCCESS;
+        }
+        line = eol;
+    }
+    return ERROR;
+}
+
+/* case-insensitive search of token in a comma separated header value */
+static bool m_has_token(const char* value, const char* token)
+{
+    const char* p;
+    size_t len;
+    size_t token_len;
+
+    token_len = strlen(token);
+    p = value;
+    while (*p)
+    {
+        while (*p == ' ' || *p == ',')
+            p++;
+        len = strcspn(p, ", ");
+        if (len == token_len && strncasecmp(p, token, len) == 0)
+            return true;
+        p += len;
+    }
+    return false;
+}
+
+bool router_is_websocket_upgrade(const char* request, size_t request_len)
+{
+    char value[128];
+
+    if (!request || strncmp(request, "GET ", 4) != 0)
+        return false;
+    if (router_get_header(request, request_len, "Upgrade", value, sizeof(value)) != SUCCESS
+        || strcasecmp(value, "websocket") != 0)
+        return false;
+    if (router_get_header(request, request_len, "Connection", value, sizeof(value)) != SUCCESS
+        || !m_has_token(value, "upgrade"))
+        return false;
+    return true;
+}
+
+static int m_dispatch(int fd, const char* request, size_t request_len, trace_t* trace,
+                      route_entry_t** matched)
 {
     const char* route = NULL;
     const char* first_line_end = NULL;
@@ -194,7 +339,9 @@ int router_handle_http_request(int fd, const char* request, size_t request_len)
     size_t first_line_len = 0;
     route_entry_t* route_entry = NULL;
     http_request_ctx_t request_ctx;
+    int span;
 
+    span = trace_span_begin("parse", NULL);
     first_line_end = strstr(request, "\r\n");
     if (first_line_end)
     {
@@ -210,13 +357,22 @@ int router_handle_http_request(int fd, const char* request, size_t request_len)
             route_end = strchr(route, ' ');
             if (route_end)
                 *route_end = '\0';
+
+            /* routes are matched on the path, the query is the handler's business */
+            route_end = strchr(route, '?');
+            if (route_end)
+                *route_end = '\0';
         }
     }
 
+    if (route)
+        route_entry = router_find(route);
+    trace_span_end(span);
+    *matched = route_entry;
+
     if (!route)
         return router_http_generate_response(fd, CODE_400_BAD_REQUEST, "{\"error\": \"Bad Request\"}");
 
-    route_entry = router_find(route);
     if (!route_entry)
         return router_http_generate_response(fd, CODE_404_NOT_FOUND, "{\"error\": \"Not Found\"}");
 
@@ -227,9 +383,43 @@ int router_handle_http_request(int fd, const char* request, size_t request_len)
     request_ctx.fd = fd;
     request_ctx.request = request;
     request_ctx.request_len = request_len;
+    request_ctx.trace = trace;
+    request_ctx.arena = ft_arena_thread();
 
     /* call the handler */
+    span = trace_span_begin("handler", route);
     route_entry->handler(&request_ctx, route_entry->user_data);
+    trace_span_end(span);
 
     return SUCCESS;
 }
+
+int router_handle_http_request(int fd, const char* request, size_t request_len)
+{
+    route_entry_t* entry;
+    trace_t* trace;
+    ft_arena_t* arena;
+    ft_arena_mark_t mark;
+    uint64_t start;
+    int ret;
+
+    start = metrics_now_us();
+    m_status = 0;
+    arena = ft_arena_thread();
+    mark = ft_arena_mark(arena);
+    trace = trace_begin("http_request", request);
+    ret = m_dispatch(fd, request, request_len, trace, &entry);
+    trace_end(trace);
+    ft_arena_release(arena, mark);
+
+    if (!entry)
+    {
+        entry = &m_unmatched;
+        if (!entry->latency)
+            m_route_metrics(entry);
+    }
+    metrics_observe(entry->latency, metrics_now_us() - start);
+    if (m_status >= 100 && m_status < 600)
+        metrics_add(entry->responses[m_status / 100 - 1], 1);
+    return ret;
+}
@@ -1,13 +1,19 @@
 #ifndef ROUTER_API_H
 #define ROUTER_API_H
 
+#include <stdbool.h>
 #include "../../third_party/uthash-master/src/uthash.h"
+#include "../trace/trace_api.h"
+#include "../metrics/metrics_api.h"
+#include "../../inc/ft_arena.h"
 
 typedef struct 
 {
     int fd;
     const char* request;
     size_t request_len;
+    trace_t* trace;         /* NULL when the request is not sampled */
+    ft_arena_t* arena;      /* request scoped memory, released once the handler returns */
 } http_request_ctx_t;
 
 typedef void (*route_cb_t)(http_request_ctx_t* request_ctx, void *user_data);
@@ -17,6 +23,8 @@ typedef struct route_entry
     char* path;
     route_cb_t handler;
     void* user_data;
+    metric_t* latency;      /* request duration, us */
+    metric_t* responses[5]; /* by status class, 1xx to 5xx */
     UT_hash_handle hh;
 } route_entry_t;
 
@@ -26,6 +34,7 @@ typedef enum
     CODE_201_CREATED = 201,
     CODE_204_NO_CONTENT = 204,
     CODE_400_BAD_REQUEST = 400,
+    CODE_401_UNAUTHORIZED = 401,
     CODE_404_NOT_FOUND = 404,
     CODE_405_METHOD_NOT_ALLOWED = 405,
     CODE_500_INTERNAL_SERVER_ERROR = 500,
@@ -38,7 +47,22 @@ void router_clear();
 
 int router_handle_http_request(int fd, const char* request, size_t request_len);
 int router_http_generate_response(int fd, HTTP_response_code_t code, const char* body);
-int router_parse_http_request(const char* request, size_t request_len, char** method,\
-    char** route, char** headers, char** body);
+
+/* response with an arbitrary content type, body may hold NUL bytes */
+int router_http_send(int fd, HTTP_response_code_t code, const char* content_type,
+    const char* body, size_t body_len);
+/* method, route, headers and body are allocated from arena */
+int router_parse_http_request(ft_arena_t* arena, const char* request, size_t request_len,
+    char** method, char** route, char** headers, char** body);
+
+/*
+ * Copies the value of header `name` (case-insensitive) into out, trimmed.
+ * Returns SUCCESS, or ERROR if missing or longer than out_len - 1.
+ */
+int router_get_header(const char* request, size_t request_len, const char* name,
+    char* out, size_t out_len);
+
+/* GET with Upgrade: websocket and Connection: upgrade */
+bool router_is_websocket_upgrade(const char* request, size_t request_len);
 
 #endif /* ROUTER_API_H */
@@ -1,17 +1,24 @@
+#define _GNU_SOURCE     /* accept4, MSG_CMSG_CLOEXEC */
 #include <stdio.h>
 #include <sys/epoll.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include "../../inc/ft_malloc.h"
+#include "../../inc/ft_slab.h"
 #include "../../inc/error_codes.h"
-#include "../../inc/ft_list.h"
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <time.h>
 #include "../log/log_api.h"
+#include "../metrics/metrics_api.h"
+#include "../../third_party/uthash-master/src/uthash.h"
 #include "server_api.h"
+#include "server_ws.h"
 
 /* defines */
 #define SERVER_KEY "SOME_KEY"
@@ -20,7 +27,8 @@
 #define REMOVE_CLIENT(fd) \
     do { \
         epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, NULL); \
-        log_msg(LOG_LEVEL_INFO, "Removing client %d\n", fd); \
+        LOG_FAST(LOG_LEVEL_INFO, "Removing client %d\n", fd); \
+        m_http_forget(fd); \
         close(fd); \
     } while (0)
 
@@ -50,29 +58,131 @@ do { \
 
 typedef struct
 {
-    list_item_t item;
     int fd;
-} client_list_t;
+    on_fd_ready cb;
+    void* user_data;
+    UT_hash_handle hh;
+} watched_fd_t;
+
+/* an accepted HTTP connection, until it is closed or upgraded */
+typedef struct
+{
+    int fd;
+    time_t accepted_at;
+    UT_hash_handle hh;
+} http_conn_t;
 
 #define MAX_EVENTS 64
+#define SERVER_READ_BUFFER 4096
+#define WS_MAX_MESSAGE (64 * 1024)
+#define WS_MAX_PENDING (1024 * 1024)
+#define WS_PING_INTERVAL_SEC 30
+#define WS_PONG_TIMEOUT_SEC 30
+#define HANDOFF_TIMEOUT_SEC 5       /* a running instance has this long to pass its listener */
+#define DRAIN_IDLE_SEC 2            /* while draining, HTTP clients silent this long are closed */
+static watched_fd_t* m_watched = NULL;
+static ft_slab_cache_t* m_watched_cache = NULL;
+static metric_t* m_accepted = NULL;
+static metric_t* m_bytes_in = NULL;
 static int m_epoll_fd = -1;
 static int m_sock_server = -1;
 static struct epoll_event m_events[MAX_EVENTS];
 static on_http_request m_http_request_handler = NULL;
+static char* m_read_buf = NULL;
+static size_t m_read_cap = 0;
+static http_conn_t* m_http = NULL;      /* open HTTP fds, what the drain waits for */
+static ft_slab_cache_t* m_http_cache = NULL;
+static bool m_draining = false;
+static bool m_handed_off = false;
+static int m_handoff_fd = -1;           /* where the next instance asks for the listener */
+static char* m_handoff_path = NULL;
+static on_server_handoff m_handoff_handler = NULL;
+static server_options m_options = {
+    .backlog = SOMAXCONN,
+    .read_buffer = SERVER_READ_BUFFER,
+    .ws_max_message = WS_MAX_MESSAGE,
+    .ws_max_pending = WS_MAX_PENDING,
+    .ws_ping_interval = WS_PING_INTERVAL_SEC,
+    .ws_pong_timeout = WS_PONG_TIMEOUT_SEC,
+};
 
 void server_set_http_request_handler(on_http_request handler)
 {
     m_http_request_handler = handler;
 }
 
+void server_set_options(const server_options* opts)
+{
+    if (!opts)
+        return;
+    m_options.backlog = opts->backlog > 0 ? opts->backlog : SOMAXCONN;
+    m_options.read_buffer = opts->read_buffer ? opts->read_buffer : SERVER_READ_BUFFER;
+    m_options.ws_max_message = opts->ws_max_message ? opts->ws_max_message : WS_MAX_MESSAGE;
+    m_options.ws_max_pending = opts->ws_max_pending ? opts->ws_max_pending : WS_MAX_PENDING;
+    m_options.ws_ping_interval = opts->ws_ping_interval > 0 ? opts->ws_ping_interval : WS_PING_INTERVAL_SEC;
+    m_options.ws_pong_timeout = opts->ws_pong_timeout > 0 ? opts->ws_pong_timeout : WS_PONG_TIMEOUT_SEC;
+    m_options.handoff_path = opts->handoff_path;
+}
+
+void server_set_handoff_handler(on_server_handoff handler)
+{
+    m_handoff_handler = handler;
+}
+
+const server_options* server_get_options(void)
+{
+    return &m_options;
+}
+
 /* Definitions */
+static void m_http_track(int fd)
+{
+    http_conn_t* c;
+
+    c = FT_SLAB_NEW(m_http_cache, http_conn_t);
+    c->fd = fd;
+    c->accepted_at = time(NULL);
+    HASH_ADD_INT(m_http, fd, c);
+}
+
+static void m_http_forget(int fd)
+{
+    http_conn_t* c;
+
+    HASH_FIND_INT(m_http, &fd, c);
+    if (!c)
+        return;
+    HASH_DEL(m_http, c);
+    ft_slab_free(c);
+}
+
+/*
+ * Requests are handled within their read event, so an open HTTP fd is
+ * one whose client has not sent anything yet. While draining it gets
+ * DRAIN_IDLE_SEC to do so instead of holding the drain until its end.
+ */
+static void m_http_close_idle(void)
+{
+    http_conn_t* c;
+    http_conn_t* tmp;
+    time_t now;
+
+    now = time(NULL);
+    HASH_ITER(hh, m_http, c, tmp)
+    {
+        if (now - c->accepted_at >= DRAIN_IDLE_SEC)
+            REMOVE_CLIENT(c->fd);
+    }
+}
+
 int init_plain_socket(int port)
 {
     int sockfd;
     struct sockaddr_in addr;
     int opt = 1;
 
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    /* non blocking: after a handoff two instances may race for a connection */
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (sockfd < 0) {
         perror("socket");
         return ERROR;
@@ -91,7 +201,7 @@ int init_plain_socket(int port)
         return ERROR;
     }
 
-    if (listen(sockfd, SOMAXCONN) < 0) {
+    if (listen(sockfd, m_options.backlog) < 0) {
         perror("listen");
         close(sockfd);
         return ERROR;
@@ -102,23 +212,37 @@ int init_plain_socket(int port)
 
 int m_handle_client_event(int fd)
 {
-    char buf[4096];
+    char* buf;
     int ret;
 
-    ret = recv(fd, buf, sizeof(buf) - 1, 0);
+    /* resized on the next request after a reload */
+    if (m_read_cap != m_options.read_buffer + 1)
+    {
+        free(m_read_buf);
+        m_read_cap = m_options.read_buffer + 1;
+        m_read_buf = malloc(m_read_cap);
+    }
+    buf = m_read_buf;
+    ret = recv(fd, buf, m_read_cap - 1, 0);
     if (ret <= 0)
     {
-        log_msg(LOG_LEVEL_INFO, "Client disconnected or error: fd=%d\n", fd);
+        LOG_FAST(LOG_LEVEL_INFO, "Client disconnected or error: fd=%d\n", fd);
         REMOVE_CLIENT(fd);
         return SUCCESS;
     }
 
     buf[ret] = '\0';
+    metrics_add(m_bytes_in, ret);
 
     // log_msg(LOG_LEVEL_INFO, "Server: HTTP Request received:\n%s\n", buf);
     if (m_http_request_handler)
     {
         ret = m_http_request_handler(fd, buf, ret);
+        if (server_ws_is_conn(fd))
+        {
+            m_http_forget(fd); /* upgraded, the connection stays open */
+            return SUCCESS;
+        }
         if (ret == ERROR)
         {
             log_msg(LOG_LEVEL_ERROR, "Error handling HTTP request for fd=%d\n", fd);
@@ -144,11 +268,13 @@ int m_handle_new_client(int fd)
     client_fd = accept(fd, (struct sockaddr*)&client_addr, &addr_len);
     if (client_fd < 0)
     {
-        perror("accept");
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            perror("accept");
         return ERROR;
     }
 
-    log_msg(LOG_LEVEL_INFO, "New client connected: fd=%d\n", client_fd);
+    LOG_FAST(LOG_LEVEL_INFO, "New client connected: fd=%d\n", client_fd);
+    metrics_add(m_accepted, 1);
 
     flags = fcntl(client_fd, F_GETFL, 0);
     fcntl(client_fd, F_SETFL, flags | O_NONBLOCK);
@@ -161,18 +287,63 @@ int m_handle_new_client(int fd)
         close(client_fd);
         return ERROR;
     }
+    m_http_track(client_fd);
+
+    return SUCCESS;
+}
+
+int server_watch_fd(int fd, on_fd_ready cb, void* user_data)
+{
+    watched_fd_t* w;
+    struct epoll_event ev;
+
+    if (fd < 0 || !cb)
+        return INVALID_ARGS;
+
+    HASH_FIND_INT(m_watched, &fd, w);
+    if (w)
+        return ERROR;
+
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    {
+        perror("epoll_ctl: watch fd");
+        return ERROR;
+    }
 
+    w = FT_SLAB_NEW(m_watched_cache, watched_fd_t);
+    w->fd = fd;
+    w->cb = cb;
+    w->user_data = user_data;
+    HASH_ADD_INT(m_watched, fd, w);
     return SUCCESS;
 }
 
+void server_unwatch_fd(int fd)
+{
+    watched_fd_t* w;
+
+    HASH_FIND_INT(m_watched, &fd, w);
+    if (!w)
+        return;
+
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    HASH_DEL(m_watched, w);
+    ft_slab_free(w);
+}
+
 int server_select()
 {
+    watched_fd_t* w;
     int n;
     int i;
     int fd;
     int ret;
 
     n = epoll_wait(m_epoll_fd, m_events, MAX_EVENTS, 1000); /* 1s */
+    if (n < 0 && errno == EINTR)
+        n = 0; /* a signal, the caller looks at its flags */
     if (n < 0)
     {
         perror("epoll_wait");
@@ -182,13 +353,26 @@ int server_select()
     for (i = 0; i < n; ++i)
     {
         fd = m_events[i].data.fd;
+        HASH_FIND_INT(m_watched, &fd, w);
 
         if (fd == m_sock_server)
         {
+            /* handed off earlier in this batch, the connection is the next instance's */
+            if (m_handed_off)
+                continue;
+            /* EAGAIN: the other instance sharing the listener took it */
             ret = m_handle_new_client(fd);
-            if (ret == ERROR)
+            if (ret == ERROR && errno != EAGAIN && errno != EWOULDBLOCK)
                 log_msg(LOG_LEVEL_ERROR, "Failed to accept new client\n");
         }
+        else if (w)
+        {
+            w->cb(fd, w->user_data);
+        }
+        else if (server_ws_is_conn(fd))
+        {
+            server_ws_on_event(fd, m_events[i].events);
+        }
         else
         {
             ret = m_handle_client_event(fd);
@@ -201,14 +385,197 @@ int server_select()
         }
     }
 
+    if (m_draining)
+        m_http_close_idle();
+    server_ws_tick();
+    return SUCCESS;
+}
+
+static int m_unix_addr(struct sockaddr_un* addr, const char* path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+        return ERROR;
+    strcpy(addr->sun_path, path);
     return SUCCESS;
 }
 
+/* the listener of the instance serving path, ERROR when there is none */
+static int m_handoff_receive(const char* path)
+{
+    struct sockaddr_un addr;
+    struct timeval timeout;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctrl;
+    char byte;
+    int sock;
+    int fd;
+
+    if (m_unix_addr(&addr, path) != SUCCESS)
+        return ERROR;
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return ERROR;
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        close(sock);
+        return ERROR;
+    }
+    timeout.tv_sec = HANDOFF_TIMEOUT_SEC;
+    timeout.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+
+    fd = ERROR;
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) == 1)
+    {
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+            && cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    close(sock);
+    return fd;
+}
+
+static int m_handoff_send(int sock, int fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctrl;
+    char byte;
+
+    byte = 'L';
+    memset(&msg, 0, sizeof(msg));
+    memset(&ctrl, 0, sizeof(ctrl));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? SUCCESS : ERROR;
+}
+
+/* the next instance connected: pass the listener on and step aside */
+static void m_on_handoff_request(int fd, void* user_data)
+{
+    int conn;
+
+    (void)user_data;
+    conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn < 0)
+        return;
+    if (m_sock_server == -1 || m_handoff_send(conn, m_sock_server) != SUCCESS)
+    {
+        log_msg(LOG_LEVEL_ERROR, "Listener handoff failed: %s\n", strerror(errno));
+        close(conn);
+        return;
+    }
+    close(conn);
+    log_msg(LOG_LEVEL_INFO, "Listener handed off through %s\n", m_handoff_path);
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, m_sock_server, NULL);
+
+    /* the path belongs to the next instance now, it is not unlinked */
+    server_unwatch_fd(m_handoff_fd);
+    close(m_handoff_fd);
+    m_handoff_fd = -1;
+    m_handed_off = true;
+    if (m_handoff_handler)
+        m_handoff_handler();
+}
+
+static int m_handoff_listen(const char* path)
+{
+    struct sockaddr_un addr;
+
+    if (m_unix_addr(&addr, path) != SUCCESS)
+        return ERROR;
+    m_handoff_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_handoff_fd < 0)
+        return ERROR;
+    unlink(path);
+    if (bind(m_handoff_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+        || listen(m_handoff_fd, 1) < 0
+        || server_watch_fd(m_handoff_fd, m_on_handoff_request, NULL) != SUCCESS)
+    {
+        close(m_handoff_fd);
+        m_handoff_fd = -1;
+        return ERROR;
+    }
+    m_handoff_path = strdup(path);
+    return SUCCESS;
+}
+
+void server_drain(void)
+{
+    if (m_draining)
+        return;
+    m_draining = true;
+
+    if (m_sock_server != -1)
+    {
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, m_sock_server, NULL);
+        /*
+         * Without a successor the backlog would be reset on close, so it
+         * is accepted first. A handed off listener is shared and the next
+         * instance takes the backlog.
+         */
+        if (!m_handed_off)
+            while (m_handle_new_client(m_sock_server) == SUCCESS)
+                ;
+        close(m_sock_server);
+        m_sock_server = -1;
+    }
+    server_ws_drain();
+    log_msg(LOG_LEVEL_INFO, "Draining: %u HTTP clients and %zu websockets left\n", HASH_COUNT(m_http), server_ws_count());
+}
+
+bool server_drained(void)
+{
+    return m_draining && HASH_COUNT(m_http) == 0 && server_ws_count() == 0;
+}
+
 int server_init(int port)
 {
     struct epoll_event ev;
+    const char* handoff;
 
-    m_sock_server = init_plain_socket(port);
+    handoff = m_options.handoff_path && m_options.handoff_path[0] ? m_options.handoff_path : NULL;
+    m_sock_server = handoff ? m_handoff_receive(handoff) : ERROR;
+    if (m_sock_server != ERROR)
+    {
+        /* shared with the previous instance, which may be an older blocking build */
+        fcntl(m_sock_server, F_SETFL, fcntl(m_sock_server, F_GETFL, 0) | O_NONBLOCK);
+        log_msg(LOG_LEVEL_BOOT, "Listener taken over through %s\n", handoff);
+    }
+    else
+        m_sock_server = init_plain_socket(port);
     if (m_sock_server == ERROR)
     {
         log_msg(LOG_LEVEL_ERROR, "Failed to initialize plain TCP socket\n");
@@ -230,12 +597,53 @@ int server_init(int port)
         return ERROR;
     }
 
+    m_watched_cache = FT_SLAB_CACHE(watched_fd_t);
+    m_http_cache = FT_SLAB_CACHE(http_conn_t);
+    server_ws_init(m_epoll_fd);
+    if (handoff && m_handoff_listen(handoff) != SUCCESS)
+        log_msg(LOG_LEVEL_WARN, "Cannot serve listener handoff on %s: %s\n", handoff, strerror(errno));
+
+    m_accepted = metrics_counter("server_connections_accepted_total", "Accepted client connections", NULL);
+    m_bytes_in = metrics_counter("server_received_bytes_total", "Bytes read from HTTP clients", NULL);
+
     log_msg(LOG_LEVEL_BOOT, "HTTP server initialized: fd=%d\n", m_sock_server);
     return SUCCESS;
 }
 
 void server_cleanup()
 {
+    watched_fd_t* w;
+    watched_fd_t* tmp;
+    http_conn_t* h;
+    http_conn_t* htmp;
+
+    server_ws_cleanup();
+
+    if (m_handoff_fd != -1)
+    {
+        server_unwatch_fd(m_handoff_fd);
+        close(m_handoff_fd);
+        m_handoff_fd = -1;
+        unlink(m_handoff_path);
+    }
+    free(m_handoff_path);
+    m_handoff_path = NULL;
+    m_draining = false;
+    m_handed_off = false;
+
+    HASH_ITER(hh, m_watched, w, tmp)
+    {
+        server_unwatch_fd(w->fd);
+    }
+    ft_slab_destroy(m_watched_cache);
+    m_watched_cache = NULL;
+    HASH_ITER(hh, m_http, h, htmp)
+    {
+        REMOVE_CLIENT(h->fd);
+    }
+    ft_slab_destroy(m_http_cache);
+    m_http_cache = NULL;
+
     if (m_sock_server != -1)
     {
         epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, m_sock_server, NULL);
@@ -251,4 +659,7 @@ void server_cleanup()
         m_epoll_fd = -1;
     }
 
+    free(m_read_buf);
+    m_read_buf = NULL;
+    m_read_cap = 0;
 }
@@ -1,13 +1,90 @@
 #ifndef SERVER_API_H
 #define SERVER_API_H
 
+#include <stddef.h>
+#include <stdbool.h>
+
 typedef int (*on_http_request)(int fd, const char *request, size_t request_len);
 
 void server_set_http_request_handler(on_http_request handler);
+
+/* a field left at 0 keeps its default */
+typedef struct
+{
+    int backlog;                /* listen(2) backlog, SOMAXCONN by default */
+    size_t read_buffer;         /* bytes read per request */
+    size_t ws_max_message;      /* reassembled WebSocket message */
+    size_t ws_max_pending;      /* queued bytes before a slow client is dropped */
+    int ws_ping_interval;       /* seconds without traffic before a ping */
+    int ws_pong_timeout;        /* seconds left to answer it */
+    const char* handoff_path;   /* Unix socket for the listener handoff, NULL or "" disables it */
+} server_options;
+
+/* from the main loop thread, the backlog and handoff path are only read by server_init() */
+void server_set_options(const server_options* opts);
+
+/*
+ * Graceful shutdown. server_drain() stops accepting, keeps serving the
+ * connections already accepted and sends WebSocket clients a 1001 Going
+ * Away. server_drained() turns true once none of them is left.
+ */
+void server_drain(void);
+bool server_drained(void);
+
+/*
+ * Zero downtime restart. With a handoff path, server_init() first asks a
+ * running instance for its listening socket (SCM_RIGHTS over the Unix
+ * socket) and only binds the port when nobody answers. It then serves
+ * the path itself: once the listener went to the next instance, the
+ * handler runs and should start the drain.
+ */
+typedef void (*on_server_handoff)(void);
+
+void server_set_handoff_handler(on_server_handoff handler);
 int server_select();
 int server_init(int port);
 void server_cleanup();
 
 int server_remove_client(int fd);
 
+/*
+ * Extra fds (eventfd, database sockets, ...) dispatched by the same
+ * epoll loop. cb runs whenever fd is readable (level triggered).
+ */
+typedef void (*on_fd_ready)(int fd, void* user_data);
+
+int server_watch_fd(int fd, on_fd_ready cb, void* user_data);
+void server_unwatch_fd(int fd);
+
+/*
+ * WebSocket (RFC 6455) connections. An HTTP handler upgrades its fd with
+ * server_ws_accept(), the server then keeps it open, answers pings,
+ * pings idle clients and queues outgoing frames until the socket drains.
+ */
+typedef void (*on_ws_message)(int fd, int user_id, const char* data, size_t len);
+
+void server_ws_set_message_handler(on_ws_message handler);
+
+/* Sends the 101 response for Sec-WebSocket-Key sec_key and binds fd to user_id. */
+int server_ws_accept(int fd, const char* sec_key, int user_id);
+
+int server_ws_send_text(int fd, const char* data, size_t len);
+
+/* Sends to every connection of user_id, returns how many got it. */
+int server_ws_send_to_user(int user_id, const char* data, size_t len);
+
+bool server_ws_user_online(int user_id);
+
+/* Called when a WebSocket connection goes away, whatever the reason. */
+typedef void (*on_ws_close)(int fd, int user_id);
+
+void server_ws_set_close_handler(on_ws_close handler);
+
+/*
+ * While corked, frames are only queued. Uncorking flushes every
+ * connection written in between with one send per connection.
+ */
+void server_ws_cork(void);
+void server_ws_uncork(void);
+
 #endif /* SERVER_API_H */
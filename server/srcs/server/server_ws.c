@@ -0,0 +1,670 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "../../inc/ft_malloc.h"
+#include "../../inc/ft_sha1.h"
+#include "../../inc/ft_slab.h"
+#include "../../inc/ft_deque.h"
+#include "../../inc/error_codes.h"
+#include "../../third_party/uthash-master/src/uthash.h"
+#include "../../third_party/uthash-master/src/utlist.h"
+#include "../log/log_api.h"
+#include "../metrics/metrics_api.h"
+#include "server_api.h"
+#include "server_ws.h"
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_READ_CHUNK 4096
+
+#define WS_OP_CONT 0x0
+#define WS_OP_TEXT 0x1
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xA
+
+#define WS_CLOSE_NORMAL 1000
+#define WS_CLOSE_GOING_AWAY 1001
+#define WS_CLOSE_PROTOCOL 1002
+#define WS_CLOSE_TOO_BIG 1009
+
+typedef struct
+{
+    uint8_t* data;
+    size_t len;
+    size_t cap;
+} ws_buf_t;
+
+typedef struct ws_conn_s
+{
+    int fd;
+    int user_id;
+    ws_buf_t rx;        /* bytes not parsed yet */
+    ws_buf_t msg;       /* fragmented message being reassembled */
+    uint8_t msg_opcode; /* 0 when no fragmented message is pending */
+    ws_buf_t tx;        /* frames waiting for the socket */
+    size_t tx_off;
+    bool want_write;    /* EPOLLOUT armed */
+    bool broken;        /* send failed from the public API, removed on the next event or tick */
+    bool ping_sent;
+    bool dirty;         /* in m_dirty, waiting for the uncork */
+    time_t last_seen;
+    struct ws_conn_s* prev; /* connections of the same user */
+    struct ws_conn_s* next;
+    UT_hash_handle hh;
+} ws_conn_t;
+
+typedef struct
+{
+    int user_id;
+    ws_conn_t* conns;
+    UT_hash_handle hh;
+} ws_user_t;
+
+static int m_epoll_fd = -1;
+static ws_conn_t* m_conns = NULL;
+static ws_user_t* m_users = NULL;
+static on_ws_message m_message_handler = NULL;
+static on_ws_close m_close_handler = NULL;
+static bool m_corked = false;
+static bool m_going_away = false;   /* draining, new connections are closed right away */
+FT_DEQUE_DEFINE(ws_fd_queue, int)
+static ws_fd_queue_t m_dirty = FT_DEQUE_INIT; /* fds written while corked */
+static time_t m_last_sweep = 0;
+static ft_slab_cache_t* m_conn_cache = NULL;
+static ft_slab_cache_t* m_user_cache = NULL;
+
+/* buffers */
+static void m_buf_reserve(ws_buf_t* buf, size_t extra)
+{
+    if (buf->len + extra <= buf->cap)
+        return;
+    buf->cap = buf->cap ? buf->cap : 256;
+    while (buf->cap < buf->len + extra)
+        buf->cap *= 2;
+    buf->data = realloc(buf->data, buf->cap);
+}
+
+static void m_buf_append(ws_buf_t* buf, const void* data, size_t len)
+{
+    m_buf_reserve(buf, len);
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void m_buf_consume(ws_buf_t* buf, size_t len)
+{
+    memmove(buf->data, buf->data + len, buf->len - len);
+    buf->len -= len;
+}
+
+static void m_buf_free(ws_buf_t* buf)
+{
+    free(buf->data);
+    memset(buf, 0, sizeof(*buf));
+}
+
+/* connection table */
+static ws_conn_t* m_find(int fd)
+{
+    ws_conn_t* c;
+
+    HASH_FIND_INT(m_conns, &fd, c);
+    return c;
+}
+
+/* drops the state, the socket is left to the caller */
+static void m_forget(ws_conn_t* c)
+{
+    ws_user_t* u;
+
+    HASH_FIND_INT(m_users, &c->user_id, u);
+    if (u)
+    {
+        DL_DELETE(u->conns, c);
+        if (!u->conns)
+        {
+            HASH_DEL(m_users, u);
+            ft_slab_free(u);
+        }
+    }
+
+    HASH_DEL(m_conns, c);
+    m_buf_free(&c->rx);
+    m_buf_free(&c->msg);
+    m_buf_free(&c->tx);
+    ft_slab_free(c);
+}
+
+static void m_remove(ws_conn_t* c)
+{
+    int fd;
+
+    fd = c->fd;
+    if (m_close_handler)
+        m_close_handler(fd, c->user_id);
+    m_forget(c);
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    LOG_FAST(LOG_LEVEL_INFO, "WebSocket closed: fd=%d\n", fd);
+    close(fd);
+}
+
+static void m_set_want_write(ws_conn_t* c, bool on)
+{
+    struct epoll_event ev;
+
+    if (c->want_write == on)
+        return;
+    ev.events = EPOLLIN | EPOLLET | (on ? EPOLLOUT : 0);
+    ev.data.fd = c->fd;
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) == 0)
+        c->want_write = on;
+}
+
+/* sends as much of the queue as the socket takes, EPOLLOUT resumes the rest */
+static int m_flush(ws_conn_t* c)
+{
+    ssize_t n;
+
+    while (c->tx_off < c->tx.len)
+    {
+        n = send(c->fd, c->tx.data + c->tx_off, c->tx.len - c->tx_off, MSG_NOSIGNAL);
+        if (n > 0)
+            c->tx_off += n;
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        else
+            return ERROR;
+    }
+
+    if (c->tx_off == c->tx.len)
+    {
+        c->tx.len = 0;
+        c->tx_off = 0;
+        m_set_want_write(c, false);
+    }
+    else
+    {
+        if (c->tx_off > c->tx.len / 2)
+        {
+            m_buf_consume(&c->tx, c->tx_off);
+            c->tx_off = 0;
+        }
+        m_set_want_write(c, true);
+    }
+    return SUCCESS;
+}
+
+static int m_queue_frame(ws_conn_t* c, uint8_t opcode, const void* data, size_t len)
+{
+    uint8_t header[10];
+    size_t header_len;
+    int i;
+
+    if (c->tx.len - c->tx_off + len > server_get_options()->ws_max_pending)
+    {
+        log_msg(LOG_LEVEL_WARN, "WebSocket fd=%d is not reading, dropping it\n", c->fd);
+        return ERROR;
+    }
+
+    /* server frames are never masked */
+    header[0] = 0x80 | opcode;
+    if (len < 126)
+    {
+        header[1] = (uint8_t)len;
+        header_len = 2;
+    }
+    else if (len <= 0xFFFF)
+    {
+        header[1] = 126;
+        header[2] = (uint8_t)(len >> 8);
+        header[3] = (uint8_t)len;
+        header_len = 4;
+    }
+    else
+    {
+        header[1] = 127;
+        for (i = 0; i < 8; i++)
+            header[2 + i] = (uint8_t)((uint64_t)len >> (56 - 8 * i));
+        header_len = 10;
+    }
+
+    m_buf_append(&c->tx, header, header_len);
+    if (len)
+        m_buf_append(&c->tx, data, len);
+
+    if (m_corked)
+    {
+        if (!c->dirty)
+        {
+            c->dirty = true;
+            ws_fd_queue_push_back(&m_dirty, c->fd);
+        }
+        return SUCCESS;
+    }
+    return m_flush(c);
+}
+
+static void m_send_close(ws_conn_t* c, uint16_t code)
+{
+    uint8_t payload[2];
+
+    payload[0] = (uint8_t)(code >> 8);
+    payload[1] = (uint8_t)code;
+    m_queue_frame(c, WS_OP_CLOSE, payload, sizeof(payload));
+}
+
+/* XOR with the client mask, 8 bytes at a time */
+static void m_unmask(uint8_t* data, size_t len, const uint8_t mask[4])
+{
+    uint64_t mask64;
+    uint64_t word;
+    uint32_t mask32;
+    size_t i;
+
+    memcpy(&mask32, mask, sizeof(mask32));
+    mask64 = ((uint64_t)mask32 << 32) | mask32;
+    for (i = 0; i + 8 <= len; i += 8)
+    {
+        memcpy(&word, data + i, sizeof(word));
+        word ^= mask64;
+        memcpy(data + i, &word, sizeof(word));
+    }
+    for (; i < len; i++)
+        data[i] ^= mask[i & 3];
+}
+
+static void m_deliver(ws_conn_t* c, const uint8_t* data, size_t len)
+{
+    if (m_message_handler)
+        m_message_handler(c->fd, c->user_id, (const char*)data, len);
+}
+
+/* handles one complete frame. ERROR means the connection must go */
+static int m_handle_frame(ws_conn_t* c, bool fin, uint8_t opcode, uint8_t* payload, size_t len)
+{
+    switch (opcode)
+    {
+        case WS_OP_TEXT:
+        case WS_OP_BINARY:
+            if (c->msg_opcode)
+                break;
+            if (fin)
+            {
+                m_deliver(c, payload, len);
+                return SUCCESS;
+            }
+            c->msg_opcode = opcode;
+            m_buf_append(&c->msg, payload, len);
+            return SUCCESS;
+        case WS_OP_CONT:
+            if (!c->msg_opcode)
+                break;
+            m_buf_append(&c->msg, payload, len);
+            if (fin)
+            {
+                m_deliver(c, c->msg.data, c->msg.len);
+                c->msg.len = 0;
+                c->msg_opcode = 0;
+            }
+            return SUCCESS;
+        case WS_OP_PING:
+            return m_queue_frame(c, WS_OP_PONG, payload, len);
+        case WS_OP_PONG:
+            c->ping_sent = false;
+            return SUCCESS;
+        case WS_OP_CLOSE:
+            /* echo the status code back, then hang up */
+            m_queue_frame(c, WS_OP_CLOSE, payload, len >= 2 ? 2 : 0);
+            return ERROR;
+        default:
+            break;
+    }
+
+    m_send_close(c, WS_CLOSE_PROTOCOL);
+    return ERROR;
+}
+
+/* parses every complete frame in rx */
+static int m_process(ws_conn_t* c)
+{
+    uint8_t* p;
+    uint64_t len;
+    size_t header_len;
+    bool fin;
+    uint8_t opcode;
+    int i;
+
+    while (c->rx.len >= 2)
+    {
+        p = c->rx.data;
+        fin = p[0] & 0x80;
+        opcode = p[0] & 0x0F;
+
+        /* no extensions negotiated, and clients must mask */
+        if ((p[0] & 0x70) || !(p[1] & 0x80))
+        {
+            m_send_close(c, WS_CLOSE_PROTOCOL);
+            return ERROR;
+        }
+
+        len = p[1] & 0x7F;
+        header_len = 2;
+        if (len == 126)
+        {
+            if (c->rx.len < 4)
+                return SUCCESS;
+            len = ((uint64_t)p[2] << 8) | p[3];
+            header_len = 4;
+        }
+        else if (len == 127)
+        {
+            if (c->rx.len < 10)
+                return SUCCESS;
+            len = 0;
+            for (i = 0; i < 8; i++)
+                len = (len << 8) | p[2 + i];
+            header_len = 10;
+        }
+
+        if (opcode & 0x8)
+        {
+            if (!fin || len > 125)
+            {
+                m_send_close(c, WS_CLOSE_PROTOCOL);
+                return ERROR;
+            }
+        }
+        else if (len > server_get_options()->ws_max_message
+                 || c->msg.len + len > server_get_options()->ws_max_message)
+        {
+            m_send_close(c, WS_CLOSE_TOO_BIG);
+            return ERROR;
+        }
+
+        if (c->rx.len < header_len + 4 + len)
+            return SUCCESS;
+
+        m_unmask(p + header_len + 4, len, p + header_len);
+        c->last_seen = time(NULL);
+        if (m_handle_frame(c, fin, opcode, p + header_len + 4, len) != SUCCESS || c->broken)
+            return ERROR;
+        m_buf_consume(&c->rx, header_len + 4 + len);
+    }
+    return SUCCESS;
+}
+
+void server_ws_on_event(int fd, uint32_t events)
+{
+    ws_conn_t* c;
+    ssize_t n;
+
+    c = m_find(fd);
+    if (!c)
+        return;
+
+    if (events & (EPOLLERR | EPOLLHUP))
+    {
+        m_remove(c);
+        return;
+    }
+
+    if (events & EPOLLIN)
+    {
+        /* edge triggered: drain the socket, parsing as we go so rx stays small */
+        while (1)
+        {
+            m_buf_reserve(&c->rx, WS_READ_CHUNK);
+            n = recv(fd, c->rx.data + c->rx.len, WS_READ_CHUNK, 0);
+            if (n > 0)
+            {
+                c->rx.len += n;
+                if (m_process(c) != SUCCESS)
+                {
+                    m_remove(c);
+                    return;
+                }
+            }
+            else if (n < 0 && errno == EINTR)
+                continue;
+            else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            else
+            {
+                m_remove(c);
+                return;
+            }
+        }
+    }
+
+    if (c->broken || ((events & EPOLLOUT) && m_flush(c) != SUCCESS))
+        m_remove(c);
+}
+
+/* public API */
+void server_ws_set_message_handler(on_ws_message handler)
+{
+    m_message_handler = handler;
+}
+
+int server_ws_accept(int fd, const char* sec_key, int user_id)
+{
+    ws_conn_t* c;
+    ws_user_t* u;
+    char key[64];
+    uint8_t digest[FT_SHA1_DIGEST_LEN];
+    char accept[ft_base64_len(FT_SHA1_DIGEST_LEN)];
+    char response[256];
+    int len;
+
+    /* base64 of a 16 byte nonce */
+    if (!sec_key || strlen(sec_key) != 24 || m_find(fd))
+        return INVALID_ARGS;
+
+    len = snprintf(key, sizeof(key), "%s%s", sec_key, WS_GUID);
+    ft_sha1(key, len, digest);
+    ft_base64_encode(digest, sizeof(digest), accept);
+
+    len = snprintf(response, sizeof(response),
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: %s\r\n\r\n",
+        accept);
+
+    c = FT_SLAB_NEW(m_conn_cache, ws_conn_t);
+    c->fd = fd;
+    c->user_id = user_id;
+    c->last_seen = time(NULL);
+    HASH_ADD_INT(m_conns, fd, c);
+
+    HASH_FIND_INT(m_users, &user_id, u);
+    if (!u)
+    {
+        u = FT_SLAB_NEW(m_user_cache, ws_user_t);
+        u->user_id = user_id;
+        HASH_ADD_INT(m_users, user_id, u);
+    }
+    DL_APPEND(u->conns, c);
+
+    m_buf_append(&c->tx, response, len);
+    if (m_flush(c) != SUCCESS)
+    {
+        m_forget(c);
+        return ERROR;
+    }
+
+    LOG_FAST(LOG_LEVEL_INFO, "WebSocket opened: fd=%d user=%d\n", fd, user_id);
+    if (m_going_away)
+        m_send_close(c, WS_CLOSE_GOING_AWAY);
+    return SUCCESS;
+}
+
+/*
+ * Sends may run inside a message handler, while m_process() still holds
+ * the connection, so a failed send only flags it.
+ */
+int server_ws_send_text(int fd, const char* data, size_t len)
+{
+    ws_conn_t* c;
+
+    c = m_find(fd);
+    if (!c || c->broken || !data)
+        return INVALID_ARGS;
+    if (m_queue_frame(c, WS_OP_TEXT, data, len) != SUCCESS)
+    {
+        c->broken = true;
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+bool server_ws_user_online(int user_id)
+{
+    ws_user_t* u;
+
+    HASH_FIND_INT(m_users, &user_id, u);
+    return u != NULL;
+}
+
+int server_ws_send_to_user(int user_id, const char* data, size_t len)
+{
+    ws_user_t* u;
+    ws_conn_t* c;
+    int sent;
+
+    HASH_FIND_INT(m_users, &user_id, u);
+    if (!u || !data)
+        return 0;
+
+    sent = 0;
+    DL_FOREACH(u->conns, c)
+    {
+        if (c->broken)
+            continue;
+        if (m_queue_frame(c, WS_OP_TEXT, data, len) == SUCCESS)
+            sent++;
+        else
+            c->broken = true;
+    }
+    return sent;
+}
+
+void server_ws_set_close_handler(on_ws_close handler)
+{
+    m_close_handler = handler;
+}
+
+void server_ws_cork(void)
+{
+    m_corked = true;
+}
+
+void server_ws_uncork(void)
+{
+    ws_conn_t* c;
+    int fd;
+
+    m_corked = false;
+    while (ws_fd_queue_pop_front(&m_dirty, &fd))
+    {
+        /* looked up again, the fd may have been closed meanwhile */
+        c = m_find(fd);
+        if (!c || !c->dirty)
+            continue;
+        c->dirty = false;
+        if (m_flush(c) != SUCCESS)
+            c->broken = true;
+    }
+}
+
+/* server.c side */
+static int64_t m_connection_count(void)
+{
+    return HASH_COUNT(m_conns);
+}
+
+void server_ws_init(int epoll_fd)
+{
+    m_epoll_fd = epoll_fd;
+    m_conn_cache = FT_SLAB_CACHE(ws_conn_t);
+    m_user_cache = FT_SLAB_CACHE(ws_user_t);
+    metrics_gauge_fn("server_ws_connections", "Open websocket connections", NULL, m_connection_count);
+}
+
+bool server_ws_is_conn(int fd)
+{
+    return m_find(fd) != NULL;
+}
+
+size_t server_ws_count(void)
+{
+    return HASH_COUNT(m_conns);
+}
+
+/* clients answer the close frame and the connections go the usual way */
+void server_ws_drain(void)
+{
+    ws_conn_t* c;
+    ws_conn_t* tmp;
+
+    m_going_away = true;
+    HASH_ITER(hh, m_conns, c, tmp)
+    {
+        m_send_close(c, WS_CLOSE_GOING_AWAY);
+    }
+}
+
+/* keepalive: ping idle connections, drop the ones that stopped answering */
+void server_ws_tick(void)
+{
+    ws_conn_t* c;
+    ws_conn_t* tmp;
+    const server_options* opts;
+    time_t now;
+
+    now = time(NULL);
+    if (now == m_last_sweep)
+        return;
+    m_last_sweep = now;
+    opts = server_get_options();
+
+    HASH_ITER(hh, m_conns, c, tmp)
+    {
+        if (c->broken)
+            m_remove(c);
+        else if (c->ping_sent && now - c->last_seen >= opts->ws_ping_interval + opts->ws_pong_timeout)
+            m_remove(c);
+        else if (!c->ping_sent && now - c->last_seen >= opts->ws_ping_interval)
+        {
+            c->ping_sent = true;
+            if (m_queue_frame(c, WS_OP_PING, NULL, 0) != SUCCESS)
+                m_remove(c);
+        }
+    }
+}
+
+void server_ws_cleanup(void)
+{
+    ws_conn_t* c;
+    ws_conn_t* tmp;
+
+    m_corked = false;
+    m_going_away = false;
+    HASH_ITER(hh, m_conns, c, tmp)
+    {
+        m_send_close(c, WS_CLOSE_NORMAL);
+        m_remove(c);
+    }
+    ws_fd_queue_free(&m_dirty);
+    ft_slab_destroy(m_conn_cache);
+    ft_slab_destroy(m_user_cache);
+    m_conn_cache = NULL;
+    m_user_cache = NULL;
+}
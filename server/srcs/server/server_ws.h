@@ -0,0 +1,25 @@
+#ifndef SERVER_WS_H
+#define SERVER_WS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "server_api.h"
+
+/* server.c side of the WebSocket connections, see server_api.h for the public part */
+void server_ws_init(int epoll_fd);
+bool server_ws_is_conn(int fd);
+void server_ws_on_event(int fd, uint32_t events);
+void server_ws_tick(void);
+void server_ws_cleanup(void);
+
+size_t server_ws_count(void);
+
+/* sends 1001 Going Away to every connection and to the ones accepted afterwards */
+void server_ws_drain(void);
+
+/* current server_set_options() values, defaults filled in */
+const server_options* server_get_options(void);
+
+#endif /* SERVER_WS_H */
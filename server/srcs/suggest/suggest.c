@@ -0,0 +1,576 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include "../log/log_api.h"
+#include "../db/db_events.h"
+#include "../db/index/db_index_user.h"
+#include "../db/index/db_index_tag.h"
+#include "../db/index/db_index_like.h"
+#include "../../inc/ft_malloc.h"
+#include "../../inc/error_codes.h"
+#include "../../third_party/uthash-master/src/uthash.h"
+#include "suggest_api.h"
+
+#define SUGGEST_FEED_SIZE 200
+#define SUGGEST_MAX_FEEDS 4096         /* default of suggest_set_max_feeds() */
+#define SUGGEST_REFRESH_PER_TICK 8
+#define SUGGEST_RESCORE_PER_TICK 512   /* (feed, candidate) pairs */
+#define SUGGEST_STALE_SEC 60           /* a browsed feed older than this picks up newcomers */
+
+/* score weights */
+#define W_DISTANCE 100.0
+#define DISTANCE_SCALE_KM 10.0
+#define W_COMMON_TAG 15.0
+#define W_FAME 0.5
+
+typedef struct
+{
+    int user_id;
+    double score;
+} suggest_entry_t;
+
+typedef struct
+{
+    int user_id;
+    suggest_entry_t* entries; /* best first */
+    size_t count;
+    bool complete; /* every eligible candidate fits in the feed */
+    bool queued;
+    time_t last_access;
+    time_t built_at;
+    unsigned built_gen;
+    UT_hash_handle hh;
+} suggest_feed_t;
+
+/* one feed holding a candidate, with the score it is ranked by there */
+typedef struct
+{
+    int feed_id;
+    double score;
+} suggest_ref_t;
+
+/* every feed a candidate is in, so that its changes only touch those */
+typedef struct
+{
+    int user_id;
+    suggest_ref_t* refs;
+    size_t count;
+    size_t cap;
+    UT_hash_handle hh;
+} suggest_member_t;
+
+typedef struct
+{
+    int feed_id;
+    int user_id;
+} suggest_job_t;
+
+typedef struct
+{
+    suggest_job_t* jobs;
+    size_t head;
+    size_t count;
+    size_t cap;
+} job_queue_t;
+
+typedef struct
+{
+    const user_profile_t* owner;
+    suggest_entry_t* heap; /* min-heap on score */
+    size_t count;
+} rebuild_ctx_t;
+
+static suggest_feed_t* m_feeds = NULL;
+static suggest_member_t* m_members = NULL;
+static size_t m_max_feeds = SUGGEST_MAX_FEEDS;
+static unsigned m_gen = 0;             /* bumped when a user may enter feeds it is not in */
+static job_queue_t m_refresh_q = {0};  /* feeds waiting for a full rebuild */
+static job_queue_t m_rescore_q = {0};  /* a candidate to reposition in one feed */
+
+/* queues */
+static void m_queue_push(job_queue_t* q, int feed_id, int user_id)
+{
+    if (q->head > 0 && q->count == q->cap)
+    {
+        memmove(q->jobs, q->jobs + q->head, (q->count - q->head) * sizeof(suggest_job_t));
+        q->count -= q->head;
+        q->head = 0;
+    }
+    if (q->count == q->cap)
+    {
+        q->cap = q->cap ? q->cap * 2 : 64;
+        q->jobs = realloc(q->jobs, q->cap * sizeof(suggest_job_t));
+    }
+    q->jobs[q->count].feed_id = feed_id;
+    q->jobs[q->count].user_id = user_id;
+    q->count++;
+}
+
+static bool m_queue_pop(job_queue_t* q, suggest_job_t* job)
+{
+    if (q->head == q->count)
+    {
+        q->head = 0;
+        q->count = 0;
+        return false;
+    }
+    *job = q->jobs[q->head++];
+    return true;
+}
+
+static void m_queue_free(job_queue_t* q)
+{
+    free(q->jobs);
+    memset(q, 0, sizeof(*q));
+}
+
+/* membership */
+static void m_member_add(int user_id, int feed_id, double score)
+{
+    suggest_member_t* m;
+
+    HASH_FIND_INT(m_members, &user_id, m);
+    if (!m)
+    {
+        m = calloc(1, sizeof(*m));
+        ft_assert(m != NULL, "calloc failed");
+        m->user_id = user_id;
+        HASH_ADD_INT(m_members, user_id, m);
+    }
+    if (m->count == m->cap)
+    {
+        m->cap = m->cap ? m->cap * 2 : 4;
+        m->refs = realloc(m->refs, m->cap * sizeof(suggest_ref_t));
+    }
+    m->refs[m->count].feed_id = feed_id;
+    m->refs[m->count].score = score;
+    m->count++;
+}
+
+/* false when user_id is not in that feed, *score is its ranking there otherwise */
+static bool m_member_del(int user_id, int feed_id, double* score)
+{
+    suggest_member_t* m;
+    size_t i;
+
+    HASH_FIND_INT(m_members, &user_id, m);
+    if (!m)
+        return false;
+    for (i = 0; i < m->count && m->refs[i].feed_id != feed_id; i++)
+        ;
+    if (i == m->count)
+        return false;
+
+    *score = m->refs[i].score;
+    m->refs[i] = m->refs[--m->count];
+    if (m->count == 0)
+    {
+        HASH_DEL(m_members, m);
+        free(m->refs);
+        free(m);
+    }
+    return true;
+}
+
+/* one rescore job per feed user_id is in */
+static void m_queue_member(int user_id)
+{
+    suggest_member_t* m;
+    size_t i;
+
+    HASH_FIND_INT(m_members, &user_id, m);
+    if (!m)
+        return;
+    for (i = 0; i < m->count; i++)
+        m_queue_push(&m_rescore_q, m->refs[i].feed_id, user_id);
+}
+
+/* scoring */
+static bool m_score(const user_profile_t* owner, const user_profile_t* cand, double* score)
+{
+    double km;
+
+    if (owner->id == cand->id)
+        return false;
+    if (!db_iuser_compatible(owner, cand))
+        return false;
+    if (db_ilike_has_liked(owner->id, cand->id))
+        return false;
+
+    *score = W_COMMON_TAG * db_itag_common_tags(owner->id, cand->id)
+             + W_FAME * cand->fame_rating;
+
+    km = db_iuser_distance_km(owner, cand);
+    if (km >= 0)
+        *score += W_DISTANCE / (1.0 + km / DISTANCE_SCALE_KM);
+
+    return true;
+}
+
+/* feeds */
+static void m_feed_remove(suggest_feed_t* feed, int user_id)
+{
+    double score;
+    size_t lo;
+    size_t hi;
+    size_t mid;
+
+    if (!m_member_del(user_id, feed->user_id, &score))
+        return;
+
+    /* best first: the first entry not above score, then its ties */
+    lo = 0;
+    hi = feed->count;
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (feed->entries[mid].score > score)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    while (lo < feed->count && feed->entries[lo].user_id != user_id)
+        lo++;
+    if (lo == feed->count)
+        return;
+
+    memmove(&feed->entries[lo], &feed->entries[lo + 1],
+            (feed->count - lo - 1) * sizeof(suggest_entry_t));
+    feed->count--;
+}
+
+static void m_feed_clear(suggest_feed_t* feed)
+{
+    double score;
+    size_t i;
+
+    for (i = 0; i < feed->count; i++)
+        m_member_del(feed->entries[i].user_id, feed->user_id, &score);
+    feed->count = 0;
+}
+
+static void m_feed_offer(suggest_feed_t* feed, int user_id, double score)
+{
+    size_t pos;
+
+    if (feed->count == SUGGEST_FEED_SIZE && score <= feed->entries[feed->count - 1].score)
+        return;
+    if (feed->count == SUGGEST_FEED_SIZE)
+        m_feed_remove(feed, feed->entries[feed->count - 1].user_id);
+
+    pos = feed->count < SUGGEST_FEED_SIZE ? feed->count : SUGGEST_FEED_SIZE - 1;
+    while (pos > 0 && feed->entries[pos - 1].score < score)
+        pos--;
+
+    if (feed->count < SUGGEST_FEED_SIZE)
+        feed->count++;
+    memmove(&feed->entries[pos + 1], &feed->entries[pos],
+            (feed->count - pos - 1) * sizeof(suggest_entry_t));
+    feed->entries[pos].user_id = user_id;
+    feed->entries[pos].score = score;
+    m_member_add(user_id, feed->user_id, score);
+}
+
+/* recomputes the position of one candidate inside one feed */
+static void m_feed_rescore(suggest_feed_t* feed, int cand_id)
+{
+    const user_profile_t* owner;
+    const user_profile_t* cand;
+    double score;
+
+    m_feed_remove(feed, cand_id);
+
+    owner = db_iuser_get(feed->user_id);
+    cand = db_iuser_get(cand_id);
+    if (owner && cand && m_score(owner, cand, &score))
+        m_feed_offer(feed, cand_id, score);
+
+    /* candidates dropped out of a truncated feed, the next best are unknown */
+    if (!feed->complete && feed->count < SUGGEST_FEED_SIZE / 2 && !feed->queued)
+    {
+        feed->queued = true;
+        m_queue_push(&m_refresh_q, feed->user_id, 0);
+    }
+}
+
+static void m_heap_sift_down(suggest_entry_t* heap, size_t count, size_t i)
+{
+    suggest_entry_t tmp;
+    size_t smallest;
+    size_t l;
+    size_t r;
+
+    while (1)
+    {
+        l = 2 * i + 1;
+        r = l + 1;
+        smallest = i;
+        if (l < count && heap[l].score < heap[smallest].score)
+            smallest = l;
+        if (r < count && heap[r].score < heap[smallest].score)
+            smallest = r;
+        if (smallest == i)
+            return;
+        tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+static void m_heap_push(rebuild_ctx_t* ctx, int user_id, double score)
+{
+    suggest_entry_t tmp;
+    size_t i;
+
+    if (ctx->count == SUGGEST_FEED_SIZE)
+    {
+        if (score <= ctx->heap[0].score)
+            return;
+        ctx->heap[0].user_id = user_id;
+        ctx->heap[0].score = score;
+        m_heap_sift_down(ctx->heap, ctx->count, 0);
+        return;
+    }
+
+    i = ctx->count++;
+    ctx->heap[i].user_id = user_id;
+    ctx->heap[i].score = score;
+    while (i > 0 && ctx->heap[(i - 1) / 2].score > ctx->heap[i].score)
+    {
+        tmp = ctx->heap[i];
+        ctx->heap[i] = ctx->heap[(i - 1) / 2];
+        ctx->heap[(i - 1) / 2] = tmp;
+        i = (i - 1) / 2;
+    }
+}
+
+static void m_rebuild_visit(const user_profile_t* cand, void* user_data)
+{
+    rebuild_ctx_t* ctx = user_data;
+    double score;
+
+    if (m_score(ctx->owner, cand, &score))
+        m_heap_push(ctx, cand->id, score);
+}
+
+static int m_entry_cmp_desc(const void* a, const void* b)
+{
+    const suggest_entry_t* ea = a;
+    const suggest_entry_t* eb = b;
+
+    if (ea->score < eb->score) return 1;
+    if (ea->score > eb->score) return -1;
+    return ea->user_id - eb->user_id;
+}
+
+static void m_feed_rebuild(suggest_feed_t* feed)
+{
+    rebuild_ctx_t ctx;
+    size_t i;
+
+    feed->queued = false;
+    m_feed_clear(feed);
+    feed->built_at = time(NULL);
+    feed->built_gen = m_gen;
+
+    ctx.owner = db_iuser_get(feed->user_id);
+    if (!ctx.owner)
+        return;
+    ctx.heap = feed->entries;
+    ctx.count = 0;
+
+    db_iuser_foreach(m_rebuild_visit, &ctx);
+
+    qsort(feed->entries, ctx.count, sizeof(suggest_entry_t), m_entry_cmp_desc);
+    feed->count = ctx.count;
+    feed->complete = ctx.count < SUGGEST_FEED_SIZE;
+    for (i = 0; i < feed->count; i++)
+        m_member_add(feed->entries[i].user_id, feed->user_id, feed->entries[i].score);
+}
+
+static void m_evict_oldest(void)
+{
+    suggest_feed_t* feed;
+    suggest_feed_t* tmp;
+    suggest_feed_t* oldest;
+
+    oldest = NULL;
+    HASH_ITER(hh, m_feeds, feed, tmp)
+    {
+        if (!oldest || feed->last_access < oldest->last_access)
+            oldest = feed;
+    }
+    if (oldest)
+        suggest_drop(oldest->user_id);
+}
+
+void suggest_set_max_feeds(size_t max_feeds)
+{
+    m_max_feeds = max_feeds ? max_feeds : SUGGEST_MAX_FEEDS;
+}
+
+static suggest_feed_t* m_feed_get(int user_id, bool create)
+{
+    suggest_feed_t* feed;
+
+    HASH_FIND_INT(m_feeds, &user_id, feed);
+    if (!feed && create)
+    {
+        /* a lowered limit takes effect on the next new feed */
+        while (HASH_COUNT(m_feeds) >= m_max_feeds)
+            m_evict_oldest();
+
+        feed = calloc(1, sizeof(*feed));
+        ft_assert(feed != NULL, "calloc failed");
+        feed->user_id = user_id;
+        feed->entries = malloc(SUGGEST_FEED_SIZE * sizeof(suggest_entry_t));
+        HASH_ADD_INT(m_feeds, user_id, feed);
+        m_feed_rebuild(feed);
+    }
+    return feed;
+}
+
+static void m_queue_refresh(int user_id)
+{
+    suggest_feed_t* feed;
+
+    feed = m_feed_get(user_id, false);
+    if (feed && !feed->queued)
+    {
+        feed->queued = true;
+        m_queue_push(&m_refresh_q, user_id, 0);
+    }
+}
+
+static void m_on_db_event(const db_event_t* event, void* user_data)
+{
+    suggest_feed_t* feed;
+
+    (void)user_data;
+    /*
+     * A change repositions the user in the feeds it is in. Feeds it is not
+     * in yet only see it once rebuilt, see m_gen and SUGGEST_STALE_SEC.
+     */
+    switch (event->type)
+    {
+        case DB_EVENT_USER_CREATED:
+            m_gen++;
+            break;
+        case DB_EVENT_USER_UPDATED:
+        case DB_EVENT_TAG_ADDED:
+        case DB_EVENT_TAG_REMOVED:
+            /* own ranking and own position in other feeds moved */
+            m_queue_refresh(event->user_id);
+            m_queue_member(event->user_id);
+            m_gen++;
+            break;
+        case DB_EVENT_FAME_CHANGED:
+            m_queue_member(event->user_id);
+            m_gen++;
+            break;
+        case DB_EVENT_USER_DELETED:
+            suggest_drop(event->user_id);
+            m_queue_member(event->user_id);
+            break;
+        case DB_EVENT_LIKE_ADDED:
+            feed = m_feed_get(event->user_id, false);
+            if (feed)
+                m_feed_remove(feed, event->other_id);
+            break;
+        case DB_EVENT_LIKE_REMOVED:
+            feed = m_feed_get(event->user_id, false);
+            if (feed)
+                m_feed_rescore(feed, event->other_id);
+            break;
+        default:
+            break;
+    }
+}
+
+void suggest_tick(void)
+{
+    suggest_feed_t* feed;
+    suggest_job_t job;
+    int i;
+
+    for (i = 0; i < SUGGEST_RESCORE_PER_TICK && m_queue_pop(&m_rescore_q, &job); i++)
+    {
+        /* dropped since, or about to be rebuilt anyway */
+        feed = m_feed_get(job.feed_id, false);
+        if (feed && !feed->queued)
+            m_feed_rescore(feed, job.user_id);
+    }
+
+    for (i = 0; i < SUGGEST_REFRESH_PER_TICK && m_queue_pop(&m_refresh_q, &job); i++)
+    {
+        feed = m_feed_get(job.feed_id, false);
+        if (feed && feed->queued)
+            m_feed_rebuild(feed);
+    }
+}
+
+size_t suggest_get_page(int user_id, size_t offset, size_t limit, int* out_ids)
+{
+    suggest_feed_t* feed;
+    size_t n;
+
+    if (!out_ids)
+        return 0;
+
+    feed = m_feed_get(user_id, true);
+    feed->last_access = time(NULL);
+    if (feed->built_gen != m_gen && feed->last_access - feed->built_at >= SUGGEST_STALE_SEC)
+        m_queue_refresh(user_id);
+
+    n = 0;
+    while (offset + n < feed->count && n < limit)
+    {
+        out_ids[n] = feed->entries[offset + n].user_id;
+        n++;
+    }
+    return n;
+}
+
+void suggest_drop(int user_id)
+{
+    suggest_feed_t* feed;
+
+    HASH_FIND_INT(m_feeds, &user_id, feed);
+    if (!feed)
+        return;
+
+    HASH_DEL(m_feeds, feed);
+    m_feed_clear(feed);
+    free(feed->entries);
+    free(feed);
+}
+
+int suggest_init(void)
+{
+    if (db_events_subscribe(m_on_db_event, NULL) != SUCCESS)
+    {
+        log_msg(LOG_LEVEL_ERROR, "suggest: unable to subscribe to db events\n");
+        return ERROR;
+    }
+
+    log_msg(LOG_LEVEL_BOOT, "Suggestion feeds initialized\n");
+    return SUCCESS;
+}
+
+void suggest_cleanup(void)
+{
+    suggest_feed_t* feed;
+    suggest_feed_t* tmp;
+
+    db_events_unsubscribe(m_on_db_event, NULL);
+
+    HASH_ITER(hh, m_feeds, feed, tmp)
+    {
+        suggest_drop(feed->user_id);
+    }
+    m_queue_free(&m_refresh_q);
+    m_queue_free(&m_rescore_q);
+}
@@ -0,0 +1,41 @@
+#ifndef SUGGEST_API_H
+#define SUGGEST_API_H
+
+#include <stddef.h>
+
+/*
+ * Precomputed suggestion feeds.
+ *
+ * Every active user (one that browsed recently) owns a ranked candidate
+ * list. Profile, tag and like changes reported through db_events only
+ * queue work; suggest_tick() applies it in small batches from the main
+ * loop, so the browse path just pages through an already sorted list.
+ * A change only touches the feeds that hold that user; browsed feeds are
+ * rebuilt now and then to take in users they do not hold yet.
+ */
+
+int suggest_init(void);
+void suggest_cleanup(void);
+
+/* feeds kept before the least recently browsed one is dropped, 0 = default */
+void suggest_set_max_feeds(size_t max_feeds);
+
+/*
+ * Apply queued refresh work. Bounded, meant to be called once per loop
+ * iteration.
+ */
+void suggest_tick(void);
+
+/*
+ * Copy up to limit candidate ids, best first, starting at offset.
+ * Builds the feed synchronously the first time a user browses.
+ * Returns the number of ids written.
+ */
+size_t suggest_get_page(int user_id, size_t offset, size_t limit, int* out_ids);
+
+/*
+ * Forget the feed of user_id (logout, account deletion, ...).
+ */
+void suggest_drop(int user_id);
+
+#endif /* SUGGEST_API_H */
@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include "../log/log_api.h"
+#include "../../inc/ft_malloc.h"
+#include "../../inc/error_codes.h"
+#include "trace_api.h"
+
+#define TRACE_MAX_SPANS 24      /* keeps an exported trace under the log line limit */
+#define TRACE_DETAIL_LEN 48
+#define TRACE_EXPORT_BATCH 64   /* traces exported per tick */
+#define TRACE_NO_STATUS -1
+
+typedef struct
+{
+    const char* name;
+    char detail[TRACE_DETAIL_LEN];
+    int parent;                 /* -1 for children of the root */
+    uint64_t start_ns;
+    uint64_t end_ns;
+} trace_span_t;
+
+struct trace_s
+{
+    uint64_t id;
+    const char* name;
+    char detail[TRACE_DETAIL_LEN];
+    int status;
+    uint64_t wall_start_ns;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    int current_span;
+    int n_spans;
+    int dropped_spans;
+    trace_span_t spans[TRACE_MAX_SPANS];
+};
+
+/* changed by a config reload while requests are sampled */
+static _Atomic uint64_t m_threshold = 0;    /* sample when rand32 < threshold */
+static atomic_bool m_enabled = false;
+
+static pthread_mutex_t m_ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_t* m_ring = NULL;
+static size_t m_ring_size = 0;
+static size_t m_ring_head = 0;      /* next slot to export */
+static size_t m_ring_count = 0;
+static unsigned long m_overwritten = 0;
+
+static __thread trace_t m_active;
+static __thread trace_t* m_current = NULL;
+static __thread uint64_t m_rng = 0;
+
+static uint64_t m_clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* xorshift64*, seeded per thread */
+static uint64_t m_rand(void)
+{
+    if (m_rng == 0)
+        m_rng = m_clock_ns(CLOCK_MONOTONIC) ^ ((uint64_t)(uintptr_t)&m_rng << 16) ^ 0x9E3779B97F4A7C15ull;
+    m_rng ^= m_rng >> 12;
+    m_rng ^= m_rng << 25;
+    m_rng ^= m_rng >> 27;
+    return m_rng * 0x2545F4914F6CDD1Dull;
+}
+
+/* first line only, and never a query string (it may carry a session id) */
+static void m_copy_detail(char* dst, const char* src)
+{
+    size_t i;
+
+    if (!src)
+    {
+        dst[0] = '\0';
+        return;
+    }
+    while (*src == ' ' || *src == '\n' || *src == '\t')
+        src++;
+    for (i = 0; i < TRACE_DETAIL_LEN - 1 && src[i] && src[i] != '\r' && src[i] != '?'; i++)
+        dst[i] = src[i];
+    dst[i] = '\0';
+}
+
+trace_t* trace_begin(const char* name, const char* detail)
+{
+    trace_t* t;
+    uint64_t r;
+
+    if (!atomic_load_explicit(&m_enabled, memory_order_relaxed) || m_current)
+        return NULL;
+    r = m_rand();
+    if ((r >> 32) >= atomic_load_explicit(&m_threshold, memory_order_relaxed))
+        return NULL;
+
+    t = &m_active;
+    t->id = m_rand();
+    t->name = name;
+    m_copy_detail(t->detail, detail);
+    t->status = TRACE_NO_STATUS;
+    t->wall_start_ns = m_clock_ns(CLOCK_REALTIME);
+    t->start_ns = m_clock_ns(CLOCK_MONOTONIC);
+    t->end_ns = 0;
+    t->current_span = -1;
+    t->n_spans = 0;
+    t->dropped_spans = 0;
+    m_current = t;
+    return t;
+}
+
+trace_t* trace_current(void)
+{
+    return m_current;
+}
+
+void trace_set_status(int status)
+{
+    if (m_current)
+        m_current->status = status;
+}
+
+int trace_span_begin(const char* name, const char* detail)
+{
+    trace_t* t;
+    trace_span_t* span;
+
+    t = m_current;
+    if (!t)
+        return -1;
+    if (t->n_spans == TRACE_MAX_SPANS)
+    {
+        t->dropped_spans++;
+        return -1;
+    }
+
+    span = &t->spans[t->n_spans];
+    span->name = name;
+    m_copy_detail(span->detail, detail);
+    span->parent = t->current_span;
+    span->start_ns = m_clock_ns(CLOCK_MONOTONIC);
+    span->end_ns = 0;
+    t->current_span = t->n_spans;
+    return t->n_spans++;
+}
+
+void trace_span_end(int span)
+{
+    trace_t* t;
+
+    t = m_current;
+    if (!t || span < 0 || span >= t->n_spans)
+        return;
+    t->spans[span].end_ns = m_clock_ns(CLOCK_MONOTONIC);
+    t->current_span = t->spans[span].parent;
+}
+
+void trace_end(trace_t* trace)
+{
+    trace_t* slot;
+    uint64_t now;
+    int i;
+
+    if (!trace || trace != m_current)
+        return;
+
+    now = m_clock_ns(CLOCK_MONOTONIC);
+    trace->end_ns = now;
+    for (i = 0; i < trace->n_spans; i++)
+    {
+        if (trace->spans[i].end_ns == 0)
+            trace->spans[i].end_ns = now;
+    }
+    m_current = NULL;
+    if (!m_ring)
+        return;
+
+    /* the ring keeps the newest traces, the oldest unexported is overwritten */
+    pthread_mutex_lock(&m_ring_lock);
+    if (m_ring_count == m_ring_size)
+    {
+        m_ring_head = (m_ring_head + 1) % m_ring_size;
+        m_ring_count--;
+        m_overwritten++;
+    }
+    slot = &m_ring[(m_ring_head + m_ring_count) % m_ring_size];
+    memcpy(slot, trace, offsetof(trace_t, spans) + trace->n_spans * sizeof(trace_span_t));
+    m_ring_count++;
+    pthread_mutex_unlock(&m_ring_lock);
+}
+
+/* export */
+static size_t m_json_detail(char* out, size_t cap, const char* s)
+{
+    size_t n;
+
+    n = 0;
+    for (; *s && n + 3 < cap; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            out[n++] = '\\';
+        out[n++] = ((unsigned char)*s < 0x20) ? ' ' : *s;
+    }
+    out[n] = '\0';
+    return n;
+}
+
+static void m_export(const trace_t* t)
+{
+    char line[4000];
+    char detail[TRACE_DETAIL_LEN * 2];
+    const trace_span_t* span;
+    size_t n;
+    size_t next;
+    int dropped;
+    int i;
+
+    m_json_detail(detail, sizeof(detail), t->detail);
+    n = snprintf(line, sizeof(line),
+                 "{\"trace\":\"%016llx\",\"name\":\"%s\",\"detail\":\"%s\",\"status\":%d,"
+                 "\"start_ns\":%llu,\"duration_us\":%llu,\"spans\":[",
+                 (unsigned long long)t->id, t->name, detail, t->status,
+                 (unsigned long long)t->wall_start_ns,
+                 (unsigned long long)(t->end_ns - t->start_ns) / 1000);
+
+    /* spans that would not fit the line count as dropped */
+    dropped = t->dropped_spans;
+    for (i = 0; i < t->n_spans; i++)
+    {
+        span = &t->spans[i];
+        m_json_detail(detail, sizeof(detail), span->detail);
+        next = n + snprintf(line + n, sizeof(line) - n,
+                            "%s{\"id\":%d,\"parent\":%d,\"name\":\"%s\",\"detail\":\"%s\","
+                            "\"offset_us\":%llu,\"duration_us\":%llu}",
+                            i ? "," : "", i, span->parent, span->name, detail,
+                            (unsigned long long)(span->start_ns - t->start_ns) / 1000,
+                            (unsigned long long)(span->end_ns - span->start_ns) / 1000);
+        if (next + 32 >= sizeof(line))
+        {
+            dropped += t->n_spans - i;
+            break;
+        }
+        n = next;
+    }
+    snprintf(line + n, sizeof(line) - n, "],\"dropped_spans\":%d}", dropped);
+
+    log_msg(LOG_LEVEL_INFO, "trace %s\n", line);
+}
+
+void trace_tick(void)
+{
+    static trace_t t;
+    unsigned long overwritten;
+    int i;
+
+    if (!m_ring)
+        return;
+
+    for (i = 0; i < TRACE_EXPORT_BATCH; i++)
+    {
+        pthread_mutex_lock(&m_ring_lock);
+        if (m_ring_count == 0)
+        {
+            pthread_mutex_unlock(&m_ring_lock);
+            break;
+        }
+        memcpy(&t, &m_ring[m_ring_head], sizeof(t));
+        m_ring_head = (m_ring_head + 1) % m_ring_size;
+        m_ring_count--;
+        overwritten = m_overwritten;
+        m_overwritten = 0;
+        pthread_mutex_unlock(&m_ring_lock);
+
+        if (overwritten)
+            log_msg(LOG_LEVEL_WARN, "trace: %lu traces overwritten before export\n", overwritten);
+        m_export(&t);
+    }
+}
+
+int trace_set_sample_rate(double sample_rate)
+{
+    if (sample_rate < 0.0 || sample_rate > 1.0)
+        return INVALID_ARGS;
+    atomic_store_explicit(&m_threshold, (uint64_t)(sample_rate * 4294967296.0), memory_order_relaxed);
+    atomic_store_explicit(&m_enabled, sample_rate > 0.0, memory_order_relaxed);
+    return SUCCESS;
+}
+
+int trace_init(double sample_rate, size_t ring_size)
+{
+    if (sample_rate < 0.0 || sample_rate > 1.0 || ring_size == 0)
+    {
+        log_msg(LOG_LEVEL_ERROR, "trace: invalid sample rate %f or ring size %zu\n", sample_rate, ring_size);
+        return INVALID_ARGS;
+    }
+
+    m_ring = malloc(ring_size * sizeof(trace_t));
+    m_ring_size = ring_size;
+    m_ring_head = 0;
+    m_ring_count = 0;
+    trace_set_sample_rate(sample_rate);
+
+    log_msg(LOG_LEVEL_BOOT, "Tracing initialized: sample rate %.4f, ring %zu\n", sample_rate, ring_size);
+    return SUCCESS;
+}
+
+void trace_cleanup(void)
+{
+    trace_tick();
+    atomic_store(&m_enabled, false);
+    pthread_mutex_lock(&m_ring_lock);
+    free(m_ring);
+    m_ring = NULL;
+    m_ring_size = 0;
+    m_ring_count = 0;
+    pthread_mutex_unlock(&m_ring_lock);
+}
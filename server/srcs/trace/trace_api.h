@@ -0,0 +1,42 @@
+#ifndef TRACE_API_H
+#define TRACE_API_H
+
+#include <stddef.h>
+
+/*
+ * Sampled request tracing.
+ *
+ * trace_begin() opens a trace on the calling thread when the sampler
+ * picks it; spans opened while it is current nest under the innermost
+ * open span. Completed traces go into a ring buffer and trace_tick()
+ * exports them as JSON lines through the logger (INFO level).
+ *
+ * Every call is a no-op when no trace is current, so instrumented code
+ * pays one thread-local load on unsampled requests.
+ */
+
+typedef struct trace_s trace_t;
+
+/* sample_rate in [0, 1], 0 disables tracing; ring_size completed traces */
+int trace_init(double sample_rate, size_t ring_size);
+
+/* at runtime, same range as trace_init() */
+int trace_set_sample_rate(double sample_rate);
+void trace_cleanup(void);
+
+/* NULL when not sampled or a trace is already open on this thread */
+trace_t* trace_begin(const char* name, const char* detail);
+void trace_end(trace_t* trace);
+trace_t* trace_current(void);
+
+/* result of the traced operation, e.g. the HTTP status */
+void trace_set_status(int status);
+
+/* detail is copied up to its first \r or '?' (truncated); -1 when nothing is traced */
+int trace_span_begin(const char* name, const char* detail);
+void trace_span_end(int span);
+
+/* exports the completed traces, call from the main loop */
+void trace_tick(void);
+
+#endif /* TRACE_API_H */